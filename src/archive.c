@@ -63,8 +63,10 @@ do_archive_push(char *wal_file_path, char *wal_file_name, bool overwrite)
 
 	elog(INFO, "pg_probackup archive-push from %s to %s", absolute_wal_file_path, backup_wal_file_path);
 
-	if (compress_alg == PGLZ_COMPRESS)
-		elog(ERROR, "pglz compression is not supported");
+	if (compress_alg == PGLZ_COMPRESS || compress_alg == ZSTD_COMPRESS ||
+		compress_alg == LZ4_COMPRESS)
+		elog(ERROR, "%s compression is not supported",
+			 deparse_compress_alg(compress_alg));
 
 #ifdef HAVE_LIBZ
 	if (compress_alg == ZLIB_COMPRESS)
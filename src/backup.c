@@ -45,6 +45,23 @@ const char *progname = "pg_probackup";
 /* list of files contained in backup */
 static parray *backup_files_list = NULL;
 
+/*
+ * Hash index of datafiles in backup_files_list, used to map block changes
+ * found in WAL onto pgFile entries in PAGE backup mode.
+ */
+typedef struct DatafileIndexEntry
+{
+	Oid			tblspcOid;
+	Oid			dbOid;
+	Oid			relOid;
+	ForkNumber	forknum;
+	int			segno;
+	pgFile	   *file;		/* NULL if the slot is free */
+} DatafileIndexEntry;
+
+static DatafileIndexEntry *datafile_index = NULL;
+static size_t datafile_index_size = 0;
+
 static pthread_mutex_t start_stream_mut = PTHREAD_MUTEX_INITIALIZER;
 /*
  * We need to wait end of WAL streaming before execute pg_stop_backup().
@@ -61,10 +78,59 @@ static PGconn *backup_conn = NULL;
 static PGconn *master_conn = NULL;
 static PGconn *backup_conn_replication = NULL;
 
+/* Limits reads of backup threads, NULL if there are no limits */
+throttle *backup_throttle = NULL;
+
+/* Interval of sampling server read latency by throttle monitor, in ms */
+#define THROTTLE_MONITOR_INTERVAL	1000
+
+static pthread_t throttle_monitor_thread;
+static bool throttle_monitor_started = false;
+static volatile bool throttle_monitor_stop = false;
+/* Connection of the throttle monitor, libpq connections are not shared */
+static PGconn *throttle_monitor_conn = NULL;
+static PGcancel *throttle_monitor_cancel_conn = NULL;
+
 /* PostgreSQL server version from "backup_conn" */
 static int server_version = 0;
 static char server_version_str[100] = "";
 
+/*
+ * Phases of backup. Time spent in each of them is written to
+ * BACKUP_STATS_FILE, waits for WAL are not counted in the phase they
+ * happen in.
+ */
+typedef enum BackupPhase
+{
+	BACKUP_PHASE_OTHER = 0,
+	BACKUP_PHASE_START_BACKUP,
+	BACKUP_PHASE_LIST_FILES,
+	BACKUP_PHASE_PAGEMAP,
+	BACKUP_PHASE_COPY,
+	BACKUP_PHASE_FSYNC,
+	BACKUP_PHASE_STOP_BACKUP,
+	BACKUP_PHASE_WAL_WAIT,
+	BACKUP_PHASE_WRITE_FILELIST,
+	BACKUP_NUM_PHASES
+} BackupPhase;
+
+static const char *backup_phase_names[BACKUP_NUM_PHASES] =
+{
+	"other",
+	"start-backup",
+	"list-files",
+	"pagemap",
+	"copy",
+	"fsync",
+	"stop-backup",
+	"wal-wait",
+	"write-filelist"
+};
+
+static BackupPhase backup_phase = BACKUP_PHASE_OTHER;
+static instr_time backup_phase_start;
+static instr_time backup_phase_time[BACKUP_NUM_PHASES];
+
 /* Is pg_start_backup() was executed */
 static bool backup_in_progress = false;
 /* Is pg_stop_backup() was sent */
@@ -88,6 +154,8 @@ static int checkpoint_timeout(void);
 
 static void parse_backup_filelist_filenames(parray *files, const char *root);
 static void write_backup_file_list(parray *files, const char *root);
+static void write_backup_stats(BackupThreadStats *thread_stats);
+static BackupPhase backup_phase_switch(BackupPhase phase);
 static void wait_wal_lsn(XLogRecPtr lsn, bool wait_prev_segment);
 static void wait_replica_wal_lsn(XLogRecPtr lsn, bool is_start_backup);
 static void make_pagemap_from_ptrack(parray *files);
@@ -96,6 +164,11 @@ static void StreamLog(void *arg);
 static void get_remote_pgdata_filelist(parray *files);
 static void ReceiveFileList(parray* files, PGconn *conn, PGresult *res, int rownum);
 static void	remote_copy_file(PGconn *conn, pgFile* file);
+static bool file_is_unchanged(backup_files_args *arguments, pgFile *file);
+
+static void throttle_start(void);
+static void throttle_stop(void);
+static void *throttle_monitor(void *arg);
 
 /* Ptrack functions */
 static void pg_ptrack_clear(void);
@@ -116,6 +189,11 @@ static void check_system_identifiers(void);
 static void confirm_block_size(const char *name, int blcksz);
 static void set_cfs_datafiles(parray *files, const char *root, char *relative, size_t i);
 
+static void datafile_index_build(parray *files);
+static void datafile_index_free(void);
+static uint32 datafile_index_hash(Oid tblspcOid, Oid dbOid, Oid relOid,
+								  ForkNumber forknum, int segno);
+
 
 #define disconnect_and_exit(code)				\
 	{											\
@@ -304,6 +382,9 @@ static void	remote_copy_file(PGconn *conn, pgFile* file)
 		if (row_length == -1)
 			break;
 
+		/* The server reads the file as fast as we receive it */
+		throttle_acquire(backup_throttle, row_length, 0);
+
 		if (!skip_padding)
 		{
 			write_buffer_size = Min(row_length, sizeof(buf));
@@ -351,28 +432,25 @@ static void	remote_copy_file(PGconn *conn, pgFile* file)
 static void
 remote_backup_files(void *arg)
 {
-	int i;
 	backup_files_args *arguments = (backup_files_args *) arg;
-	int n_backup_files_list = parray_num(arguments->backup_files_list);
 	PGconn		*file_backup_conn = NULL;
+	pgFilePart	*part;
 
-	for (i = 0; i < n_backup_files_list; i++)
+	/* Remote backup does not split files, each part is a whole file */
+	while ((part = (pgFilePart *) scheduler_next(arguments->sched,
+												 arguments->thread_num,
+												 NULL)) != NULL)
 	{
+		pgFile		*file = part->file;
 		char		*query_str;
 		PGresult	*res;
 		char		*copybuf = NULL;
-		pgFile		*file;
 		int			row_length;
 
-		file = (pgFile *) parray_get(arguments->backup_files_list, i);
-
 		/* We have already copied all directories */
 		if (S_ISDIR(file->mode))
 			continue;
 
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
-
 		file_backup_conn = pgut_connect_replication(pgut_dbname);
 
 		/* check for interrupt */
@@ -418,6 +496,9 @@ remote_backup_files(void *arg)
 
 		/* receive the data from stream and write to backup file */
 		remote_copy_file(file_backup_conn, file);
+		arguments->stats.files_copied++;
+		arguments->stats.bytes_read += file->read_size;
+		arguments->stats.bytes_written += file->write_size;
 
 		elog(VERBOSE, "File \"%s\". Copied %lu bytes",
 				 file->path, (unsigned long) file->write_size);
@@ -425,6 +506,133 @@ remote_backup_files(void *arg)
 	}
 }
 
+/*
+ * Create backup_throttle shared by backup threads if read limits are set,
+ * and start monitoring server read latency if --throttle-latency is set.
+ */
+static void
+throttle_start(void)
+{
+	if (read_rate_limit == 0 && read_iops_limit == 0)
+	{
+		if (throttle_latency > 0)
+			elog(WARNING, "--throttle-latency requires --read-rate-limit or --read-iops-limit, ignored");
+		return;
+	}
+
+	backup_throttle = throttle_new((double) read_rate_limit * 1024,
+								   read_iops_limit);
+	elog(LOG, "Read limits: %u kB/s, %u IOPS", read_rate_limit,
+		 read_iops_limit);
+
+	if (throttle_latency > 0)
+	{
+		PGresult   *res;
+		bool		track_io_timing;
+
+		res = pgut_execute(backup_conn, "SELECT current_setting('track_io_timing')",
+						   0, NULL, true);
+		track_io_timing = (strcmp(PQgetvalue(res, 0, 0), "on") == 0);
+		PQclear(res);
+
+		if (!track_io_timing)
+		{
+			elog(WARNING, "track_io_timing is off, --throttle-latency is ignored");
+			return;
+		}
+
+		throttle_monitor_conn = pgut_connect(pgut_dbname);
+		throttle_monitor_cancel_conn = PQgetCancel(throttle_monitor_conn);
+		throttle_monitor_stop = false;
+		if (pthread_create(&throttle_monitor_thread, NULL, throttle_monitor,
+						   NULL) != 0)
+			elog(ERROR, "cannot create throttle monitor thread: %s",
+				 strerror(errno));
+		throttle_monitor_started = true;
+	}
+}
+
+static void
+throttle_stop(void)
+{
+	if (backup_throttle == NULL)
+		return;
+
+	if (throttle_monitor_started)
+	{
+		throttle_monitor_stop = true;
+		pthread_join(throttle_monitor_thread, NULL);
+		throttle_monitor_started = false;
+	}
+	if (throttle_monitor_conn != NULL)
+	{
+		PQfreeCancel(throttle_monitor_cancel_conn);
+		throttle_monitor_cancel_conn = NULL;
+		pgut_disconnect(throttle_monitor_conn);
+		throttle_monitor_conn = NULL;
+	}
+
+	throttle_free(backup_throttle);
+	backup_throttle = NULL;
+}
+
+/*
+ * Sample average read latency of server backends and adjust read limits of
+ * backup threads to it: halve them while the latency exceeds
+ * --throttle-latency, raise them by a tenth of configured values otherwise.
+ * Uses a connection of its own, backup_conn is used by the main thread,
+ * and leaves cancel_conn of the main thread alone, as copying threads do.
+ */
+static void *
+throttle_monitor(void *arg)
+{
+	double		prev_time = -1;
+	double		prev_reads = 0;
+
+	while (!throttle_monitor_stop)
+	{
+		PGresult   *res;
+		double		read_time;
+		double		reads;
+		double		factor;
+		int			i;
+
+		res = pgut_execute_parallel(throttle_monitor_conn,
+									throttle_monitor_cancel_conn,
+									"SELECT sum(blk_read_time), sum(blks_read) "
+									"FROM pg_catalog.pg_stat_database",
+									0, NULL, true);
+		read_time = atof(PQgetvalue(res, 0, 0));
+		reads = atof(PQgetvalue(res, 0, 1));
+		PQclear(res);
+
+		if (prev_time >= 0)
+		{
+			double		old_factor = throttle_get_factor(backup_throttle);
+
+			/* No reads in the interval mean no pressure */
+			if (reads > prev_reads &&
+				(read_time - prev_time) / (reads - prev_reads) > throttle_latency)
+				factor = old_factor / 2;
+			else
+				factor = old_factor + 0.1;
+
+			throttle_set_factor(backup_throttle, factor);
+			factor = throttle_get_factor(backup_throttle);
+			if (factor != old_factor)
+				elog(VERBOSE, "Read limits are scaled by %.2f", factor);
+		}
+		prev_time = read_time;
+		prev_reads = reads;
+
+		for (i = 0; i < THROTTLE_MONITOR_INTERVAL / 100 &&
+					!throttle_monitor_stop; i++)
+			pg_usleep(100000L);
+	}
+
+	return NULL;
+}
+
 /*
  * Take a backup of a single postgresql instance.
  * Move files from 'pgdata' to a subdirectory in 'backup_path'.
@@ -437,9 +645,12 @@ do_backup_instance(void)
 	char		dst_backup_path[MAXPGPATH];
 	char		label[1024];
 	XLogRecPtr	prev_backup_start_lsn = InvalidXLogRecPtr;
+	time_t		prev_backup_start_time = 0;
 
-	pthread_t	backup_threads[num_threads];
-	backup_files_args *backup_threads_args[num_threads];
+	scheduler  *backup_sched;
+	parray	   *backup_parts;
+	backup_files_args *backup_threads_args[io_threads];
+	BackupThreadStats thread_stats[io_threads];
 
 	pgBackup   *prev_backup = NULL;
 	char		prev_backup_filelist_path[MAXPGPATH];
@@ -450,6 +661,10 @@ do_backup_instance(void)
 	/* Initialize size summary */
 	current.data_bytes = 0;
 
+	memset(backup_phase_time, 0, sizeof(backup_phase_time));
+	backup_phase = BACKUP_PHASE_OTHER;
+	INSTR_TIME_SET_CURRENT(backup_phase_start);
+
 	/* Obtain current timeline */
 	if (is_remote_backup)
 	{
@@ -479,7 +694,8 @@ do_backup_instance(void)
 	 * backup on current timeline exists and get its filelist.
 	 */
 	if (current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
-		current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
+		current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+		current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 	{
 		parray	   *backup_list;
 		/* get list of backups already taken */
@@ -496,6 +712,9 @@ do_backup_instance(void)
 		pgBackupGetPath(prev_backup, prev_backup_filelist_path, lengthof(prev_backup_filelist_path),
 						DATABASE_FILE_LIST);
 		prev_backup_filelist = dir_read_file_list(pgdata, prev_backup_filelist_path);
+		/* Sorted for lookups of unchanged files */
+		parray_qsort(prev_backup_filelist, pgFileComparePath);
+		prev_backup_start_time = prev_backup->start_time;
 
 		/* If lsn is not NULL, only pages with higher lsn will be copied. */
 		prev_backup_start_lsn = prev_backup->start_lsn;
@@ -527,7 +746,9 @@ do_backup_instance(void)
 	/* notify start of backup to PostgreSQL server */
 	time2iso(label, lengthof(label), current.start_time);
 	strncat(label, " with pg_probackup", lengthof(label));
+	backup_phase_switch(BACKUP_PHASE_START_BACKUP);
 	pg_start_backup(label, smooth_checkpoint, &current);
+	backup_phase_switch(BACKUP_PHASE_OTHER);
 
 	pgBackupGetPath(&current, database_path, lengthof(database_path),
 					DATABASE_DIR);
@@ -551,6 +772,7 @@ do_backup_instance(void)
 	backup_files_list = parray_new();
 
 	/* list files with the logical path. omit $PGDATA */
+	backup_phase_switch(BACKUP_PHASE_LIST_FILES);
 	if (is_remote_backup)
 		get_remote_pgdata_filelist(backup_files_list);
 	else
@@ -558,6 +780,7 @@ do_backup_instance(void)
 
 	/* Extract information about files in backup_list parsing their names:*/
 	parse_backup_filelist_filenames(backup_files_list, pgdata);
+	backup_phase_switch(BACKUP_PHASE_OTHER);
 
 	if (current.backup_mode != BACKUP_MODE_FULL)
 	{
@@ -571,6 +794,7 @@ do_backup_instance(void)
 	/*
 	 * Build page mapping in incremental mode.
 	 */
+	backup_phase_switch(BACKUP_PHASE_PAGEMAP);
 	if (current.backup_mode == BACKUP_MODE_DIFF_PAGE)
 	{
 		/*
@@ -578,6 +802,7 @@ do_backup_instance(void)
 		 * reading WAL segments present in archives up to the point
 		 * where this backup has started.
 		 */
+		datafile_index_build(backup_files_list);
 		extractPageMap(arclog_path, prev_backup->start_lsn, current.tli,
 					   current.start_lsn,
 					   /*
@@ -585,6 +810,7 @@ do_backup_instance(void)
 						* For backup from replica wait for current segment.
 						*/
 					   !from_replica);
+		datafile_index_free();
 	}
 
 	if (current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
@@ -592,6 +818,7 @@ do_backup_instance(void)
 		parray_qsort(backup_files_list, pgFileComparePath);
 		make_pagemap_from_ptrack(backup_files_list);
 	}
+	backup_phase_switch(BACKUP_PHASE_OTHER);
 
 	/*
 	 * Sort pathname ascending. It is necessary to create intermediate
@@ -630,51 +857,97 @@ do_backup_instance(void)
 			join_path_components(dirpath, database_path, dir_name);
 			dir_create_dir(dirpath, DIR_PERMISSION);
 		}
+	}
 
-		/* setup threads */
-		__sync_lock_release(&file->lock);
+	/* Train dictionary shared by pages of this backup */
+	if (compress_dict)
+	{
+		if (is_remote_backup)
+			elog(WARNING, "Compression dictionary is not supported for remote backup");
+		else
+		{
+			char		dict_path[MAXPGPATH];
+
+			pgBackupGetPath(&current, dict_path, lengthof(dict_path),
+							COMPRESS_DICT_FILE);
+			compress_dict_build(backup_files_list, dict_path);
+		}
 	}
 
-	/* sort by size for load balancing */
-	parray_qsort(backup_files_list, pgFileCompareSize);
+	if (current.dedup)
+		dedup_store_init();
 
-	/* init thread args with own file lists */
-	for (i = 0; i < num_threads; i++)
+	/*
+	 * Largest files are copied first for load balancing. Large datafiles
+	 * are split into parts copied by different threads. PTRACK backup
+	 * fetches changed blocks of a file by a single query, so its files are
+	 * not split.
+	 */
+	backup_parts = backup_file_parts(backup_files_list,
+									 io_threads > 1 && !is_remote_backup &&
+									 current.backup_mode != BACKUP_MODE_DIFF_PTRACK);
+	backup_sched = scheduler_new(backup_parts, pgFilePartWeightSize,
+								 io_threads);
+
+	/* init thread args */
+	for (i = 0; i < io_threads; i++)
 	{
 		backup_files_args *arg = pg_malloc(sizeof(backup_files_args));
 
+		arg->sched = backup_sched;
+		arg->thread_num = i;
 		arg->from_root = pgdata;
 		arg->to_root = database_path;
 		arg->backup_files_list = backup_files_list;
 		arg->prev_backup_filelist = prev_backup_filelist;
 		arg->prev_backup_start_lsn = prev_backup_start_lsn;
+		arg->prev_backup_start_time = prev_backup_start_time;
 		arg->thread_backup_conn = NULL;
 		arg->thread_cancel_conn = NULL;
+		arg->ptrack_stmt_prepared = false;
+		memset(&arg->stats, 0, sizeof(arg->stats));
+		init_backup_buffers(arg);
 		backup_threads_args[i] = arg;
 	}
 
-	/* Run threads */
-	elog(LOG, "Start transfering data files");
-	for (i = 0; i < num_threads; i++)
-	{
-		elog(VERBOSE, "Start thread num: %i", i);
-
-		if (!is_remote_backup)
-			pthread_create(&backup_threads[i], NULL,
-						   (void *(*)(void *)) backup_files,
-						   backup_threads_args[i]);
-		else
-			pthread_create(&backup_threads[i], NULL,
-						   (void *(*)(void *)) remote_backup_files,
-						   backup_threads_args[i]);
-	}
+	/*
+	 * Written files are synced at once after all of them are copied.
+	 * The catalog is synced with syncfs() if it has a file system of its own.
+	 */
+	deferred_fsync = fsync_queue_new(backup_instance_path, backup_path,
+									 no_cache);
 
-	/* Wait threads */
-	for (i = 0; i < num_threads; i++)
+	/* Run threads and wait for them */
+	elog(LOG, "Start transfering data files");
+	backup_phase_switch(BACKUP_PHASE_COPY);
+	throttle_start();
+	/* Pages read by copying threads are verified and compressed by cpu_pool */
+	cpu_pool = work_pool_start("compress", cpu_threads,
+							   io_threads * CPU_PIPELINE_DEPTH);
+	scheduler_run(backup_sched, "backup",
+				  is_remote_backup ? remote_backup_files : backup_files,
+				  (void **) backup_threads_args);
+	work_pool_stop(cpu_pool);
+	cpu_pool = NULL;
+	throttle_stop();
+
+	/* Pages added to the page store are synced with the other files */
+	backup_phase_switch(BACKUP_PHASE_FSYNC);
+	current.fsync_time = (uint32) (fsync_queue_flush(deferred_fsync,
+													 io_threads) * 1000);
+	fsync_queue_free(deferred_fsync);
+	deferred_fsync = NULL;
+	backup_phase_switch(BACKUP_PHASE_OTHER);
+
+	for (i = 0; i < io_threads; i++)
 	{
-		pthread_join(backup_threads[i], NULL);
+		thread_stats[i] = backup_threads_args[i]->stats;
+		free_backup_buffers(backup_threads_args[i]);
 		pg_free(backup_threads_args[i]);
 	}
+	scheduler_free(backup_sched);
+	free_file_parts(backup_parts);
+	compress_dict_free();
 	elog(LOG, "Data files are transfered");
 
 	/* clean previous backup file list */
@@ -685,7 +958,9 @@ do_backup_instance(void)
 	}
 
 	/* Notify end of backup */
+	backup_phase_switch(BACKUP_PHASE_STOP_BACKUP);
 	pg_stop_backup(&current);
+	backup_phase_switch(BACKUP_PHASE_OTHER);
 
 	/* Add archived xlog files into the list of files of this backup */
 	if (stream_wal)
@@ -718,7 +993,11 @@ do_backup_instance(void)
 	}
 
 	/* Print the list of files to backup catalog */
+	backup_phase_switch(BACKUP_PHASE_WRITE_FILELIST);
 	write_backup_file_list(backup_files_list, pgdata);
+	backup_phase_switch(BACKUP_PHASE_OTHER);
+
+	write_backup_stats(thread_stats);
 
 	/* Compute summary of size of regular files in the backup */
 	for (i = 0; i < parray_num(backup_files_list); i++)
@@ -783,6 +1062,12 @@ do_backup(time_t start_time)
 	StrNCpy(current.server_version, server_version_str,
 			sizeof(current.server_version));
 	current.stream = stream_wal;
+	current.dedup = dedup;
+	if (dedup && is_remote_backup)
+	{
+		elog(WARNING, "Deduplication is not supported for remote backup");
+		current.dedup = false;
+	}
 
 	is_ptrack_support = pg_ptrack_support();
 	if (is_ptrack_support)
@@ -964,6 +1249,7 @@ pg_start_backup(const char *label, bool smooth, pgBackup *backup)
 	uint32		xlogid;
 	uint32		xrecoff;
 	PGconn	   *conn;
+	BackupPhase	prev_phase;
 
 	params[0] = label;
 
@@ -999,6 +1285,7 @@ pg_start_backup(const char *label, bool smooth, pgBackup *backup)
 		 */
 		pg_switch_wal(conn);
 
+	prev_phase = backup_phase_switch(BACKUP_PHASE_WAL_WAIT);
 	if (!stream_wal)
 	{
 		/*
@@ -1017,6 +1304,7 @@ pg_start_backup(const char *label, bool smooth, pgBackup *backup)
 	/* Wait for start_lsn to be replayed by replica */
 	if (from_replica)
 		wait_replica_wal_lsn(backup->start_lsn, true);
+	backup_phase_switch(prev_phase);
 
 	/*
 	 * Set flag that pg_start_backup() was called. If an error will happen it
@@ -1768,8 +2056,14 @@ pg_stop_backup(pgBackup *backup)
 		PQclear(res);
 
 		if (stream_wal)
+		{
+			BackupPhase	prev_phase;
+
 			/* Wait for the completion of stream */
+			prev_phase = backup_phase_switch(BACKUP_PHASE_WAL_WAIT);
 			pthread_join(stream_thread, NULL);
+			backup_phase_switch(prev_phase);
+		}
 	}
 
 	/* Fill in fields if that is the correct end of backup. */
@@ -1777,8 +2071,10 @@ pg_stop_backup(pgBackup *backup)
 	{
 		char	   *xlog_path,
 					stream_xlog_path[MAXPGPATH];
+		BackupPhase	prev_phase;
 
 		/* Wait for stop_lsn to be received by replica */
+		prev_phase = backup_phase_switch(BACKUP_PHASE_WAL_WAIT);
 		if (from_replica)
 			wait_replica_wal_lsn(stop_backup_lsn, false);
 		/*
@@ -1786,6 +2082,7 @@ pg_stop_backup(pgBackup *backup)
 		 * We wait for stop_lsn in stream mode just in case.
 		 */
 		wait_wal_lsn(stop_backup_lsn, false);
+		backup_phase_switch(prev_phase);
 
 		if (stream_wal)
 		{
@@ -1883,6 +2180,36 @@ backup_disconnect(bool fatal, void *userdata)
 		pgut_disconnect(master_conn);
 }
 
+/*
+ * Check if the file, which is copied as a whole, was not modified since the
+ * previous backup, so that restore can take it from there. The file must
+ * have the same size and modification time as in the previous backup, and
+ * the time must be older than the start of the previous backup: changes
+ * made within the same second are not reflected in mtime.
+ */
+static bool
+file_is_unchanged(backup_files_args *arguments, pgFile *file)
+{
+	pgFile	  **prev_file;
+
+	if (arguments->prev_backup_filelist == NULL || file->mtime == 0)
+		return false;
+
+	prev_file = (pgFile **) parray_bsearch(arguments->prev_backup_filelist,
+										   file, pgFileComparePath);
+	if (prev_file == NULL)
+		return false;
+
+	if ((*prev_file)->mtime != file->mtime ||
+		(*prev_file)->size != file->size ||
+		(*prev_file)->mtime >= arguments->prev_backup_start_time)
+		return false;
+
+	/* Keep CRC of the copy in the previous backups */
+	file->crc = (*prev_file)->crc;
+	return true;
+}
+
 /*
  * Take a backup of the PGDATA at a file level.
  * Copy all directories and files listed in backup_files_list.
@@ -1894,28 +2221,60 @@ backup_disconnect(bool fatal, void *userdata)
 static void
 backup_files(void *arg)
 {
-	int				i;
 	backup_files_args *arguments = (backup_files_args *) arg;
-	int n_backup_files_list = parray_num(arguments->backup_files_list);
+	size_t		n_parts = scheduler_num_tasks(arguments->sched);
+	pgFilePart *part;
+	size_t		task_no;
 
 	/* backup a file */
-	for (i = 0; i < n_backup_files_list; i++)
+	while ((part = (pgFilePart *) scheduler_next(arguments->sched,
+												 arguments->thread_num,
+												 &task_no)) != NULL)
 	{
+		pgFile	   *file = part->file;
 		int			ret;
 		struct stat	buf;
 
-		pgFile *file = (pgFile *) parray_get(arguments->backup_files_list, i);
 		elog(VERBOSE, "Copying file:  \"%s\" ", file->path);
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
 
 		/* check for interrupt */
 		if (interrupted)
 			elog(ERROR, "interrupted during backup");
 
 		if (progress)
-			elog(LOG, "Progress: (%d/%d). Process file \"%s\"",
-				 i + 1, n_backup_files_list, file->path);
+			elog(LOG, "Progress: (%lu/%lu). Process file \"%s\"",
+				 (unsigned long) task_no, (unsigned long) n_parts,
+				 file->path);
+
+		/*
+		 * Blocks of a part of a large datafile are copied separately, the
+		 * file is complete when its last part is copied.
+		 */
+		if (part->split != NULL)
+		{
+			if (!backup_data_file_part(arguments,
+									   arguments->from_root,
+									   arguments->to_root, part,
+									   arguments->prev_backup_start_lsn,
+									   current.backup_mode))
+				continue;
+
+			if (file->write_size == BYTES_INVALID)
+			{
+				arguments->stats.files_skipped++;
+				elog(VERBOSE, "File \"%s\" was not copied to backup", file->path);
+				continue;
+			}
+			arguments->stats.data_bytes_read += file->read_size;
+			arguments->stats.data_bytes_written += file->write_size;
+			arguments->stats.files_copied++;
+			arguments->stats.bytes_read += file->read_size;
+			arguments->stats.bytes_written += file->write_size;
+
+			elog(VERBOSE, "File \"%s\". Copied %lu bytes",
+				 file->path, (unsigned long) file->write_size);
+			continue;
+		}
 
 		/* stat file to check its current state */
 		ret = stat(file->path, &buf);
@@ -1928,6 +2287,8 @@ backup_files(void *arg)
 				 * It could have been deleted by concurrent postgres transaction.
 				 */
 				file->write_size = BYTES_INVALID;
+				/* Never take it from this backup as unchanged */
+				file->mtime = 0;
 				elog(LOG, "File \"%s\" is not found", file->path);
 				continue;
 			}
@@ -1956,18 +2317,44 @@ backup_files(void *arg)
 									  current.backup_mode))
 				{
 					file->write_size = BYTES_INVALID;
+					arguments->stats.files_skipped++;
 					elog(VERBOSE, "File \"%s\" was not copied to backup", file->path);
 					continue;
 				}
+				arguments->stats.data_bytes_read += file->read_size;
+				arguments->stats.data_bytes_written += file->write_size;
 			}
-			else if (!copy_file(arguments->from_root,
-							   arguments->to_root,
-							   file))
+			else if (file_is_unchanged(arguments, file))
 			{
 				file->write_size = BYTES_INVALID;
-				elog(VERBOSE, "File \"%s\" was not copied to backup", file->path);
+				arguments->stats.files_skipped++;
+				elog(VERBOSE, "Skipping the file because it didn`t changed: %s", file->path);
 				continue;
 			}
+			else
+			{
+				instr_time	start_time;
+				instr_time	end_time;
+				bool		copied;
+
+				INSTR_TIME_SET_CURRENT(start_time);
+				copied = copy_file(arguments->from_root, arguments->to_root,
+								   file);
+				INSTR_TIME_SET_CURRENT(end_time);
+				INSTR_TIME_ACCUM_DIFF(arguments->stats.copy_time, end_time,
+									  start_time);
+				if (!copied)
+				{
+					file->write_size = BYTES_INVALID;
+					arguments->stats.files_skipped++;
+					elog(VERBOSE, "File \"%s\" was not copied to backup", file->path);
+					continue;
+				}
+			}
+
+			arguments->stats.files_copied++;
+			arguments->stats.bytes_read += file->read_size;
+			arguments->stats.bytes_written += file->write_size;
 
 			elog(VERBOSE, "File \"%s\". Copied %lu bytes",
 				 file->path, (unsigned long) file->write_size);
@@ -2324,24 +2711,209 @@ write_backup_file_list(parray *files, const char *root)
 }
 
 /*
- * A helper function to create the path of a relation file and segment.
- * The returned path is palloc'd
+ * Switch to the next phase of backup, adding time spent since the last
+ * switch to the current phase. Returns the phase switched from.
  */
-static char *
-datasegpath(RelFileNode rnode, ForkNumber forknum, BlockNumber segno)
+static BackupPhase
+backup_phase_switch(BackupPhase phase)
 {
-	char	   *path;
-	char	   *segpath;
+	BackupPhase	prev_phase = backup_phase;
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(backup_phase_time[prev_phase], now,
+						  backup_phase_start);
+	backup_phase_start = now;
+	backup_phase = phase;
 
-	path = relpathperm(rnode, forknum);
-	if (segno > 0)
+	return prev_phase;
+}
+
+static void
+print_thread_stats(FILE *out, const char *prefix, BackupThreadStats *stats)
+{
+	fprintf(out, "%sfiles-copied = " UINT64_FORMAT "\n", prefix,
+			stats->files_copied);
+	fprintf(out, "%sfiles-skipped = " UINT64_FORMAT "\n", prefix,
+			stats->files_skipped);
+	fprintf(out, "%sbytes-read = " UINT64_FORMAT "\n", prefix,
+			stats->bytes_read);
+	fprintf(out, "%sbytes-written = " UINT64_FORMAT "\n", prefix,
+			stats->bytes_written);
+	fprintf(out, "%spages-read = " UINT64_FORMAT "\n", prefix,
+			stats->pages_read);
+	fprintf(out, "%spages-skipped = " UINT64_FORMAT "\n", prefix,
+			stats->pages_skipped);
+	fprintf(out, "%spages-zero = " UINT64_FORMAT "\n", prefix,
+			stats->pages_zero);
+	fprintf(out, "%spages-retried = " UINT64_FORMAT "\n", prefix,
+			stats->pages_retried);
+	/* Bytes of datafiles read per byte written to backup */
+	if (stats->data_bytes_written > 0)
+		fprintf(out, "%scompress-ratio = %.2f\n", prefix,
+				(double) stats->data_bytes_read / stats->data_bytes_written);
+	fprintf(out, "%sread-time = %.3fs\n", prefix,
+			INSTR_TIME_GET_DOUBLE(stats->read_time));
+	fprintf(out, "%scompress-time = %.3fs\n", prefix,
+			INSTR_TIME_GET_DOUBLE(stats->compress_time));
+	fprintf(out, "%swrite-time = %.3fs\n", prefix,
+			INSTR_TIME_GET_DOUBLE(stats->write_time));
+	fprintf(out, "%sfsync-time = %.3fs\n", prefix,
+			INSTR_TIME_GET_DOUBLE(stats->fsync_time));
+	fprintf(out, "%scopy-time = %.3fs\n", prefix,
+			INSTR_TIME_GET_DOUBLE(stats->copy_time));
+}
+
+/*
+ * Write time spent in phases of backup and counters of backup threads to
+ * BACKUP_STATS_FILE. It is printed by "show --stats".
+ */
+static void
+write_backup_stats(BackupThreadStats *thread_stats)
+{
+	FILE	   *fp;
+	char		path[MAXPGPATH];
+	char		prefix[32];
+	BackupThreadStats total;
+	instr_time	total_time;
+	int			i;
+
+	pgBackupGetPath(&current, path, lengthof(path), BACKUP_STATS_FILE);
+
+	fp = fopen(path, "wt");
+	if (fp == NULL)
+		elog(ERROR, "cannot open stats file \"%s\": %s", path,
+			strerror(errno));
+
+	INSTR_TIME_SET_ZERO(total_time);
+	fprintf(fp, "#Phases\n");
+	for (i = 0; i < BACKUP_NUM_PHASES; i++)
 	{
-		segpath = psprintf("%s.%u", path, segno);
-		pfree(path);
-		return segpath;
+		fprintf(fp, "%s-time = %.3fs\n", backup_phase_names[i],
+				INSTR_TIME_GET_DOUBLE(backup_phase_time[i]));
+		INSTR_TIME_ADD(total_time, backup_phase_time[i]);
 	}
-	else
-		return path;
+	fprintf(fp, "total-time = %.3fs\n", INSTR_TIME_GET_DOUBLE(total_time));
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < io_threads; i++)
+	{
+		BackupThreadStats *stats = &thread_stats[i];
+
+		total.files_copied += stats->files_copied;
+		total.files_skipped += stats->files_skipped;
+		total.bytes_read += stats->bytes_read;
+		total.bytes_written += stats->bytes_written;
+		total.data_bytes_read += stats->data_bytes_read;
+		total.data_bytes_written += stats->data_bytes_written;
+		total.pages_read += stats->pages_read;
+		total.pages_skipped += stats->pages_skipped;
+		total.pages_zero += stats->pages_zero;
+		total.pages_retried += stats->pages_retried;
+		INSTR_TIME_ADD(total.read_time, stats->read_time);
+		INSTR_TIME_ADD(total.compress_time, stats->compress_time);
+		INSTR_TIME_ADD(total.write_time, stats->write_time);
+		INSTR_TIME_ADD(total.fsync_time, stats->fsync_time);
+		INSTR_TIME_ADD(total.copy_time, stats->copy_time);
+	}
+
+	fprintf(fp, "\n#All threads\n");
+	print_thread_stats(fp, "", &total);
+
+	for (i = 0; i < io_threads; i++)
+	{
+		fprintf(fp, "\n#Thread %d\n", i);
+		snprintf(prefix, lengthof(prefix), "thread-%d-", i);
+		print_thread_stats(fp, prefix, &thread_stats[i]);
+	}
+
+	if (fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0 ||
+		fclose(fp))
+		elog(ERROR, "cannot write stats file \"%s\": %s", path, strerror(errno));
+}
+
+/*
+ * Build the index of relation data files used by process_block_change().
+ *
+ * WAL records identify changed blocks by (RelFileNode, fork, blkno), so the
+ * index is keyed on (tablespace, database, relfilenode, fork, segno) and
+ * maps directly onto pgFile entries of the backup list. Only main fork
+ * segments are indexed: files of other forks are not datafiles and are
+ * always copied as a whole, so their pagemaps are never used.
+ */
+static void
+datafile_index_build(parray *files)
+{
+	size_t		i;
+	size_t		nfiles = 0;
+
+	datafile_index_free();
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISREG(file->mode) && file->is_datafile)
+			nfiles++;
+	}
+
+	/* Keep load factor not higher than 0.5 */
+	datafile_index_size = 16;
+	while (datafile_index_size < nfiles * 2)
+		datafile_index_size *= 2;
+
+	datafile_index = (DatafileIndexEntry *)
+		pgut_malloc(sizeof(DatafileIndexEntry) * datafile_index_size);
+	memset(datafile_index, 0, sizeof(DatafileIndexEntry) * datafile_index_size);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		uint32		pos;
+
+		if (!S_ISREG(file->mode) || !file->is_datafile)
+			continue;
+
+		pos = datafile_index_hash(file->tblspcOid, file->dbOid, file->relOid,
+								  MAIN_FORKNUM, file->segno);
+		while (datafile_index[pos].file != NULL)
+			pos = (pos + 1) & (datafile_index_size - 1);
+
+		datafile_index[pos].tblspcOid = file->tblspcOid;
+		datafile_index[pos].dbOid = file->dbOid;
+		datafile_index[pos].relOid = file->relOid;
+		datafile_index[pos].forknum = MAIN_FORKNUM;
+		datafile_index[pos].segno = file->segno;
+		datafile_index[pos].file = file;
+	}
+
+	elog(LOG, "Built datafile index of %lu entries for %lu datafiles",
+		 (unsigned long) datafile_index_size, (unsigned long) nfiles);
+}
+
+static void
+datafile_index_free(void)
+{
+	if (datafile_index)
+		pg_free(datafile_index);
+	datafile_index = NULL;
+	datafile_index_size = 0;
+}
+
+static uint32
+datafile_index_hash(Oid tblspcOid, Oid dbOid, Oid relOid, ForkNumber forknum,
+					int segno)
+{
+	uint32		h;
+
+	h = relOid * 0x9E3779B1;
+	h = (h ^ dbOid) * 0x85EBCA77;
+	h = (h ^ tblspcOid) * 0xC2B2AE3D;
+	h = (h ^ ((uint32) forknum << 24 | (uint32) segno)) * 0x27D4EB2F;
+	h ^= h >> 15;
+
+	return h & (datafile_index_size - 1);
 }
 
 /*
@@ -2351,42 +2923,39 @@ datasegpath(RelFileNode rnode, ForkNumber forknum, BlockNumber segno)
 void
 process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
 {
-	char		*path;
-	char		*rel_path;
 	BlockNumber blkno_inseg;
 	int			segno;
-	pgFile		*file_item = NULL;
-	int			j;
+	uint32		pos;
+
+	if (datafile_index == NULL)
+		elog(ERROR, "datafile index is not built");
 
 	segno = blkno / RELSEG_SIZE;
 	blkno_inseg = blkno % RELSEG_SIZE;
 
-	rel_path = datasegpath(rnode, forknum, segno);
-	path = pg_malloc(strlen(rel_path) + strlen(pgdata) + 2);
-	sprintf(path, "%s/%s", pgdata, rel_path);
-
-	for (j = 0; j < parray_num(backup_files_list); j++)
-	{
-		pgFile *p = (pgFile *) parray_get(backup_files_list, j);
-
-		if (strcmp(p->path, path) == 0)
-		{
-			file_item = p;
-			break;
-		}
-	}
-
 	/*
 	 * If we don't have any record of this file in the file map, it means
 	 * that it's a relation that did not have much activity since the last
 	 * backup. We can safely ignore it. If it is a new relation file, the
 	 * backup would simply copy it as-is.
 	 */
-	if (file_item)
-		datapagemap_add(&file_item->pagemap, blkno_inseg);
+	pos = datafile_index_hash(rnode.spcNode, rnode.dbNode, rnode.relNode,
+							  forknum, segno);
+	while (datafile_index[pos].file != NULL)
+	{
+		DatafileIndexEntry *entry = &datafile_index[pos];
 
-	pg_free(path);
-	pg_free(rel_path);
+		if (entry->relOid == rnode.relNode &&
+			entry->dbOid == rnode.dbNode &&
+			entry->tblspcOid == rnode.spcNode &&
+			entry->forknum == forknum &&
+			entry->segno == segno)
+		{
+			datapagemap_add(&entry->file->pagemap, blkno_inseg);
+			break;
+		}
+		pos = (pos + 1) & (datafile_index_size - 1);
+	}
 }
 
 /*
@@ -2690,69 +3259,260 @@ get_last_ptrack_lsn(void)
 	return lsn;
 }
 
-char *
-pg_ptrack_get_block(backup_files_args *arguments,
-					Oid dbOid,
-					Oid tblsOid,
-					Oid relOid,
-					BlockNumber blknum,
-					size_t *result_size)
+/*
+ * Name of the prepared statement used to fetch blocks from shared buffers.
+ * It takes an array of block numbers of the relation and returns them
+ * in binary format in the same order.
+ */
+#define PTRACK_GET_BLOCKS_STMT	"pg_probackup_ptrack_get_blocks"
+
+/*
+ * Connect the backup thread to the server if it isn't connected yet
+ * and prepare statement to fetch blocks.
+ */
+static void
+ptrack_prepare_get_blocks(backup_files_args *arguments)
 {
 	PGresult   *res;
-	char	   *params[4];
-	char	   *result;
-
-	params[0] = palloc(64);
-	params[1] = palloc(64);
-	params[2] = palloc(64);
-	params[3] = palloc(64);
 
 	/*
 	 * Use tmp_conn, since we may work in parallel threads.
 	 * We can connect to any database.
 	 */
-	sprintf(params[0], "%i", tblsOid);
-	sprintf(params[1], "%i", dbOid);
-	sprintf(params[2], "%i", relOid);
-	sprintf(params[3], "%u", blknum);
-
 	if (arguments->thread_backup_conn == NULL)
 	{
 		arguments->thread_backup_conn = pgut_connect(pgut_dbname);
+		arguments->ptrack_stmt_prepared = false;
 	}
 
 	if (arguments->thread_cancel_conn == NULL)
 		arguments->thread_cancel_conn = PQgetCancel(arguments->thread_backup_conn);
 
-	//elog(LOG, "db %i pg_ptrack_get_block(%i, %i, %u)",dbOid, tblsOid, relOid, blknum);
-	res = pgut_execute_parallel(arguments->thread_backup_conn,
-								arguments->thread_cancel_conn,
-					"SELECT pg_ptrack_get_block_2($1, $2, $3, $4)",
-					4, (const char **)params, true);
+	if (arguments->ptrack_stmt_prepared)
+		return;
 
-	if (PQnfields(res) != 1)
+	res = PQprepare(arguments->thread_backup_conn, PTRACK_GET_BLOCKS_STMT,
+					"SELECT b.blkno, pg_ptrack_get_block_2($1, $2, $3, b.blkno) "
+					"FROM unnest($4::int8[]) WITH ORDINALITY AS b(blkno, n) "
+					"ORDER BY b.n",
+					4, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		elog(ERROR, "cannot prepare statement to get blocks: %s",
+			 PQerrorMessage(arguments->thread_backup_conn));
+	PQclear(res);
+
+	arguments->ptrack_stmt_prepared = true;
+}
+
+/*
+ * Copy a row returned by PTRACK_GET_BLOCKS_STMT in binary format into page.
+ * Returns false if the block doesn't exist.
+ */
+static bool
+ptrack_get_block_from_result(PGresult *res, int row, BlockNumber blknum,
+							 Oid relOid, char *page, size_t *page_size)
+{
+	const unsigned char *blkno_value;
+	uint64		blkno = 0;
+	int			len;
+	int			i;
+
+	if (PQnfields(res) != 2 || PQgetlength(res, row, 0) != sizeof(uint64))
+		elog(ERROR, "unexpected result while getting block %u of relation oid %u",
+			 blknum, relOid);
+
+	/* int8 is sent in network byte order */
+	blkno_value = (const unsigned char *) PQgetvalue(res, row, 0);
+	for (i = 0; i < sizeof(uint64); i++)
+		blkno = (blkno << 8) | blkno_value[i];
+
+	if (blkno != blknum)
+		elog(ERROR, "got block " UINT64_FORMAT " of relation oid %u instead of block %u",
+			 blkno, relOid, blknum);
+
+	if (PQgetisnull(res, row, 1))
 	{
 		elog(VERBOSE, "cannot get file block for relation oid %u",
 					   relOid);
-		return NULL;
+		return false;
 	}
 
-	if (PQgetisnull(res, 0, 0))
+	len = PQgetlength(res, row, 1);
+	if (len > BLCKSZ)
+		elog(ERROR, "block %u of relation oid %u is larger than %d bytes",
+			 blknum, relOid, BLCKSZ);
+
+	memcpy(page, PQgetvalue(res, row, 1), len);
+	*page_size = len;
+
+	return true;
+}
+
+/*
+ * Get a block of the relation from shared buffers via SQL and copy it
+ * into page, which must be at least BLCKSZ bytes.
+ * Returns false if the block doesn't exist.
+ */
+bool
+pg_ptrack_get_block(backup_files_args *arguments,
+					Oid dbOid,
+					Oid tblsOid,
+					Oid relOid,
+					BlockNumber blknum,
+					char *page,
+					size_t *page_size)
+{
+	PGresult   *res;
+	char		params_buf[4][16];
+	const char *params[4];
+	bool		result;
+
+	sprintf(params_buf[0], "%u", tblsOid);
+	sprintf(params_buf[1], "%u", dbOid);
+	sprintf(params_buf[2], "%u", relOid);
+	sprintf(params_buf[3], "{%u}", blknum);
+	params[0] = params_buf[0];
+	params[1] = params_buf[1];
+	params[2] = params_buf[2];
+	params[3] = params_buf[3];
+
+	ptrack_prepare_get_blocks(arguments);
+
+	if (interrupted)
+		elog(ERROR, "interrupted");
+
+	res = PQexecPrepared(arguments->thread_backup_conn, PTRACK_GET_BLOCKS_STMT,
+						 4, params, NULL, NULL, 1);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		elog(ERROR, "cannot get block %u of relation oid %u: %s",
+			 blknum, relOid, PQerrorMessage(arguments->thread_backup_conn));
+
+	if (PQntuples(res) != 1)
+		elog(ERROR, "unexpected result while getting block %u of relation oid %u",
+			 blknum, relOid);
+
+	result = ptrack_get_block_from_result(res, 0, blknum, relOid,
+										  page, page_size);
+	PQclear(res);
+
+	return result;
+}
+
+/*
+ * Start fetching changed blocks of the datafile from shared buffers.
+ *
+ * All blocks of the file which are marked in its pagemap (or all of its
+ * nblocks if it has no pagemap) are requested by a single statement, which
+ * returns them in binary format. Result rows are streamed in single-row
+ * mode: while the thread processes a block, the following ones are already
+ * on their way, so there is no round trip per block. Blocks must be read
+ * by pg_ptrack_get_blocks_next() in ascending order, and the fetch must be
+ * finished by pg_ptrack_get_blocks_end().
+ */
+void
+pg_ptrack_get_blocks_begin(backup_files_args *arguments, pgFile *file,
+						   BlockNumber nblocks)
+{
+	PQExpBufferData blocks;
+	char		params_buf[3][16];
+	const char *params[4];
+	BlockNumber	base = file->segno * RELSEG_SIZE;
+	BlockNumber	blknum;
+
+	ptrack_prepare_get_blocks(arguments);
+
+	initPQExpBuffer(&blocks);
+	appendPQExpBufferChar(&blocks, '{');
+	if (file->pagemap.bitmapsize == PageBitmapIsAbsent)
 	{
-		elog(VERBOSE, "cannot get file block for relation oid %u",
-				   relOid);
-		return NULL;
+		for (blknum = 0; blknum < nblocks; blknum++)
+			appendPQExpBuffer(&blocks, "%s%u", blknum > 0 ? "," : "",
+							  base + blknum);
 	}
+	else
+	{
+		datapagemap_iterator_t *iter;
+		bool		first = true;
 
-	result = (char *) PQunescapeBytea((unsigned char *) PQgetvalue(res, 0, 0),
-									  result_size);
+		iter = datapagemap_iterate(&file->pagemap);
+		while (datapagemap_next(iter, &blknum))
+		{
+			appendPQExpBuffer(&blocks, "%s%u", first ? "" : ",", base + blknum);
+			first = false;
+		}
+		pg_free(iter);
+	}
+	appendPQExpBufferChar(&blocks, '}');
+	if (PQExpBufferBroken(&blocks))
+		elog(ERROR, "out of memory");
+
+	sprintf(params_buf[0], "%u", file->tblspcOid);
+	sprintf(params_buf[1], "%u", file->dbOid);
+	sprintf(params_buf[2], "%u", file->relOid);
+	params[0] = params_buf[0];
+	params[1] = params_buf[1];
+	params[2] = params_buf[2];
+	params[3] = blocks.data;
+
+	if (!PQsendQueryPrepared(arguments->thread_backup_conn,
+							 PTRACK_GET_BLOCKS_STMT, 4, params, NULL, NULL, 1))
+		elog(ERROR, "cannot send query to get blocks of file \"%s\": %s",
+			 file->path, PQerrorMessage(arguments->thread_backup_conn));
+
+	if (!PQsetSingleRowMode(arguments->thread_backup_conn))
+		elog(ERROR, "cannot set single-row mode to get blocks of file \"%s\"",
+			 file->path);
+
+	termPQExpBuffer(&blocks);
+}
 
-	PQclear(res);
+/*
+ * Copy the next block fetched by pg_ptrack_get_blocks_begin() into page.
+ * blknum is the expected absolute number of the block.
+ * Returns false if the block doesn't exist.
+ */
+bool
+pg_ptrack_get_blocks_next(backup_files_args *arguments, pgFile *file,
+						  BlockNumber blknum, char *page, size_t *page_size)
+{
+	PGresult   *res;
+	bool		result;
 
-	pfree(params[0]);
-	pfree(params[1]);
-	pfree(params[2]);
-	pfree(params[3]);
+	if (interrupted)
+		elog(ERROR, "interrupted");
+
+	res = PQgetResult(arguments->thread_backup_conn);
+	if (res == NULL || PQresultStatus(res) != PGRES_SINGLE_TUPLE)
+	{
+		if (res == NULL || PQresultStatus(res) == PGRES_TUPLES_OK)
+			elog(ERROR, "block %u of file \"%s\" is not returned by server",
+				 blknum, file->path);
+		elog(ERROR, "cannot get block %u of file \"%s\": %s",
+			 blknum, file->path, PQerrorMessage(arguments->thread_backup_conn));
+	}
+
+	result = ptrack_get_block_from_result(res, 0, blknum, file->relOid,
+										  page, page_size);
+	PQclear(res);
 
 	return result;
-}
\ No newline at end of file
+}
+
+/*
+ * Finish fetching blocks started by pg_ptrack_get_blocks_begin().
+ */
+void
+pg_ptrack_get_blocks_end(backup_files_args *arguments)
+{
+	PGresult   *res;
+
+	while ((res = PQgetResult(arguments->thread_backup_conn)) != NULL)
+	{
+		ExecStatusType status = PQresultStatus(res);
+
+		PQclear(res);
+		if (status != PGRES_TUPLES_OK && status != PGRES_SINGLE_TUPLE)
+			elog(ERROR, "cannot get blocks: %s",
+				 PQerrorMessage(arguments->thread_backup_conn));
+	}
+}
@@ -21,7 +21,7 @@
 #include <time.h>
 #include <unistd.h>
 
-static const char *backupModes[] = {"", "PAGE", "PTRACK", "FULL"};
+static const char *backupModes[] = {"", "PAGE", "PTRACK", "DELTA", "FULL"};
 static pgBackup *readBackupControlFile(const char *path);
 
 static bool exit_hook_registered = false;
@@ -389,6 +389,8 @@ pgBackupWriteControl(FILE *out, pgBackup *backup)
 	fprintf(out, "compress-alg = %s\n", deparse_compress_alg(compress_alg));
 	fprintf(out, "compress-level = %d\n", compress_level);
 	fprintf(out, "from-replica = %s\n", from_replica?"true":"false");
+	if (backup->dedup)
+		fprintf(out, "dedup = true\n");
 	
 	fprintf(out, "\n#Compatibility\n");
 	fprintf(out, "block-size = %u\n", backup->block_size);
@@ -432,6 +434,9 @@ pgBackupWriteControl(FILE *out, pgBackup *backup)
 	if (backup->data_bytes != BYTES_INVALID)
 		fprintf(out, "wal-bytes = " INT64_FORMAT "\n", backup->wal_bytes);
 
+	if (backup->fsync_time > 0)
+		fprintf(out, "fsync-time = %ums\n", backup->fsync_time);
+
 	fprintf(out, "status = %s\n", status2str(backup->status));
 
 	/* 'parent_backup' is set if it is incremental backup */
@@ -488,6 +493,7 @@ readBackupControlFile(const char *path)
 		{'t', 0, "recovery-time",		&backup->recovery_time, SOURCE_FILE_STRICT},
 		{'I', 0, "data-bytes",			&backup->data_bytes, SOURCE_FILE_STRICT},
 		{'I', 0, "wal-bytes",			&backup->wal_bytes, SOURCE_FILE_STRICT},
+		{'u', 0, "fsync-time",			&backup->fsync_time, SOURCE_FILE_STRICT, SOURCE_DEFAULT, OPTION_UNIT_MS},
 		{'u', 0, "block-size",			&backup->block_size, SOURCE_FILE_STRICT},
 		{'u', 0, "xlog-block-size",		&backup->wal_block_size, SOURCE_FILE_STRICT},
 		{'u', 0, "checksum-version",	&backup->checksum_version, SOURCE_FILE_STRICT},
@@ -498,6 +504,7 @@ readBackupControlFile(const char *path)
 		{'s', 0, "compress-alg",		&compress_alg, SOURCE_FILE_STRICT},
 		{'u', 0, "compress-level",		&compress_level, SOURCE_FILE_STRICT},
 		{'b', 0, "from-replica",		&from_replica, SOURCE_FILE_STRICT},
+		{'b', 0, "dedup",				&backup->dedup, SOURCE_FILE_STRICT},
 		{0}
 	};
 
@@ -555,6 +562,8 @@ readBackupControlFile(const char *path)
 			backup->status = BACKUP_STATUS_ORPHAN;
 		else if (strcmp(status, "CORRUPT") == 0)
 			backup->status = BACKUP_STATUS_CORRUPT;
+		else if (strcmp(status, "MERGING") == 0)
+			backup->status = BACKUP_STATUS_MERGING;
 		else
 			elog(WARNING, "invalid STATUS \"%s\"", status);
 		free(status);
@@ -593,6 +602,8 @@ parse_backup_mode(const char *value)
 		return BACKUP_MODE_DIFF_PAGE;
 	else if (len > 0 && pg_strncasecmp("ptrack", v, len) == 0)
 		return BACKUP_MODE_DIFF_PTRACK;
+	else if (len > 0 && pg_strncasecmp("delta", v, len) == 0)
+		return BACKUP_MODE_DIFF_DELTA;
 
 	/* Backup mode is invalid, so leave with an error */
 	elog(ERROR, "invalid backup-mode \"%s\"", value);
@@ -610,6 +621,8 @@ deparse_backup_mode(BackupMode mode)
 			return "page";
 		case BACKUP_MODE_DIFF_PTRACK:
 			return "ptrack";
+		case BACKUP_MODE_DIFF_DELTA:
+			return "delta";
 		case BACKUP_MODE_INVALID:
 			return "invalid";
 	}
@@ -0,0 +1,281 @@
+/*-------------------------------------------------------------------------
+ *
+ * checksum.c: data page checksums
+ *
+ * Checksums of many pages are computed by one call, using AVX2 or SSE4.1
+ * when the CPU supports them. The algorithm is the one of
+ * storage/checksum_impl.h: each page is split into rows of N_SUMS words,
+ * which are mixed into N_SUMS independent FNV-1a like sums. These sums map
+ * directly onto vector lanes, and interleaving several pages hides the
+ * latency of vector multiplication.
+ *
+ * Portions Copyright (c) 2015-2017, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include "storage/bufpage.h"
+#include "storage/checksum_impl.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_CHECKSUM_SIMD
+#include <immintrin.h>
+#endif
+
+/* Number of 32-bit words in a row of the page */
+#define CHECKSUM_ROWS		((int) (BLCKSZ / sizeof(uint32) / N_SUMS))
+
+/* Reduce 32-bit checksum of the block to the page checksum */
+#define CHECKSUM_FINISH(checksum, blkno) \
+	((uint16) ((((checksum) ^ (blkno)) % 65535) + 1))
+
+static void pg_checksum_pages_choose(char *pages, int npages,
+									 BlockNumber blkno, uint16 *checksums);
+
+void (*pg_checksum_pages) (char *pages, int npages, BlockNumber blkno,
+						   uint16 *checksums) = pg_checksum_pages_choose;
+
+/*
+ * Portable implementation, computes checksums page by page.
+ */
+static void
+pg_checksum_pages_sb(char *pages, int npages, BlockNumber blkno,
+					 uint16 *checksums)
+{
+	int			i;
+
+	for (i = 0; i < npages; i++)
+	{
+		char	   *page = pages + (size_t) i * BLCKSZ;
+
+		/* New pages have no checksum */
+		checksums[i] = PageIsNew((Page) page) ? 0 :
+			pg_checksum_page(page, blkno + i);
+	}
+}
+
+#ifdef USE_CHECKSUM_SIMD
+
+/*
+ * pd_checksum occupies the lower half of the third word of the page, it is
+ * treated as zero while the checksum is computed.
+ */
+#define PD_CHECKSUM_WORD	(offsetof(PageHeaderData, pd_checksum) / sizeof(uint32))
+
+/*
+ * AVX2 implementation. N_SUMS lanes of a page take 4 registers, two pages
+ * are processed at once.
+ */
+#define AVX2_REGS	(N_SUMS / 8)
+
+__attribute__((target("avx2")))
+static inline __m256i
+checksum_comp_avx2(__m256i sum, __m256i value, __m256i prime)
+{
+	__m256i		tmp = _mm256_xor_si256(sum, value);
+
+	return _mm256_xor_si256(_mm256_mullo_epi32(tmp, prime),
+							_mm256_srli_epi32(tmp, 17));
+}
+
+__attribute__((target("avx2")))
+static inline uint32
+checksum_reduce_avx2(__m256i *sums, __m256i prime)
+{
+	__m256i		zero = _mm256_setzero_si256();
+	__m128i		r;
+	int			i;
+
+	/* Two rounds of zeroes mix in the last values */
+	for (i = 0; i < AVX2_REGS; i++)
+	{
+		sums[i] = checksum_comp_avx2(sums[i], zero, prime);
+		sums[i] = checksum_comp_avx2(sums[i], zero, prime);
+	}
+
+	sums[0] = _mm256_xor_si256(_mm256_xor_si256(sums[0], sums[1]),
+							   _mm256_xor_si256(sums[2], sums[3]));
+	r = _mm_xor_si128(_mm256_castsi256_si128(sums[0]),
+					  _mm256_extracti128_si256(sums[0], 1));
+	r = _mm_xor_si128(r, _mm_srli_si128(r, 8));
+	r = _mm_xor_si128(r, _mm_srli_si128(r, 4));
+
+	return (uint32) _mm_cvtsi128_si32(r);
+}
+
+__attribute__((target("avx2")))
+static void
+pg_checksum_pages_avx2(char *pages, int npages, BlockNumber blkno,
+					   uint16 *checksums)
+{
+	const __m256i prime = _mm256_set1_epi32(FNV_PRIME);
+	const __m256i mask = _mm256_setr_epi32(-1, -1, 0xFFFF0000, -1,
+										   -1, -1, -1, -1);
+	int			i = 0;
+
+	StaticAssertStmt(PD_CHECKSUM_WORD == 2, "unexpected pd_checksum offset");
+
+	for (; i + 1 < npages; i += 2)
+	{
+		const __m256i *p1 = (const __m256i *) (pages + (size_t) i * BLCKSZ);
+		const __m256i *p2 = (const __m256i *) (pages + (size_t) (i + 1) * BLCKSZ);
+		__m256i		s1[AVX2_REGS];
+		__m256i		s2[AVX2_REGS];
+		int			row;
+		int			j;
+
+		for (j = 0; j < AVX2_REGS; j++)
+		{
+			s1[j] = _mm256_loadu_si256((const __m256i *) checksumBaseOffsets + j);
+			s2[j] = s1[j];
+		}
+
+		/* The first row contains pd_checksum */
+		s1[0] = checksum_comp_avx2(s1[0],
+					_mm256_and_si256(_mm256_loadu_si256(p1), mask), prime);
+		s2[0] = checksum_comp_avx2(s2[0],
+					_mm256_and_si256(_mm256_loadu_si256(p2), mask), prime);
+		for (j = 1; j < AVX2_REGS; j++)
+		{
+			s1[j] = checksum_comp_avx2(s1[j], _mm256_loadu_si256(p1 + j), prime);
+			s2[j] = checksum_comp_avx2(s2[j], _mm256_loadu_si256(p2 + j), prime);
+		}
+
+		for (row = 1; row < CHECKSUM_ROWS; row++)
+		{
+			p1 += AVX2_REGS;
+			p2 += AVX2_REGS;
+			for (j = 0; j < AVX2_REGS; j++)
+			{
+				s1[j] = checksum_comp_avx2(s1[j], _mm256_loadu_si256(p1 + j), prime);
+				s2[j] = checksum_comp_avx2(s2[j], _mm256_loadu_si256(p2 + j), prime);
+			}
+		}
+
+		checksums[i] = CHECKSUM_FINISH(checksum_reduce_avx2(s1, prime), blkno + i);
+		checksums[i + 1] = CHECKSUM_FINISH(checksum_reduce_avx2(s2, prime), blkno + i + 1);
+	}
+
+	for (; i < npages; i++)
+	{
+		const __m256i *p = (const __m256i *) (pages + (size_t) i * BLCKSZ);
+		__m256i		s[AVX2_REGS];
+		int			row;
+		int			j;
+
+		for (j = 0; j < AVX2_REGS; j++)
+			s[j] = _mm256_loadu_si256((const __m256i *) checksumBaseOffsets + j);
+
+		s[0] = checksum_comp_avx2(s[0],
+					_mm256_and_si256(_mm256_loadu_si256(p), mask), prime);
+		for (j = 1; j < AVX2_REGS; j++)
+			s[j] = checksum_comp_avx2(s[j], _mm256_loadu_si256(p + j), prime);
+
+		for (row = 1; row < CHECKSUM_ROWS; row++)
+		{
+			p += AVX2_REGS;
+			for (j = 0; j < AVX2_REGS; j++)
+				s[j] = checksum_comp_avx2(s[j], _mm256_loadu_si256(p + j), prime);
+		}
+
+		checksums[i] = CHECKSUM_FINISH(checksum_reduce_avx2(s, prime), blkno + i);
+	}
+
+	/* New pages have no checksum */
+	for (i = 0; i < npages; i++)
+		if (PageIsNew((Page) (pages + (size_t) i * BLCKSZ)))
+			checksums[i] = 0;
+}
+
+/*
+ * SSE4.1 implementation. N_SUMS lanes of a page take 8 registers, which is
+ * enough to keep the multiplier busy with a single page.
+ */
+#define SSE41_REGS	(N_SUMS / 4)
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+checksum_comp_sse41(__m128i sum, __m128i value, __m128i prime)
+{
+	__m128i		tmp = _mm_xor_si128(sum, value);
+
+	return _mm_xor_si128(_mm_mullo_epi32(tmp, prime),
+						 _mm_srli_epi32(tmp, 17));
+}
+
+__attribute__((target("sse4.1")))
+static void
+pg_checksum_pages_sse41(char *pages, int npages, BlockNumber blkno,
+						uint16 *checksums)
+{
+	const __m128i prime = _mm_set1_epi32(FNV_PRIME);
+	const __m128i mask = _mm_setr_epi32(-1, -1, 0xFFFF0000, -1);
+	const __m128i zero = _mm_setzero_si128();
+	int			i;
+
+	for (i = 0; i < npages; i++)
+	{
+		const __m128i *p = (const __m128i *) (pages + (size_t) i * BLCKSZ);
+		__m128i		s[SSE41_REGS];
+		__m128i		r;
+		int			row;
+		int			j;
+
+		if (PageIsNew((Page) p))
+		{
+			checksums[i] = 0;
+			continue;
+		}
+
+		for (j = 0; j < SSE41_REGS; j++)
+			s[j] = _mm_loadu_si128((const __m128i *) checksumBaseOffsets + j);
+
+		s[0] = checksum_comp_sse41(s[0],
+					_mm_and_si128(_mm_loadu_si128(p), mask), prime);
+		for (j = 1; j < SSE41_REGS; j++)
+			s[j] = checksum_comp_sse41(s[j], _mm_loadu_si128(p + j), prime);
+
+		for (row = 1; row < CHECKSUM_ROWS; row++)
+		{
+			p += SSE41_REGS;
+			for (j = 0; j < SSE41_REGS; j++)
+				s[j] = checksum_comp_sse41(s[j], _mm_loadu_si128(p + j), prime);
+		}
+
+		r = zero;
+		for (j = 0; j < SSE41_REGS; j++)
+		{
+			s[j] = checksum_comp_sse41(s[j], zero, prime);
+			s[j] = checksum_comp_sse41(s[j], zero, prime);
+			r = _mm_xor_si128(r, s[j]);
+		}
+		r = _mm_xor_si128(r, _mm_srli_si128(r, 8));
+		r = _mm_xor_si128(r, _mm_srli_si128(r, 4));
+
+		checksums[i] = CHECKSUM_FINISH((uint32) _mm_cvtsi128_si32(r), blkno + i);
+	}
+}
+
+#endif   /* USE_CHECKSUM_SIMD */
+
+/*
+ * Choose the best implementation for this CPU on the first call.
+ */
+static void
+pg_checksum_pages_choose(char *pages, int npages, BlockNumber blkno,
+						 uint16 *checksums)
+{
+#ifdef USE_CHECKSUM_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		pg_checksum_pages = pg_checksum_pages_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		pg_checksum_pages = pg_checksum_pages_sse41;
+	else
+#endif
+		pg_checksum_pages = pg_checksum_pages_sb;
+
+	pg_checksum_pages(pages, npages, blkno, checksums);
+}
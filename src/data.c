@@ -10,21 +10,61 @@
 
 #include "pg_probackup.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Maximum number of buffers accepted by a single writev() */
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+#define USE_CACHE_GUARD
+#endif
+
+/* Copying files inside the kernel */
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#endif
+
+/* Preallocating restored files and punching holes in them */
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE) && \
+	defined(FALLOC_FL_PUNCH_HOLE)
+#define USE_FALLOCATE
+#endif
 
 #include "libpq/pqsignal.h"
 #include "storage/block.h"
 #include "storage/bufpage.h"
-#include "storage/checksum_impl.h"
+#include "storage/checksum.h"
 #include <common/pg_lzcompress.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_LIBZ
 #include <zlib.h>
 #endif
 
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
 #ifdef HAVE_LIBZ
 /* Implementation of zlib compression method */
 static size_t zlib_compress(void* dst, size_t dst_size, void const* src, size_t src_size)
@@ -43,6 +83,116 @@ static size_t zlib_decompress(void* dst, size_t dst_size, void const* src, size_
 }
 #endif
 
+#ifdef HAVE_LIBZSTD
+/*
+ * Dictionary used to compress and decompress pages of the current backup.
+ * It is trained before backup threads are started and loaded before restore
+ * threads are started, so threads only read these pointers.
+ */
+static ZSTD_CDict *zstd_cdict = NULL;
+static ZSTD_DDict *zstd_ddict = NULL;
+
+/* zstd contexts are expensive to create, so each thread keeps its own */
+typedef struct ZstdThreadContext
+{
+	ZSTD_CCtx  *cctx;
+	ZSTD_DCtx  *dctx;
+} ZstdThreadContext;
+
+static pthread_key_t zstd_context_key;
+static pthread_once_t zstd_context_once = PTHREAD_ONCE_INIT;
+
+static void
+zstd_context_free(void *arg)
+{
+	ZstdThreadContext *ctx = (ZstdThreadContext *) arg;
+
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	free(ctx);
+}
+
+static void
+zstd_context_key_init(void)
+{
+	pthread_key_create(&zstd_context_key, zstd_context_free);
+}
+
+static ZstdThreadContext *
+zstd_get_context(void)
+{
+	ZstdThreadContext *ctx;
+
+	pthread_once(&zstd_context_once, zstd_context_key_init);
+
+	ctx = (ZstdThreadContext *) pthread_getspecific(zstd_context_key);
+	if (ctx == NULL)
+	{
+		ctx = pgut_new(ZstdThreadContext);
+		ctx->cctx = ZSTD_createCCtx();
+		ctx->dctx = ZSTD_createDCtx();
+		if (ctx->cctx == NULL || ctx->dctx == NULL)
+			elog(ERROR, "cannot allocate zstd context");
+		pthread_setspecific(zstd_context_key, ctx);
+	}
+
+	return ctx;
+}
+
+/* Implementation of zstd compression method */
+static size_t zstd_compress(void* dst, size_t dst_size, void const* src, size_t src_size)
+{
+	ZstdThreadContext *ctx = zstd_get_context();
+	size_t		rc;
+
+	if (zstd_cdict)
+		rc = ZSTD_compress_usingCDict(ctx->cctx, dst, dst_size,
+									  src, src_size, zstd_cdict);
+	else
+		rc = ZSTD_compressCCtx(ctx->cctx, dst, dst_size,
+							   src, src_size, compress_level);
+
+	return ZSTD_isError(rc) ? -1 : rc;
+}
+
+/* Implementation of zstd compression method */
+static size_t zstd_decompress(void* dst, size_t dst_size, void const* src, size_t src_size)
+{
+	ZstdThreadContext *ctx = zstd_get_context();
+	size_t		rc;
+
+	if (zstd_ddict)
+		rc = ZSTD_decompress_usingDDict(ctx->dctx, dst, dst_size,
+										src, src_size, zstd_ddict);
+	else
+		rc = ZSTD_decompressDCtx(ctx->dctx, dst, dst_size, src, src_size);
+
+	return ZSTD_isError(rc) ? -1 : rc;
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+/*
+ * Implementation of lz4 compression method. Higher compress levels map to
+ * lower acceleration factors, level 9 being the default LZ4 compression.
+ */
+static size_t lz4_compress(void* dst, size_t dst_size, void const* src, size_t src_size)
+{
+	int			rc = LZ4_compress_fast(src, dst, src_size, dst_size,
+									   10 - compress_level);
+
+	return rc > 0 ? rc : -1;
+}
+
+/* Implementation of lz4 compression method */
+static size_t lz4_decompress(void* dst, size_t dst_size, void const* src, size_t src_size)
+{
+	int			rc = LZ4_decompress_safe(src, dst, src_size, dst_size);
+
+	return rc >= 0 ? rc : -1;
+}
+#endif
+
 /*
  * Compresses source into dest using algorithm. Returns the number of bytes
  * written in the destination buffer, or -1 if compression fails.
@@ -58,6 +208,14 @@ do_compress(void* dst, size_t dst_size, void const* src, size_t src_size, Compre
 #ifdef HAVE_LIBZ
 		case ZLIB_COMPRESS:
 			return zlib_compress(dst, dst_size, src, src_size);
+#endif
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+			return zstd_compress(dst, dst_size, src, src_size);
+#endif
+#ifdef HAVE_LIBLZ4
+		case LZ4_COMPRESS:
+			return lz4_compress(dst, dst_size, src, src_size);
 #endif
 		case PGLZ_COMPRESS:
 			return pglz_compress(src, src_size, dst, PGLZ_strategy_always);
@@ -81,6 +239,14 @@ do_decompress(void* dst, size_t dst_size, void const* src, size_t src_size, Comp
 #ifdef HAVE_LIBZ
 		case ZLIB_COMPRESS:
 			return zlib_decompress(dst, dst_size, src, src_size);
+#endif
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+			return zstd_decompress(dst, dst_size, src, src_size);
+#endif
+#ifdef HAVE_LIBLZ4
+		case LZ4_COMPRESS:
+			return lz4_decompress(dst, dst_size, src, src_size);
 #endif
 		case PGLZ_COMPRESS:
 			return pglz_decompress(src, src_size, dst, dst_size);
@@ -89,18 +255,179 @@ do_decompress(void* dst, size_t dst_size, void const* src, size_t src_size, Comp
 	return -1;
 }
 
+#ifdef HAVE_LIBZSTD
+/* Install dictionary used by zstd_compress() and zstd_decompress() */
+static void
+compress_dict_set(const void *dict, size_t dict_size)
+{
+	compress_dict_free();
+
+	zstd_cdict = ZSTD_createCDict(dict, dict_size, compress_level);
+	zstd_ddict = ZSTD_createDDict(dict, dict_size);
+	if (zstd_cdict == NULL || zstd_ddict == NULL)
+		elog(ERROR, "cannot load compression dictionary");
+}
+#endif
+
+/*
+ * Train zstd dictionary on a sample of pages spread evenly over the data
+ * files of the list, save it to dict_path and use it to compress pages of
+ * the current backup.  Separately compressed 8kB pages share a lot of
+ * structure (page headers, line pointers, tuple headers), which a dictionary
+ * allows to exploit.
+ */
+void
+compress_dict_build(parray *files, const char *dict_path)
+{
+#ifdef HAVE_LIBZSTD
+	uint64		total_blocks = 0;
+	uint64		block_no = 0;
+	uint64		stride;
+	char	   *samples;
+	size_t	   *sample_sizes;
+	int			nsamples = 0;
+	char	   *dict;
+	size_t		dict_size;
+	FILE	   *out;
+	int			i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISREG(file->mode) && file->is_datafile && !file->is_cfs)
+			total_blocks += file->size / BLCKSZ;
+	}
+
+	if (total_blocks == 0)
+		return;
+
+	stride = total_blocks / COMPRESS_DICT_SAMPLES + 1;
+	samples = pgut_malloc((size_t) COMPRESS_DICT_SAMPLES * BLCKSZ);
+	sample_sizes = pgut_malloc(COMPRESS_DICT_SAMPLES * sizeof(size_t));
+
+	for (i = 0; i < parray_num(files) && nsamples < COMPRESS_DICT_SAMPLES; i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		BlockNumber	nblocks;
+		BlockNumber	blknum;
+		int			fd;
+
+		if (!S_ISREG(file->mode) || !file->is_datafile || file->is_cfs)
+			continue;
+
+		nblocks = file->size / BLCKSZ;
+		blknum = (stride - block_no % stride) % stride;
+		block_no += nblocks;
+
+		if (blknum >= nblocks)
+			continue;
+
+		fd = open(file->path, O_RDONLY | PG_BINARY, 0);
+		if (fd < 0)
+		{
+			/* The file may have been dropped since the list was built */
+			if (errno == ENOENT)
+				continue;
+			elog(ERROR, "cannot open file \"%s\": %s",
+				 file->path, strerror(errno));
+		}
+
+		for (; blknum < nblocks && nsamples < COMPRESS_DICT_SAMPLES;
+			 blknum += stride)
+		{
+			char	   *page = samples + (size_t) nsamples * BLCKSZ;
+
+			if (pread(fd, page, BLCKSZ, (off_t) blknum * BLCKSZ) != BLCKSZ)
+				break;
+			if (PageIsNew((Page) page))
+				continue;
+
+			sample_sizes[nsamples++] = BLCKSZ;
+		}
+
+		close(fd);
+	}
+
+	dict = pgut_malloc(COMPRESS_DICT_SIZE);
+	dict_size = ZDICT_trainFromBuffer(dict, COMPRESS_DICT_SIZE,
+									  samples, sample_sizes, nsamples);
+	free(samples);
+	free(sample_sizes);
+
+	if (ZDICT_isError(dict_size))
+	{
+		elog(WARNING, "cannot train compression dictionary on %d pages: %s",
+			 nsamples, ZDICT_getErrorName(dict_size));
+		free(dict);
+		return;
+	}
+
+	out = fopen(dict_path, PG_BINARY_W);
+	if (out == NULL)
+		elog(ERROR, "cannot open file \"%s\": %s", dict_path, strerror(errno));
+
+	if (fwrite(dict, 1, dict_size, out) != dict_size ||
+		fflush(out) != 0 ||
+		fsync(fileno(out)) != 0)
+		elog(ERROR, "cannot write file \"%s\": %s", dict_path, strerror(errno));
+	fclose(out);
+
+	compress_dict_set(dict, dict_size);
+	free(dict);
+
+	elog(LOG, "Trained compression dictionary of %lu bytes on %d pages",
+		 (unsigned long) dict_size, nsamples);
+#endif
+}
+
 /*
- * When copying datafiles to backup we validate and compress them block
- * by block. Thus special header is required for each data block.
+ * Load dictionary saved by compress_dict_build(), if the backup has one.
  */
-typedef struct BackupPageHeader
+void
+compress_dict_load(const char *dict_path)
 {
-	BlockNumber	block;			/* block number */
-	int32		compressed_size;
-} BackupPageHeader;
+#ifdef HAVE_LIBZSTD
+	FILE	   *in;
+	struct stat	st;
+	char	   *dict;
+
+	compress_dict_free();
+
+	in = fopen(dict_path, PG_BINARY_R);
+	if (in == NULL)
+	{
+		if (errno == ENOENT)
+			return;
+		elog(ERROR, "cannot open file \"%s\": %s", dict_path, strerror(errno));
+	}
 
-/* Special value for compressed_size field */
-#define PageIsTruncated -2
+	if (fstat(fileno(in), &st) != 0)
+		elog(ERROR, "cannot stat file \"%s\": %s", dict_path, strerror(errno));
+
+	dict = pgut_malloc(st.st_size);
+	if (fread(dict, 1, st.st_size, in) != st.st_size)
+		elog(ERROR, "cannot read file \"%s\": %s", dict_path, strerror(errno));
+	fclose(in);
+
+	compress_dict_set(dict, st.st_size);
+	free(dict);
+
+	elog(LOG, "Loaded compression dictionary \"%s\"", dict_path);
+#endif
+}
+
+/* Release compression dictionary, if any */
+void
+compress_dict_free(void)
+{
+#ifdef HAVE_LIBZSTD
+	ZSTD_freeCDict(zstd_cdict);
+	ZSTD_freeDDict(zstd_ddict);
+	zstd_cdict = NULL;
+	zstd_ddict = NULL;
+#endif
+}
 
 /* Verify page's header */
 static bool
@@ -124,548 +451,3791 @@ parse_page(Page page, XLogRecPtr *lsn)
 	return false;
 }
 
-/* Read one page from file directly accessing disk
- * return value:
- * 0  - if the page is not found
- * 1  - if the page is found and valid
- * -1 - if the page is found but invalid
+/*
+ * Check if the page consists of zero bytes only.
+ * Pages are checked 64 bytes per iteration, so a page with data is rejected
+ * after the first iteration, which makes the check cheap enough to run on
+ * every page.
  */
-static int
-read_page_from_file(pgFile *file, BlockNumber blknum,
-					FILE *in, Page page)
+static inline bool
+page_is_zeroed(const char *page)
 {
-	off_t				offset = blknum*BLCKSZ;
-	size_t				read_len = 0;
-	XLogRecPtr			page_lsn;
-
-	/* read the block */
-	if (fseek(in, offset, SEEK_SET) != 0)
-		elog(ERROR, "File: %s, could not seek to block %u: %s",
-				file->path, blknum, strerror(errno));
-
-	read_len = fread(page, 1, BLCKSZ, in);
-
-	if (read_len != BLCKSZ)
-	{
-		/* The block could have been truncated. It is fine. */
-		if (read_len == 0)
-		{
-			elog(LOG, "File %s, block %u, file was truncated",
-					file->path, blknum);
-			return 0;
-		}
-		else
-			elog(WARNING, "File: %s, block %u, expected block size %lu,"
-					  "but read %d, try again",
-					   file->path, blknum, read_len, BLCKSZ);
-	}
+#if defined(__SSE2__)
+	const __m128i *p = (const __m128i *) page;
+	const __m128i *end = (const __m128i *) (page + BLCKSZ);
+	const __m128i zero = _mm_setzero_si128();
 
-	/*
-	 * If we found page with invalid header, at first check if it is zeroed,
-	 * which is a valid state for page. If it is not, read it and check header
-	 * again, because it's possible that we've read a partly flushed page.
-	 * If after several attempts page header is still invalid, throw an error.
-	 * The same idea is applied to checksum verification.
-	 */
-	if (!parse_page(page, &page_lsn))
+	for (; p < end; p += 4)
 	{
-		int i;
-		/* Check if the page is zeroed. */
-		for(i = 0; i < BLCKSZ && page[i] == 0; i++);
-
-		/* Page is zeroed. No need to check header and checksum. */
-		if (i == BLCKSZ)
-		{
-			elog(LOG, "File: %s blknum %u, empty page", file->path, blknum);
-			return 1;
-		}
+		__m128i		acc;
 
-		/*
-		 * If page is not completely empty and we couldn't parse it,
-		 * try again several times. If it didn't help, throw error
-		 */
-		elog(LOG, "File: %s blknum %u have wrong page header, try again",
-					   file->path, blknum);
-		return -1;
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p),
+										_mm_loadu_si128(p + 1)),
+						   _mm_or_si128(_mm_loadu_si128(p + 2),
+										_mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+			return false;
 	}
+#else
+	const size_t *p = (const size_t *) page;
+	const size_t *end = (const size_t *) (page + BLCKSZ);
 
-	/* Verify checksum */
-	if(current.checksum_version)
-	{
-		/*
-		 * If checksum is wrong, sleep a bit and then try again
-		 * several times. If it didn't help, throw error
-		 */
-		if (pg_checksum_page(page, file->segno * RELSEG_SIZE + blknum)
-			!= ((PageHeader) page)->pd_checksum)
-		{
-			elog(WARNING, "File: %s blknum %u have wrong checksum, try again",
-						   file->path, blknum);
-			return -1;
-		}
-		else
-		{
-			/* page header and checksum are correct */
-			return 1;
-		}
-	}
-	else
+	for (; p < end; p += 8)
 	{
-		/* page header is correct and checksum check is disabled */
-		return 1;
+		if ((p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) != 0)
+			return false;
 	}
+#endif
+
+	return true;
 }
 
+/* Alignment of page buffers, suitable for direct I/O */
+#define BACKUP_BUFFER_ALIGN		4096
+
+/* Passes to re-read torn pages and delay before them, in microseconds */
+#define BACKUP_RETRY_PASSES		10
+#define BACKUP_RETRY_DELAY_MIN	10000
+#define BACKUP_RETRY_DELAY_MAX	1000000
+
 /*
- * Backup the specified block from a file of a relation.
- * Verify page header and checksum of the page and write it
- * to the backup file.
+ * Page cache residency of a file read with --no-cache, when it can not be
+ * read with O_DIRECT. Consumed ranges of the file are dropped from the
+ * cache, except pages which were cached before the file was opened: they
+ * are likely used by postgres.
  */
-static void
-backup_data_page(backup_files_args *arguments, 
-				 pgFile *file, XLogRecPtr prev_backup_start_lsn,
-				 BlockNumber blknum, BlockNumber nblocks,
-				 FILE *in, FILE *out,
-				 pg_crc32 *crc, int *n_skipped,
-				 BackupMode backup_mode)
+typedef struct CacheGuard
 {
-	BackupPageHeader	header;
-	Page 				page = malloc(BLCKSZ);
-	Page 				compressed_page = NULL;
-	size_t				write_buffer_size;
-	char				write_buffer[BLCKSZ+sizeof(header)];
-
-	int					try_again = 100;
-	bool				page_is_valid = false;
-	BlockNumber absolute_blknum = file->segno * RELSEG_SIZE + blknum;
+	int			fd;				/* -1 if the cache is not guarded */
+	size_t		os_page;		/* size of OS page */
+	size_t		npages;			/* number of OS pages in resident */
+	unsigned char *resident;	/* NULL to drop every consumed page */
+} CacheGuard;
 
-	header.block = blknum;
-	header.compressed_size = 0;
+/*
+ * State of a datafile being copied to backup.
+ *
+ * Pages are read from the source file in runs of up to BACKUP_READ_BLOCKS
+ * contiguous blocks by a single pread(). Backup records of the run
+ * (headers and page payloads) are collected into iovec array and written
+ * to the backup file with writev(), up to IOV_MAX of them per call,
+ * which is a single call unless BLCKSZ is small. Buffers are owned by the
+ * backup thread and reused for all files it copies.
+ */
+typedef struct BackupDataFileState
+{
+	pgFile	   *file;
+	int			in;				/* source datafile */
+	int			out;			/* destination file in backup */
+	const char *to_path;
+
+	char	   *read_buf;		/* pages of the current run */
+	char	   *compress_buf;	/* compressed pages of the current run */
+	BackupPageHeader *headers;	/* headers of the current run */
+	uint8	   *hashes;			/* hashes of pages of the current run */
+	int			nheaders;
+	struct iovec *iov;			/* headers and payloads to write */
+	int			iovcnt;
+
+	BackupIndexEntry *index;	/* entries for records written so far */
+	uint32		nindex;
+	uint32		index_size;
+
+	BlockNumber *retry;			/* blocks to read again */
+	uint32		nretry;
+	uint32		retry_size;
 
 	/*
-	 * Read the page and verify its header and checksum.
-	 * Under high write load it's possible that we've read partly
-	 * flushed page, so try several times before throwing an error.
+	 * Sizes and CRC of what was read and written, kept here rather than in
+	 * the file since parts of the file are backed up concurrently.
 	 */
-	if (backup_mode != BACKUP_MODE_DIFF_PTRACK)
-	{
-		while(!page_is_valid && try_again)
-		{
-			int result = read_page_from_file(file, blknum,
-											 in, page);
-
-			try_again--;
-			if (result == 0)
-			{
-				/* This block was truncated.*/
-				header.compressed_size = PageIsTruncated;
-				/* Page is not actually valid, but it is absent
-				 * and we're not going to reread it or validate */
-				page_is_valid = true;
-			}
+	size_t		read_size;
+	size_t		write_size;
+	pg_crc32	crc;
+	bool		compressed;		/* some page is compressed */
 
-			if (result == 1)
-				page_is_valid = true;
+	int			n_blocks_read;
+	int			n_blocks_skipped;
+	int			n_torn;			/* pages put to the retry queue */
+	int			n_torn_fetched;	/* torn pages fetched via SQL */
 
-			/*
-			 * If ptrack support is available use it to get invalid block
-			 * instead of rereading it 99 times
-			 */
-			//elog(WARNING, "Checksum_Version: %i", current.checksum_version ? 1 : 0);
+	BackupThreadStats *stats;	/* counters of the backup thread */
+	CacheGuard	cache;			/* source file pages to drop from cache */
+} BackupDataFileState;
 
-			if (result == -1 && is_ptrack_support)
-			{
-				elog(WARNING, "File %s, block %u, try to fetch via SQL",
-					file->path, blknum);
-				break;
-			}
-		}
-		/*
-		 * If page is not valid after 100 attempts to read it
-		 * throw an error.
-		 */
-		if(!page_is_valid && !is_ptrack_support)
-			elog(ERROR, "Data file checksum mismatch. Canceling backup");
-	}
+/* Iterator over runs of contiguous blocks to back up */
+typedef struct BlockRunIterator
+{
+	datapagemap_iterator_t *pagemap;	/* NULL to back up all blocks */
+	BlockNumber	next;			/* next block to return */
+	BlockNumber	end;			/* block following the last one to return */
+	bool		has_next;		/* pagemap returned next block */
+} BlockRunIterator;
+
+/* Result of backup of a part of a split file */
+typedef struct FilePartResult
+{
+	size_t		read_size;
+	size_t		write_size;
+	pg_crc32	crc;			/* CRC of the backup file of the part */
+	bool		compressed;
+	bool		missing;		/* the file was not found */
+	BackupIndexEntry *index;	/* offsets are within the part */
+	uint32		nindex;
+	int			n_blocks_read;
+	int			n_blocks_skipped;
+} FilePartResult;
 
-	if (backup_mode == BACKUP_MODE_DIFF_PTRACK || (!page_is_valid && is_ptrack_support))
-	{
-		size_t page_size = 0;
+/*
+ * State shared by parts of a split file. Backup collects results of the
+ * parts to merge them, restore shares the index of the backed-up file.
+ */
+struct pgFileSplit
+{
+	pthread_mutex_t mutex;
+	int			nparts;
+	int			ndone;			/* parts finished so far */
 
-		free(page);
-		page = NULL;
-		page = (Page) pg_ptrack_get_block(arguments, file->dbOid, file->tblspcOid,
-										  file->relOid, absolute_blknum, &page_size);
+	FilePartResult *results;	/* backup: result of each part */
 
-		if (page == NULL)
-		{
-			/* This block was truncated.*/
-			header.compressed_size = PageIsTruncated;
-		}
-		else if (page_size != BLCKSZ)
-		{
-			elog(ERROR, "File: %s, block %u, expected block size %lu, but read %d",
-					   file->path, absolute_blknum, page_size, BLCKSZ);
-		}
-		else
-		{
-			/*
-			 * We must set checksum here, because it is outdated
-			 * in the block recieved from shared buffers.
-			 */
-			if (is_checksum_enabled)
-				((PageHeader) page)->pd_checksum = pg_checksum_page(page, absolute_blknum);
-		}
-	}
+	BackupIndexEntry *index;	/* restore: index of the backed-up file */
+	uint32		nentries;
+	off_t		zeroed_size;	/* restore: size implied by zeroed pages */
+};
 
-	if (header.compressed_size != PageIsTruncated)
-	{
-		file->read_size += BLCKSZ;
+/* Bytes copied by one copy_file_range() call */
+#define COPY_RANGE_CHUNK		(8 * 1024 * 1024)
 
-		compressed_page = malloc(BLCKSZ);
-		header.compressed_size = do_compress(compressed_page, BLCKSZ,
-											page, BLCKSZ, compress_alg);
+/* copy_file() drops pages read from the cache by chunks of this size */
+#define COPY_CACHE_DROP_SIZE	(BACKUP_READ_BLOCKS * BLCKSZ)
 
-		file->compress_alg = compress_alg;
+/* Writeback of WAL file being copied is started by chunks of this size */
+#define WAL_WRITEBACK_SIZE		(1024 * 1024)
 
-		Assert (header.compressed_size <= BLCKSZ);
-	}
+/* Files written by backup or restore threads, to be synced at the end */
+fsync_queue *deferred_fsync = NULL;
 
-	write_buffer_size = sizeof(header);
+/* Blocks read by one asynchronous request */
+#define AIO_SLOT_BLOCKS		16
+#define AIO_SLOT_SIZE		(AIO_SLOT_BLOCKS * BLCKSZ)
 
-	/*
+/*
+ * Asynchronous I/O state of a thread, used by every backup, restore and copy
+ * of a file done by it. The ring has a slot of AIO_SLOT_SIZE bytes for each
+ * request in flight, requests are reused round-robin along with the slots.
+ */
+typedef struct AioThreadState
+{
+	aio_context *ctx;
+	char	   *ring;			/* NULL if I/O is synchronous */
+	aio_request *reqs;
+	char	   *write_buf;		/* BACKUP_READ_BLOCKS pages of RestoreWriter */
+} AioThreadState;
+
+static pthread_key_t aio_state_key;
+static pthread_once_t aio_state_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Allocate buffer aligned to BACKUP_BUFFER_ALIGN.
+ */
+static void *
+alloc_aligned_buffer(size_t size)
+{
+	void	   *buf;
+	int			rc;
+
+	rc = posix_memalign(&buf, BACKUP_BUFFER_ALIGN, size);
+	if (rc != 0)
+		elog(ERROR, "could not allocate %lu bytes: %s",
+			 (unsigned long) size, strerror(rc));
+
+	return buf;
+}
+
+static void
+aio_state_free(void *arg)
+{
+	AioThreadState *aio = (AioThreadState *) arg;
+
+	aio_free(aio->ctx);
+	free(aio->ring);
+	free(aio->reqs);
+	free(aio->write_buf);
+	free(aio);
+}
+
+static void
+aio_state_key_init(void)
+{
+	pthread_key_create(&aio_state_key, aio_state_free);
+}
+
+/*
+ * Get asynchronous I/O state of the calling thread, creating it on the
+ * first call.
+ */
+static AioThreadState *
+get_aio_state(void)
+{
+	AioThreadState *aio;
+
+	pthread_once(&aio_state_once, aio_state_key_init);
+
+	aio = (AioThreadState *) pthread_getspecific(aio_state_key);
+	if (aio == NULL)
+	{
+		aio = pgut_new(AioThreadState);
+		aio->ctx = aio_init(io_depth);
+		aio->ring = NULL;
+		aio->reqs = NULL;
+		aio->write_buf = NULL;
+
+		if (aio_is_async(aio->ctx))
+		{
+			int			depth = aio_depth(aio->ctx);
+			int			i;
+
+			aio->ring = alloc_aligned_buffer((size_t) depth * AIO_SLOT_SIZE);
+			aio->reqs = pgut_newarray(aio_request, depth);
+			/* Slots are free */
+			for (i = 0; i < depth; i++)
+			{
+				aio->reqs[i].write = false;
+				aio->reqs[i].done = true;
+			}
+		}
+
+		pthread_setspecific(aio_state_key, aio);
+	}
+
+	return aio;
+}
+
+/* Threads verifying, compressing and restoring pages, NULL without them */
+work_pool  *cpu_pool = NULL;
+
+/*
+ * A run of pages passing through cpu_pool. Backup reads pages of a run of
+ * blocks into "in", the pool verifies them and compresses them into "out".
+ * Restore reads records into "in", the pool restores their pages into "out".
+ * The I/O thread writes results of its runs in order, so files are the same
+ * as without the pool.
+ */
+typedef struct PageBatch
+{
+	work_item	item;
+	pgFile	   *file;
+	int			npages;
+	char	   *in;				/* BACKUP_READ_BLOCKS pages or payloads */
+	char	   *out;			/* BACKUP_READ_BLOCKS pages */
+	uint8	   *hashes;			/* backup: hashes of pages, with --dedup */
+	instr_time	cpu_time;
+
+	/* backup */
+	XLogRecPtr	prev_backup_start_lsn;
+	BackupMode	backup_mode;
+	BlockNumber	blknum;			/* first block of the run */
+	size_t		read_len;
+	int			results[BACKUP_READ_BLOCKS];	/* as of check_page() */
+	XLogRecPtr	lsns[BACKUP_READ_BLOCKS];
+	bool		prepared[BACKUP_READ_BLOCKS];	/* compressed or hashed */
+	int32		sizes[BACKUP_READ_BLOCKS];		/* compressed_size of record */
+
+	/* restore */
+	BackupPageHeader headers[BACKUP_READ_BLOCKS];
+} PageBatch;
+
+static pthread_key_t page_batches_key;
+static pthread_once_t page_batches_once = PTHREAD_ONCE_INIT;
+
+static void
+page_batches_free(void *arg)
+{
+	PageBatch  *batches = (PageBatch *) arg;
+	int			i;
+
+	for (i = 0; i < CPU_PIPELINE_DEPTH; i++)
+	{
+		free(batches[i].in);
+		free(batches[i].out);
+		free(batches[i].hashes);
+	}
+	free(batches);
+}
+
+static void
+page_batches_key_init(void)
+{
+	pthread_key_create(&page_batches_key, page_batches_free);
+}
+
+/*
+ * Get CPU_PIPELINE_DEPTH batches of the calling thread, creating them on
+ * the first call.
+ */
+static PageBatch *
+get_page_batches(void)
+{
+	PageBatch  *batches;
+
+	pthread_once(&page_batches_once, page_batches_key_init);
+
+	batches = (PageBatch *) pthread_getspecific(page_batches_key);
+	if (batches == NULL)
+	{
+		int			i;
+
+		batches = pgut_newarray(PageBatch, CPU_PIPELINE_DEPTH);
+		for (i = 0; i < CPU_PIPELINE_DEPTH; i++)
+		{
+			batches[i].in = alloc_aligned_buffer(BACKUP_READ_BLOCKS * BLCKSZ);
+			batches[i].out = alloc_aligned_buffer(BACKUP_READ_BLOCKS * BLCKSZ);
+			batches[i].hashes = pgut_malloc(BACKUP_READ_BLOCKS *
+											SHA256_DIGEST_LEN);
+		}
+
+		pthread_setspecific(page_batches_key, batches);
+	}
+
+	return batches;
+}
+
+/*
+ * Start guarding page cache from pages of the file read through fd, which
+ * is size bytes long. Does nothing without --no-cache or if fd is -1.
+ */
+static void
+cache_guard_init(CacheGuard *guard, int fd, off_t size)
+{
+	guard->fd = -1;
+	guard->os_page = 0;
+	guard->npages = 0;
+	guard->resident = NULL;
+
+#ifdef USE_CACHE_GUARD
+	if (!no_cache || fd < 0)
+		return;
+
+	guard->fd = fd;
+	guard->os_page = sysconf(_SC_PAGESIZE);
+
+	/* Mapping the file does not read it, mincore() tells what is cached */
+	if (size > 0)
+	{
+		void	   *map;
+
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			return;
+
+		guard->npages = (size + guard->os_page - 1) / guard->os_page;
+		guard->resident = pgut_malloc(guard->npages);
+		if (mincore(map, size, (void *) guard->resident) != 0)
+		{
+			free(guard->resident);
+			guard->resident = NULL;
+			guard->npages = 0;
+		}
+		munmap(map, size);
+	}
+#endif
+}
+
+/*
+ * Drop consumed range of the file from the cache, skipping pages which were
+ * cached before.
+ */
+static void
+cache_guard_drop(CacheGuard *guard, off_t offset, size_t len)
+{
+#ifdef USE_CACHE_GUARD
+	size_t		first;
+	size_t		end;
+	size_t		run_start = 0;
+	bool		in_run = false;
+	size_t		i;
+
+	if (guard->fd < 0 || len == 0)
+		return;
+
+	first = offset / guard->os_page;
+	end = (offset + len + guard->os_page - 1) / guard->os_page;
+
+	for (i = first; i <= end; i++)
+	{
+		bool		drop = (i < end &&
+							!(i < guard->npages && (guard->resident[i] & 1)));
+
+		if (drop && !in_run)
+		{
+			run_start = i;
+			in_run = true;
+		}
+		else if (!drop && in_run)
+		{
+			(void) posix_fadvise(guard->fd, (off_t) run_start * guard->os_page,
+								 (off_t) (i - run_start) * guard->os_page,
+								 POSIX_FADV_DONTNEED);
+			in_run = false;
+		}
+	}
+#endif
+}
+
+/*
+ * Drop the first len bytes of the file, which covers pages read again out
+ * of order, and stop guarding the cache.
+ */
+static void
+cache_guard_release(CacheGuard *guard, size_t len)
+{
+	cache_guard_drop(guard, 0, len);
+	free(guard->resident);
+	guard->resident = NULL;
+	guard->fd = -1;
+}
+
+/*
+ * Drop file written to backup from the cache with --no-cache. Must be
+ * called after fsync(): dirty pages are not dropped.
+ */
+static void
+cache_drop_written(int fd)
+{
+#ifdef USE_CACHE_GUARD
+	if (no_cache)
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * Make the written file durable. If deferred_fsync is set, the file is
+ * only queued, to be synced with other files at the end of backup or
+ * restore. Returns false with errno set on failure.
+ */
+static bool
+sync_written_file(int fd, const char *path)
+{
+	if (deferred_fsync)
+	{
+		fsync_queue_add(deferred_fsync, fd, path);
+		return true;
+	}
+
+	if (fsync(fd) != 0)
+		return false;
+	cache_drop_written(fd);
+	return true;
+}
+
+/*
+ * Wait for completion of the request, which is a write if the slot was used
+ * to write last time, and check its result.
+ */
+static void
+aio_wait_slot(AioThreadState *aio, aio_request *req, const char *path)
+{
+	aio_wait(aio->ctx, req);
+
+	if (req->write && req->result != (ssize_t) req->len)
+		elog(ERROR, "cannot write \"%s\": %s", path,
+			 req->result < 0 ? strerror(-req->result) : "short write");
+}
+
+/*
+ * Verify header and checksum of the page read from file. The checksum
+ * is computed by caller with pg_checksum_pages(), so that checksums of all
+ * pages read at once are computed by a single call.
+ * return value:
+ * 1  - if the page is valid
+ * -1 - if the page is invalid
+ * LSN of the page is returned in page_lsn, it is InvalidXLogRecPtr
+ * for zeroed pages.
+ */
+static int
+check_page(pgFile *file, BlockNumber blknum, Page page, uint16 checksum,
+		   XLogRecPtr *page_lsn)
+{
+	/*
+	 * If we found page with invalid header, at first check if it is zeroed,
+	 * which is a valid state for page. If it is not, read it and check header
+	 * again, because it's possible that we've read a partly flushed page.
+	 * If after several attempts page header is still invalid, throw an error.
+	 * The same idea is applied to checksum verification.
+	 */
+	if (!parse_page(page, page_lsn))
+	{
+		/* Page is zeroed. No need to check header and checksum. */
+		if (page_is_zeroed(page))
+		{
+			elog(LOG, "File: %s blknum %u, empty page", file->path, blknum);
+			*page_lsn = InvalidXLogRecPtr;
+			return 1;
+		}
+
+		/*
+		 * If page is not completely empty and we couldn't parse it,
+		 * try again several times. If it didn't help, throw error
+		 */
+		elog(LOG, "File: %s blknum %u have wrong page header, try again",
+					   file->path, blknum);
+		return -1;
+	}
+
+	/* Verify checksum */
+	if(current.checksum_version)
+	{
+		/*
+		 * If checksum is wrong, sleep a bit and then try again
+		 * several times. If it didn't help, throw error
+		 */
+		if (checksum != ((PageHeader) page)->pd_checksum)
+		{
+			elog(WARNING, "File: %s blknum %u have wrong checksum, try again",
+						   file->path, blknum);
+			return -1;
+		}
+		else
+		{
+			/* page header and checksum are correct */
+			return 1;
+		}
+	}
+	else
+	{
+		/* page header is correct and checksum check is disabled */
+		return 1;
+	}
+}
+
+/*
+ * Read nblocks contiguous blocks starting from blknum into buf.
+ * Returns number of bytes read, which is less than requested if the file
+ * is shorter.
+ */
+static size_t
+read_blocks(pgFile *file, int fd, BlockNumber blknum, int nblocks, char *buf)
+{
+	size_t		len = (size_t) nblocks * BLCKSZ;
+	size_t		read_len = 0;
+
+	throttle_acquire(backup_throttle, len, 1);
+
+	while (read_len < len)
+	{
+		ssize_t		rc;
+
+		rc = pread(fd, buf + read_len, len - read_len,
+				   (off_t) blknum * BLCKSZ + read_len);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			elog(ERROR, "File: %s, could not read block %u: %s",
+				 file->path, blknum, strerror(errno));
+		}
+		/* EOF */
+		if (rc == 0)
+			break;
+		read_len += rc;
+	}
+
+	return read_len;
+}
+
+/* Read one page from file directly accessing disk
+ * return value:
+ * 0  - if the page is not found
+ * 1  - if the page is found and valid
+ * -1 - if the page is found but invalid
+ * LSN of the page is returned in page_lsn, it is InvalidXLogRecPtr
+ * for zeroed pages.
+ */
+static int
+read_page_from_file(pgFile *file, BlockNumber blknum,
+					int fd, Page page, XLogRecPtr *page_lsn)
+{
+	size_t				read_len = 0;
+	uint16				checksum = 0;
+
+	read_len = read_blocks(file, fd, blknum, 1, page);
+
+	if (read_len != BLCKSZ)
+	{
+		/* The block could have been truncated. It is fine. */
+		if (read_len == 0)
+		{
+			elog(LOG, "File %s, block %u, file was truncated",
+					file->path, blknum);
+			return 0;
+		}
+		else
+			elog(WARNING, "File: %s, block %u, expected block size %d,"
+					  "but read %lu, try again",
+					   file->path, blknum, BLCKSZ, read_len);
+	}
+
+	if (read_len == BLCKSZ && current.checksum_version)
+		pg_checksum_pages(page, 1, file->segno * RELSEG_SIZE + blknum,
+						  &checksum);
+
+	return check_page(file, blknum, page, checksum, page_lsn);
+}
+
+/*
+ * Add buffer to the list of buffers to be written by write_backup_records().
+ */
+static inline void
+append_iov(BackupDataFileState *state, void *buf, size_t len)
+{
+	state->iov[state->iovcnt].iov_base = buf;
+	state->iov[state->iovcnt].iov_len = len;
+	state->iovcnt++;
+}
+
+/*
+ * CRC-32C of concatenation of two blocks of data, computed from CRCs of the
+ * blocks and the length of the second one, the way zlib's crc32_combine()
+ * does it: CRC of the first block is passed through len2 zero bytes by
+ * multiplying it by powers of the CRC operator matrix over GF(2).
+ */
+#define CRC32C_POLY_REVERSED	0x82F63B78
+
+static uint32
+gf2_matrix_times(const uint32 *mat, uint32 vec)
+{
+	uint32		sum = 0;
+
+	for (; vec != 0; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32 *square, const uint32 *mat)
+{
+	int			n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static pg_crc32
+crc32c_combine(pg_crc32 crc1, pg_crc32 crc2, uint64 len2)
+{
+	uint32		even[32];		/* operator for even powers of two zeroes */
+	uint32		odd[32];		/* operator for odd powers of two zeroes */
+	uint32		row = 1;
+	int			n;
+
+	if (len2 == 0)
+		return crc1;
+
+	/* Operator for one zero bit */
+	odd[0] = CRC32C_POLY_REVERSED;
+	for (n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* Apply len2 zero bytes to crc1, the first square gives one byte */
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/* Make room for n more entries of the index of the backup file */
+static void
+backup_index_reserve(BackupDataFileState *state, uint32 n)
+{
+	if (state->nindex + n <= state->index_size)
+		return;
+
+	state->index_size = Max(Max(state->index_size * 2, 64), state->nindex + n);
+	state->index = pgut_realloc(state->index,
+								state->index_size * sizeof(BackupIndexEntry));
+}
+
+/*
+ * Write backup records collected in state->iov to the backup file and
+ * update CRC of the file.
+ */
+static void
+write_backup_records(BackupDataFileState *state)
+{
+	struct iovec *iov = state->iov;
+	int			iovcnt = state->iovcnt;
+	instr_time	start_time;
+	instr_time	end_time;
+	int			i;
+
+	/*
+	 * Each record starts with a header, which is followed by a payload
+	 * unless the page is truncated or zeroed. Add an index entry per record.
+	 */
+	for (i = 0; i < iovcnt; i++)
+	{
+		BackupPageHeader *header = (BackupPageHeader *) iov[i].iov_base;
+		BackupIndexEntry *entry;
+
+		backup_index_reserve(state, 1);
+		entry = &state->index[state->nindex++];
+		entry->offset = state->write_size;
+		entry->block = header->block;
+		entry->compressed_size = header->compressed_size;
+		entry->reserved = 0;
+
+		INIT_CRC32C(entry->crc);
+		COMP_CRC32C(entry->crc, iov[i].iov_base, iov[i].iov_len);
+		COMP_CRC32C(state->crc, iov[i].iov_base, iov[i].iov_len);
+		state->write_size += iov[i].iov_len;
+
+		if (BackupRecordPayloadSize(header->compressed_size) > 0)
+		{
+			i++;
+			COMP_CRC32C(entry->crc, iov[i].iov_base, iov[i].iov_len);
+			COMP_CRC32C(state->crc, iov[i].iov_base, iov[i].iov_len);
+			state->write_size += iov[i].iov_len;
+		}
+		FIN_CRC32C(entry->crc);
+	}
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	while (iovcnt > 0)
+	{
+		ssize_t		rc = writev(state->out, iov, Min(iovcnt, IOV_MAX));
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			elog(ERROR, "File: %s, cannot write backup file \"%s\": %s",
+				 state->file->path, state->to_path, strerror(errno));
+		}
+
+		/* Skip buffers written completely, adjust partially written one */
+		while (iovcnt > 0 && rc >= (ssize_t) iov->iov_len)
+		{
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_ACCUM_DIFF(state->stats->write_time, end_time, start_time);
+
+	state->iovcnt = 0;
+	state->nheaders = 0;
+}
+
+/*
+ * Write index of nentries entries of the backup file at backup_path.
+ */
+static void
+write_backup_index_file(const char *backup_path, BackupIndexEntry *index,
+						uint32 nentries)
+{
+	char		path[MAXPGPATH];
+	BackupIndexHeader header;
+	FILE	   *out;
+
+	snprintf(path, lengthof(path), "%s%s", backup_path, BACKUP_INDEX_SUFFIX);
+
+	header.magic = BACKUP_INDEX_MAGIC;
+	header.version = BACKUP_INDEX_VERSION;
+	header.nentries = nentries;
+	INIT_CRC32C(header.crc);
+	COMP_CRC32C(header.crc, index, nentries * sizeof(BackupIndexEntry));
+	FIN_CRC32C(header.crc);
+
+	out = fopen(path, PG_BINARY_W);
+	if (out == NULL)
+		elog(ERROR, "cannot open backup index file \"%s\": %s",
+			 path, strerror(errno));
+
+	if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+		fwrite(index, sizeof(BackupIndexEntry), nentries, out) != nentries ||
+		fflush(out) != 0 ||
+		!sync_written_file(fileno(out), path))
+		elog(ERROR, "cannot write backup index file \"%s\": %s",
+			 path, strerror(errno));
+
+	fclose(out);
+}
+
+/*
+ * Write index of the backup file collected by write_backup_records().
+ */
+static void
+write_backup_index(BackupDataFileState *state)
+{
+	write_backup_index_file(state->to_path, state->index, state->nindex);
+}
+
+/*
+ * Read index of the backup file. Returns NULL if the file has no index,
+ * which is the case for files backed up by older versions.
+ * Invalid index is reported with WARNING and also treated as absent.
+ */
+BackupIndexEntry *
+read_backup_index(pgFile *file, uint32 *nentries)
+{
+	char		path[MAXPGPATH];
+	BackupIndexHeader header;
+	BackupIndexEntry *index;
+	pg_crc32	crc;
+	FILE	   *in;
+
+	snprintf(path, lengthof(path), "%s%s", file->path, BACKUP_INDEX_SUFFIX);
+
+	in = fopen(path, PG_BINARY_R);
+	if (in == NULL)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "cannot open backup index file \"%s\": %s",
+				 path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&header, 1, sizeof(header), in) != sizeof(header) ||
+		header.magic != BACKUP_INDEX_MAGIC ||
+		header.version != BACKUP_INDEX_VERSION)
+	{
+		elog(WARNING, "invalid header of backup index file \"%s\"", path);
+		fclose(in);
+		return NULL;
+	}
+
+	index = pgut_malloc(Max(header.nentries, 1) * sizeof(BackupIndexEntry));
+	if (fread(index, sizeof(BackupIndexEntry), header.nentries,
+			  in) != header.nentries)
+	{
+		elog(WARNING, "cannot read backup index file \"%s\"", path);
+		fclose(in);
+		free(index);
+		return NULL;
+	}
+	fclose(in);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, index, header.nentries * sizeof(BackupIndexEntry));
+	FIN_CRC32C(crc);
+	if (crc != header.crc)
+	{
+		elog(WARNING, "invalid CRC of backup index file \"%s\"", path);
+		free(index);
+		return NULL;
+	}
+
+	*nentries = header.nentries;
+	return index;
+}
+
+/*
+ * Read a record described by the index entry from the backup file and
+ * verify its CRC. The record is stored to buf, which must have room for
+ * a header and a page.
+ */
+static bool
+read_backup_record(pgFile *file, int fd, BackupIndexEntry *entry, char *buf)
+{
+	size_t		len = BackupIndexEntrySize(entry);
+	pg_crc32	crc;
+
+	if (entry->compressed_size > BLCKSZ)
+		return false;
+
+	if (pread(fd, buf, len, entry->offset) != len)
+	{
+		elog(WARNING, "cannot read block %u of \"%s\": %s",
+			 entry->block, file->path, strerror(errno));
+		return false;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buf, len);
+	FIN_CRC32C(crc);
+
+	if (crc != entry->crc)
+	{
+		elog(WARNING, "invalid CRC of block %u of backup file \"%s\"",
+			 entry->block, file->path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Restore page from the record described by the index entry, which was read
+ * by read_backup_record() and starts with payload. Returns false if the page
+ * cannot be restored.
+ */
+static bool
+decode_backup_record(pgFile *file, BackupIndexEntry *entry, char *payload,
+					 char *page)
+{
+	if (entry->compressed_size == PageIsZeroed)
+	{
+		MemSet(page, 0, BLCKSZ);
+		return true;
+	}
+	else if (entry->compressed_size == PageIsDeduplicated)
+		return read_dedup_page((uint8 *) payload, page);
+	else if (entry->compressed_size == BLCKSZ)
+	{
+		memcpy(page, payload, BLCKSZ);
+		return true;
+	}
+	else
+		return do_decompress(page, BLCKSZ, payload, entry->compressed_size,
+							 file->compress_alg) == BLCKSZ;
+}
+
+/*
+ * Read block blknum from the backup file using its index, without reading
+ * the rest of the file. The page is decompressed into page. Returns false
+ * if the file has no record for the block or the record is corrupted.
+ */
+bool
+read_backup_block(pgFile *file, BackupIndexEntry *index, uint32 nentries,
+				  BlockNumber blknum, char *page)
+{
+	BackupIndexEntry *entry = NULL;
+	char		buf[sizeof(BackupPageHeader) + BLCKSZ];
+	char	   *payload = buf + sizeof(BackupPageHeader);
+	int			fd;
+	bool		result = false;
+	int64		i;
+
+	/* The latest record of the block wins */
+	for (i = (int64) nentries - 1; i >= 0; i--)
+	{
+		if (index[i].block == blknum &&
+			index[i].compressed_size != PageIsTruncated)
+		{
+			entry = &index[i];
+			break;
+		}
+	}
+
+	if (entry == NULL)
+		return false;
+
+	fd = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 file->path, strerror(errno));
+
+	if (read_backup_record(file, fd, entry, buf))
+		result = decode_backup_record(file, entry, payload, page);
+
+	close(fd);
+	return result;
+}
+
+/*
+ * Read page with the given hash from the page store of deduplicated backups
+ * and verify it against the hash. Returns false, after reporting a WARNING,
+ * if the page is missing or corrupted.
+ */
+bool
+read_dedup_page(const uint8 *hash, char *page)
+{
+	char		payload[BLCKSZ];
+	uint8		page_hash[SHA256_DIGEST_LEN];
+	char		path[MAXPGPATH];
+	int32		size;
+	CompressAlg	alg;
+
+	if (!dedup_get_page(hash, payload, &size, &alg))
+		return false;
+
+	dedup_page_path(path, lengthof(path), hash);
+
+	if (size == BLCKSZ)
+		memcpy(page, payload, BLCKSZ);
+	else if (do_decompress(page, BLCKSZ, payload, size, alg) != BLCKSZ)
+	{
+		elog(WARNING, "cannot decompress page store file \"%s\"", path);
+		return false;
+	}
+
+	sha256(page, BLCKSZ, page_hash);
+	if (memcmp(page_hash, hash, SHA256_DIGEST_LEN) != 0)
+	{
+		elog(WARNING, "invalid hash of page store file \"%s\"", path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Verify records of the backup file against CRCs in its index, to find
+ * out which blocks of the file are corrupted. Every corrupted block is
+ * reported with WARNING. Returns true if all records are valid or the
+ * file has no index.
+ */
+bool
+check_backup_index(pgFile *file)
+{
+	BackupIndexEntry *index;
+	uint32		nentries;
+	char		buf[sizeof(BackupPageHeader) + BLCKSZ];
+	bool		result = true;
+	uint64		size = 0;
+	uint32		i;
+	int			fd;
+
+	index = read_backup_index(file, &nentries);
+	if (index == NULL)
+		return true;
+
+	fd = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 file->path, strerror(errno));
+
+	for (i = 0; i < nentries; i++)
+	{
+		if (interrupted)
+			elog(ERROR, "Interrupted during validate");
+
+		if (!read_backup_record(file, fd, &index[i], buf))
+			result = false;
+		size += BackupIndexEntrySize(&index[i]);
+	}
+
+	if (size != (uint64) file->write_size)
+	{
+		elog(WARNING, "backup index of \"%s\" covers %lu bytes, file size is %lu",
+			 file->path, (unsigned long) size, (unsigned long) file->write_size);
+		result = false;
+	}
+
+	close(fd);
+	free(index);
+	return result;
+}
+
+/*
+ * Add the page with the given hash to the page store of deduplicated
+ * backups, unless it is there already. compressed_page is a buffer for
+ * the compressed page.
+ */
+static void
+dedup_store_page(const uint8 *hash, char *page, char *compressed_page)
+{
+	if (!dedup_has_page(hash))
+	{
+		int32		size = do_compress(compressed_page, BLCKSZ,
+									   page, BLCKSZ, compress_alg);
+
+		if (size > 0 && size < BLCKSZ)
+			dedup_put_page(hash, compressed_page, size, compress_alg);
+		else
+			dedup_put_page(hash, page, BLCKSZ, NONE_COMPRESS);
+	}
+}
+
+/*
+ * Backup the specified block from a file of a relation.
+ * Verify page header and checksum of the page and add it
+ * to the list of records to be written to the backup file.
+ *
+ * The page is passed in read_buffer, read_result is the result of its
+ * verification by check_page() or 0 if the block is beyond the end of file.
+ *
+ * Under high write load it's possible that we've read partly flushed page.
+ * If retry is true, such a page is put to the retry queue of the file, to be
+ * read again by backup_retry_pages() after the rest of the file is copied.
+ * Otherwise it is fetched via SQL if ptrack is available, or the backup
+ * fails.
+ *
+ * In DELTA mode pages which were not changed since the start of the
+ * previous backup (their LSN is older than prev_backup_start_lsn) are not
+ * written, n_blocks_skipped is incremented for them instead.
+ *
+ * If the page is the i-th one of the batch and it was compressed or hashed
+ * by backup_prepare_blocks(), its record is made of the prepared payload.
+ */
+static void
+backup_data_page(backup_files_args *arguments, BackupDataFileState *state,
+				 XLogRecPtr prev_backup_start_lsn, BlockNumber blknum,
+				 char *read_buffer, int read_result, XLogRecPtr page_lsn,
+				 BackupMode backup_mode, bool retry, PageBatch *batch, int i)
+{
+	pgFile			   *file = state->file;
+	BackupPageHeader   *header = &state->headers[state->nheaders];
+	uint8			   *hash;
+	char			   *compressed_page;
+	Page				page = read_buffer;
+	bool				fetch_via_sql = false;
+	BlockNumber absolute_blknum = file->segno * RELSEG_SIZE + blknum;
+
+	compressed_page = state->compress_buf + (size_t) state->nheaders * BLCKSZ;
+	hash = state->hashes + (size_t) state->nheaders * SHA256_DIGEST_LEN;
+
+	header->block = blknum;
+	header->compressed_size = 0;
+
+	if (backup_mode != BACKUP_MODE_DIFF_PTRACK)
+	{
+		/* This block was truncated. */
+		if (read_result == 0)
+			header->compressed_size = PageIsTruncated;
+		else if (read_result == -1)
+		{
+			if (retry)
+			{
+				if (state->nretry == state->retry_size)
+				{
+					state->retry_size = Max(state->retry_size * 2, 16);
+					state->retry = pgut_realloc(state->retry,
+									state->retry_size * sizeof(BlockNumber));
+				}
+				state->retry[state->nretry++] = blknum;
+				state->n_torn++;
+				return;
+			}
+
+			/* The page is still invalid after all passes of retry */
+			if (!is_ptrack_support)
+				elog(ERROR, "File: %s, block %u, data file checksum mismatch. "
+					 "Canceling backup", file->path, blknum);
+
+			elog(WARNING, "File %s, block %u, try to fetch via SQL",
+				 file->path, blknum);
+			state->n_torn_fetched++;
+			fetch_via_sql = true;
+		}
+	}
+
+	if (backup_mode == BACKUP_MODE_DIFF_PTRACK || fetch_via_sql)
+	{
+		size_t	page_size = 0;
+		bool	found;
+
+		/* The block is copied right into the read buffer */
+		if (backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			found = pg_ptrack_get_blocks_next(arguments, file, absolute_blknum,
+											  page, &page_size);
+		else
+			found = pg_ptrack_get_block(arguments, file->dbOid, file->tblspcOid,
+										file->relOid, absolute_blknum, page,
+										&page_size);
+
+		if (!found)
+		{
+			/* This block was truncated.*/
+			header->compressed_size = PageIsTruncated;
+		}
+		else if (page_size != BLCKSZ)
+		{
+			elog(ERROR, "File: %s, block %u, expected block size %d, but read %lu",
+					   file->path, absolute_blknum, BLCKSZ, page_size);
+		}
+		else if (page_is_zeroed(page))
+			page_lsn = InvalidXLogRecPtr;
+		else
+		{
+			/*
+			 * We must set checksum here, because it is outdated
+			 * in the block recieved from shared buffers.
+			 */
+			if (is_checksum_enabled)
+				((PageHeader) page)->pd_checksum = pg_checksum_page(page, absolute_blknum);
+
+			if (!parse_page(page, &page_lsn))
+				page_lsn = InvalidXLogRecPtr;
+		}
+	}
+
+	/*
+	 * In DELTA mode skip the page if it was not changed since the previous
+	 * backup. Zeroed pages and pages with invalid LSN are always copied.
+	 */
+	if (backup_mode == BACKUP_MODE_DIFF_DELTA &&
+		header->compressed_size != PageIsTruncated &&
+		page_lsn != InvalidXLogRecPtr &&
+		page_lsn < prev_backup_start_lsn)
+	{
+		state->n_blocks_skipped++;
+		return;
+	}
+
+	state->nheaders++;
+
+	/*
 	 * The page was truncated. Write only header
 	 * to know that we must truncate restored file
 	 */
-	if (header.compressed_size == PageIsTruncated)
+	if (header->compressed_size == PageIsTruncated)
+	{
+		append_iov(state, header, sizeof(BackupPageHeader));
+		return;
+	}
+
+	state->read_size += BLCKSZ;
+
+	/* Zeroed page is restored from its header alone */
+	if (page_is_zeroed(page))
+	{
+		state->stats->pages_zero++;
+		header->compressed_size = PageIsZeroed;
+		append_iov(state, header, sizeof(BackupPageHeader));
+		return;
+	}
+
+	/*
+	 * Deduplicated page is added to the page store, unless it is there
+	 * already, and the record refers to it by hash.
+	 */
+	if (batch != NULL && batch->prepared[i])
+	{
+		hash = batch->hashes + (size_t) i * SHA256_DIGEST_LEN;
+		compressed_page = batch->out + (size_t) i * BLCKSZ;
+		header->compressed_size = batch->sizes[i];
+	}
+	else if (current.dedup)
+	{
+		sha256(page, BLCKSZ, hash);
+		dedup_store_page(hash, page, compressed_page);
+		header->compressed_size = PageIsDeduplicated;
+	}
+	else
+		header->compressed_size = do_compress(compressed_page, BLCKSZ,
+											  page, BLCKSZ, compress_alg);
+
+	if (header->compressed_size == PageIsDeduplicated)
+	{
+		append_iov(state, header, sizeof(BackupPageHeader));
+		append_iov(state, hash, SHA256_DIGEST_LEN);
+		return;
+	}
+
+	state->compressed = true;
+
+	Assert (header->compressed_size <= BLCKSZ);
+
+	append_iov(state, header, sizeof(BackupPageHeader));
+
+	/* The page compression failed. Write it as is. */
+	if (header->compressed_size == -1)
+	{
+		header->compressed_size = BLCKSZ;
+		append_iov(state, page, BLCKSZ);
+	}
+	/* The page was successfully compressed */
+	else if (header->compressed_size > 0)
+		append_iov(state, compressed_page, MAXALIGN(header->compressed_size));
+}
+
+/*
+ * Verify pages of the run read into batch->in, and compress or hash those
+ * of them which are written to backup as they are. This is the CPU-bound
+ * part of backup of the run, done by a thread of cpu_pool if there is one.
+ * Everything depending on state of the file, such as retry of torn pages,
+ * is left for backup_finish_blocks().
+ */
+static void
+backup_prepare_blocks(void *arg)
+{
+	PageBatch  *batch = (PageBatch *) arg;
+	uint16		checksums[BACKUP_READ_BLOCKS];
+	instr_time	start_time;
+	instr_time	end_time;
+	int			i;
+
+	Assert(batch->npages <= BACKUP_READ_BLOCKS);
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+	/* PTRACK backup fetches pages from shared buffers */
+	if (batch->backup_mode == BACKUP_MODE_DIFF_PTRACK)
+	{
+		for (i = 0; i < batch->npages; i++)
+		{
+			batch->results[i] = 1;
+			batch->lsns[i] = InvalidXLogRecPtr;
+			batch->prepared[i] = false;
+		}
+		INSTR_TIME_SET_ZERO(batch->cpu_time);
+		return;
+	}
+
+	/* Compute checksums of all pages of the run at once */
+	if (current.checksum_version && batch->read_len >= BLCKSZ)
+		pg_checksum_pages(batch->in, batch->read_len / BLCKSZ,
+						  batch->file->segno * RELSEG_SIZE + batch->blknum,
+						  checksums);
+
+	for (i = 0; i < batch->npages; i++)
+	{
+		char	   *page = batch->in + (size_t) i * BLCKSZ;
+		size_t		page_offset = (size_t) i * BLCKSZ;
+		BlockNumber	blknum = batch->blknum + i;
+
+		batch->lsns[i] = InvalidXLogRecPtr;
+		batch->prepared[i] = false;
+
+		if (page_offset >= batch->read_len)
+		{
+			/* The block could have been truncated. It is fine. */
+			elog(LOG, "File %s, block %u, file was truncated",
+				 batch->file->path, blknum);
+			batch->results[i] = 0;
+		}
+		else if (page_offset + BLCKSZ > batch->read_len)
+		{
+			elog(WARNING, "File: %s, block %u, expected block size %d,"
+				 "but read %lu, try again",
+				 batch->file->path, blknum, BLCKSZ,
+				 batch->read_len - page_offset);
+			batch->results[i] = -1;
+		}
+		else
+			batch->results[i] = check_page(batch->file, blknum, page,
+										   checksums[i], &batch->lsns[i]);
+
+		/*
+		 * Only valid pages which are written as they are can be prepared,
+		 * as decided by backup_data_page().
+		 */
+		if (batch->results[i] != 1 || page_is_zeroed(page) ||
+			(batch->backup_mode == BACKUP_MODE_DIFF_DELTA &&
+			 batch->lsns[i] != InvalidXLogRecPtr &&
+			 batch->lsns[i] < batch->prev_backup_start_lsn))
+			continue;
+
+		if (current.dedup)
+		{
+			uint8	   *hash = batch->hashes + (size_t) i * SHA256_DIGEST_LEN;
+
+			sha256(page, BLCKSZ, hash);
+			dedup_store_page(hash, page, batch->out + (size_t) i * BLCKSZ);
+			batch->sizes[i] = PageIsDeduplicated;
+		}
+		else
+			batch->sizes[i] = do_compress(batch->out + (size_t) i * BLCKSZ,
+										  BLCKSZ, page, BLCKSZ, compress_alg);
+		batch->prepared[i] = true;
+	}
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_SET_ZERO(batch->cpu_time);
+	INSTR_TIME_ACCUM_DIFF(batch->cpu_time, end_time, start_time);
+}
+
+/*
+ * Make records of pages of the run prepared by backup_prepare_blocks() and
+ * write them to the backup file at once.
+ */
+static void
+backup_finish_blocks(backup_files_args *arguments, BackupDataFileState *state,
+					 PageBatch *batch)
+{
+	instr_time	start_time;
+	instr_time	end_time;
+	int			i;
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+	for (i = 0; i < batch->npages; i++)
+	{
+		backup_data_page(arguments, state, batch->prev_backup_start_lsn,
+						 batch->blknum + i, batch->in + (size_t) i * BLCKSZ,
+						 batch->results[i], batch->lsns[i],
+						 batch->backup_mode, true, batch, i);
+		state->n_blocks_read++;
+	}
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_ACCUM_DIFF(state->stats->compress_time, end_time, start_time);
+	INSTR_TIME_ADD(state->stats->compress_time, batch->cpu_time);
+
+	write_backup_records(state);
+}
+
+/* Set up batch of the run of nblocks blocks starting at blknum */
+static void
+backup_batch_init(PageBatch *batch, BackupDataFileState *state,
+				  XLogRecPtr prev_backup_start_lsn, BlockNumber blknum,
+				  int nblocks, BackupMode backup_mode)
+{
+	batch->item.fn = backup_prepare_blocks;
+	batch->item.arg = batch;
+	batch->file = state->file;
+	batch->prev_backup_start_lsn = prev_backup_start_lsn;
+	batch->backup_mode = backup_mode;
+	batch->blknum = blknum;
+	batch->npages = nblocks;
+	batch->read_len = 0;
+}
+
+/*
+ * Verify and compress pages of a run of nblocks contiguous blocks starting
+ * at blknum, which were read into buf, and write their records to the
+ * backup file at once. read_len is the number of bytes read, it is less
+ * than requested if the file was truncated.
+ */
+static void
+backup_read_blocks(backup_files_args *arguments, BackupDataFileState *state,
+				   XLogRecPtr prev_backup_start_lsn, BlockNumber blknum,
+				   int nblocks, char *buf, size_t read_len,
+				   BackupMode backup_mode)
+{
+	PageBatch	batch;
+
+	backup_batch_init(&batch, state, prev_backup_start_lsn, blknum, nblocks,
+					  backup_mode);
+	batch.in = buf;
+	batch.out = state->compress_buf;
+	batch.hashes = state->hashes;
+	batch.read_len = read_len;
+
+	backup_prepare_blocks(&batch);
+	backup_finish_blocks(arguments, state, &batch);
+}
+
+/*
+ * Backup a run of nblocks contiguous blocks starting at blknum.
+ * Read all of them with one system call, verify and compress each of them,
+ * and write their records to the backup file at once.
+ */
+static void
+backup_data_blocks(backup_files_args *arguments, BackupDataFileState *state,
+				   XLogRecPtr prev_backup_start_lsn, BlockNumber blknum,
+				   int nblocks, BackupMode backup_mode)
+{
+	size_t		read_len = 0;
+
+	/* PTRACK backup fetches pages from shared buffers */
+	if (backup_mode != BACKUP_MODE_DIFF_PTRACK)
+	{
+		instr_time	start_time;
+		instr_time	end_time;
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		read_len = read_blocks(state->file, state->in, blknum, nblocks,
+							   state->read_buf);
+		INSTR_TIME_SET_CURRENT(end_time);
+		INSTR_TIME_ACCUM_DIFF(state->stats->read_time, end_time, start_time);
+	}
+
+	backup_read_blocks(arguments, state, prev_backup_start_lsn, blknum,
+					   nblocks, state->read_buf, read_len, backup_mode);
+	cache_guard_drop(&state->cache, (off_t) blknum * BLCKSZ, read_len);
+}
+
+/*
+ * Return the next run of at most max_len contiguous blocks to back up.
+ */
+static bool
+next_block_run(BlockRunIterator *it, int max_len, BlockNumber *start, int *len)
+{
+	/* Scan all blocks of the file */
+	if (it->pagemap == NULL)
+	{
+		if (it->next >= it->end)
+			return false;
+
+		*start = it->next;
+		*len = Min(it->end - it->next, max_len);
+		it->next += *len;
+		return true;
+	}
+
+	/* Merge adjacent changed blocks */
+	if (!it->has_next)
+		return false;
+
+	*start = it->next;
+	*len = 1;
+	while ((it->has_next = datapagemap_next(it->pagemap, &it->next)) &&
+		   it->next == *start + *len && *len < max_len && it->next < it->end)
+		(*len)++;
+	if (it->has_next && it->next >= it->end)
+		it->has_next = false;
+
+	return true;
+}
+
+/*
+ * Backup runs of blocks keeping reads of the following runs in flight,
+ * while pages of the current one are verified and compressed. Runs are
+ * processed in order, so the backup file is the same as of synchronous
+ * reads.
+ */
+static void
+backup_data_blocks_async(backup_files_args *arguments,
+						 BackupDataFileState *state, AioThreadState *aio,
+						 BlockRunIterator *it,
+						 XLogRecPtr prev_backup_start_lsn,
+						 BackupMode backup_mode)
+{
+	int			depth = aio_depth(aio->ctx);
+	int			head = 0;
+	int			ninflight = 0;
+	bool		more = true;
+
+	for (;;)
+	{
+		aio_request *req;
+		instr_time	start_time;
+		instr_time	end_time;
+
+		/* Keep the ring full of reads */
+		while (more && ninflight < depth)
+		{
+			int			slot = (head + ninflight) % depth;
+			BlockNumber	blknum;
+			int			nblocks;
+
+			if (!next_block_run(it, AIO_SLOT_BLOCKS, &blknum, &nblocks))
+			{
+				more = false;
+				break;
+			}
+
+			throttle_acquire(backup_throttle, (size_t) nblocks * BLCKSZ, 1);
+			aio_read(aio->ctx, &aio->reqs[slot], state->in,
+					 aio->ring + (size_t) slot * AIO_SLOT_SIZE,
+					 (size_t) nblocks * BLCKSZ, (off_t) blknum * BLCKSZ);
+			ninflight++;
+		}
+
+		if (ninflight == 0)
+			break;
+
+		/* Only waiting for the read is counted, it is done in background */
+		req = &aio->reqs[head];
+		INSTR_TIME_SET_CURRENT(start_time);
+		aio_wait(aio->ctx, req);
+		INSTR_TIME_SET_CURRENT(end_time);
+		INSTR_TIME_ACCUM_DIFF(state->stats->read_time, end_time, start_time);
+		if (req->result < 0)
+			elog(ERROR, "File: %s, could not read block %u: %s",
+				 state->file->path, (BlockNumber) (req->offset / BLCKSZ),
+				 strerror(-req->result));
+
+		backup_read_blocks(arguments, state, prev_backup_start_lsn,
+						   req->offset / BLCKSZ, req->len / BLCKSZ,
+						   req->buf, req->result, backup_mode);
+		cache_guard_drop(&state->cache, req->offset, req->result);
+
+		head = (head + 1) % depth;
+		ninflight--;
+	}
+}
+
+/*
+ * Backup runs of blocks through cpu_pool: runs are read ahead while pages
+ * of earlier ones are verified and compressed by the pool, and records of
+ * runs are written in order, as soon as each one is ready.
+ */
+static void
+backup_data_blocks_pipeline(backup_files_args *arguments,
+							BackupDataFileState *state, BlockRunIterator *it,
+							XLogRecPtr prev_backup_start_lsn,
+							BackupMode backup_mode)
+{
+	PageBatch  *batches = get_page_batches();
+	int			head = 0;
+	int			ninflight = 0;
+	bool		more = true;
+
+	for (;;)
+	{
+		PageBatch  *batch;
+
+		/* Keep the pool busy with runs of this file */
+		while (more && ninflight < CPU_PIPELINE_DEPTH)
+		{
+			BlockNumber	blknum;
+			int			nblocks;
+			instr_time	start_time;
+			instr_time	end_time;
+
+			if (!next_block_run(it, BACKUP_READ_BLOCKS, &blknum, &nblocks))
+			{
+				more = false;
+				break;
+			}
+
+			batch = &batches[(head + ninflight) % CPU_PIPELINE_DEPTH];
+			backup_batch_init(batch, state, prev_backup_start_lsn, blknum,
+							  nblocks, backup_mode);
+
+			INSTR_TIME_SET_CURRENT(start_time);
+			batch->read_len = read_blocks(state->file, state->in, blknum,
+										  nblocks, batch->in);
+			INSTR_TIME_SET_CURRENT(end_time);
+			INSTR_TIME_ACCUM_DIFF(state->stats->read_time, end_time,
+								  start_time);
+
+			work_pool_submit(cpu_pool, &batch->item);
+			ninflight++;
+		}
+
+		if (ninflight == 0)
+			break;
+
+		batch = &batches[head];
+		work_pool_wait(cpu_pool, &batch->item);
+		backup_finish_blocks(arguments, state, batch);
+		cache_guard_drop(&state->cache, (off_t) batch->blknum * BLCKSZ,
+						 batch->read_len);
+
+		head = (head + 1) % CPU_PIPELINE_DEPTH;
+		ninflight--;
+	}
+}
+
+/*
+ * Read again pages of the file which failed verification, after the rest
+ * of the file is copied. Pages are re-read in passes with growing delay
+ * between them, giving postgres time to finish writing them. Pages which
+ * are still invalid after the last pass are handled by backup_data_page().
+ * Records of these pages follow the rest of records of the file.
+ */
+static void
+backup_retry_pages(backup_files_args *arguments, BackupDataFileState *state,
+				   XLogRecPtr prev_backup_start_lsn, BackupMode backup_mode)
+{
+	long		delay = BACKUP_RETRY_DELAY_MIN;
+	int			pass;
+
+	for (pass = 1; state->nretry > 0; pass++)
+	{
+		bool		last_pass = (pass == BACKUP_RETRY_PASSES);
+		uint32		nretry = 0;
+		uint32		i;
+
+		pg_usleep(delay);
+		delay = Min(delay * 2, BACKUP_RETRY_DELAY_MAX);
+
+		for (i = 0; i < state->nretry; i++)
+		{
+			BlockNumber	blknum = state->retry[i];
+			XLogRecPtr	page_lsn = InvalidXLogRecPtr;
+			instr_time	start_time;
+			instr_time	end_time;
+			int			result;
+
+			if (interrupted)
+				elog(ERROR, "interrupted during backup");
+
+			INSTR_TIME_SET_CURRENT(start_time);
+			result = read_page_from_file(state->file, blknum, state->in,
+										 state->read_buf, &page_lsn);
+			INSTR_TIME_SET_CURRENT(end_time);
+			INSTR_TIME_ACCUM_DIFF(state->stats->read_time, end_time,
+								  start_time);
+			if (result == -1 && !last_pass)
+			{
+				state->retry[nretry++] = blknum;
+				continue;
+			}
+
+			backup_data_page(arguments, state, prev_backup_start_lsn, blknum,
+							 state->read_buf, result, page_lsn, backup_mode,
+							 false, NULL, 0);
+			write_backup_records(state);
+		}
+
+		state->nretry = nretry;
+	}
+
+	elog(LOG, "File %s: %d torn pages, re-read in %d passes, %d fetched via SQL",
+		 state->file->path, state->n_torn, pass - 1, state->n_torn_fetched);
+}
+
+/*
+ * Allocate buffers of the backup thread. They are reused for every datafile
+ * the thread copies, so that no memory is allocated per page.
+ */
+void
+init_backup_buffers(backup_files_args *arguments)
+{
+	arguments->read_buf = alloc_aligned_buffer(BACKUP_READ_BLOCKS * BLCKSZ);
+	arguments->compress_buf = alloc_aligned_buffer(BACKUP_READ_BLOCKS * BLCKSZ);
+	arguments->page_headers =
+		pgut_malloc(BACKUP_READ_BLOCKS * sizeof(BackupPageHeader));
+	arguments->page_hashes = pgut_malloc(BACKUP_READ_BLOCKS * SHA256_DIGEST_LEN);
+	/* Each block takes at most a header and a payload */
+	arguments->iov = pgut_malloc(BACKUP_READ_BLOCKS * 2 * sizeof(struct iovec));
+	arguments->index = NULL;
+	arguments->index_size = 0;
+	arguments->retry = NULL;
+	arguments->retry_size = 0;
+}
+
+void
+free_backup_buffers(backup_files_args *arguments)
+{
+	free(arguments->read_buf);
+	free(arguments->compress_buf);
+	free(arguments->page_headers);
+	free(arguments->page_hashes);
+	free(arguments->iov);
+	free(arguments->index);
+	free(arguments->retry);
+	arguments->read_buf = NULL;
+	arguments->compress_buf = NULL;
+	arguments->page_headers = NULL;
+	arguments->page_hashes = NULL;
+	arguments->iov = NULL;
+	arguments->index = NULL;
+	arguments->index_size = 0;
+	arguments->retry = NULL;
+	arguments->retry_size = 0;
+}
+
+/*
+ * Open the datafile and its backup file to_path and set up state of the
+ * backup. Returns false if the datafile is not found: it could have been
+ * deleted by concurrent postgres transaction, this is not an error.
+ */
+static bool
+backup_data_file_open(backup_files_args *arguments, BackupDataFileState *state,
+					  pgFile *file, const char *to_path)
+{
+	bool		direct = false;
+
+	/*
+	 * Open backup mode file for read. With --no-cache it is read bypassing
+	 * the page cache, if the file system supports direct I/O. Buffers and
+	 * offsets of reads are aligned for it.
+	 */
+#ifdef O_DIRECT
+	if (no_cache)
+	{
+		state->in = open(file->path, O_RDONLY | PG_BINARY | O_DIRECT, 0);
+		direct = (state->in >= 0);
+		if (state->in < 0 && errno == EINVAL)
+			state->in = open(file->path, O_RDONLY | PG_BINARY, 0);
+	}
+	else
+#endif
+		state->in = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (state->in < 0)
+	{
+		if (errno == ENOENT)
+		{
+			elog(LOG, "File \"%s\" is not found", file->path);
+			return false;
+		}
+
+		elog(ERROR, "cannot open file \"%s\": %s",
+			 file->path, strerror(errno));
+	}
+
+	if (file->size % BLCKSZ != 0)
+	{
+		close(state->in);
+		elog(ERROR, "File: %s, invalid file size %lu", file->path, file->size);
+	}
+
+	/* open backup file for write  */
+	state->out = open(to_path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+					  FILE_PERMISSION);
+	if (state->out < 0)
+	{
+		int errno_tmp = errno;
+		close(state->in);
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 to_path, strerror(errno_tmp));
+	}
+
+	state->file = file;
+	state->to_path = to_path;
+	state->read_buf = arguments->read_buf;
+	state->compress_buf = arguments->compress_buf;
+	state->headers = arguments->page_headers;
+	state->hashes = arguments->page_hashes;
+	state->nheaders = 0;
+	state->iov = arguments->iov;
+	state->iovcnt = 0;
+	state->index = arguments->index;
+	state->nindex = 0;
+	state->index_size = arguments->index_size;
+	state->retry = arguments->retry;
+	state->nretry = 0;
+	state->retry_size = arguments->retry_size;
+	state->read_size = 0;
+	state->write_size = 0;
+	INIT_CRC32C(state->crc);
+	state->compressed = false;
+	state->n_blocks_read = 0;
+	state->n_blocks_skipped = 0;
+	state->n_torn = 0;
+	state->n_torn_fetched = 0;
+	state->stats = &arguments->stats;
+	cache_guard_init(&state->cache, direct ? -1 : state->in, file->size);
+
+	return true;
+}
+
+/*
+ * Keep the buffers grown by backup of the file for reuse by the thread and
+ * add counters of the file to the thread ones.
+ */
+static void
+backup_data_file_done(backup_files_args *arguments, BackupDataFileState *state)
+{
+	arguments->index = state->index;
+	arguments->index_size = state->index_size;
+	arguments->retry = state->retry;
+	arguments->retry_size = state->retry_size;
+
+	arguments->stats.pages_read += state->n_blocks_read;
+	arguments->stats.pages_skipped += state->n_blocks_skipped;
+	arguments->stats.pages_retried += state->n_torn;
+}
+
+/*
+ * Backup blocks of the file from start up to end, or up to the end of file
+ * if end is InvalidBlockNumber. Torn pages are read again after the rest
+ * of the blocks.
+ */
+static void
+backup_data_range(backup_files_args *arguments, BackupDataFileState *state,
+				  BlockNumber start, BlockNumber end,
+				  XLogRecPtr prev_backup_start_lsn, BackupMode backup_mode)
+{
+	pgFile	   *file = state->file;
+	BlockRunIterator it;
+	AioThreadState *aio;
+
+	/*
+	 * Read each page, verify checksum and write it to backup.
+	 * If page map is empty backup all pages of the relation.
+	 * If page map is not empty we scan only changed blocks,
+	 * merging adjacent ones into runs.
+	 *
+	 * NOTE Expected number of blocks in the file is computed from its size
+	 * at the moment of listing. This is a normal situation, if the file
+	 * size has changed since then.
+	 */
+	it.pagemap = NULL;
+	it.next = start;
+	it.end = Min(end, file->size / BLCKSZ);
+	it.has_next = false;
+	if (file->pagemap.bitmapsize != PageBitmapIsEmpty
+		&& file->pagemap.bitmapsize != PageBitmapIsAbsent)
+	{
+		it.pagemap = datapagemap_iterate(&file->pagemap);
+		it.end = end;
+		while ((it.has_next = datapagemap_next(it.pagemap, &it.next)) &&
+			   it.next < start)
+			;
+		if (it.has_next && it.next >= end)
+			it.has_next = false;
+	}
+
+	/*
+	 * PTRACK pages are fetched by a single query, no reads to overlap and
+	 * nothing to verify. With cpu_pool, reads overlap with compression of
+	 * pages read before.
+	 */
+	aio = get_aio_state();
+	if (backup_mode != BACKUP_MODE_DIFF_PTRACK && cpu_pool != NULL)
+		backup_data_blocks_pipeline(arguments, state, &it,
+									prev_backup_start_lsn, backup_mode);
+	else if (backup_mode != BACKUP_MODE_DIFF_PTRACK && aio_is_async(aio->ctx))
+		backup_data_blocks_async(arguments, state, aio, &it,
+								 prev_backup_start_lsn, backup_mode);
+	else
+	{
+		BlockNumber	blknum;
+		int			run_len;
+
+		while (next_block_run(&it, BACKUP_READ_BLOCKS, &blknum, &run_len))
+			backup_data_blocks(arguments, state, prev_backup_start_lsn,
+							   blknum, run_len, backup_mode);
+	}
+
+	if (it.pagemap != NULL)
+		pg_free(it.pagemap);
+
+	if (state->nretry > 0)
+		backup_retry_pages(arguments, state, prev_backup_start_lsn,
+						   backup_mode);
+}
+
+/*
+ * Backup data file in the from_root directory to the to_root directory with
+ * same relative path. If prev_backup_start_lsn is not NULL, only pages with
+ * higher lsn will be copied.
+ * Not just copy file, but read it block by block (use bitmap in case of
+ * incremental backup), validate checksum, optionally compress and write to
+ * backup with special header.
+ */
+bool
+backup_data_file(backup_files_args* arguments,
+				 const char *from_root, const char *to_root,
+				 pgFile *file, XLogRecPtr prev_backup_start_lsn,
+				 BackupMode backup_mode)
+{
+	char			to_path[MAXPGPATH];
+	BackupDataFileState state;
+	BlockNumber		nblocks;
+	instr_time		start_time;
+	instr_time		end_time;
+
+	if ((backup_mode == BACKUP_MODE_DIFF_PAGE ||
+		backup_mode == BACKUP_MODE_DIFF_PTRACK) &&
+		file->pagemap.bitmapsize == PageBitmapIsEmpty)
+	{
+		/*
+		 * There are no changed blocks since last backup. We want make
+		 * incremental backup, so we should exit.
+		 */
+		elog(VERBOSE, "Skipping the file because it didn`t changed: %s", file->path);
+		return false;
+	}
+
+	/* reset size summary */
+	file->read_size = 0;
+	file->write_size = 0;
+	INIT_CRC32C(file->crc);
+	FIN_CRC32C(file->crc);
+
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	if (!backup_data_file_open(arguments, &state, file, to_path))
+		return false;
+
+	nblocks = file->size / BLCKSZ;
+
+	/* PTRACK backup streams all changed blocks of the file at once */
+	if (backup_mode == BACKUP_MODE_DIFF_PTRACK)
+		pg_ptrack_get_blocks_begin(arguments, file, nblocks);
+
+	backup_data_range(arguments, &state, 0, InvalidBlockNumber,
+					  prev_backup_start_lsn, backup_mode);
+
+	if (file->pagemap.bitmapsize != PageBitmapIsEmpty
+		&& file->pagemap.bitmapsize != PageBitmapIsAbsent)
+		pg_free(file->pagemap.bitmap);
+
+	if (backup_mode == BACKUP_MODE_DIFF_PTRACK)
+		pg_ptrack_get_blocks_end(arguments);
+
+	/*
+	 * DELTA backup doesn't know which blocks were truncated since the
+	 * previous backup, so store the number of blocks of the file. Restore
+	 * uses it to truncate (or extend) the file restored from previous
+	 * backups.
+	 */
+	if (backup_mode == BACKUP_MODE_DIFF_DELTA)
+	{
+		BackupPageHeader   *header = &state.headers[0];
+
+		header->block = nblocks;
+		header->compressed_size = PageIsTruncated;
+		append_iov(&state, header, sizeof(BackupPageHeader));
+		write_backup_records(&state);
+	}
+
+	/* update file permission */
+	if (chmod(to_path, FILE_PERMISSION) == -1)
+	{
+		int errno_tmp = errno;
+		close(state.in);
+		close(state.out);
+		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
+			 strerror(errno_tmp));
+	}
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	if (!sync_written_file(state.out, to_path))
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_ACCUM_DIFF(arguments->stats.fsync_time, end_time, start_time);
+	if (close(state.out) != 0)
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+	cache_guard_release(&state.cache, (size_t) nblocks * BLCKSZ);
+	close(state.in);
+
+	FIN_CRC32C(state.crc);
+	file->read_size = state.read_size;
+	file->write_size = state.write_size;
+	file->crc = state.crc;
+	if (state.compressed)
+		file->compress_alg = compress_alg;
+
+	backup_data_file_done(arguments, &state);
+
+	/*
+	 * If we have pagemap then file in the backup can't be a zero size.
+	 * Otherwise, we will clear the last file.
+	 * DELTA backup keeps the file to preserve its number of blocks.
+	 */
+	if (backup_mode != BACKUP_MODE_DIFF_DELTA &&
+		state.n_blocks_read != 0 &&
+		state.n_blocks_read == state.n_blocks_skipped)
+	{
+		if (remove(to_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
+				 strerror(errno));
+		return false;
+	}
+
+	write_backup_index(&state);
+
+	return true;
+}
+
+/*
+ * Path of the file holding backup of the part of the file, which is backed
+ * up to to_path. The first part is written to to_path itself.
+ */
+static void
+file_part_path(char *path, size_t len, const char *to_path, int partno)
+{
+	if (partno == 0)
+		snprintf(path, len, "%s", to_path);
+	else
+		snprintf(path, len, "%s.part%d", to_path, partno);
+}
+
+/*
+ * Append the file at path to the file open as out, at its current position.
+ * The data is copied inside the kernel if possible, buf is used otherwise.
+ */
+static void
+append_file_part(int out, const char *to_path, const char *path,
+				 char *buf, size_t buf_size)
+{
+	bool		in_kernel = true;
+	int			in;
+
+	in = open(path, O_RDONLY | PG_BINARY, 0);
+	if (in < 0)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 path, strerror(errno));
+
+	for (;;)
+	{
+		ssize_t		rc;
+
+#ifdef __NR_copy_file_range
+		if (in_kernel)
+		{
+			rc = syscall(__NR_copy_file_range, in, NULL, out, NULL,
+						 COPY_RANGE_CHUNK, 0);
+			/* Different file systems, or not supported by this one */
+			if (rc < 0 &&
+				(errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+				 errno == EINVAL || errno == EBADF))
+			{
+				in_kernel = false;
+				continue;
+			}
+		}
+		else
+#endif
+		{
+			rc = read(in, buf, buf_size);
+			if (rc > 0)
+			{
+				ssize_t		written = 0;
+
+				while (written < rc)
+				{
+					ssize_t		wrc = write(out, buf + written, rc - written);
+
+					if (wrc < 0 && errno == EINTR)
+						continue;
+					if (wrc < 0)
+						elog(ERROR, "cannot write backup file \"%s\": %s",
+							 to_path, strerror(errno));
+					written += wrc;
+				}
+			}
+		}
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			elog(ERROR, "cannot append \"%s\" to \"%s\": %s",
+				 path, to_path, strerror(errno));
+		}
+		/* EOF */
+		if (rc == 0)
+			break;
+	}
+
+	close(in);
+}
+
+/*
+ * Make the backup file of the split file from files of its parts: append
+ * other parts to the first one in order, so that the records are the same
+ * as of backup of the whole file by one thread. CRC of the file is combined
+ * from CRCs of the parts, index entries of each part are shifted by the
+ * size of preceding parts.
+ */
+static void
+backup_merge_parts(backup_files_args *arguments, pgFilePart *part,
+				   const char *to_path, BackupMode backup_mode)
+{
+	pgFile	   *file = part->file;
+	pgFileSplit *split = part->split;
+	BackupDataFileState state;
+	char		part_path[MAXPGPATH];
+	pg_crc32	crc;
+	size_t		size;
+	size_t		read_size = 0;
+	int			n_blocks_read = 0;
+	int			n_blocks_skipped = 0;
+	bool		compressed = false;
+	instr_time	start_time;
+	instr_time	end_time;
+	int			i;
+
+	/* The file was deleted while it was copied, forget what was copied */
+	for (i = 0; i < split->nparts; i++)
+	{
+		if (split->results[i].missing)
+		{
+			for (i = 0; i < split->nparts; i++)
+			{
+				file_part_path(part_path, lengthof(part_path), to_path, i);
+				if (remove(part_path) == -1 && errno != ENOENT)
+					elog(ERROR, "cannot remove file \"%s\": %s", part_path,
+						 strerror(errno));
+			}
+			file->write_size = BYTES_INVALID;
+			return;
+		}
+	}
+
+	state.file = file;
+	state.to_path = to_path;
+	state.headers = arguments->page_headers;
+	state.nheaders = 0;
+	state.iov = arguments->iov;
+	state.iovcnt = 0;
+	state.index = arguments->index;
+	state.nindex = 0;
+	state.index_size = arguments->index_size;
+	state.stats = &arguments->stats;
+
+	state.out = open(to_path, O_WRONLY | PG_BINARY, 0);
+	if (state.out < 0 ||
+		lseek(state.out, split->results[0].write_size, SEEK_SET) < 0)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	crc = split->results[0].crc;
+	size = 0;
+	for (i = 0; i < split->nparts; i++)
+	{
+		FilePartResult *result = &split->results[i];
+		uint32		j;
+
+		if (i > 0)
+		{
+			file_part_path(part_path, lengthof(part_path), to_path, i);
+			append_file_part(state.out, to_path, part_path,
+							 arguments->read_buf,
+							 BACKUP_READ_BLOCKS * BLCKSZ);
+			if (remove(part_path) == -1)
+				elog(ERROR, "cannot remove file \"%s\": %s", part_path,
+					 strerror(errno));
+			crc = crc32c_combine(crc, result->crc, result->write_size);
+		}
+
+		backup_index_reserve(&state, result->nindex);
+		for (j = 0; j < result->nindex; j++)
+		{
+			state.index[state.nindex] = result->index[j];
+			state.index[state.nindex].offset += size;
+			state.nindex++;
+		}
+
+		size += result->write_size;
+		read_size += result->read_size;
+		n_blocks_read += result->n_blocks_read;
+		n_blocks_skipped += result->n_blocks_skipped;
+		compressed |= result->compressed;
+
+		pg_free(result->index);
+		result->index = NULL;
+	}
+
+	/*
+	 * DELTA backup stores the number of blocks of the file, as
+	 * backup_data_file() does. CRC of this record is combined too.
+	 */
+	state.write_size = size;
+	INIT_CRC32C(state.crc);
+	if (backup_mode == BACKUP_MODE_DIFF_DELTA)
+	{
+		BackupPageHeader   *header = &state.headers[0];
+
+		header->block = file->size / BLCKSZ;
+		header->compressed_size = PageIsTruncated;
+		append_iov(&state, header, sizeof(BackupPageHeader));
+		write_backup_records(&state);
+	}
+	FIN_CRC32C(state.crc);
+	crc = crc32c_combine(crc, state.crc, state.write_size - size);
+
+	if (file->pagemap.bitmapsize != PageBitmapIsEmpty
+		&& file->pagemap.bitmapsize != PageBitmapIsAbsent)
+		pg_free(file->pagemap.bitmap);
+
+	/* update file permission */
+	if (chmod(to_path, FILE_PERMISSION) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno));
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	if (!sync_written_file(state.out, to_path))
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_ACCUM_DIFF(arguments->stats.fsync_time, end_time, start_time);
+	if (close(state.out) != 0)
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	arguments->index = state.index;
+	arguments->index_size = state.index_size;
+
+	file->read_size = read_size;
+	file->write_size = state.write_size;
+	file->crc = crc;
+	if (compressed)
+		file->compress_alg = compress_alg;
+
+	/* As in backup_data_file() */
+	if (backup_mode != BACKUP_MODE_DIFF_DELTA &&
+		n_blocks_read != 0 &&
+		n_blocks_read == n_blocks_skipped)
+	{
+		if (remove(to_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
+				 strerror(errno));
+		file->write_size = BYTES_INVALID;
+		return;
+	}
+
+	write_backup_index(&state);
+}
+
+/*
+ * Backup a part of a split datafile. Parts are written to files of their
+ * own, see file_part_path(), and the thread which finishes the last part
+ * of the file merges them into the backup file. Returns true to that
+ * thread only: then the file is complete, its write_size is BYTES_INVALID
+ * if it was not copied.
+ */
+bool
+backup_data_file_part(backup_files_args* arguments,
+					  const char *from_root, const char *to_root,
+					  pgFilePart *part, XLogRecPtr prev_backup_start_lsn,
+					  BackupMode backup_mode)
+{
+	pgFile	   *file = part->file;
+	pgFileSplit *split = part->split;
+	FilePartResult *result = &split->results[part->partno];
+	char		to_path[MAXPGPATH];
+	char		part_path[MAXPGPATH];
+	BackupDataFileState state;
+	bool		last;
+
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	file_part_path(part_path, lengthof(part_path), to_path, part->partno);
+
+	memset(result, 0, sizeof(FilePartResult));
+	if (!backup_data_file_open(arguments, &state, file, part_path))
+		result->missing = true;
+	else
+	{
+		/*
+		 * The last part takes changed blocks of the pagemap beyond the end
+		 * of the file as listed. A full scan stops at the listed size, the
+		 * same as for a file which is not split: blocks added later are
+		 * restored from WAL.
+		 */
+		backup_data_range(arguments, &state, part->start,
+						  part->partno == split->nparts - 1 ?
+						  InvalidBlockNumber : part->end,
+						  prev_backup_start_lsn, backup_mode);
+
+		if (close(state.out) != 0)
+			elog(ERROR, "cannot write backup file \"%s\": %s",
+				 part_path, strerror(errno));
+		cache_guard_drop(&state.cache, (off_t) part->start * BLCKSZ,
+						 (size_t) (part->end - part->start) * BLCKSZ);
+		cache_guard_release(&state.cache, 0);
+		close(state.in);
+
+		FIN_CRC32C(state.crc);
+		result->read_size = state.read_size;
+		result->write_size = state.write_size;
+		result->crc = state.crc;
+		result->compressed = state.compressed;
+		result->n_blocks_read = state.n_blocks_read;
+		result->n_blocks_skipped = state.n_blocks_skipped;
+		result->nindex = state.nindex;
+		result->index = pgut_malloc(Max(state.nindex, 1) *
+									sizeof(BackupIndexEntry));
+		memcpy(result->index, state.index,
+			   state.nindex * sizeof(BackupIndexEntry));
+
+		backup_data_file_done(arguments, &state);
+	}
+
+	pthread_mutex_lock(&split->mutex);
+	last = (++split->ndone == split->nparts);
+	pthread_mutex_unlock(&split->mutex);
+
+	if (!last)
+		return false;
+
+	backup_merge_parts(arguments, part, to_path, backup_mode);
+	return true;
+}
+
+/*
+ * Append parts of the file to the list of parts. Returns state shared by
+ * the parts, or NULL if the file makes a single part.
+ */
+static pgFileSplit *
+add_file_parts(parray *parts, pgFile *file, BlockNumber nblocks, int nparts)
+{
+	pgFileSplit *split = NULL;
+	int			i;
+
+	if (nparts > 1)
+	{
+		split = pgut_new(pgFileSplit);
+		pthread_mutex_init(&split->mutex, NULL);
+		split->nparts = nparts;
+		split->ndone = 0;
+		split->results = NULL;
+		split->index = NULL;
+		split->nentries = 0;
+		split->zeroed_size = 0;
+	}
+
+	for (i = 0; i < nparts; i++)
+	{
+		pgFilePart *part = pgut_new(pgFilePart);
+
+		part->file = file;
+		part->start = (BlockNumber) i * FILE_PART_BLOCKS;
+		part->end = (i == nparts - 1) ? nblocks : part->start + FILE_PART_BLOCKS;
+		part->partno = i;
+		part->split = split;
+		parray_append(parts, part);
+	}
+
+	return split;
+}
+
+/*
+ * Make the list of parts of files to back up. If split is false, or the
+ * file is not a large datafile, the file makes a single part. Files with
+ * no changed blocks are not split, they are not copied at all.
+ */
+parray *
+backup_file_parts(parray *files, bool split)
+{
+	parray	   *parts = parray_new();
+	size_t		i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		BlockNumber	nblocks = file->size / BLCKSZ;
+		int			nparts = 1;
+		pgFileSplit *file_split;
+
+		if (split && S_ISREG(file->mode) &&
+			file->is_datafile && !file->is_cfs &&
+			file->pagemap.bitmapsize != PageBitmapIsEmpty &&
+			nblocks > FILE_PART_BLOCKS)
+			nparts = (nblocks + FILE_PART_BLOCKS - 1) / FILE_PART_BLOCKS;
+
+		file_split = add_file_parts(parts, file, nblocks, nparts);
+		if (file_split != NULL)
+			file_split->results = pgut_malloc(nparts * sizeof(FilePartResult));
+	}
+
+	return parts;
+}
+
+/*
+ * Make the list of parts of files to restore. A large datafile is split if
+ * its backup has an index: parts find their records in it.
+ */
+parray *
+restore_file_parts(parray *files, bool split)
+{
+	parray	   *parts = parray_new();
+	size_t		i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		BackupIndexEntry *index = NULL;
+		uint32		nentries = 0;
+		BlockNumber	nblocks = 0;
+		int			nparts = 1;
+		pgFileSplit *file_split;
+
+		if (split && S_ISREG(file->mode) &&
+			file->is_datafile && !file->is_cfs &&
+			file->write_size != BYTES_INVALID &&
+			file->write_size >= (size_t) FILE_PART_BLOCKS * BLCKSZ)
+			index = read_backup_index(file, &nentries);
+
+		if (index != NULL)
+		{
+			uint32		j;
+
+			for (j = 0; j < nentries; j++)
+				if (index[j].compressed_size != PageIsTruncated)
+					nblocks = Max(nblocks, index[j].block + 1);
+
+			nparts = (nblocks + FILE_PART_BLOCKS - 1) / FILE_PART_BLOCKS;
+			if (nparts <= 1)
+			{
+				nparts = 1;
+				free(index);
+				index = NULL;
+			}
+		}
+
+		file_split = add_file_parts(parts, file, nblocks, nparts);
+		if (file_split != NULL)
+		{
+			file_split->index = index;
+			file_split->nentries = nentries;
+		}
+	}
+
+	return parts;
+}
+
+void
+free_file_parts(parray *parts)
+{
+	size_t		i;
+
+	for (i = 0; i < parray_num(parts); i++)
+	{
+		pgFilePart *part = (pgFilePart *) parray_get(parts, i);
+
+		/* The first part owns the shared state */
+		if (part->split != NULL && part->partno == 0)
+		{
+			pthread_mutex_destroy(&part->split->mutex);
+			free(part->split->results);
+			free(part->split->index);
+			free(part->split);
+		}
+		free(part);
+	}
+	parray_free(parts);
+}
+
+/*
+ * Weight of the part of the file to back up, see pgFileWeightSize().
+ */
+size_t
+pgFilePartWeightSize(const void *p)
+{
+	const pgFilePart *part = (const pgFilePart *) p;
+
+	if (part->split == NULL)
+		return pgFileWeightSize(part->file);
+	return (size_t) (part->end - part->start) * BLCKSZ;
+}
+
+/*
+ * Weight of the part of the file to restore, see pgFileWeightWriteSize().
+ */
+size_t
+pgFilePartWeightWriteSize(const void *p)
+{
+	const pgFilePart *part = (const pgFilePart *) p;
+
+	if (part->split == NULL)
+		return pgFileWeightWriteSize(part->file);
+	return pgFileWeightWriteSize(part->file) / part->split->nparts;
+}
+
+/*
+ * Restored pages are written by runs of consecutive blocks, up to
+ * BACKUP_READ_BLOCKS pages by one pwritev(). Runs of zeroed pages are
+ * deallocated instead of written, so they take no space, the same as
+ * zeroed pages beyond the end of the file.
+ */
+typedef struct RestoreWriter
+{
+	int			fd;
+	const char *path;
+	char	   *buf;			/* slots of pages, see restore_writer_slot() */
+	BlockNumber	start;			/* first block of the pending run */
+	BlockNumber	nblocks;		/* blocks of the pending run */
+	bool		zeroed;			/* the run is of zeroed pages */
+	struct iovec iov[BACKUP_READ_BLOCKS];
+} RestoreWriter;
+
+/*
+ * Allocate blocks [start, start + nblocks) of the restored file, without
+ * changing its size, so that the file gets a few large extents instead of
+ * growing block by block. Returns false if the file system can't.
+ */
+static bool
+restore_preallocate(int fd, BlockNumber start, BlockNumber nblocks,
+					const char *to_path)
+{
+#ifdef USE_FALLOCATE
+	if (nblocks == 0)
+		return true;
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) start * BLCKSZ,
+				  (off_t) nblocks * BLCKSZ) == 0)
+		return true;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		elog(ERROR, "cannot preallocate \"%s\": %s", to_path, strerror(errno));
+#endif
+	return false;
+}
+
+/*
+ * Make blocks [start, start + nblocks) of the restored file read as zeros.
+ * They are deallocated, or zeros are written over blocks within the file if
+ * the file system can't punch holes. Blocks beyond the end are holes once
+ * the file is extended.
+ */
+static void
+restore_zero_blocks(int fd, BlockNumber start, BlockNumber nblocks,
+					const char *to_path)
+{
+	static const char zero_page[BLCKSZ];
+	struct stat	st;
+	BlockNumber	blknum;
+
+#ifdef USE_FALLOCATE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  (off_t) start * BLCKSZ, (off_t) nblocks * BLCKSZ) == 0)
+		return;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		elog(ERROR, "cannot punch hole in \"%s\": %s", to_path,
+			 strerror(errno));
+#endif
+
+	if (fstat(fd, &st) != 0)
+		elog(ERROR, "cannot stat \"%s\": %s", to_path, strerror(errno));
+	for (blknum = start;
+		 blknum < start + nblocks && (off_t) blknum * BLCKSZ < st.st_size;
+		 blknum++)
+	{
+		if (pwrite(fd, zero_page, BLCKSZ, (off_t) blknum * BLCKSZ) != BLCKSZ)
+			elog(ERROR, "cannot write block %u of \"%s\": %s",
+				 blknum, to_path, strerror(errno));
+	}
+}
+
+/*
+ * Start writing pages of the file. With slots, pages are restored right
+ * into the buffer of the writer by restore_writer_slot(), otherwise they
+ * are added by restore_writer_page() and must be kept until the flush.
+ */
+static void
+restore_writer_init(RestoreWriter *w, int fd, const char *path, bool slots)
+{
+	w->fd = fd;
+	w->path = path;
+	w->buf = NULL;
+	w->nblocks = 0;
+	w->zeroed = false;
+
+	if (slots)
+	{
+		AioThreadState *aio = get_aio_state();
+
+		if (aio->write_buf == NULL)
+			aio->write_buf = alloc_aligned_buffer(BACKUP_READ_BLOCKS * BLCKSZ);
+		w->buf = aio->write_buf;
+	}
+}
+
+/*
+ * Write the pending run of the writer.
+ */
+static void
+restore_writer_flush(RestoreWriter *w)
+{
+	struct iovec *iov = w->iov;
+	int			iovcnt = w->nblocks;
+	off_t		offset = (off_t) w->start * BLCKSZ;
+
+	if (w->nblocks == 0)
+		return;
+
+	if (w->zeroed)
+	{
+		restore_zero_blocks(w->fd, w->start, w->nblocks, w->path);
+		w->nblocks = 0;
+		return;
+	}
+
+	while (iovcnt > 0)
+	{
+		ssize_t		rc = pwritev(w->fd, iov, iovcnt, offset);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+		{
+			/* if write didn't set errno, assume problem is no disk space */
+			if (rc == 0)
+				errno = ENOSPC;
+			elog(ERROR, "cannot write blocks %u-%u of \"%s\": %s",
+				 w->start, w->start + w->nblocks - 1, w->path,
+				 strerror(errno));
+		}
+		offset += rc;
+
+		/* Skip pages written, continue the one written partially */
+		while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+		{
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+
+	w->nblocks = 0;
+}
+
+/*
+ * Flush the pending run unless the block continues it.
+ */
+static void
+restore_writer_next(RestoreWriter *w, BlockNumber blknum, bool zeroed)
+{
+	if (w->nblocks > 0 &&
+		(w->zeroed != zeroed || blknum != w->start + w->nblocks ||
+		 (!zeroed && w->nblocks == BACKUP_READ_BLOCKS)))
+		restore_writer_flush(w);
+
+	if (w->nblocks == 0)
+	{
+		w->start = blknum;
+		w->zeroed = zeroed;
+	}
+}
+
+/*
+ * Add page of block blknum to the run. The page is written by a later flush.
+ */
+static void
+restore_writer_page(RestoreWriter *w, BlockNumber blknum, char *page)
+{
+	restore_writer_next(w, blknum, false);
+	w->iov[w->nblocks].iov_base = page;
+	w->iov[w->nblocks].iov_len = BLCKSZ;
+	w->nblocks++;
+}
+
+/*
+ * Get the slot to restore the page of block blknum into, and add it to the
+ * run. The page must be restored before the next call.
+ */
+static char *
+restore_writer_slot(RestoreWriter *w, BlockNumber blknum)
+{
+	char	   *page;
+
+	Assert(w->buf != NULL);
+	restore_writer_next(w, blknum, false);
+	page = w->buf + (size_t) w->nblocks * BLCKSZ;
+	restore_writer_page(w, blknum, page);
+	return page;
+}
+
+/*
+ * Add zeroed page of block blknum to the run.
+ */
+static void
+restore_writer_zeroed(RestoreWriter *w, BlockNumber blknum)
+{
+	restore_writer_next(w, blknum, true);
+	w->nblocks++;
+}
+
+/*
+ * Start asynchronous write of restored page at blknum of the file if req is
+ * given. Otherwise the page was restored into a slot of the writer, which
+ * writes it along with the rest of the run.
+ */
+static void
+restore_write_page(AioThreadState *aio, aio_request *req, FILE *out,
+				   char *page, BlockNumber blknum)
+{
+	if (req != NULL)
+		aio_write(aio->ctx, req, fileno(out), page, BLCKSZ,
+				  (off_t) blknum * BLCKSZ);
+}
+
+/*
+ * Read up to BACKUP_READ_BLOCKS records of the backup file into the batch,
+ * payload of each record into its slot of "in". Returns false at the end
+ * of the file.
+ */
+static bool
+restore_read_records(FILE *in, pgFile *file, PageBatch *batch)
+{
+	batch->file = file;
+	batch->npages = 0;
+
+	while (batch->npages < BACKUP_READ_BLOCKS)
+	{
+		BackupPageHeader *header = &batch->headers[batch->npages];
+		size_t		payload_len;
+		size_t		read_len;
+
+		read_len = fread(header, 1, sizeof(*header), in);
+		if (read_len != sizeof(*header))
+		{
+			int errno_tmp = errno;
+			if (read_len == 0 && feof(in))
+				break;		/* EOF found */
+			else if (read_len != 0 && feof(in))
+				elog(ERROR, "odd size page found in \"%s\"", file->path);
+			else
+				elog(ERROR, "cannot read header of block of \"%s\": %s",
+					 file->path, strerror(errno_tmp));
+		}
+
+		payload_len = BackupRecordPayloadSize(header->compressed_size);
+		Assert(payload_len <= BLCKSZ);
+
+		if (payload_len > 0 &&
+			fread(batch->in + (size_t) batch->npages * BLCKSZ, 1,
+				  payload_len, in) != payload_len)
+			elog(ERROR, "cannot read block %u of \"%s\": %s",
+				 header->block, file->path, strerror(errno));
+
+		batch->npages++;
+	}
+
+	return batch->npages > 0;
+}
+
+/*
+ * CPU stage of restore: restore pages of compressed and deduplicated
+ * records of the batch into their slots of "out". Pages stored as is are
+ * written right from "in", zeroed pages are filled by the writer.
+ */
+static void
+restore_prepare_pages(void *arg)
+{
+	PageBatch  *batch = (PageBatch *) arg;
+	int			i;
+
+	for (i = 0; i < batch->npages; i++)
+	{
+		BackupPageHeader *header = &batch->headers[i];
+		char	   *payload = batch->in + (size_t) i * BLCKSZ;
+		char	   *page = batch->out + (size_t) i * BLCKSZ;
+
+		if (header->compressed_size == PageIsDeduplicated)
+		{
+			if (!read_dedup_page((uint8 *) payload, page))
+				elog(ERROR, "cannot restore block %u of \"%s\" from page store",
+					 header->block, batch->file->path);
+		}
+		else if (header->compressed_size > 0 &&
+				 header->compressed_size != BLCKSZ)
+		{
+			size_t		uncompressed_size;
+
+			uncompressed_size = do_decompress(page, BLCKSZ, payload,
+											  header->compressed_size,
+											  batch->file->compress_alg);
+			if (uncompressed_size != BLCKSZ)
+				elog(ERROR, "page uncompressed to %ld bytes. != BLCKSZ",
+					 uncompressed_size);
+		}
+	}
+}
+
+/*
+ * Apply records of the backup file through cpu_pool: records are read
+ * ahead while pages of records read before are restored by the pool, and
+ * restored pages are written in order of records, as restore_data_file()
+ * does. Sizes to extend or truncate the file to are returned the same way.
+ */
+static void
+restore_data_pages_pipeline(FILE *in, FILE *out, pgFile *file,
+							const char *to_path, off_t *file_size,
+							off_t *zeroed_size, BlockNumber *truncate_blkno)
+{
+	PageBatch  *batches = get_page_batches();
+	RestoreWriter writer;
+	int			head = 0;
+	int			ninflight = 0;
+	bool		more = true;
+
+	restore_writer_init(&writer, fileno(out), to_path, false);
+
+	for (;;)
+	{
+		PageBatch  *batch;
+		int			i;
+
+		while (more && ninflight < CPU_PIPELINE_DEPTH)
+		{
+			batch = &batches[(head + ninflight) % CPU_PIPELINE_DEPTH];
+			if (!restore_read_records(in, file, batch))
+			{
+				more = false;
+				break;
+			}
+
+			batch->item.fn = restore_prepare_pages;
+			batch->item.arg = batch;
+			work_pool_submit(cpu_pool, &batch->item);
+			ninflight++;
+		}
+
+		if (ninflight == 0)
+			break;
+
+		batch = &batches[head];
+		work_pool_wait(cpu_pool, &batch->item);
+
+		for (i = 0; i < batch->npages; i++)
+		{
+			BackupPageHeader *header = &batch->headers[i];
+			BlockNumber	blknum = header->block;
+			char	   *page = batch->out + (size_t) i * BLCKSZ;
+
+			if (header->compressed_size == PageIsTruncated)
+			{
+				*truncate_blkno = Min(*truncate_blkno, blknum);
+				continue;
+			}
+
+			if (header->compressed_size == PageIsZeroed)
+			{
+				/* Leave a hole, as without pool */
+				if ((off_t) blknum * BLCKSZ >= *file_size)
+					*zeroed_size = Max(*zeroed_size,
+									   (off_t) (blknum + 1) * BLCKSZ);
+				restore_writer_zeroed(&writer, blknum);
+				continue;
+			}
+
+			if (header->compressed_size == BLCKSZ)
+				page = batch->in + (size_t) i * BLCKSZ;
+			*file_size = Max(*file_size, (off_t) (blknum + 1) * BLCKSZ);
+			restore_writer_page(&writer, blknum, page);
+		}
+
+		/* Pages of the batch are written before it is reused */
+		restore_writer_flush(&writer);
+		head = (head + 1) % CPU_PIPELINE_DEPTH;
+		ninflight--;
+	}
+}
+
+/*
+ * Restore files in the from_root directory to the to_root directory with
+ * same relative path.
+ */
+void
+restore_data_file(const char *from_root,
+				  const char *to_root,
+				  pgFile *file,
+				  pgBackup *backup)
+{
+	char				to_path[MAXPGPATH];
+	FILE			   *in;
+	FILE			   *out;
+	BackupPageHeader	header;
+	BlockNumber			blknum;
+	struct stat			st;
+	off_t				file_size;		/* size of the restored file */
+	off_t				zeroed_size = 0;	/* size implied by zeroed pages */
+	BlockNumber			truncate_blkno = InvalidBlockNumber;
+	AioThreadState	   *aio = get_aio_state();
+	RestoreWriter		writer;
+	int					slot = 0;
+
+	/* open backup mode file for read */
+	in = fopen(file->path, "r");
+	if (in == NULL)
+	{
+		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
+			 strerror(errno));
+	}
+
+	/*
+	 * Open backup file for write. 	We use "r+" at first to overwrite only
+	 * modified pages for differential restore. If the file does not exist,
+	 * re-open it with "w" to create an empty file.
+	 */
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = fopen(to_path, "r+");
+	if (out == NULL && errno == ENOENT)
+		out = fopen(to_path, "w");
+	if (out == NULL)
 	{
-		memcpy(write_buffer, &header, sizeof(header));
+		int errno_tmp = errno;
+		fclose(in);
+		elog(ERROR, "cannot open restore target file \"%s\": %s",
+			 to_path, strerror(errno_tmp));
 	}
-	/* The page compression failed. Write it as is. */
-	else if (header.compressed_size == -1)
+
+	if (fstat(fileno(out), &st) != 0)
+		elog(ERROR, "cannot stat \"%s\": %s", to_path, strerror(errno));
+	file_size = st.st_size;
+
+	/* The file takes its size in the backup, unless truncated */
+	restore_preallocate(fileno(out), 0, (file->size + BLCKSZ - 1) / BLCKSZ,
+						to_path);
+
+	if (cpu_pool != NULL)
+		restore_data_pages_pipeline(in, out, file, to_path, &file_size,
+									&zeroed_size, &truncate_blkno);
+	else
 	{
-		header.compressed_size = BLCKSZ;
-		memcpy(write_buffer, &header, sizeof(header));
-		memcpy(write_buffer + sizeof(header), page, BLCKSZ);
-		write_buffer_size += header.compressed_size;
+		restore_writer_init(&writer, fileno(out), to_path, aio->ring == NULL);
+
+		for (blknum = 0; ; blknum++)
+		{
+			size_t		read_len;
+			DataPage	compressed_page; /* used as read buffer */
+			char	   *buf;			/* restored page */
+			aio_request *req = NULL;
+
+			/* read BackupPageHeader */
+			read_len = fread(&header, 1, sizeof(header), in);
+			if (read_len != sizeof(header))
+			{
+				int errno_tmp = errno;
+				if (read_len == 0 && feof(in))
+					break;		/* EOF found */
+				else if (read_len != 0 && feof(in))
+					elog(ERROR,
+						 "odd size page found at block %u of \"%s\"",
+						 blknum, file->path);
+				else
+					elog(ERROR, "cannot read header of block %u of \"%s\": %s",
+						 blknum, file->path, strerror(errno_tmp));
+			}
+
+			if (header.compressed_size == PageIsTruncated)
+			{
+				/*
+				 * Backup contains information that this block was truncated.
+				 * Records of torn pages, which were read again at the end of
+				 * backup, may follow, so truncate the file after all records
+				 * are applied.
+				 */
+				truncate_blkno = Min(truncate_blkno, header.block);
+				continue;
+			}
+
+			blknum = header.block;
+
+			if (header.compressed_size == PageIsZeroed)
+			{
+				/*
+				 * Zeroed page is left as a hole, which replaces its previous
+				 * version inside the file. Beyond the end of the file, the
+				 * file is extended to cover it after all pages are written.
+				 */
+				if ((off_t) blknum * BLCKSZ >= file_size)
+					zeroed_size = Max(zeroed_size, (off_t) (blknum + 1) * BLCKSZ);
+				restore_writer_zeroed(&writer, blknum);
+				continue;
+			}
+
+			/*
+			 * With asynchronous I/O the page is restored into a slot of the
+			 * ring, and written from it while next pages are restored. A block
+			 * has a single record in the backup file, so writes in flight never
+			 * overlap. Otherwise it is restored into a slot of the writer.
+			 */
+			if (aio->ring != NULL)
+			{
+				req = &aio->reqs[slot];
+				aio_wait_slot(aio, req, to_path);
+				buf = aio->ring + (size_t) slot * AIO_SLOT_SIZE;
+				slot = (slot + 1) % aio_depth(aio->ctx);
+			}
+			else
+				buf = restore_writer_slot(&writer, blknum);
+
+			if (header.compressed_size == PageIsDeduplicated)
+			{
+				uint8		hash[SHA256_DIGEST_LEN];
+
+				if (fread(hash, 1, sizeof(hash), in) != sizeof(hash))
+					elog(ERROR, "cannot read block %u of \"%s\": %s",
+						 blknum, file->path, strerror(errno));
+				if (!read_dedup_page(hash, buf))
+					elog(ERROR, "cannot restore block %u of \"%s\" from page store",
+						 blknum, file->path);
+
+				file_size = Max(file_size, (off_t) (blknum + 1) * BLCKSZ);
+				restore_write_page(aio, req, out, buf, blknum);
+				continue;
+			}
+
+			Assert(header.compressed_size <= BLCKSZ);
+
+			/* Uncompressed page is read right to its place */
+			if (header.compressed_size == BLCKSZ)
+				read_len = fread(buf, 1, BLCKSZ, in);
+			else
+				read_len = fread(compressed_page.data, 1,
+								 MAXALIGN(header.compressed_size), in);
+			if (read_len != MAXALIGN(header.compressed_size))
+				elog(ERROR, "cannot read block %u of \"%s\" read %lu of %d",
+					blknum, file->path, read_len, header.compressed_size);
+
+			if (header.compressed_size != BLCKSZ)
+			{
+				size_t uncompressed_size = 0;
+
+				uncompressed_size = do_decompress(buf, BLCKSZ,
+												compressed_page.data,
+												header.compressed_size, file->compress_alg);
+
+				if (uncompressed_size != BLCKSZ)
+					elog(ERROR, "page uncompressed to %ld bytes. != BLCKSZ", uncompressed_size);
+			}
+
+			file_size = Max(file_size, (off_t) (blknum + 1) * BLCKSZ);
+			restore_write_page(aio, req, out, buf, blknum);
+		}
+
+		restore_writer_flush(&writer);
 	}
-	/* The page was successfully compressed */
-	else if (header.compressed_size > 0)
+
+	/* Wait for writes in flight before the size of the file is changed */
+	if (aio->ring != NULL)
 	{
-		memcpy(write_buffer, &header, sizeof(header));
-		memcpy(write_buffer + sizeof(header), compressed_page, header.compressed_size);
-		write_buffer_size += MAXALIGN(header.compressed_size);
+		int			i;
+
+		for (i = 0; i < aio_depth(aio->ctx); i++)
+			aio_wait_slot(aio, &aio->reqs[i], to_path);
 	}
 
-	/* elog(VERBOSE, "backup blkno %u, compressed_size %d write_buffer_size %ld",
-				  blknum, header.compressed_size, write_buffer_size); */
+	/* Extend the file to cover trailing zeroed pages without writing them */
+	if (zeroed_size > file_size)
+	{
+		if (fflush(out) != 0 ||
+			ftruncate(fileno(out), zeroed_size) != 0)
+			elog(ERROR, "cannot extend \"%s\": %s", to_path, strerror(errno));
+	}
 
-	/* Update CRC */
-	COMP_CRC32C(*crc, &write_buffer, write_buffer_size);
+	if (truncate_blkno != InvalidBlockNumber)
+	{
+		if (fflush(out) != 0 ||
+			ftruncate(fileno(out), (off_t) truncate_blkno * BLCKSZ) != 0)
+			elog(ERROR, "cannot truncate \"%s\": %s",
+				 to_path, strerror(errno));
+		elog(VERBOSE, "truncate file %s to block %u", file->path, truncate_blkno);
+	}
 
-	/* write data page */
-	if(fwrite(write_buffer, 1, write_buffer_size, out) != write_buffer_size)
+	/* update file permission */
+	if (chmod(to_path, file->mode) == -1)
 	{
 		int errno_tmp = errno;
+
 		fclose(in);
 		fclose(out);
-		elog(ERROR, "File: %s, cannot write backup at block %u : %s",
-				file->path, blknum, strerror(errno_tmp));
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno_tmp));
 	}
 
-	file->write_size += write_buffer_size;
-
-	if (page != NULL)
-		free(page);
-	if (compressed_page != NULL)
-		free(compressed_page);
+	if (fflush(out) != 0 ||
+		!sync_written_file(fileno(out), to_path) ||
+		fclose(out))
+		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+	fclose(in);
 }
 
 /*
- * Backup data file in the from_root directory to the to_root directory with
- * same relative path. If prev_backup_start_lsn is not NULL, only pages with
- * higher lsn will be copied.
- * Not just copy file, but read it block by block (use bitmap in case of
- * incremental backup), validate checksum, optionally compress and write to
- * backup with special header.
+ * Restore a part of a split datafile: apply records of blocks of the part,
+ * found by the index of the backed-up file, the same way restore_data_file()
+ * does. The file is never truncated while parts are written concurrently:
+ * the thread which finishes the last part extends or truncates the file,
+ * updates its permissions and syncs it.
  */
-bool
-backup_data_file(backup_files_args* arguments,
-				 const char *from_root, const char *to_root,
-				 pgFile *file, XLogRecPtr prev_backup_start_lsn,
-				 BackupMode backup_mode)
+void
+restore_data_file_part(const char *from_root, const char *to_root,
+					   pgFilePart *part)
 {
-	char			to_path[MAXPGPATH];
-	FILE			*in;
-	FILE			*out;
-	BlockNumber		blknum = 0;
-	BlockNumber		nblocks = 0;
-	int n_blocks_skipped = 0;
-	int n_blocks_read = 0;
+	pgFile	   *file = part->file;
+	pgFileSplit *split = part->split;
+	char		to_path[MAXPGPATH];
+	char		buf[sizeof(BackupPageHeader) + BLCKSZ];
+	char	   *payload = buf + sizeof(BackupPageHeader);
+	RestoreWriter writer;
+	struct stat	st;
+	off_t		file_size;		/* size of the restored file */
+	off_t		zeroed_size = 0;	/* size implied by zeroed pages */
+	BlockNumber	truncate_blkno = InvalidBlockNumber;
+	BlockNumber	nblocks;
+	bool		last;
+	uint32		i;
+	int			in;
+	int			out;
+
+	in = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (in < 0)
+		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
+			 strerror(errno));
 
-	if ((backup_mode == BACKUP_MODE_DIFF_PAGE ||
-		backup_mode == BACKUP_MODE_DIFF_PTRACK) &&
-		file->pagemap.bitmapsize == PageBitmapIsEmpty)
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = open(to_path, O_RDWR | O_CREAT | PG_BINARY, FILE_PERMISSION);
+	if (out < 0)
 	{
-		/*
-		 * There are no changed blocks since last backup. We want make
-		 * incremental backup, so we should exit.
-		 */
-		elog(VERBOSE, "Skipping the file because it didn`t changed: %s", file->path);
-		return false;
+		int errno_tmp = errno;
+		close(in);
+		elog(ERROR, "cannot open restore target file \"%s\": %s",
+			 to_path, strerror(errno_tmp));
 	}
 
-	/* reset size summary */
-	file->read_size = 0;
-	file->write_size = 0;
-	INIT_CRC32C(file->crc);
+	if (fstat(out, &st) != 0)
+		elog(ERROR, "cannot stat \"%s\": %s", to_path, strerror(errno));
+	file_size = st.st_size;
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+	/* Every part preallocates its blocks of the file */
+	nblocks = (file->size + BLCKSZ - 1) / BLCKSZ;
+	if (nblocks > part->start)
+		restore_preallocate(out, part->start,
+							Min(nblocks, part->end) - part->start, to_path);
+	restore_writer_init(&writer, out, to_path, true);
+
+	for (i = 0; i < split->nentries; i++)
 	{
-		FIN_CRC32C(file->crc);
+		BackupIndexEntry *entry = &split->index[i];
+		BlockNumber	blknum = entry->block;
 
-		/*
-		 * If file is not found, this is not en error.
-		 * It could have been deleted by concurrent postgres transaction.
-		 */
-		if (errno == ENOENT)
+		/* Truncation is applied to the whole file at the end */
+		if (entry->compressed_size == PageIsTruncated ||
+			blknum < part->start || blknum >= part->end)
+			continue;
+
+		if (interrupted)
+			elog(ERROR, "interrupted during restore database");
+
+		/* Zeroed page is left as a hole */
+		if (entry->compressed_size == PageIsZeroed)
 		{
-			elog(LOG, "File \"%s\" is not found", file->path);
-			return false;
+			if ((off_t) blknum * BLCKSZ >= file_size)
+				zeroed_size = Max(zeroed_size, (off_t) (blknum + 1) * BLCKSZ);
+			restore_writer_zeroed(&writer, blknum);
+			continue;
 		}
 
-		elog(ERROR, "cannot open file \"%s\": %s",
-			 file->path, strerror(errno));
+		if (!read_backup_record(file, in, entry, buf) ||
+			!decode_backup_record(file, entry, payload,
+								  restore_writer_slot(&writer, blknum)))
+			elog(ERROR, "cannot restore block %u of \"%s\"",
+				 blknum, file->path);
+		file_size = Max(file_size, (off_t) (blknum + 1) * BLCKSZ);
 	}
+	restore_writer_flush(&writer);
+	close(in);
 
-	if (file->size % BLCKSZ != 0)
+	pthread_mutex_lock(&split->mutex);
+	split->zeroed_size = Max(split->zeroed_size, zeroed_size);
+	last = (++split->ndone == split->nparts);
+	pthread_mutex_unlock(&split->mutex);
+
+	if (!last)
 	{
-		fclose(in);
-		elog(ERROR, "File: %s, invalid file size %lu", file->path, file->size);
+		if (close(out) != 0)
+			elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+		return;
 	}
 
-	/*
-	 * Compute expected number of blocks in the file.
-	 * NOTE This is a normal situation, if the file size has changed
-	 * since the moment we computed it.
-	 */
-	nblocks = file->size/BLCKSZ;
+	/* Extend the file to cover trailing zeroed pages without writing them */
+	if (fstat(out, &st) != 0)
+		elog(ERROR, "cannot stat \"%s\": %s", to_path, strerror(errno));
+	if (split->zeroed_size > st.st_size &&
+		ftruncate(out, split->zeroed_size) != 0)
+		elog(ERROR, "cannot extend \"%s\": %s", to_path, strerror(errno));
 
-	/* open backup file for write  */
-	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "w");
-	if (out == NULL)
+	for (i = 0; i < split->nentries; i++)
+		if (split->index[i].compressed_size == PageIsTruncated)
+			truncate_blkno = Min(truncate_blkno, split->index[i].block);
+
+	if (truncate_blkno != InvalidBlockNumber)
+	{
+		if (ftruncate(out, (off_t) truncate_blkno * BLCKSZ) != 0)
+			elog(ERROR, "cannot truncate \"%s\": %s",
+				 to_path, strerror(errno));
+		elog(VERBOSE, "truncate file %s to block %u", file->path, truncate_blkno);
+	}
+
+	/* update file permission */
+	if (chmod(to_path, file->mode) == -1)
 	{
 		int errno_tmp = errno;
-		fclose(in);
-		elog(ERROR, "cannot open backup file \"%s\": %s",
-			 to_path, strerror(errno_tmp));
+
+		close(out);
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno_tmp));
+	}
+
+	if (!sync_written_file(out, to_path) || close(out) != 0)
+		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+}
+
+/*
+ * Newest record of a block restored by restore_data_file_chain(), version
+ * is -1 if the block has none.
+ */
+typedef struct ChainBlock
+{
+	int			version;
+	BackupIndexEntry entry;
+} ChainBlock;
+
+/*
+ * Find the newest record of every block [start, end) of a datafile backed
+ * up by a chain of backups, without reading any page. versions are the file
+ * as backed up by backups of the chain which have it, oldest first. Their
+ * indexes are replayed the way restore_data_file() applies records of one
+ * backup after another, truncations included.
+ *
+ * *blocks is set to an array of *nblocks entries for blocks starting at
+ * start, *size to the size of the file restored from the chain in blocks.
+ * Returns false if a version has no index.
+ */
+static bool
+plan_data_file_chain(int nversions, pgFile **versions, BlockNumber start,
+					 BlockNumber end, ChainBlock **blocks_p,
+					 BlockNumber *nblocks_p, BlockNumber *size_p)
+{
+	ChainBlock *blocks = NULL;
+	BlockNumber	nallocated = 0;
+	BlockNumber	nblocks = 0;	/* blocks of the range having records */
+	BlockNumber	size = 0;
+	BlockNumber	blknum;
+	int			v;
+
+	for (v = 0; v < nversions; v++)
+	{
+		BackupIndexEntry *index;
+		uint32		nentries;
+		BlockNumber	truncate_blkno = InvalidBlockNumber;
+		uint32		i;
+
+		index = read_backup_index(versions[v], &nentries);
+		if (index == NULL)
+		{
+			free(blocks);
+			return false;
+		}
+
+		/* Later record of the block wins, as it is applied later */
+		for (i = 0; i < nentries; i++)
+		{
+			BackupIndexEntry *entry = &index[i];
+
+			blknum = entry->block;
+			if (entry->compressed_size == PageIsTruncated)
+			{
+				truncate_blkno = Min(truncate_blkno, blknum);
+				continue;
+			}
+
+			size = Max(size, blknum + 1);
+			if (blknum < start || blknum >= end)
+				continue;
+
+			if (blknum - start >= nallocated)
+			{
+				BlockNumber	n = Max(nallocated * 2, blknum - start + 1);
+
+				blocks = pgut_realloc(blocks, n * sizeof(ChainBlock));
+				for (; nallocated < n; nallocated++)
+					blocks[nallocated].version = -1;
+			}
+			blocks[blknum - start].version = v;
+			blocks[blknum - start].entry = *entry;
+			nblocks = Max(nblocks, blknum - start + 1);
+		}
+		free(index);
+
+		/* Truncation is applied after all records of the backup */
+		if (truncate_blkno != InvalidBlockNumber)
+		{
+			size = truncate_blkno;
+			for (blknum = Max(truncate_blkno, start);
+				 blknum - start < nblocks; blknum++)
+				blocks[blknum - start].version = -1;
+			nblocks = (truncate_blkno > start) ?
+				Min(nblocks, truncate_blkno - start) : 0;
+		}
+	}
+
+	*blocks_p = blocks;
+	*nblocks_p = nblocks;
+	*size_p = size;
+	return true;
+}
+
+/*
+ * Read the page of the block planned by plan_data_file_chain() from the
+ * version holding it. fds are descriptors of versions opened so far.
+ */
+static void
+read_chain_block(pgFile **versions, int *fds, ChainBlock *block,
+				 BlockNumber blknum, char *page)
+{
+	char		buf[sizeof(BackupPageHeader) + BLCKSZ];
+	char	   *payload = buf + sizeof(BackupPageHeader);
+	int			v = block->version;
+
+	if (fds[v] < 0)
+	{
+		fds[v] = open(versions[v]->path, O_RDONLY | PG_BINARY, 0);
+		if (fds[v] < 0)
+			elog(ERROR, "cannot open backup file \"%s\": %s",
+				 versions[v]->path, strerror(errno));
 	}
 
+	if (!read_backup_record(versions[v], fds[v], &block->entry, buf) ||
+		!decode_backup_record(versions[v], &block->entry, payload, page))
+		elog(ERROR, "cannot restore block %u of \"%s\"",
+			 blknum, versions[v]->path);
+}
+
+/*
+ * Restore blocks [start, end) of a datafile from a chain of backups at once.
+ * versions are the file as backed up by backups of the chain which have it,
+ * oldest first, and roots are database directories of these backups.
+ *
+ * The newest record of every block and the final size of the file are found
+ * by plan_data_file_chain(), then every block is read from the backup
+ * holding its newest record and written once. The blocks are preallocated,
+ * and zeroed ones and blocks without records are left as holes. Parts of a
+ * split file compute the same size of the file, each of them sets it.
+ *
+ * Returns false without writing anything if a version has no index, the
+ * caller restores the file version by version then.
+ */
+bool
+restore_data_file_chain(int nversions, pgFile **versions, char **roots,
+						const char *to_root, BlockNumber start, BlockNumber end)
+{
+	pgFile	   *newest = versions[nversions - 1];
+	char		to_path[MAXPGPATH];
+	RestoreWriter writer;
+	ChainBlock *blocks;
+	BlockNumber	nblocks;
+	BlockNumber	size;
+	BlockNumber	blknum;
+	int		   *fds;
+	bool		preallocated = false;
+	int			out;
+	int			v;
+
+	if (!plan_data_file_chain(nversions, versions, start, end,
+							  &blocks, &nblocks, &size))
+		return false;
+
+	join_path_components(to_path, to_root,
+						 newest->path + strlen(roots[nversions - 1]) + 1);
+	out = open(to_path, O_WRONLY | O_CREAT | PG_BINARY, FILE_PERMISSION);
+	if (out < 0)
+		elog(ERROR, "cannot open restore target file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	/* Blocks of other parts are written within the same size */
+	if (ftruncate(out, (off_t) size * BLCKSZ) != 0)
+		elog(ERROR, "cannot extend \"%s\": %s", to_path, strerror(errno));
+
 	/*
-	 * Read each page, verify checksum and write it to backup.
-	 * If page map is empty backup all pages of the relation.
+	 * The file is new, so blocks not written are holes, unless they were
+	 * preallocated: holes are punched in them then.
 	 */
-	if (file->pagemap.bitmapsize == PageBitmapIsEmpty
-		|| file->pagemap.bitmapsize == PageBitmapIsAbsent)
+	end = Min(end, size);
+	if (end > start)
+		preallocated = restore_preallocate(out, start, end - start, to_path);
+	restore_writer_init(&writer, out, to_path, true);
+
+	fds = pgut_malloc(nversions * sizeof(int));
+	for (v = 0; v < nversions; v++)
+		fds[v] = -1;
+
+	for (blknum = start; blknum < end; blknum++)
 	{
-		for (blknum = 0; blknum < nblocks; blknum++)
+		ChainBlock *block = (blknum - start < nblocks) ?
+			&blocks[blknum - start] : NULL;
+
+		if (block == NULL || block->version < 0 ||
+			block->entry.compressed_size == PageIsZeroed)
 		{
-			backup_data_page(arguments, file, prev_backup_start_lsn, blknum,
-							 nblocks, in, out, &(file->crc),
-							 &n_blocks_skipped, backup_mode);
-			n_blocks_read++;
+			if (preallocated)
+				restore_writer_zeroed(&writer, blknum);
+			continue;
 		}
+
+		if (interrupted)
+			elog(ERROR, "interrupted during restore database");
+
+		read_chain_block(versions, fds, block, blknum,
+						 restore_writer_slot(&writer, blknum));
 	}
-	/* If page map is not empty we scan only changed blocks, */
-	else
+	restore_writer_flush(&writer);
+
+	for (v = 0; v < nversions; v++)
+		if (fds[v] >= 0)
+			close(fds[v]);
+	free(fds);
+	free(blocks);
+
+	/* update file permission */
+	if (chmod(to_path, newest->mode) == -1)
+	{
+		int errno_tmp = errno;
+
+		close(out);
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno_tmp));
+	}
+
+	if (!sync_written_file(out, to_path) || close(out) != 0)
+		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+
+	return true;
+}
+
+/*
+ * Write a datafile of a chain of backups the way a full backup stores it.
+ * versions are the file as backed up by backups of the chain which have it,
+ * oldest first. The newest record of every block is found by
+ * plan_data_file_chain(), its page is decoded and stored again, compressed
+ * with compress_alg. Blocks without records are stored as zeroed pages.
+ * The file and its index are written to to_file->path, and to_file gets
+ * size, CRC and compression of the written file.
+ *
+ * Returns false without writing anything if a version has no index.
+ */
+bool
+merge_data_file(int nversions, pgFile **versions, pgFile *to_file)
+{
+	ChainBlock *blocks;
+	BlockNumber	nblocks;
+	BlockNumber	size;
+	BlockNumber	blknum;
+	BackupIndexEntry *index;
+	DataPage	page;
+	DataPage	compressed_page;
+	pg_crc32	crc;
+	uint64		offset = 0;
+	FILE	   *out;
+	int		   *fds;
+	int			v;
+
+	if (!plan_data_file_chain(nversions, versions, 0, InvalidBlockNumber,
+							  &blocks, &nblocks, &size))
+		return false;
+
+	out = fopen(to_file->path, PG_BINARY_W);
+	if (out == NULL)
+		elog(ERROR, "cannot open merged file \"%s\": %s",
+			 to_file->path, strerror(errno));
+
+	index = pgut_malloc(Max(size, 1) * sizeof(BackupIndexEntry));
+	fds = pgut_malloc(nversions * sizeof(int));
+	for (v = 0; v < nversions; v++)
+		fds[v] = -1;
+
+	to_file->compress_alg = NOT_DEFINED_COMPRESS;
+	INIT_CRC32C(crc);
+
+	for (blknum = 0; blknum < size; blknum++)
 	{
-		datapagemap_iterator_t *iter;
-		iter = datapagemap_iterate(&file->pagemap);
-		while (datapagemap_next(iter, &blknum))
+		ChainBlock *block = (blknum < nblocks) ? &blocks[blknum] : NULL;
+		BackupIndexEntry *entry = &index[blknum];
+		BackupPageHeader header;
+		char	   *payload = NULL;
+		size_t		payload_len = 0;
+
+		if (interrupted)
+			elog(ERROR, "interrupted during merge");
+
+		header.block = blknum;
+		header.compressed_size = PageIsZeroed;
+
+		if (block != NULL && block->version >= 0 &&
+			block->entry.compressed_size != PageIsZeroed)
 		{
-			backup_data_page(arguments, file, prev_backup_start_lsn, blknum,
-							 nblocks, in, out, &(file->crc),
-							 &n_blocks_skipped, backup_mode);
-			n_blocks_read++;
+			read_chain_block(versions, fds, block, blknum, page.data);
+
+			if (!page_is_zeroed(page.data))
+			{
+				header.compressed_size = do_compress(compressed_page.data,
+													 BLCKSZ, page.data, BLCKSZ,
+													 compress_alg);
+
+				/* The page compression failed. Write it as is. */
+				if (header.compressed_size <= 0 ||
+					header.compressed_size >= BLCKSZ)
+				{
+					header.compressed_size = BLCKSZ;
+					payload = page.data;
+				}
+				else
+				{
+					MemSet(compressed_page.data + header.compressed_size, 0,
+						   MAXALIGN(header.compressed_size) -
+						   header.compressed_size);
+					payload = compressed_page.data;
+					to_file->compress_alg = compress_alg;
+				}
+				payload_len = BackupRecordPayloadSize(header.compressed_size);
+			}
 		}
 
-		pg_free(file->pagemap.bitmap);
-		pg_free(iter);
+		entry->offset = offset;
+		entry->block = blknum;
+		entry->compressed_size = header.compressed_size;
+		entry->reserved = 0;
+		INIT_CRC32C(entry->crc);
+		COMP_CRC32C(entry->crc, &header, sizeof(header));
+		if (payload_len > 0)
+			COMP_CRC32C(entry->crc, payload, payload_len);
+		FIN_CRC32C(entry->crc);
+
+		COMP_CRC32C(crc, &header, sizeof(header));
+		if (payload_len > 0)
+			COMP_CRC32C(crc, payload, payload_len);
+
+		if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+			(payload_len > 0 &&
+			 fwrite(payload, 1, payload_len, out) != payload_len))
+			elog(ERROR, "cannot write block %u of \"%s\": %s",
+				 blknum, to_file->path, strerror(errno));
+
+		offset += sizeof(header) + payload_len;
 	}
+	FIN_CRC32C(crc);
 
-	/* update file permission */
-	if (chmod(to_path, FILE_PERMISSION) == -1)
-	{
-		int errno_tmp = errno;
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
-			 strerror(errno_tmp));
-	}
+	for (v = 0; v < nversions; v++)
+		if (fds[v] >= 0)
+			close(fds[v]);
+	free(fds);
+	free(blocks);
 
 	if (fflush(out) != 0 ||
-		fsync(fileno(out)) != 0 ||
+		!sync_written_file(fileno(out), to_file->path) ||
 		fclose(out))
-		elog(ERROR, "cannot write backup file \"%s\": %s",
-			 to_path, strerror(errno));
-	fclose(in);
+		elog(ERROR, "cannot write \"%s\": %s", to_file->path, strerror(errno));
 
-	FIN_CRC32C(file->crc);
+	write_backup_index_file(to_file->path, index, size);
+	free(index);
 
-	/*
-	 * If we have pagemap then file in the backup can't be a zero size.
-	 * Otherwise, we will clear the last file.
-	 */
-	if (n_blocks_read != 0 && n_blocks_read == n_blocks_skipped)
-	{
-		if (remove(to_path) == -1)
-			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
-				 strerror(errno));
-		return false;
-	}
+	to_file->read_size = (size_t) size * BLCKSZ;
+	to_file->write_size = offset;
+	to_file->crc = crc;
 
 	return true;
 }
 
 /*
- * Restore files in the from_root directory to the to_root directory with
- * same relative path.
+ * Copy the whole file in to out inside the kernel. Extents of the file are
+ * cloned if the file system supports it (FICLONE on XFS and btrfs),
+ * otherwise the data is copied by copy_file_range() without passing through
+ * userspace. Returns false if neither is supported for these files and
+ * nothing was copied: caller copies the file through a buffer then.
+ * Otherwise *copied is set to number of bytes copied, or to -1 on error
+ * with errno set.
  */
-void
-restore_data_file(const char *from_root,
-				  const char *to_root,
-				  pgFile *file,
-				  pgBackup *backup)
+static bool
+copy_file_in_kernel(int in, int out, off_t *copied)
 {
-	char				to_path[MAXPGPATH];
-	FILE			   *in;
-	FILE			   *out;
-	BackupPageHeader	header;
-	BlockNumber			blknum;
+	*copied = 0;
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
 	{
-		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
-			 strerror(errno));
-	}
+		struct stat	st;
 
-	/*
-	 * Open backup file for write. 	We use "r+" at first to overwrite only
-	 * modified pages for differential restore. If the file does not exist,
-	 * re-open it with "w" to create an empty file.
-	 */
-	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "r+");
-	if (out == NULL && errno == ENOENT)
-		out = fopen(to_path, "w");
-	if (out == NULL)
-	{
-		int errno_tmp = errno;
-		fclose(in);
-		elog(ERROR, "cannot open restore target file \"%s\": %s",
-			 to_path, strerror(errno_tmp));
+		*copied = (fstat(out, &st) == 0) ? st.st_size : -1;
+		if (*copied > 0)
+			throttle_acquire(backup_throttle, *copied, 1);
+		return true;
 	}
+#endif
 
-	for (blknum = 0; ; blknum++)
+#ifdef __NR_copy_file_range
+	for (;;)
 	{
-		size_t		read_len;
-		DataPage	compressed_page; /* used as read buffer */
-		DataPage	page;
+		ssize_t		rc;
 
-		/* read BackupPageHeader */
-		read_len = fread(&header, 1, sizeof(header), in);
-		if (read_len != sizeof(header))
+		rc = syscall(__NR_copy_file_range, in, NULL, out, NULL,
+					 COPY_RANGE_CHUNK, 0);
+		if (rc < 0)
 		{
-			int errno_tmp = errno;
-			if (read_len == 0 && feof(in))
-				break;		/* EOF found */
-			else if (read_len != 0 && feof(in))
-				elog(ERROR,
-					 "odd size page found at block %u of \"%s\"",
-					 blknum, file->path);
-			else
-				elog(ERROR, "cannot read header of block %u of \"%s\": %s",
-					 blknum, file->path, strerror(errno_tmp));
+			if (errno == EINTR)
+				continue;
+			/* Different file systems, or not supported by this one */
+			if (*copied == 0 &&
+				(errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+				 errno == EINVAL || errno == EBADF))
+				return false;
+			*copied = -1;
+			return true;
 		}
+		/* EOF */
+		if (rc == 0)
+			return true;
+		/* Charge what was actually copied, the last chunk is short */
+		throttle_acquire(backup_throttle, rc, 1);
+		*copied += rc;
+	}
+#else
+	return false;
+#endif
+}
 
-		if (header.block < blknum)
-			elog(ERROR, "backup is broken at file->path %s block %u",file->path, blknum);
+/*
+ * Compute CRC of the first size bytes of the file copied inside the kernel.
+ * The file is mapped to memory, so the data is taken from the page cache
+ * when it is there.
+ */
+static void
+calc_copied_file_crc(const char *path, off_t size, pg_crc32 *crc)
+{
+	int			fd;
+	void	   *map;
 
-		if (header.compressed_size == PageIsTruncated)
-		{
-			/*
-			 * Backup contains information that this block was truncated.
-			 * Truncate file to this length.
-			 */
-			ftruncate(fileno(out), header.block * BLCKSZ);
-			elog(VERBOSE, "truncate file %s to block %u", file->path, header.block);
-			break;
-		}
+	if (size == 0)
+		return;
 
-		Assert(header.compressed_size <= BLCKSZ);
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		elog(ERROR, "cannot open \"%s\": %s", path, strerror(errno));
 
-		read_len = fread(compressed_page.data, 1,
-			MAXALIGN(header.compressed_size), in);
-		if (read_len != MAXALIGN(header.compressed_size))
-			elog(ERROR, "cannot read block %u of \"%s\" read %lu of %d",
-				blknum, file->path, read_len, header.compressed_size);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		elog(ERROR, "cannot map \"%s\": %s", path, strerror(errno));
 
-		if (header.compressed_size != BLCKSZ)
-		{
-			size_t uncompressed_size = 0;
+	COMP_CRC32C(*crc, map, size);
 
-			uncompressed_size = do_decompress(page.data, BLCKSZ,
-											compressed_page.data,
-											header.compressed_size, file->compress_alg);
+	munmap(map, size);
+	close(fd);
+}
 
-			if (uncompressed_size != BLCKSZ)
-				elog(ERROR, "page uncompressed to %ld bytes. != BLCKSZ", uncompressed_size);
-		}
+/*
+ * Copy contents of the file keeping reads and writes in flight. Chunks are
+ * read ahead into the ring, CRC is computed in file order as reads complete,
+ * and each chunk is written from its slot, which is reused once the write
+ * completes. Reads beyond the first short one are ignored, so the file is
+ * copied up to the end seen by the first read reaching it.
+ */
+static void
+copy_file_async(AioThreadState *aio, CacheGuard *cache, pgFile *file,
+				int in, int out, const char *to_path, pg_crc32 *crc)
+{
+	int			depth = aio_depth(aio->ctx);
+	off_t		offset = 0;		/* offset of the next read */
+	int			head = 0;
+	int			nreads = 0;
+	bool		eof = false;
+	int			i;
 
-		/*
-		 * Seek and write the restored page.
-		 */
-		blknum = header.block;
-		if (fseek(out, blknum * BLCKSZ, SEEK_SET) < 0)
-			elog(ERROR, "cannot seek block %u of \"%s\": %s",
-				 blknum, to_path, strerror(errno));
+	for (;;)
+	{
+		aio_request *req;
 
-		if (header.compressed_size < BLCKSZ)
+		while (!eof && nreads < depth)
 		{
-			if (fwrite(page.data, 1, BLCKSZ, out) != BLCKSZ)
-				elog(ERROR, "cannot write block %u of \"%s\": %s",
-					blknum, file->path, strerror(errno));
+			int			slot = (head + nreads) % depth;
+
+			req = &aio->reqs[slot];
+			aio_wait_slot(aio, req, to_path);
+			throttle_acquire(backup_throttle, AIO_SLOT_SIZE, 1);
+			aio_read(aio->ctx, req, in, aio->ring + (size_t) slot * AIO_SLOT_SIZE,
+					 AIO_SLOT_SIZE, offset);
+			offset += AIO_SLOT_SIZE;
+			nreads++;
 		}
-		else
+
+		if (nreads == 0)
+			break;
+
+		req = &aio->reqs[head];
+		aio_wait(aio->ctx, req);
+		if (req->result < 0)
+			elog(ERROR, "cannot read backup mode file \"%s\": %s",
+				 file->path, strerror(-req->result));
+
+		if (!eof)
 		{
-			/* if page wasn't compressed, we've read full block */
-			if (fwrite(compressed_page.data, 1, BLCKSZ, out) != BLCKSZ)
-				elog(ERROR, "cannot write block %u of \"%s\": %s",
-					blknum, file->path, strerror(errno));
+			eof = (req->result < (ssize_t) req->len);
+			if (req->result > 0)
+			{
+				/* update CRC */
+				COMP_CRC32C(*crc, req->buf, req->result);
+				file->read_size += req->result;
+				cache_guard_drop(cache, req->offset, req->result);
+				aio_write(aio->ctx, req, out, req->buf, req->result,
+						  req->offset);
+			}
 		}
-	}
-
-	/* update file permission */
-	if (chmod(to_path, file->mode) == -1)
-	{
-		int errno_tmp = errno;
 
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
-			 strerror(errno_tmp));
+		head = (head + 1) % depth;
+		nreads--;
 	}
 
-	if (fflush(out) != 0 ||
-		fsync(fileno(out)) != 0 ||
-		fclose(out))
-		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
-	fclose(in);
+	for (i = 0; i < depth; i++)
+		aio_wait_slot(aio, &aio->reqs[i], to_path);
 }
 
 /*
@@ -684,6 +4254,9 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	char		buf[BLCKSZ];
 	struct stat	st;
 	pg_crc32	crc;
+	AioThreadState *aio;
+	CacheGuard	cache;
+	off_t		copied;
 
 	INIT_CRC32C(crc);
 
@@ -726,54 +4299,83 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 			 strerror(errno));
 	}
 
+	cache_guard_init(&cache, fileno(in), st.st_size);
+
 	/* copy content and calc CRC */
-	for (;;)
+	aio = get_aio_state();
+	if (copy_file_in_kernel(fileno(in), fileno(out), &copied))
 	{
-		read_len = 0;
-
-		if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
-			break;
-
-		if (fwrite(buf, 1, read_len, out) != read_len)
+		if (copied < 0)
 		{
 			errno_tmp = errno;
-			/* oops */
 			fclose(in);
 			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
+			elog(ERROR, "cannot copy \"%s\" to \"%s\": %s", file->path,
+				 to_path, strerror(errno_tmp));
 		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
-
-		file->read_size += read_len;
+		calc_copied_file_crc(to_path, copied, &crc);
+		file->read_size = copied;
+		cache_guard_drop(&cache, 0, copied);
 	}
-
-	errno_tmp = errno;
-	if (!feof(in))
+	else if (aio_is_async(aio->ctx))
+		copy_file_async(aio, &cache, file, fileno(in), fileno(out), to_path,
+						&crc);
+	else
 	{
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot read backup mode file \"%s\": %s",
-			 file->path, strerror(errno_tmp));
-	}
+		for (;;)
+		{
+			read_len = 0;
 
-	/* copy odd part. */
-	if (read_len > 0)
-	{
-		if (fwrite(buf, 1, read_len, out) != read_len)
+			throttle_acquire(backup_throttle, sizeof(buf), 1);
+			if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
+				break;
+
+			if (fwrite(buf, 1, read_len, out) != read_len)
+			{
+				errno_tmp = errno;
+				/* oops */
+				fclose(in);
+				fclose(out);
+				elog(ERROR, "cannot write to \"%s\": %s", to_path,
+					 strerror(errno_tmp));
+			}
+			/* update CRC */
+			COMP_CRC32C(crc, buf, read_len);
+
+			file->read_size += read_len;
+
+			if (file->read_size % COPY_CACHE_DROP_SIZE == 0)
+				cache_guard_drop(&cache,
+								 file->read_size - COPY_CACHE_DROP_SIZE,
+								 COPY_CACHE_DROP_SIZE);
+		}
+
+		errno_tmp = errno;
+		if (!feof(in))
 		{
-			errno_tmp = errno;
-			/* oops */
 			fclose(in);
 			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
+			elog(ERROR, "cannot read backup mode file \"%s\": %s",
+				 file->path, strerror(errno_tmp));
 		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
 
-		file->read_size += read_len;
+		/* copy odd part. */
+		if (read_len > 0)
+		{
+			if (fwrite(buf, 1, read_len, out) != read_len)
+			{
+				errno_tmp = errno;
+				/* oops */
+				fclose(in);
+				fclose(out);
+				elog(ERROR, "cannot write to \"%s\": %s", to_path,
+					 strerror(errno_tmp));
+			}
+			/* update CRC */
+			COMP_CRC32C(crc, buf, read_len);
+
+			file->read_size += read_len;
+		}
 	}
 
 	file->write_size = file->read_size;
@@ -792,9 +4394,11 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	}
 
 	if (fflush(out) != 0 ||
-		fsync(fileno(out)) != 0 ||
-		fclose(out))
+		!sync_written_file(fileno(out), to_path))
+		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+	if (fclose(out))
 		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+	cache_guard_release(&cache, file->read_size);
 	fclose(in);
 
 	return true;
@@ -856,6 +4460,8 @@ push_wal_file(const char *from_path, const char *to_path, bool is_compress,
 	const char *to_path_p = to_path;
 	char		to_path_temp[MAXPGPATH];
 	int			errno_temp;
+	off_t		copied;
+	size_t		written = 0;	/* bytes written since writeback started */
 
 #ifdef HAVE_LIBZ
 	char		gz_to_path[MAXPGPATH];
@@ -900,50 +4506,78 @@ push_wal_file(const char *from_path, const char *to_path, bool is_compress,
 				 to_path_temp, strerror(errno));
 	}
 
-	/* copy content */
-	for (;;)
+	/* copy content, inside the kernel if it is not compressed */
+	if (!is_compress && copy_file_in_kernel(fileno(in), fileno(out), &copied))
 	{
-		size_t		read_len = 0;
-
-		read_len = fread(buf, 1, sizeof(buf), in);
-
-		if (ferror(in))
+		if (copied < 0)
 		{
 			errno_temp = errno;
 			unlink(to_path_temp);
-			elog(ERROR,
-				 "Cannot read source WAL file \"%s\": %s",
-				 from_path, strerror(errno_temp));
+			elog(ERROR, "Cannot copy WAL file \"%s\" to \"%s\": %s",
+				 from_path, to_path_temp, strerror(errno_temp));
 		}
-
-		if (read_len > 0)
+	}
+	else
+	{
+		for (;;)
 		{
-#ifdef HAVE_LIBZ
-			if (is_compress)
+			size_t		read_len = 0;
+
+			read_len = fread(buf, 1, sizeof(buf), in);
+
+			if (ferror(in))
+			{
+				errno_temp = errno;
+				unlink(to_path_temp);
+				elog(ERROR,
+					 "Cannot read source WAL file \"%s\": %s",
+					 from_path, strerror(errno_temp));
+			}
+
+			if (read_len > 0)
 			{
-				if (gzwrite(gz_out, buf, read_len) != read_len)
+#ifdef HAVE_LIBZ
+				if (is_compress)
 				{
-					errno_temp = errno;
-					unlink(to_path_temp);
-					elog(ERROR, "Cannot write to compressed WAL file \"%s\": %s",
-						 to_path_temp, get_gz_error(gz_out, errno_temp));
+					if (gzwrite(gz_out, buf, read_len) != read_len)
+					{
+						errno_temp = errno;
+						unlink(to_path_temp);
+						elog(ERROR, "Cannot write to compressed WAL file \"%s\": %s",
+							 to_path_temp, get_gz_error(gz_out, errno_temp));
+					}
 				}
-			}
-			else
+				else
 #endif
-			{
-				if (fwrite(buf, 1, read_len, out) != read_len)
 				{
-					errno_temp = errno;
-					unlink(to_path_temp);
-					elog(ERROR, "Cannot write to WAL file \"%s\": %s",
-						 to_path_temp, strerror(errno_temp));
+					if (fwrite(buf, 1, read_len, out) != read_len)
+					{
+						errno_temp = errno;
+						unlink(to_path_temp);
+						elog(ERROR, "Cannot write to WAL file \"%s\": %s",
+							 to_path_temp, strerror(errno_temp));
+					}
+
+					/* Start writeback early, leaving less for fsync() */
+					written += read_len;
+					if (written >= WAL_WRITEBACK_SIZE)
+					{
+						if (fflush(out) != 0)
+						{
+							errno_temp = errno;
+							unlink(to_path_temp);
+							elog(ERROR, "Cannot write to WAL file \"%s\": %s",
+								 to_path_temp, strerror(errno_temp));
+						}
+						fsync_start_writeback(fileno(out));
+						written = 0;
+					}
 				}
 			}
-		}
 
-		if (feof(in) || read_len == 0)
-			break;
+			if (feof(in) || read_len == 0)
+				break;
+		}
 	}
 
 #ifdef HAVE_LIBZ
@@ -1009,6 +4643,8 @@ get_wal_file(const char *from_path, const char *to_path)
 	char		to_path_temp[MAXPGPATH];
 	int			errno_temp;
 	bool		is_decompress = false;
+	off_t		copied;
+	size_t		written = 0;	/* bytes written since writeback started */
 
 #ifdef HAVE_LIBZ
 	char		gz_from_path[MAXPGPATH];
@@ -1058,59 +4694,87 @@ get_wal_file(const char *from_path, const char *to_path)
 		elog(ERROR, "Cannot open destination WAL file \"%s\": %s",
 			 to_path_temp, strerror(errno));
 
-	/* copy content */
-	for (;;)
+	/* copy content, inside the kernel if it is not compressed */
+	if (!is_decompress && copy_file_in_kernel(fileno(in), fileno(out), &copied))
+	{
+		if (copied < 0)
+		{
+			errno_temp = errno;
+			unlink(to_path_temp);
+			elog(ERROR, "Cannot copy WAL file \"%s\" to \"%s\": %s",
+				 from_path, to_path_temp, strerror(errno_temp));
+		}
+	}
+	else
 	{
-		size_t		read_len = 0;
+		for (;;)
+		{
+			size_t		read_len = 0;
 
 #ifdef HAVE_LIBZ
-		if (is_decompress)
-		{
-			read_len = gzread(gz_in, buf, sizeof(buf));
-			if (read_len != sizeof(buf) && !gzeof(gz_in))
+			if (is_decompress)
 			{
-				errno_temp = errno;
-				unlink(to_path_temp);
-				elog(ERROR, "Cannot read compressed WAL file \"%s\": %s",
-					 gz_from_path, get_gz_error(gz_in, errno_temp));
+				read_len = gzread(gz_in, buf, sizeof(buf));
+				if (read_len != sizeof(buf) && !gzeof(gz_in))
+				{
+					errno_temp = errno;
+					unlink(to_path_temp);
+					elog(ERROR, "Cannot read compressed WAL file \"%s\": %s",
+						 gz_from_path, get_gz_error(gz_in, errno_temp));
+				}
 			}
-		}
-		else
+			else
 #endif
-		{
-			read_len = fread(buf, 1, sizeof(buf), in);
-			if (ferror(in))
 			{
-				errno_temp = errno;
-				unlink(to_path_temp);
-				elog(ERROR, "Cannot read source WAL file \"%s\": %s",
-					 from_path, strerror(errno_temp));
+				read_len = fread(buf, 1, sizeof(buf), in);
+				if (ferror(in))
+				{
+					errno_temp = errno;
+					unlink(to_path_temp);
+					elog(ERROR, "Cannot read source WAL file \"%s\": %s",
+						 from_path, strerror(errno_temp));
+				}
 			}
-		}
 
-		if (read_len > 0)
-		{
-			if (fwrite(buf, 1, read_len, out) != read_len)
+			if (read_len > 0)
 			{
-				errno_temp = errno;
-				unlink(to_path_temp);
-				elog(ERROR, "Cannot write to WAL file \"%s\": %s", to_path_temp,
-					 strerror(errno_temp));
+				if (fwrite(buf, 1, read_len, out) != read_len)
+				{
+					errno_temp = errno;
+					unlink(to_path_temp);
+					elog(ERROR, "Cannot write to WAL file \"%s\": %s", to_path_temp,
+						 strerror(errno_temp));
+				}
+
+				/* Start writeback early, leaving less for fsync() */
+				written += read_len;
+				if (written >= WAL_WRITEBACK_SIZE)
+				{
+					if (fflush(out) != 0)
+					{
+						errno_temp = errno;
+						unlink(to_path_temp);
+						elog(ERROR, "Cannot write to WAL file \"%s\": %s",
+							 to_path_temp, strerror(errno_temp));
+					}
+					fsync_start_writeback(fileno(out));
+					written = 0;
+				}
 			}
-		}
 
-		/* Check for EOF */
+			/* Check for EOF */
 #ifdef HAVE_LIBZ
-		if (is_decompress)
-		{
-			if (gzeof(gz_in) || read_len == 0)
-				break;
-		}
-		else
+			if (is_decompress)
+			{
+				if (gzeof(gz_in) || read_len == 0)
+					break;
+			}
+			else
 #endif
-		{
-			if (feof(in) || read_len == 0)
-				break;
+			{
+				if (feof(in) || read_len == 0)
+					break;
+			}
 		}
 	}
 
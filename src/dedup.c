@@ -0,0 +1,610 @@
+/*-------------------------------------------------------------------------
+ *
+ * dedup.c: page store of deduplicated backups.
+ *
+ * Backups taken with --dedup do not store pages in their datafiles.
+ * Every page is stored once per backup catalog instance in the page store,
+ * a directory of files named by SHA-256 hash of the page, and backup
+ * records refer to pages by hash. Pages which are identical in several
+ * backups, or several files, take space only once.
+ *
+ * An object of the store is a DedupPageHeader followed by the page,
+ * compressed the same way as in backup records. It is written to a
+ * temporary file and renamed, so objects are never seen half-written.
+ * Objects are synced with other files of the backup by deferred_fsync,
+ * before the backup is marked OK.
+ *
+ * Objects which are not referenced by any backup are removed by
+ * dedup_collect_garbage() after backups are deleted. References are not
+ * counted in the store: a counter would have to be updated for each page
+ * of each backup created or deleted, and could leak or, worse, drop
+ * objects in use when pg_probackup is interrupted in between. Instead
+ * references are collected from all backups of the catalog, and objects
+ * missing among them are removed. Backups and delete hold the catalog
+ * lock, so no backup adds references meanwhile.
+ *
+ * Portions Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEDUP_PAGE_MAGIC	0x47504250	/* "PBPG" */
+
+/* Objects are spread among subdirectories by the first byte of hash */
+#define DEDUP_SUBDIRS		256
+
+/* Length of object file name: the rest of hash in hex */
+#define DEDUP_NAME_LEN		((SHA256_DIGEST_LEN - 1) * 2)
+
+typedef struct DedupPageHeader
+{
+	uint32		magic;
+	int32		compressed_size;	/* BLCKSZ if the page is not compressed */
+	int32		compress_alg;
+	uint32		reserved;
+} DedupPageHeader;
+
+/* Array of page hashes, SHA256_DIGEST_LEN bytes each */
+typedef struct PageRefs
+{
+	uint8	   *hashes;
+	size_t		n;
+	size_t		size;
+} PageRefs;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void
+dedup_store_path(char *path, size_t len)
+{
+	snprintf(path, len, "%s/%s", backup_instance_path, DEDUP_DIR);
+}
+
+/* Was any deduplicated backup taken in this instance? */
+static bool
+dedup_store_exists(void)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	dedup_store_path(path, lengthof(path));
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Get path of the store object with the given hash.
+ */
+void
+dedup_page_path(char *path, size_t len, const uint8 *hash)
+{
+	char		name[DEDUP_NAME_LEN + 1];
+	int			i;
+
+	for (i = 1; i < SHA256_DIGEST_LEN; i++)
+	{
+		name[(i - 1) * 2] = hexdigits[hash[i] >> 4];
+		name[(i - 1) * 2 + 1] = hexdigits[hash[i] & 0x0F];
+	}
+	name[DEDUP_NAME_LEN] = '\0';
+
+	snprintf(path, len, "%s/%s/%02x/%s",
+			 backup_instance_path, DEDUP_DIR, hash[0], name);
+}
+
+static int
+hexvalue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Parse name of the object in subdirectory subdir into hash. Returns false
+ * if it is not a name of object.
+ */
+static bool
+dedup_parse_name(int subdir, const char *name, uint8 *hash)
+{
+	int			i;
+
+	if (strlen(name) != DEDUP_NAME_LEN)
+		return false;
+
+	hash[0] = (uint8) subdir;
+	for (i = 1; i < SHA256_DIGEST_LEN; i++)
+	{
+		int			hi = hexvalue(name[(i - 1) * 2]);
+		int			lo = hexvalue(name[(i - 1) * 2 + 1]);
+
+		if (hi < 0 || lo < 0)
+			return false;
+		hash[i] = (uint8) ((hi << 4) | lo);
+	}
+
+	return true;
+}
+
+/*
+ * Create directories of the page store, if they do not exist.
+ */
+void
+dedup_store_init(void)
+{
+	char		path[MAXPGPATH];
+	char		subdir[MAXPGPATH];
+	int			i;
+
+	dedup_store_path(path, lengthof(path));
+	if (mkdir(path, DIR_PERMISSION) != 0 && errno != EEXIST)
+		elog(ERROR, "cannot create directory \"%s\": %s",
+			 path, strerror(errno));
+
+	for (i = 0; i < DEDUP_SUBDIRS; i++)
+	{
+		snprintf(subdir, lengthof(subdir), "%s/%02x", path, i);
+		if (mkdir(subdir, DIR_PERMISSION) != 0 && errno != EEXIST)
+			elog(ERROR, "cannot create directory \"%s\": %s",
+				 subdir, strerror(errno));
+	}
+}
+
+/*
+ * Does the store have the page with the given hash? An object added by a
+ * backup which crashed before the store was synced may be empty or
+ * truncated: it is missing then, and dedup_put_page() replaces it.
+ */
+bool
+dedup_has_page(const uint8 *hash)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	dedup_page_path(path, lengthof(path), hash);
+	if (stat(path, &st) != 0)
+		return false;
+	return st.st_size > sizeof(DedupPageHeader) &&
+		st.st_size <= sizeof(DedupPageHeader) + BLCKSZ;
+}
+
+/*
+ * Add page with the given hash to the store. payload is the page compressed
+ * by compress_alg, or the page itself if size is BLCKSZ.
+ *
+ * Several threads may add the same page at once. Each of them writes its
+ * own temporary file, the last rename() wins.
+ */
+void
+dedup_put_page(const uint8 *hash, const char *payload, int32 size,
+			   CompressAlg compress_alg)
+{
+	char		path[MAXPGPATH];
+	char		tmp_path[MAXPGPATH];
+	DedupPageHeader header;
+	int			fd;
+
+	Assert(size > 0 && size <= BLCKSZ);
+
+	dedup_page_path(path, lengthof(path), hash);
+	snprintf(tmp_path, lengthof(tmp_path), "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		elog(ERROR, "cannot create page store file \"%s\": %s",
+			 tmp_path, strerror(errno));
+
+	header.magic = DEDUP_PAGE_MAGIC;
+	header.compressed_size = size;
+	header.compress_alg = compress_alg;
+	header.reserved = 0;
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+		write(fd, payload, size) != size)
+	{
+		int			errno_tmp = errno;
+
+		close(fd);
+		unlink(tmp_path);
+		elog(ERROR, "cannot write page store file \"%s\": %s",
+			 tmp_path, strerror(errno_tmp));
+	}
+
+	if (fchmod(fd, FILE_PERMISSION) != 0 ||
+		rename(tmp_path, path) != 0)
+	{
+		int			errno_tmp = errno;
+
+		close(fd);
+		unlink(tmp_path);
+		elog(ERROR, "cannot rename page store file \"%s\": %s",
+			 tmp_path, strerror(errno_tmp));
+	}
+
+	/* The object is synced at the end of backup with its directory */
+	if (deferred_fsync)
+		fsync_queue_add(deferred_fsync, fd, path);
+	else if (fsync(fd) != 0)
+		elog(ERROR, "cannot fsync page store file \"%s\": %s",
+			 path, strerror(errno));
+
+	if (close(fd) != 0)
+		elog(ERROR, "cannot close page store file \"%s\": %s",
+			 path, strerror(errno));
+}
+
+/*
+ * Read page with the given hash from the store into payload, which must
+ * have room for BLCKSZ bytes. The page is returned as it was passed to
+ * dedup_put_page(). Returns false, after reporting a WARNING, if the page
+ * is missing or can not be read.
+ */
+bool
+dedup_get_page(const uint8 *hash, char *payload, int32 *size,
+			   CompressAlg *compress_alg)
+{
+	char		path[MAXPGPATH];
+	DedupPageHeader header;
+	int			fd;
+	bool		result = false;
+
+	dedup_page_path(path, lengthof(path), hash);
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		elog(WARNING, "cannot open page store file \"%s\": %s",
+			 path, strerror(errno));
+		return false;
+	}
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+		header.magic != DEDUP_PAGE_MAGIC ||
+		header.compressed_size <= 0 || header.compressed_size > BLCKSZ)
+		elog(WARNING, "invalid header of page store file \"%s\"", path);
+	else if (read(fd, payload, header.compressed_size) != header.compressed_size)
+		elog(WARNING, "cannot read page store file \"%s\"", path);
+	else
+	{
+		*size = header.compressed_size;
+		*compress_alg = header.compress_alg;
+		result = true;
+	}
+
+	close(fd);
+	return result;
+}
+
+static int
+page_hash_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, SHA256_DIGEST_LEN);
+}
+
+/* Sort hashes and remove duplicates */
+static void
+page_refs_compact(PageRefs *refs)
+{
+	size_t		i;
+	size_t		n = 0;
+
+	if (refs->n == 0)
+		return;
+
+	qsort(refs->hashes, refs->n, SHA256_DIGEST_LEN, page_hash_cmp);
+
+	for (i = 1; i < refs->n; i++)
+	{
+		uint8	   *hash = refs->hashes + i * SHA256_DIGEST_LEN;
+
+		if (memcmp(refs->hashes + n * SHA256_DIGEST_LEN, hash,
+				   SHA256_DIGEST_LEN) != 0)
+		{
+			n++;
+			memmove(refs->hashes + n * SHA256_DIGEST_LEN, hash,
+					SHA256_DIGEST_LEN);
+		}
+	}
+	refs->n = n + 1;
+}
+
+/*
+ * Append hashes of pages referenced by records of the backup file to refs.
+ * Returns false, after reporting a WARNING, if the file can not be read.
+ */
+static bool
+page_refs_read_file(PageRefs *refs, const char *path)
+{
+	FILE	   *in;
+	bool		result = true;
+
+	in = fopen(path, PG_BINARY_R);
+	if (in == NULL)
+	{
+		elog(WARNING, "cannot open backup file \"%s\": %s",
+			 path, strerror(errno));
+		return false;
+	}
+
+	for (;;)
+	{
+		BackupPageHeader header;
+		size_t		read_len;
+		size_t		payload_len;
+
+		read_len = fread(&header, 1, sizeof(header), in);
+		if (read_len == 0 && feof(in))
+			break;
+		if (read_len != sizeof(header))
+		{
+			elog(WARNING, "cannot read header of record of \"%s\"", path);
+			result = false;
+			break;
+		}
+
+		payload_len = BackupRecordPayloadSize(header.compressed_size);
+
+		if (header.compressed_size == PageIsDeduplicated)
+		{
+			if (refs->n == refs->size)
+			{
+				refs->size = Max(refs->size * 2, 1024);
+				refs->hashes = pgut_realloc(refs->hashes,
+											refs->size * SHA256_DIGEST_LEN);
+			}
+			if (fread(refs->hashes + refs->n * SHA256_DIGEST_LEN, 1,
+					  SHA256_DIGEST_LEN, in) != SHA256_DIGEST_LEN)
+			{
+				elog(WARNING, "cannot read block %u of \"%s\"",
+					 header.block, path);
+				result = false;
+				break;
+			}
+			refs->n++;
+		}
+		else if (payload_len > 0 && fseek(in, payload_len, SEEK_CUR) != 0)
+		{
+			elog(WARNING, "cannot read block %u of \"%s\": %s",
+				 header.block, path, strerror(errno));
+			result = false;
+			break;
+		}
+	}
+
+	fclose(in);
+	return result;
+}
+
+/*
+ * Append hashes of pages referenced by the backup to refs.
+ */
+static bool
+page_refs_read_backup(PageRefs *refs, pgBackup *backup)
+{
+	char		base_path[MAXPGPATH];
+	char		list_path[MAXPGPATH];
+	parray	   *files;
+	bool		result = true;
+	size_t		i;
+
+	pgBackupGetPath(backup, base_path, lengthof(base_path), DATABASE_DIR);
+	pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+
+	/*
+	 * A backup which failed before the list of its files was written can
+	 * not be restored, its pages need not be kept.
+	 */
+	if (!fileExists(list_path))
+		return true;
+
+	files = dir_read_file_list(base_path, list_path);
+	for (i = 0; i < parray_num(files) && result; i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		if (interrupted)
+			elog(ERROR, "interrupted during collecting pages of backup");
+
+		if (!S_ISREG(file->mode) || !file->is_datafile || file->is_cfs ||
+			file->write_size == BYTES_INVALID)
+			continue;
+
+		result = page_refs_read_file(refs, file->path);
+	}
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	/* Pages are mostly shared by backups, keep the array small */
+	page_refs_compact(refs);
+
+	return result;
+}
+
+/*
+ * Remove objects of the store which are not in refs, sorted by
+ * page_refs_compact(). Leftovers of interrupted writes are removed too.
+ * Returns number of objects removed.
+ */
+static size_t
+dedup_sweep(PageRefs *refs)
+{
+	char		path[MAXPGPATH];
+	size_t		nremoved = 0;
+	int			i;
+
+	dedup_store_path(path, lengthof(path));
+
+	for (i = 0; i < DEDUP_SUBDIRS; i++)
+	{
+		char		subdir[MAXPGPATH];
+		DIR		   *dir;
+		struct dirent *de;
+
+		snprintf(subdir, lengthof(subdir), "%s/%02x", path, i);
+		dir = opendir(subdir);
+		if (dir == NULL)
+		{
+			if (errno == ENOENT)
+				continue;
+			elog(ERROR, "cannot open directory \"%s\": %s",
+				 subdir, strerror(errno));
+		}
+
+		while (errno = 0, (de = readdir(dir)) != NULL)
+		{
+			char		object_path[MAXPGPATH];
+			uint8		hash[SHA256_DIGEST_LEN];
+
+			if (interrupted)
+				elog(ERROR, "interrupted during removing unused pages");
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			if (dedup_parse_name(i, de->d_name, hash) &&
+				bsearch(hash, refs->hashes, refs->n, SHA256_DIGEST_LEN,
+						page_hash_cmp) != NULL)
+				continue;
+
+			join_path_components(object_path, subdir, de->d_name);
+			if (unlink(object_path) != 0)
+				elog(ERROR, "cannot remove \"%s\": %s",
+					 object_path, strerror(errno));
+			nremoved++;
+		}
+
+		if (errno)
+			elog(ERROR, "cannot read directory \"%s\": %s",
+				 subdir, strerror(errno));
+		closedir(dir);
+	}
+
+	return nremoved;
+}
+
+/*
+ * Remove pages of the store which are not referenced by backups of the
+ * catalog. Must be called under the catalog lock.
+ */
+void
+dedup_collect_garbage(void)
+{
+	parray	   *backup_list;
+	PageRefs	refs;
+	size_t		nremoved;
+	bool		complete = true;
+	size_t		i;
+
+	if (!dedup_store_exists())
+		return;
+
+	elog(LOG, "collecting pages referenced by deduplicated backups");
+
+	refs.hashes = NULL;
+	refs.n = 0;
+	refs.size = 0;
+
+	backup_list = catalog_get_backup_list(INVALID_BACKUP_ID);
+	if (backup_list == NULL)
+		elog(ERROR, "Failed to get backup list.");
+
+	/* Pages of backups in any status are kept, except deleted ones */
+	for (i = 0; i < parray_num(backup_list) && complete; i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backup_list, i);
+
+		if (!backup->dedup || backup->status == BACKUP_STATUS_DELETED)
+			continue;
+
+		complete = page_refs_read_backup(&refs, backup);
+	}
+
+	parray_walk(backup_list, pgBackupFree);
+	parray_free(backup_list);
+
+	/* Better keep unused pages than remove used ones */
+	if (!complete)
+	{
+		elog(WARNING, "Not going to remove unused pages of deduplicated backups "
+			 "because some backups can not be read");
+		free(refs.hashes);
+		return;
+	}
+
+	nremoved = dedup_sweep(&refs);
+	free(refs.hashes);
+
+	elog(INFO, "removed %lu unused pages of deduplicated backups, %lu pages are in use",
+		 (unsigned long) nremoved, (unsigned long) refs.n);
+}
+
+/*
+ * Remove the page store with all pages. Used when the instance is deleted.
+ */
+void
+dedup_store_remove(void)
+{
+	char		path[MAXPGPATH];
+	char		subdir[MAXPGPATH];
+	PageRefs	refs;
+	int			i;
+
+	if (!dedup_store_exists())
+		return;
+
+	refs.hashes = NULL;
+	refs.n = 0;
+	refs.size = 0;
+	dedup_sweep(&refs);
+
+	dedup_store_path(path, lengthof(path));
+	for (i = 0; i < DEDUP_SUBDIRS; i++)
+	{
+		snprintf(subdir, lengthof(subdir), "%s/%02x", path, i);
+		if (rmdir(subdir) != 0 && errno != ENOENT)
+			elog(ERROR, "can't remove \"%s\": %s", subdir, strerror(errno));
+	}
+	if (rmdir(path) != 0)
+		elog(ERROR, "can't remove \"%s\": %s", path, strerror(errno));
+}
+
+/*
+ * Check that pages referenced by the backup file are in the store and
+ * intact. Every missing or corrupted page is reported with WARNING.
+ */
+bool
+dedup_validate_file(pgFile *file)
+{
+	PageRefs	refs;
+	char		page[BLCKSZ];
+	bool		result;
+	size_t		i;
+
+	refs.hashes = NULL;
+	refs.n = 0;
+	refs.size = 0;
+
+	result = page_refs_read_file(&refs, file->path);
+	page_refs_compact(&refs);
+
+	for (i = 0; i < refs.n; i++)
+	{
+		if (interrupted)
+			elog(ERROR, "Interrupted during validate");
+
+		if (!read_dedup_page(refs.hashes + i * SHA256_DIGEST_LEN, page))
+			result = false;
+	}
+
+	free(refs.hashes);
+	return result;
+}
@@ -14,7 +14,6 @@
 #include <time.h>
 #include <unistd.h>
 
-static int pgBackupDeleteFiles(pgBackup *backup);
 static void delete_walfiles(XLogRecPtr oldest_lsn, TimeLineID oldest_tli);
 
 int
@@ -90,6 +89,9 @@ do_delete(time_t backup_id)
 		}
 
 		parray_free(delete_list);
+
+		/* Remove pages which were used by deleted backups only */
+		dedup_collect_garbage();
 	}
 
 	/* Clean WAL segments */
@@ -227,6 +229,9 @@ do_retention_purge(void)
 		delete_walfiles(oldest_lsn, oldest_tli);
 	}
 
+	if (backup_deleted)
+		dedup_collect_garbage();
+
 	/* Cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
@@ -243,7 +248,7 @@ do_retention_purge(void)
  * Delete backup files of the backup and update the status of the backup to
  * BACKUP_STATUS_DELETED.
  */
-static int
+int
 pgBackupDeleteFiles(pgBackup *backup)
 {
 	size_t		i;
@@ -436,6 +441,9 @@ do_delete_instance(void)
 	/* Delete all wal files. */
 	delete_walfiles(InvalidXLogRecPtr, 0);
 
+	/* Delete pages of deduplicated backups */
+	dedup_store_remove();
+
 	/* Delete backup instance config file */
 	join_path_components(instance_config_path, backup_instance_path, BACKUP_CATALOG_CONF_FILE);
 	if (remove(instance_config_path))
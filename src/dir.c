@@ -10,7 +10,9 @@
 
 #include "pg_probackup.h"
 
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -88,9 +90,8 @@ static char *pgdata_exclude_files_non_exclusive[] =
 
 static int BlackListCompare(const void *str1, const void *str2);
 
-static void dir_list_file_internal(parray *files, const char *root,
-								   bool exclude, bool omit_symlink,
-								   bool add_root, parray *black_list);
+static void dir_walk(parray *files, const char *root, bool exclude,
+					 bool omit_symlink, bool add_root, parray *black_list);
 
 /*
  * Create directory, also create parent directories if necessary.
@@ -138,6 +139,7 @@ pgFileNew(const char *path, bool omit_symlink)
 	file = pgFileInit(path);
 	file->size = st.st_size;
 	file->mode = st.st_mode;
+	file->mtime = st.st_mtime;
 
 	return file;
 }
@@ -150,6 +152,7 @@ pgFileInit(const char *path)
 
 	file->size = 0;
 	file->mode = 0;
+	file->mtime = 0;
 	file->read_size = 0;
 	file->write_size = 0;
 	file->crc = 0;
@@ -300,6 +303,28 @@ pgFileCompareSize(const void *f1, const void *f2)
 		return 0;
 }
 
+/*
+ * Weight of the file to be backed up, used to schedule the work among
+ * threads, see scheduler_new().
+ */
+size_t
+pgFileWeightSize(const void *f)
+{
+	return ((const pgFile *) f)->size;
+}
+
+/*
+ * Weight of the file stored in backup, used to schedule restore and
+ * validation of the backup.
+ */
+size_t
+pgFileWeightWriteSize(const void *f)
+{
+	const pgFile *file = (const pgFile *) f;
+
+	return file->write_size > 0 ? file->write_size : 0;
+}
+
 static int
 BlackListCompare(const void *str1, const void *str2)
 {
@@ -312,6 +337,8 @@ BlackListCompare(const void *str1, const void *str2)
  *
  * When omit_symlink is true, symbolic link is ignored and only file or
  * directory llnked to will be listed.
+ *
+ * Directories are listed by num_threads threads, "files" is sorted by path.
  */
 void
 dir_list_file(parray *files, const char *root, bool exclude, bool omit_symlink,
@@ -351,83 +378,214 @@ dir_list_file(parray *files, const char *root, bool exclude, bool omit_symlink,
 		parray_qsort(black_list, BlackListCompare);
 	}
 
-	dir_list_file_internal(files, root, exclude, omit_symlink, add_root,
-						   black_list);
+	dir_walk(files, root, exclude, omit_symlink, add_root, black_list);
 	parray_qsort(files, pgFileComparePath);
 }
 
 /*
- * TODO Add comment
+ * Directory to be listed by dir_walk_worker(). It is opened by the thread
+ * which found it, relative to its parent, unless too many directories are
+ * held open already.
+ */
+typedef struct DirWalkTask
+{
+	char	   *path;
+	int			fd;				/* -1 to open by path */
+} DirWalkTask;
+
+/* Maximum number of open directories waiting in the queue */
+#define DIR_WALK_MAX_FDS	256
+
+/*
+ * State of a directory tree listing shared by threads. Directories found
+ * by a thread are added to the queue and listed by any idle thread.
+ */
+typedef struct DirWalker
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	parray	   *tasks;			/* DirWalkTask, the last is taken first */
+	int			pending;		/* directories queued or being listed */
+	int			nfds;			/* directories open in the queue */
+
+	bool		exclude;
+	bool		omit_symlink;
+	parray	   *black_list;
+} DirWalker;
+
+typedef struct DirWalkerArgs
+{
+	DirWalker  *walker;
+	parray	   *files;			/* pgFile found by the thread */
+} DirWalkerArgs;
+
+/* Is a regular file excluded from backup by its name? */
+static bool
+dir_is_excluded_file(const char *name)
+{
+	int			i;
+
+	/* exclude backup_label and tablespace_map in non-exclusive backup */
+	if (!exclusive_backup)
+	{
+		for (i = 0; pgdata_exclude_files_non_exclusive[i]; i++)
+			if (strcmp(name, pgdata_exclude_files_non_exclusive[i]) == 0)
+				return true;
+	}
+
+	for (i = 0; pgdata_exclude_files[i]; i++)
+		if (strcmp(name, pgdata_exclude_files[i]) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * Is the content of the directory excluded from backup? If the item in the
+ * exclude list starts with '/', compare to the absolute path of the
+ * directory. Otherwise compare to the directory name portion.
+ */
+static bool
+dir_is_excluded_dir(const char *path, const char *name)
+{
+	int			i;
+
+	for (i = 0; pgdata_exclude_dir[i]; i++)
+	{
+		if (pgdata_exclude_dir[i][0] == '/')
+		{
+			if (strcmp(path, pgdata_exclude_dir[i]) == 0)
+				return true;
+		}
+		else if (strcmp(name, pgdata_exclude_dir[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add the directory to the queue of the walker. fd is the open directory or
+ * -1 if it is to be opened by path.
  */
 static void
-dir_list_file_internal(parray *files, const char *root, bool exclude,
-					   bool omit_symlink, bool add_root, parray *black_list)
+dir_walk_push(DirWalker *walker, const char *path, int fd)
 {
-	pgFile *file;
+	DirWalkTask *task = pgut_new(DirWalkTask);
+
+	task->path = pgut_strdup(path);
+	task->fd = fd;
+
+	pthread_mutex_lock(&walker->mutex);
+	parray_append(walker->tasks, task);
+	walker->pending++;
+	if (fd >= 0)
+		walker->nfds++;
+	pthread_cond_signal(&walker->cond);
+	pthread_mutex_unlock(&walker->mutex);
+}
 
-	file = pgFileNew(root, omit_symlink);
-	if (file == NULL)
-		return;
+/*
+ * Open subdirectory "name" of the directory dfd for the queue, unless
+ * there are too many open already. Returns -1 if it is to be opened by
+ * path later.
+ */
+static int
+dir_walk_open(DirWalker *walker, int dfd, const char *name, const char *path)
+{
+	int			fd;
+	bool		full;
+
+	pthread_mutex_lock(&walker->mutex);
+	full = (walker->nfds >= DIR_WALK_MAX_FDS);
+	pthread_mutex_unlock(&walker->mutex);
+	if (full)
+		return -1;
+
+	fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | PG_BINARY);
+	if (fd < 0)
+	{
+		/* maybe the direcotry was removed, it is checked again later */
+		if (errno == ENOENT || errno == EMFILE || errno == ENFILE)
+			return -1;
+		elog(ERROR, "cannot open directory \"%s\": %s",
+			 path, strerror(errno));
+	}
+
+	return fd;
+}
+
+/*
+ * Add file "name" of the directory dfd, with absolute path "path", to the
+ * files. If the file is a directory, queue it to be listed. d_type is the
+ * file type reported by readdir(), DT_UNKNOWN if none. Checks which do not
+ * need attributes of the file are done before stat.
+ */
+static void
+dir_walk_entry(DirWalker *walker, parray *files, int dfd, const char *name,
+			   const char *path, unsigned char d_type, bool add_root)
+{
+	pgFile	   *entry;
+	pgFile	   *file;
+	struct stat	st;
+	char	   *file_name;
 
 	/* skip if the file is in black_list defined by user */
-	if (black_list && parray_bsearch(black_list, root, BlackListCompare))
+	if (walker->black_list &&
+		parray_bsearch(walker->black_list, path, BlackListCompare))
+	{
+		elog(LOG, "Skip file \"%s\": file is in the user's black list", path);
+		return;
+	}
+
+	file_name = last_dir_separator(path);
+	file_name = file_name ? file_name + 1 : (char *) path;
+
+#ifdef DT_REG
+	/* Excluded file is not even stat'ed */
+	if (d_type == DT_REG && add_root && walker->exclude &&
+		dir_is_excluded_file(file_name))
 	{
-		elog(LOG, "Skip file \"%s\": file is in the user's black list", file->path);
+		elog(VERBOSE, "Excluding file: %s", file_name);
 		return;
 	}
+#endif
+
+	if (fstatat(dfd, name, &st,
+				walker->omit_symlink ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+	{
+		/* file not found is not an error case */
+		if (errno == ENOENT)
+			return;
+		elog(ERROR, "cannot stat file \"%s\": %s", path, strerror(errno));
+	}
 
 	/*
 	 * Add to files list only files, links and directories. Skip sockets and
 	 * other unexpected file formats.
 	 */
-	if (!S_ISDIR(file->mode) && !S_ISLNK(file->mode) &&	!S_ISREG(file->mode))
+	if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode) && !S_ISREG(st.st_mode))
 	{
-		elog(WARNING, "Skip file \"%s\": unexpected file format", file->path);
+		elog(WARNING, "Skip file \"%s\": unexpected file format", path);
 		return;
 	}
 
-	if (add_root)
+	/* TODO Consider moving this check to parse_backup_filelist_filenames */
+	if (!S_ISDIR(st.st_mode) && add_root && walker->exclude &&
+		dir_is_excluded_file(file_name))
 	{
-		/* Skip files */
-		/* TODO Consider moving this check to parse_backup_filelist_filenames */
-		if (!S_ISDIR(file->mode) && exclude)
-		{
-			char	    *file_name;
-			int			i;
-
-			/* Extract file name */
-			file_name = strrchr(file->path, '/');
-			if (file_name == NULL)
-				file_name = file->path;
-			else
-			{
-				file_name++;
-				file->name = file_name;
-			}
+		elog(VERBOSE, "Excluding file: %s", file_name);
+		return;
+	}
 
-			/* exclude backup_label and tablespace_map in non-exclusive backup */
-			if (!exclusive_backup)
-			{
-				for (i = 0; pgdata_exclude_files_non_exclusive[i]; i++)
-					if (strcmp(file->name, pgdata_exclude_files_non_exclusive[i]) == 0)
-					{
-						/* Skip */
-						elog(VERBOSE, "Excluding file: %s", file->name);
-						return;
-					}
-			}
+	entry = file = pgFileInit(path);
+	file->size = st.st_size;
+	file->mode = st.st_mode;
+	file->mtime = st.st_mtime;
+	file->name = file->path + (file_name - path);
 
-			/* Check if we need to exclude file by name */
-			for (i = 0; pgdata_exclude_files[i]; i++)
-				if (strcmp(file->name, pgdata_exclude_files[i]) == 0)
-				{
-					/* Skip */
-					elog(VERBOSE, "Excluding file: %s", file->name);
-					return;
-				}
-		}
+	if (add_root)
 		parray_append(files, file);
-	}
 
 	/* chase symbolic link chain and find regular file or directory */
 	while (S_ISLNK(file->mode))
@@ -454,110 +612,187 @@ dir_list_file_internal(parray *files, const char *root, bool exclude,
 
 			strncpy(dname, file->path, lengthof(dname));
 			join_path_components(absolute, dname, linked);
-			file = pgFileNew(absolute, omit_symlink);
+			file = pgFileNew(absolute, walker->omit_symlink);
 		}
 		else
-			file = pgFileNew(file->linked, omit_symlink);
+			file = pgFileNew(file->linked, walker->omit_symlink);
 
 		/* linked file is not found, stop following link chain */
 		if (file == NULL)
-			return;
+			break;
 
+		file_name = last_dir_separator(file->path);
+		file->name = file_name ? file_name + 1 : file->path;
 		parray_append(files, file);
+
+		/* The linked directory is opened by its path */
+		dfd = -1;
 	}
 
 	/*
-	 * If the entry was a directory, add it to the list and add call this
-	 * function recursivelly.
-	 * If the directory name is in the exclude list, do not list the contents.
+	 * If the entry is a directory, queue it to list its contents, unless
+	 * the directory name is in the exclude list.
 	 */
-	while (S_ISDIR(file->mode))
+	if (file != NULL && S_ISDIR(file->mode))
 	{
-		bool			skip = false;
-		DIR			    *dir;
-		struct dirent   *dent;
+		if (walker->exclude && dir_is_excluded_dir(file->path, file->name))
+			elog(VERBOSE, "Excluding directory content: %s", file->name);
+		else
+			dir_walk_push(walker, file->path,
+						  dfd == -1 ? -1 :
+						  dir_walk_open(walker, dfd, name, file->path));
+	}
 
-		if (exclude)
-		{
-			int			i;
-			char	    *dirname;
+	if (!add_root)
+		pgFileFree(entry);
+}
 
-			/* skip entry which matches exclude list */
-			dirname = strrchr(file->path, '/');
-			if (dirname == NULL)
-				dirname = file->path;
-			else
-			{
-				dirname++;
-				file->name = dirname;
-			}
+/*
+ * List directories of the walker queue until all of them are listed.
+ * Entries of a directory are stat'ed relative to it, so that the kernel
+ * does not resolve their whole paths.
+ */
+static void *
+dir_walk_worker(void *arg)
+{
+	DirWalkerArgs *args = (DirWalkerArgs *) arg;
+	DirWalker  *walker = args->walker;
 
-			/*
-			 * If the item in the exclude list starts with '/', compare to the
-			 * absolute path of the directory. Otherwise compare to the directory
-			 * name portion.
-			 */
-			for (i = 0; exclude && pgdata_exclude_dir[i]; i++)
-			{
-				/* Full-path exclude*/
-				if (pgdata_exclude_dir[i][0] == '/')
-				{
-					if (strcmp(file->path, pgdata_exclude_dir[i]) == 0)
-					{
-						skip = true;
-						break;
-					}
-				}
-				else if (strcmp(file->name, pgdata_exclude_dir[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-			if (skip)
-			{
-				elog(VERBOSE, "Excluding directory content: %s", file->name);
-				break;
-			}
+	for (;;)
+	{
+		DirWalkTask *task;
+		DIR		   *dir;
+		struct dirent *dent;
+
+		pthread_mutex_lock(&walker->mutex);
+		while (parray_num(walker->tasks) == 0 && walker->pending > 0)
+			pthread_cond_wait(&walker->cond, &walker->mutex);
+		if (walker->pending == 0)
+		{
+			pthread_mutex_unlock(&walker->mutex);
+			break;
 		}
+		task = (DirWalkTask *) parray_remove(walker->tasks,
+											 parray_num(walker->tasks) - 1);
+		if (task->fd >= 0)
+			walker->nfds--;
+		pthread_mutex_unlock(&walker->mutex);
+
+		if (interrupted)
+			elog(ERROR, "interrupted during directory listing");
+
+		if (task->fd < 0)
+			task->fd = open(task->path, O_RDONLY | O_DIRECTORY | PG_BINARY, 0);
 
 		/* open directory and list contents */
-		dir = opendir(file->path);
+		dir = (task->fd >= 0) ? fdopendir(task->fd) : NULL;
 		if (dir == NULL)
 		{
-			if (errno == ENOENT)
+			int errno_tmp = errno;
+
+			if (task->fd >= 0)
+				close(task->fd);
+			/* maybe the direcotry was removed */
+			if (errno_tmp != ENOENT)
+				elog(ERROR, "cannot open directory \"%s\": %s",
+					 task->path, strerror(errno_tmp));
+		}
+		else
+		{
+			errno = 0;
+			while ((dent = readdir(dir)))
 			{
-				/* maybe the direcotry was removed */
-				return;
+				char		child[MAXPGPATH];
+				unsigned char d_type = 0;
+
+				/* skip entries point current dir or parent dir */
+				if (strcmp(dent->d_name, ".") == 0 ||
+					strcmp(dent->d_name, "..") == 0)
+					continue;
+
+#ifdef DT_UNKNOWN
+				d_type = dent->d_type;
+#endif
+				join_path_components(child, task->path, dent->d_name);
+				dir_walk_entry(walker, args->files, dirfd(dir), dent->d_name,
+							   child, d_type, true);
+				errno = 0;
 			}
-			elog(ERROR, "cannot open directory \"%s\": %s",
-				file->path, strerror(errno));
+			if (errno && errno != ENOENT)
+			{
+				int errno_tmp = errno;
+				closedir(dir);
+				elog(ERROR, "cannot read directory \"%s\": %s",
+					task->path, strerror(errno_tmp));
+			}
+			closedir(dir);
 		}
 
-		errno = 0;
-		while ((dent = readdir(dir)))
-		{
-			char child[MAXPGPATH];
+		free(task->path);
+		free(task);
 
-			/* skip entries point current dir or parent dir */
-			if (strcmp(dent->d_name, ".") == 0 ||
-				strcmp(dent->d_name, "..") == 0)
-				continue;
+		pthread_mutex_lock(&walker->mutex);
+		if (--walker->pending == 0)
+			pthread_cond_broadcast(&walker->cond);
+		pthread_mutex_unlock(&walker->mutex);
+	}
 
-			join_path_components(child, file->path, dent->d_name);
-			dir_list_file_internal(files, child, exclude, omit_symlink, true, black_list);
-		}
-		if (errno && errno != ENOENT)
-		{
-			int errno_tmp = errno;
-			closedir(dir);
-			elog(ERROR, "cannot read directory \"%s\": %s",
-				file->path, strerror(errno_tmp));
-		}
-		closedir(dir);
+	return NULL;
+}
 
-		break;	/* pseudo loop */
+/*
+ * List files of the tree rooted at "root" by num_threads threads, see
+ * dir_list_file(). Files are collected by each thread separately and added
+ * to "files" at the end, in no particular order.
+ */
+static void
+dir_walk(parray *files, const char *root, bool exclude, bool omit_symlink,
+		 bool add_root, parray *black_list)
+{
+	DirWalker	walker;
+	int			nthreads = Max(num_threads, 1);
+	pthread_t	threads[nthreads];
+	DirWalkerArgs args[nthreads];
+	int			i;
+
+	pthread_mutex_init(&walker.mutex, NULL);
+	pthread_cond_init(&walker.cond, NULL);
+	walker.tasks = parray_new();
+	walker.pending = 0;
+	walker.nfds = 0;
+	walker.exclude = exclude;
+	walker.omit_symlink = omit_symlink;
+	walker.black_list = black_list;
+
+	/* The root is checked as any other entry, but is opened by path */
+	dir_walk_entry(&walker, files, AT_FDCWD, root, root, 0, add_root);
+
+	/* There is nothing to list in parallel if the root is not a directory */
+	if (walker.pending == 0)
+		nthreads = 1;
+
+	/* The calling thread is a worker too */
+	args[0].walker = &walker;
+	args[0].files = files;
+	for (i = 1; i < nthreads; i++)
+	{
+		args[i].walker = &walker;
+		args[i].files = parray_new();
+		pthread_create(&threads[i], NULL, dir_walk_worker, &args[i]);
 	}
+
+	dir_walk_worker(&args[0]);
+
+	for (i = 1; i < nthreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		parray_concat(files, args[i].files);
+		parray_free(args[i].files);
+	}
+
+	parray_free(walker.tasks);
+	pthread_cond_destroy(&walker.cond);
+	pthread_mutex_destroy(&walker.mutex);
 }
 
 /*
@@ -710,10 +945,11 @@ print_file_list(FILE *out, const parray *files, const char *root)
 
 		fprintf(out, "{\"path\":\"%s\", \"size\":\"%lu\",\"mode\":\"%u\","
 					 "\"is_datafile\":\"%u\", \"is_cfs\":\"%u\", \"crc\":\"%u\","
-					 "\"compress_alg\":\"%s\"",
+					 "\"compress_alg\":\"%s\", \"mtime\":\"%ld\", \"src_size\":\"%lu\"",
 				path, (unsigned long) file->write_size, file->mode,
 				file->is_datafile?1:0, file->is_cfs?1:0, file->crc,
-				deparse_compress_alg(file->compress_alg));
+				deparse_compress_alg(file->compress_alg),
+				(long) file->mtime, (unsigned long) file->size);
 
 		if (file->is_datafile)
 			fprintf(out, ",\"segno\":\"%d\"", file->segno);
@@ -888,7 +1124,9 @@ dir_read_file_list(const char *root, const char *file_txt)
 					is_datafile,
 					is_cfs,
 					crc,
-					segno;
+					segno,
+					mtime,
+					src_size;
 		pgFile	   *file;
 
 		get_control_value(buf, "path", path, NULL, true);
@@ -902,6 +1140,9 @@ dir_read_file_list(const char *root, const char *file_txt)
 		get_control_value(buf, "linked", linked, NULL, false);
 		get_control_value(buf, "segno", NULL, &segno, false);
 		get_control_value(buf, "compress_alg", compress_alg_string, NULL, false);
+		/* source file attributes, absent in backups of old versions */
+		get_control_value(buf, "mtime", NULL, &mtime, false);
+		get_control_value(buf, "src_size", NULL, &src_size, false);
 
 		if (root)
 			join_path_components(filepath, root, path);
@@ -919,6 +1160,8 @@ dir_read_file_list(const char *root, const char *file_txt)
 		if (linked[0])
 			file->linked = pgut_strdup(linked);
 		file->segno = (int) segno;
+		file->mtime = (time_t) mtime;
+		file->size = (size_t) src_size;
 
 		parray_append(files, file);
 	}
@@ -14,6 +14,7 @@ static void help_restore(void);
 static void help_validate(void);
 static void help_show(void);
 static void help_delete(void);
+static void help_merge(void);
 static void help_set_config(void);
 static void help_show_config(void);
 static void help_add_instance(void);
@@ -36,6 +37,8 @@ help_command(char *command)
 		help_show();
 	else if (strcmp(command, "delete") == 0)
 		help_delete();
+	else if (strcmp(command, "merge") == 0)
+		help_merge();
 	else if (strcmp(command, "set-config") == 0)
 		help_set_config();
 	else if (strcmp(command, "show-config") == 0)
@@ -93,7 +96,10 @@ help_pg_probackup(void)
 	printf(_("\n  %s backup -B backup-path -b backup-mode --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-C] [--stream [-S slot-name]] [--backup-pg-log]\n"));
 	printf(_("                 [-j num-threads] [--archive-timeout=archive-timeout]\n"));
-	printf(_("                 [--progress]\n"));
+	printf(_("                 [--io-depth=io-depth] [--progress] [--no-cache]\n"));
+	printf(_("                 [--io-threads=num] [--cpu-threads=num]\n"));
+	printf(_("                 [--read-rate-limit=rate] [--read-iops-limit=iops]\n"));
+	printf(_("                 [--throttle-latency=latency] [--dedup]\n"));
 	printf(_("                 [--log-level-console=log-level-console]\n"));
 	printf(_("                 [--log-level-file=log-level-file]\n"));
 	printf(_("                 [--log-filename=log-filename]\n"));
@@ -107,6 +113,7 @@ help_pg_probackup(void)
 	printf(_("                 [--compress]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
+	printf(_("                 [--compress-dict]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [-w --no-password] [-W --password]\n"));
 	printf(_("                 [--master-db=db_name] [--master-host=host_name]\n"));
@@ -117,6 +124,7 @@ help_pg_probackup(void)
 	printf(_("                 [-D pgdata-dir] [-i backup-id] [--progress]\n"));
 	printf(_("                 [--time=time|--xid=xid [--inclusive=boolean]]\n"));
 	printf(_("                 [--timeline=timeline] [-T OLDDIR=NEWDIR]\n"));
+	printf(_("                 [--io-threads=num] [--cpu-threads=num]\n"));
 
 	printf(_("\n  %s validate -B backup-dir [--instance=instance_name]\n"), PROGRAM_NAME);
 	printf(_("                 [-i backup-id] [--progress]\n"));
@@ -124,11 +132,16 @@ help_pg_probackup(void)
 	printf(_("                 [--timeline=timeline]\n"));
 
 	printf(_("\n  %s show -B backup-dir\n"), PROGRAM_NAME);
-	printf(_("                 [--instance=instance_name [-i backup-id]]\n"));
+	printf(_("                 [--instance=instance_name [-i backup-id [--stats]]]\n"));
 
 	printf(_("\n  %s delete -B backup-dir --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [--wal] [-i backup-id | --expired]\n"));
 
+	printf(_("\n  %s merge -B backup-dir --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 -i backup-id [-j num-threads] [--io-threads=num]\n"));
+	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
+	printf(_("                 [--compress-level=compress-level]\n"));
+
 	printf(_("\n  %s add-instance -B backup-dir -D pgdata-dir\n"), PROGRAM_NAME);
 	printf(_("                 --instance=instance_name\n"));
 
@@ -169,7 +182,10 @@ help_backup(void)
 	printf(_("%s backup -B backup-path -b backup-mode --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-C] [--stream [-S slot-name]] [--backup-pg-log]\n"));
 	printf(_("                 [-j num-threads] [--archive-timeout=archive-timeout]\n"));
-	printf(_("                 [--progress]\n"));
+	printf(_("                 [--io-depth=io-depth] [--progress] [--no-cache]\n"));
+	printf(_("                 [--io-threads=num] [--cpu-threads=num]\n"));
+	printf(_("                 [--read-rate-limit=rate] [--read-iops-limit=iops]\n"));
+	printf(_("                 [--throttle-latency=latency] [--dedup]\n"));
 	printf(_("                 [--log-level-console=log-level-console]\n"));
 	printf(_("                 [--log-level-file=log-level-file]\n"));
 	printf(_("                 [--log-filename=log-filename]\n"));
@@ -183,6 +199,7 @@ help_backup(void)
 	printf(_("                 [--compress]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
+	printf(_("                 [--compress-dict]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [-w --no-password] [-W --password]\n"));
 	printf(_("                 [--master-db=db_name] [--master-host=host_name]\n"));
@@ -190,15 +207,27 @@ help_backup(void)
 	printf(_("                 [--replica-timeout=timeout]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
-	printf(_("  -b, --backup-mode=backup-mode    backup mode=FULL|PAGE|PTRACK\n"));
+	printf(_("  -b, --backup-mode=backup-mode    backup mode=FULL|PAGE|PTRACK|DELTA\n"));
 	printf(_("      --instance=instance_name     name of the instance\n"));
 	printf(_("  -C, --smooth-checkpoint          do smooth checkpoint before backup\n"));
 	printf(_("      --stream                     stream the transaction log and include it in the backup\n"));
 	printf(_("  -S, --slot=SLOTNAME              replication slot to use\n"));
 	printf(_("      --backup-pg-log              backup of pg_log directory\n"));
 	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
+	printf(_("      --io-depth=NUM               number of reads and writes in flight per thread\n"));
+	printf(_("                                   with io_uring (default: 32)\n"));
+	printf(_("      --io-threads=NUM             number of threads reading and writing files (default: -j)\n"));
+	printf(_("      --cpu-threads=NUM            number of threads verifying and compressing pages (default: 0, done by I/O threads)\n"));
 	printf(_("      --archive-timeout=timeout    wait timeout for WAL segment archiving (default: 5min)\n"));
 	printf(_("      --progress                   show progress\n"));
+	printf(_("      --no-cache                   do not fill the OS page cache with backed up files\n"));
+	printf(_("      --dedup                      store pages once in the page store shared by backups\n"));
+
+	printf(_("\n  Throttle options:\n"));
+	printf(_("      --read-rate-limit=rate       limit of data read by all threads per second (default: 0, no limit)\n"));
+	printf(_("      --read-iops-limit=iops       limit of read operations of all threads per second (default: 0, no limit)\n"));
+	printf(_("      --throttle-latency=latency   lower the limits while average read latency of server\n"));
+	printf(_("                                   backends exceeds latency in milliseconds (requires track_io_timing)\n"));
 
 	printf(_("\n  Logging options:\n"));
 	printf(_("      --log-level-console=log-level-console\n"));
@@ -233,9 +262,10 @@ help_backup(void)
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress                   compress data files\n"));
 	printf(_("      --compress-algorithm=compress-algorithm\n"));
-	printf(_("                                   available options: 'zlib', 'pglz', 'none' (default: zlib)\n"));
+	printf(_("                                   available options: 'zlib', 'pglz', 'zstd', 'lz4', 'none' (default: zlib)\n"));
 	printf(_("      --compress-level=compress-level\n"));
 	printf(_("                                   level of compression [0-9] (default: 6)\n"));
+	printf(_("      --compress-dict              train zstd dictionary shared by pages of the backup\n"));
 
 	printf(_("\n  Connection options:\n"));
 	printf(_("  -U, --username=USERNAME          user name to connect as (default: current local user)\n"));
@@ -259,7 +289,8 @@ help_restore(void)
 	printf(_("%s restore -B backup-dir --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-D pgdata-dir] [-i backup-id] [--progress]\n"));
 	printf(_("                 [--time=time|--xid=xid [--inclusive=boolean]]\n"));
-	printf(_("                 [--timeline=timeline] [-T OLDDIR=NEWDIR]\n\n"));
+	printf(_("                 [--timeline=timeline] [-T OLDDIR=NEWDIR]\n"));
+	printf(_("                 [--io-threads=num] [--cpu-threads=num]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("      --instance=instance_name     name of the instance\n"));
@@ -274,6 +305,8 @@ help_restore(void)
 	printf(_("      --timeline=timeline          recovering into a particular timeline\n"));
 	printf(_("  -T, --tablespace-mapping=OLDDIR=NEWDIR\n"));
 	printf(_("                                   relocate the tablespace from directory OLDDIR to NEWDIR\n"));
+	printf(_("      --io-threads=NUM             number of threads reading and writing files (default: -j)\n"));
+	printf(_("      --cpu-threads=NUM            number of threads decompressing pages (default: 0, done by I/O threads)\n"));
 
 	printf(_("\n  Logging options:\n"));
 	printf(_("      --log-level-console=log-level-console\n"));
@@ -341,11 +374,13 @@ static void
 help_show(void)
 {
 	printf(_("%s show -B backup-dir\n"), PROGRAM_NAME);
-	printf(_("                 [--instance=instance_name [-i backup-id]]\n\n"));
+	printf(_("                 [--instance=instance_name [-i backup-id [--stats]]]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("      --instance=instance_name     show info about specific intstance\n"));
 	printf(_("  -i, --backup-id=backup-id        show info about specific backups\n"));
+	printf(_("      --stats                      show time spent in phases of the backup\n"));
+	printf(_("                                   and counters of backup threads\n"));
 }
 
 static void
@@ -383,6 +418,48 @@ help_delete(void)
 	printf(_("                                   available units: 'ms', 's', 'min', 'h', 'd' (default: min)\n"));
 }
 
+static void
+help_merge(void)
+{
+	printf(_("%s merge -B backup-dir --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 -i backup-id [-j num-threads] [--io-threads=num]\n"));
+	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
+	printf(_("                 [--compress-level=compress-level]\n\n"));
+
+	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
+	printf(_("      --instance=instance_name     name of the instance\n"));
+	printf(_("  -i, --backup-id=backup-id        incremental backup to merge with its parents into a full backup\n"));
+	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
+	printf(_("      --io-threads=NUM             number of threads merging files (default: -j)\n"));
+
+	printf(_("\n  Compression options:\n"));
+	printf(_("      --compress-algorithm=compress-algorithm\n"));
+	printf(_("                                   available options: 'zlib', 'pglz', 'zstd', 'lz4', 'none' (default: zlib)\n"));
+	printf(_("      --compress-level=compress-level\n"));
+	printf(_("                                   level of compression [0-9] (default: 6)\n"));
+
+	printf(_("\n  Logging options:\n"));
+	printf(_("      --log-level-console=log-level-console\n"));
+	printf(_("                                   level for console logging (default: info)\n"));
+	printf(_("                                   available options: 'off', 'error', 'warning', 'info', 'log', 'verbose'\n"));
+	printf(_("      --log-level-file=log-level-file\n"));
+	printf(_("                                   level for file logging (default: off)\n"));
+	printf(_("                                   available options: 'off', 'error', 'warning', 'info', 'log', 'verbose'\n"));
+	printf(_("      --log-filename=log-filename\n"));
+	printf(_("                                   filename for file logging (default: 'pg_probackup.log')\n"));
+	printf(_("                                   support strftime format (example: pg_probackup-%%Y-%%m-%%d_%%H%%M%%S.log\n"));
+	printf(_("      --error-log-filename=error-log-filename\n"));
+	printf(_("                                   filename for error logging (default: none)\n"));
+	printf(_("      --log-directory=log-directory\n"));
+	printf(_("                                   directory for file logging (default: BACKUP_PATH/log)\n"));
+	printf(_("      --log-rotation-size=log-rotation-size\n"));
+	printf(_("                                   rotate logfile if its size exceed this value; 0 disables; (default: 0)\n"));
+	printf(_("                                   available units: 'KB', 'MB', 'GB', 'TB' (default: KB)\n"));
+	printf(_("      --log-rotation-age=log-rotation-age\n"));
+	printf(_("                                   rotate logfile if its age exceed this value; 0 disables; (default: 0)\n"));
+	printf(_("                                   available units: 'ms', 's', 'min', 'h', 'd' (default: min)\n"));
+}
+
 static void
 help_set_config(void)
 {
@@ -435,7 +512,7 @@ help_set_config(void)
 
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress-algorithm=compress-algorithm\n"));
-	printf(_("                                   available options: 'zlib','pglz','none'\n"));
+	printf(_("                                   available options: 'zlib','pglz','zstd','lz4','none'\n"));
 	printf(_("      --compress-level=compress-level\n"));
 	printf(_("                                   level of compression [0-9] (default: 6)\n"));
 
@@ -0,0 +1,586 @@
+/*-------------------------------------------------------------------------
+ *
+ * merge.c: merge an incremental backup with its parents into a full backup.
+ *
+ * The chain from a full backup to the incremental one is folded into a new
+ * full backup, which takes ID of the incremental backup, so that parent
+ * links of its children stay valid. Datafiles are merged block by block
+ * from all versions of the chain by merge_data_file(), other files are
+ * copied from the newest backup having them.
+ *
+ * The merge can be interrupted at any point and resumed by running it
+ * again. Backups of the chain are marked MERGING. The new backup is built
+ * in a hidden directory of the instance, and its BACKUP_CONTROL_FILE is
+ * written last, when everything else is synced. Only then parents of the
+ * incremental backup are deleted, and the new backup replaces it by two
+ * renames; the replaced directory is removed last.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Hidden directories of the instance, skipped by catalog_get_backup_list() */
+#define MERGE_DIR_PREFIX		".merge-"
+#define MERGE_OLD_DIR_PREFIX	".old-"
+
+/* A file of the merged backup and its versions in backups of the chain */
+typedef struct MergeTask
+{
+	pgFileChain *chain;
+	pgFile	   *to_file;
+} MergeTask;
+
+typedef struct
+{
+	const char *to_root;
+	scheduler  *sched;
+	int			thread_num;
+} merge_files_args;
+
+static void merge_chain(parray *backup_list, pgBackup *dest_backup,
+						const char *merge_path);
+static void merge_files(void *arg);
+static void merge_swap(parray *backup_list, pgBackup *dest_backup,
+					   const char *dest_path, const char *merge_path,
+					   const char *old_path);
+static void merge_reset_status(pgBackup **backups, int nbackups);
+static pgBackup *find_backup(parray *backup_list, time_t backup_id);
+static void remove_dir_tree(const char *path);
+static void fsync_dir(const char *path);
+
+/*
+ * Merge backup backup_id with its parents into a full backup.
+ */
+int
+do_merge(time_t backup_id)
+{
+	parray	   *backup_list;
+	pgBackup   *dest_backup;
+	pgBackup   *merged;
+	char	   *backup_id_str = base36enc_dup(backup_id);
+	char		dest_path[MAXPGPATH];
+	char		merge_path[MAXPGPATH];
+	char		old_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+
+	/* Get exclusive lock of backup catalog */
+	catalog_lock();
+
+	backup_list = catalog_get_backup_list(INVALID_BACKUP_ID);
+	if (backup_list == NULL)
+		elog(ERROR, "Failed to get backup list.");
+
+	join_path_components(dest_path, backup_instance_path, backup_id_str);
+	snprintf(path, lengthof(path), MERGE_DIR_PREFIX "%s", backup_id_str);
+	join_path_components(merge_path, backup_instance_path, path);
+	snprintf(path, lengthof(path), MERGE_OLD_DIR_PREFIX "%s", backup_id_str);
+	join_path_components(old_path, backup_instance_path, path);
+	join_path_components(path, merge_path, BACKUP_CONTROL_FILE);
+
+	/*
+	 * The backup is missing if the merge was interrupted between renames,
+	 * and is full if only the replaced directory is left to remove.
+	 */
+	dest_backup = find_backup(backup_list, backup_id);
+	if (dest_backup == NULL && !fileExists(path))
+		elog(ERROR, "Target backup %s was not found", backup_id_str);
+
+	if (dest_backup != NULL && dest_backup->backup_mode == BACKUP_MODE_FULL &&
+		dest_backup->status != BACKUP_STATUS_MERGING)
+		elog(ERROR, "Backup %s is a full backup, there is nothing to merge",
+			 backup_id_str);
+
+	elog(INFO, "Merge of backup %s started", backup_id_str);
+
+	if (dest_backup != NULL && dest_backup->backup_mode != BACKUP_MODE_FULL &&
+		!fileExists(path))
+		merge_chain(backup_list, dest_backup, merge_path);
+
+	if (fileExists(path))
+		merge_swap(backup_list, dest_backup, dest_path, merge_path, old_path);
+
+	if (access(old_path, F_OK) == 0)
+		remove_dir_tree(old_path);
+
+	merged = read_backup(backup_id);
+	if (merged == NULL)
+		elog(ERROR, "Cannot read merged backup %s", backup_id_str);
+	merged->status = BACKUP_STATUS_OK;
+	pgBackupWriteBackupControlFile(merged);
+	pgBackupFree(merged);
+
+	/* Pages of deleted backups may be no longer referenced */
+	dedup_collect_garbage();
+
+	parray_walk(backup_list, pgBackupFree);
+	parray_free(backup_list);
+
+	elog(INFO, "Merge of backup %s completed", backup_id_str);
+	free(backup_id_str);
+
+	return 0;
+}
+
+/*
+ * Weight of the task of merge_chain(): size of the merged file, or size of
+ * the newest version if the size of the file is unknown.
+ */
+static size_t
+merge_task_weight(const void *t)
+{
+	const MergeTask *task = (const MergeTask *) t;
+	const pgFileChain *chain = task->chain;
+
+	if (chain->file->size == 0)
+		return pgFileWeightWriteSize(chain->versions[chain->nversions - 1]);
+	return pgFileWeightSize(chain->file);
+}
+
+/*
+ * Build the full backup merged from the chain ending with dest_backup in
+ * merge_path. BACKUP_CONTROL_FILE is written last, so the merged backup is
+ * complete once it exists.
+ */
+static void
+merge_chain(parray *backup_list, pgBackup *dest_backup, const char *merge_path)
+{
+	pgBackup  **backups;
+	pgBackup   *backup;
+	pgBackup	merged;
+	BackupChain *chain;
+	parray	   *merged_files = parray_new();
+	parray	   *tasks = parray_new();
+	scheduler  *merge_sched;
+	merge_files_args *merge_threads_args[io_threads];
+	char		database_path[MAXPGPATH];
+	char		dict_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	int			nbackups = 0;
+	int			i;
+	size_t		j;
+
+	/* Collect the chain, oldest first */
+	for (backup = dest_backup; ; )
+	{
+		nbackups++;
+		if (backup->backup_mode == BACKUP_MODE_FULL)
+			break;
+		backup = find_backup(backup_list, backup->parent_backup);
+		if (backup == NULL)
+			elog(ERROR, "Parent backup of backup %s was not found",
+				 base36enc(dest_backup->start_time));
+	}
+	backups = pgut_newarray(pgBackup *, nbackups);
+	for (i = nbackups - 1, backup = dest_backup; i >= 0; i--)
+	{
+		backups[i] = backup;
+		backup = find_backup(backup_list, backup->parent_backup);
+	}
+
+	/*
+	 * Checks below fail the same way on every retry, so backups left MERGING
+	 * by an interrupted merge are restorable again after them. Nothing of
+	 * the chain is deleted until the merged backup is complete.
+	 */
+	for (i = 0; i < nbackups; i++)
+	{
+		if (backups[i]->status != BACKUP_STATUS_OK &&
+			backups[i]->status != BACKUP_STATUS_MERGING)
+		{
+			merge_reset_status(backups, nbackups);
+			elog(ERROR, "Backup %s has status %s, it cannot be merged",
+				 base36enc(backups[i]->start_time),
+				 status2str(backups[i]->status));
+		}
+	}
+
+	/* Parents are deleted, so no other backup may depend on them */
+	for (j = 0; j < parray_num(backup_list); j++)
+	{
+		backup = (pgBackup *) parray_get(backup_list, j);
+
+		if (backup->parent_backup == 0)
+			continue;
+		for (i = 0; i < nbackups - 1; i++)
+		{
+			if (backup->parent_backup == backups[i]->start_time &&
+				backup != backups[i + 1])
+			{
+				merge_reset_status(backups, nbackups);
+				elog(ERROR, "Backup %s depends on backup %s, which is merged. "
+					 "Merge or delete it first",
+					 base36enc_dup(backup->start_time),
+					 base36enc_dup(backups[i]->start_time));
+			}
+		}
+	}
+
+	if (backup_chain_get_dict(backups, nbackups, dict_path,
+							  lengthof(dict_path)) > 1)
+	{
+		merge_reset_status(backups, nbackups);
+		elog(ERROR, "More than one backup of the chain has a compression "
+			 "dictionary, the chain cannot be merged");
+	}
+
+	/* Every version of a datafile is merged by its block index */
+	chain = backup_chain_read(backups, nbackups);
+	for (j = 0; j < parray_num(chain->files); j++)
+	{
+		pgFileChain *file_chain = (pgFileChain *) parray_get(chain->files, j);
+		int			k;
+
+		if (!S_ISREG(file_chain->file->mode) ||
+			!file_chain->file->is_datafile || file_chain->file->is_cfs)
+			continue;
+
+		for (k = 0; k < file_chain->nversions; k++)
+		{
+			BackupIndexEntry *index;
+			uint32		nentries;
+
+			index = read_backup_index(file_chain->versions[k], &nentries);
+			if (index == NULL)
+			{
+				merge_reset_status(backups, nbackups);
+				elog(ERROR, "File \"%s\" was backed up without block index, "
+					 "the chain cannot be merged",
+					 file_chain->versions[k]->path);
+			}
+			free(index);
+		}
+	}
+
+	for (i = 0; i < nbackups; i++)
+	{
+		if (backups[i]->status == BACKUP_STATUS_MERGING)
+			continue;
+		backups[i]->status = BACKUP_STATUS_MERGING;
+		pgBackupWriteBackupControlFile(backups[i]);
+	}
+
+	elog(LOG, "merging chain of %d backups ending with %s",
+		 nbackups, base36enc(dest_backup->start_time));
+
+	/* Start over if a previous merge was interrupted */
+	if (access(merge_path, F_OK) == 0)
+		remove_dir_tree(merge_path);
+	join_path_components(database_path, merge_path, DATABASE_DIR);
+	dir_create_dir(database_path, DIR_PERMISSION);
+
+	/* Pages are decompressed and compressed again with the dictionary */
+	if (dict_path[0] != '\0')
+	{
+		pgFile	   *dict = pgFileInit(dict_path);
+		char		dict_root[MAXPGPATH];
+
+		strlcpy(dict_root, dict_path, lengthof(dict_root));
+		get_parent_directory(dict_root);
+		if (!copy_file(dict_root, merge_path, dict))
+			elog(ERROR, "cannot copy compression dictionary \"%s\"", dict_path);
+		pgFileFree(dict);
+		compress_dict_load(dict_path);
+	}
+
+	for (j = 0; j < parray_num(chain->files); j++)
+	{
+		pgFileChain *file_chain = (pgFileChain *) parray_get(chain->files, j);
+		pgFile	   *file = file_chain->file;
+		pgFile	   *to_file;
+		MergeTask  *task;
+
+		join_path_components(path, database_path,
+							 GetRelativePath(file->path,
+											 chain->roots[nbackups - 1]));
+		to_file = pgFileInit(path);
+		to_file->mode = file->mode;
+		to_file->size = file->size;
+		to_file->mtime = file->mtime;
+		to_file->write_size = file->write_size;
+		to_file->crc = file->crc;
+		to_file->is_datafile = file->is_datafile;
+		to_file->is_cfs = file->is_cfs;
+		to_file->segno = file->segno;
+		to_file->compress_alg = file->compress_alg;
+		if (file->linked)
+			to_file->linked = pgut_strdup(file->linked);
+		parray_append(merged_files, to_file);
+
+		if (S_ISDIR(file->mode))
+		{
+			dir_create_dir(path, DIR_PERMISSION);
+			continue;
+		}
+
+		/* Nothing to merge if the file was never backed up */
+		if (!S_ISREG(file->mode) || file_chain->nversions == 0)
+			continue;
+
+		task = pgut_new(MergeTask);
+		task->chain = file_chain;
+		task->to_file = to_file;
+		parray_append(tasks, task);
+	}
+
+	merge_sched = scheduler_new(tasks, merge_task_weight, io_threads);
+	for (i = 0; i < io_threads; i++)
+	{
+		merge_files_args *arg = pg_malloc(sizeof(merge_files_args));
+
+		arg->to_root = database_path;
+		arg->sched = merge_sched;
+		arg->thread_num = i;
+		merge_threads_args[i] = arg;
+	}
+
+	/* Merged files are synced at once after all of them are written */
+	deferred_fsync = fsync_queue_new(backup_instance_path, backup_path, false);
+
+	elog(LOG, "Start %d threads for num:%li", io_threads, parray_num(tasks));
+	scheduler_run(merge_sched, "merge", merge_files,
+				  (void **) merge_threads_args);
+
+	fsync_queue_flush(deferred_fsync, io_threads);
+	fsync_queue_free(deferred_fsync);
+	deferred_fsync = NULL;
+
+	for (i = 0; i < io_threads; i++)
+		pg_free(merge_threads_args[i]);
+	scheduler_free(merge_sched);
+	compress_dict_free();
+
+	/* Write the file list of the merged backup */
+	join_path_components(path, merge_path, DATABASE_FILE_LIST);
+	fp = fopen(path, "wt");
+	if (fp == NULL)
+		elog(ERROR, "cannot open file list \"%s\": %s", path,
+			 strerror(errno));
+	print_file_list(fp, merged_files, database_path);
+	if (fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0 ||
+		fclose(fp))
+		elog(ERROR, "cannot write file list \"%s\": %s", path, strerror(errno));
+
+	/* The merged backup is a full one with ID of dest_backup */
+	merged = *dest_backup;
+	merged.backup_mode = BACKUP_MODE_FULL;
+	merged.parent_backup = 0;
+	merged.dedup = false;
+	merged.status = BACKUP_STATUS_MERGING;
+	merged.data_bytes = 0;
+	for (j = 0; j < parray_num(merged_files); j++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(merged_files, j);
+
+		if (S_ISDIR(file->mode))
+			merged.data_bytes += 4096;
+		if (S_ISREG(file->mode) && file->write_size != BYTES_INVALID)
+			merged.data_bytes += file->write_size;
+	}
+
+	join_path_components(path, merge_path, BACKUP_CONTROL_FILE);
+	fp = fopen(path, "wt");
+	if (fp == NULL)
+		elog(ERROR, "cannot open configuration file \"%s\": %s", path,
+			 strerror(errno));
+	pgBackupWriteControl(fp, &merged);
+	if (fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0 ||
+		fclose(fp))
+		elog(ERROR, "cannot write configuration file \"%s\": %s", path,
+			 strerror(errno));
+	fsync_dir(merge_path);
+
+	/* cleanup */
+	parray_walk(tasks, free);
+	parray_free(tasks);
+	parray_walk(merged_files, pgFileFree);
+	parray_free(merged_files);
+	backup_chain_free(chain);
+	free(backups);
+}
+
+/*
+ * Merge tasks of merge_chain() scheduled to the thread.
+ */
+static void
+merge_files(void *arg)
+{
+	merge_files_args *arguments = (merge_files_args *) arg;
+	MergeTask  *task;
+	size_t		task_no;
+
+	while ((task = (MergeTask *) scheduler_next(arguments->sched,
+												arguments->thread_num,
+												&task_no)) != NULL)
+	{
+		pgFileChain *chain = task->chain;
+		int			newest = chain->nversions - 1;
+		pgFile	   *file = chain->versions[newest];
+		char	   *from_root = chain->roots[newest];
+		pgFile	   *to_file = task->to_file;
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR, "interrupted during merge");
+
+		if (progress)
+			elog(LOG, "Progress: (%lu/%lu). Process file %s ",
+				 (unsigned long) task_no,
+				 (unsigned long) scheduler_num_tasks(arguments->sched),
+				 GetRelativePath(file->path, from_root));
+
+		elog(VERBOSE, "Merging file %s from %d backups, is_datafile %i, is_cfs %i",
+			 file->path, chain->nversions, chain->file->is_datafile?1:0,
+			 chain->file->is_cfs?1:0);
+
+		if (chain->file->is_datafile && !chain->file->is_cfs)
+		{
+			if (!merge_data_file(chain->nversions, chain->versions, to_file))
+				elog(ERROR, "File \"%s\" was backed up without block index, "
+					 "it cannot be merged", file->path);
+		}
+		else
+		{
+			if (!copy_file(from_root, arguments->to_root, file))
+				elog(ERROR, "File \"%s\" is missing in backup", file->path);
+			to_file->write_size = file->write_size;
+			to_file->crc = file->crc;
+		}
+
+		elog(LOG, "Merged file %s : %lu bytes",
+			 to_file->path, (unsigned long) to_file->write_size);
+	}
+}
+
+/*
+ * Replace dest_backup with the merged backup built in merge_path. Parents
+ * of dest_backup are deleted oldest first, so the chain left after an
+ * interruption still ends with dest_backup. dest_backup is missing if
+ * it was renamed to old_path already.
+ */
+static void
+merge_swap(parray *backup_list, pgBackup *dest_backup, const char *dest_path,
+		   const char *merge_path, const char *old_path)
+{
+	if (dest_backup != NULL && dest_backup->backup_mode != BACKUP_MODE_FULL)
+	{
+		parray	   *parents = parray_new();
+		pgBackup   *backup = dest_backup;
+		int			i;
+
+		while ((backup = find_backup(backup_list, backup->parent_backup)) != NULL)
+		{
+			parray_append(parents, backup);
+			if (backup->backup_mode == BACKUP_MODE_FULL)
+				break;
+		}
+
+		for (i = (int) parray_num(parents) - 1; i >= 0; i--)
+		{
+			backup = (pgBackup *) parray_get(parents, i);
+			if (pgBackupDeleteFiles(backup) != 0)
+				elog(ERROR, "Cannot delete backup %s",
+					 base36enc(backup->start_time));
+		}
+		parray_free(parents);
+	}
+
+	if (access(dest_path, F_OK) == 0 && rename(dest_path, old_path) != 0)
+		elog(ERROR, "cannot rename \"%s\" to \"%s\": %s",
+			 dest_path, old_path, strerror(errno));
+	if (rename(merge_path, dest_path) != 0)
+		elog(ERROR, "cannot rename \"%s\" to \"%s\": %s",
+			 merge_path, dest_path, strerror(errno));
+	fsync_dir(backup_instance_path);
+}
+
+/*
+ * Return backups of the chain left MERGING by an interrupted merge to OK,
+ * when the merge cannot go on.
+ */
+static void
+merge_reset_status(pgBackup **backups, int nbackups)
+{
+	int			i;
+
+	for (i = 0; i < nbackups; i++)
+	{
+		if (backups[i]->status != BACKUP_STATUS_MERGING)
+			continue;
+		backups[i]->status = BACKUP_STATUS_OK;
+		pgBackupWriteBackupControlFile(backups[i]);
+	}
+}
+
+/*
+ * Find backup backup_id in the list, NULL if there is no such backup.
+ */
+static pgBackup *
+find_backup(parray *backup_list, time_t backup_id)
+{
+	size_t		i;
+
+	if (backup_id == 0)
+		return NULL;
+
+	for (i = 0; i < parray_num(backup_list); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backup_list, i);
+
+		if (backup->start_time == backup_id)
+			return backup;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the directory and everything in it.
+ */
+static void
+remove_dir_tree(const char *path)
+{
+	parray	   *files = parray_new();
+	size_t		i;
+
+	dir_list_file(files, path, false, true, true);
+
+	/* delete leaf node first */
+	parray_qsort(files, pgFileComparePathDesc);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		if (remove(file->path) != 0 && errno != ENOENT)
+			elog(ERROR, "can't remove \"%s\": %s", file->path,
+				 strerror(errno));
+	}
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
+
+/*
+ * Make entries of the directory durable.
+ */
+static void
+fsync_dir(const char *path)
+{
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		elog(ERROR, "cannot open directory \"%s\": %s", path, strerror(errno));
+	if (fsync(fd) != 0)
+		elog(ERROR, "cannot fsync directory \"%s\": %s", path, strerror(errno));
+	close(fd);
+}
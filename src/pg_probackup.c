@@ -38,6 +38,9 @@ char		arclog_path[MAXPGPATH] = "";
 /* common options */
 char	   *backup_id_string_param = NULL;
 int			num_threads = 1;
+int			io_depth = DEFAULT_IO_DEPTH;
+int			io_threads = 0;		/* threads reading and writing files */
+int			cpu_threads = 0;	/* threads compressing pages */
 bool		stream_wal = false;
 bool		progress = false;
 #if PG_VERSION_NUM >= 100000
@@ -56,6 +59,13 @@ const char *master_host = NULL;
 const char *master_port= NULL;
 const char *master_user = NULL;
 uint32		replica_timeout = 300;		/* default is 300 seconds */
+bool		no_cache = false;
+bool		dedup = false;
+
+/* throttle options */
+uint32		read_rate_limit = 0;		/* kB per second, 0 for no limit */
+uint32		read_iops_limit = 0;
+uint32		throttle_latency = 0;		/* in milliseconds, 0 to disable */
 
 /* restore options */
 static char		   *target_time;
@@ -63,6 +73,9 @@ static char		   *target_xid;
 static char		   *target_inclusive;
 static TimeLineID	target_tli;
 
+/* show options */
+bool		show_stats = false;
+
 /* delete options */
 bool		delete_wal = false;
 bool		delete_expired = false;
@@ -77,6 +90,7 @@ uint32		retention_window = 0;
 CompressAlg compress_alg = NOT_DEFINED_COMPRESS;
 int			compress_level = DEFAULT_COMPRESS_LEVEL;
 bool 		compress_shortcut = false;
+bool		compress_dict = false;
 
 /* other options */
 char	   *instance_name;
@@ -108,6 +122,9 @@ static pgut_option options[] =
 	{ 's', 'B', "backup-path",			&backup_path,		SOURCE_CMDLINE },
 	/* common options */
 	{ 'u', 'j', "threads",				&num_threads,		SOURCE_CMDLINE },
+	{ 'u', 4, "io-depth",				&io_depth,			SOURCE_CMDLINE },
+	{ 'u', 5, "io-threads",				&io_threads,		SOURCE_CMDLINE },
+	{ 'u', 6, "cpu-threads",			&cpu_threads,		SOURCE_CMDLINE },
 	{ 'b', 2, "stream",					&stream_wal,		SOURCE_CMDLINE },
 	{ 'b', 3, "progress",				&progress,			SOURCE_CMDLINE },
 	{ 's', 'i', "backup-id",			&backup_id_string_param, SOURCE_CMDLINE },
@@ -124,6 +141,8 @@ static pgut_option options[] =
 	{ 's', 16, "master-port",			&master_port,		SOURCE_CMDLINE, },
 	{ 's', 17, "master-user",			&master_user,		SOURCE_CMDLINE, },
 	{ 'u', 18, "replica-timeout",		&replica_timeout,	SOURCE_CMDLINE,	SOURCE_DEFAULT,	OPTION_UNIT_S },
+	{ 'b', 19, "no-cache",				&no_cache,			SOURCE_CMDLINE },
+	{ 'b', 24, "dedup",					&dedup,				SOURCE_CMDLINE },
 	/* TODO not completed feature. Make it unavailiable from user level
 	 { 'b', 18, "remote",				&is_remote_backup,	SOURCE_CMDLINE, }, */
 	/* restore options */
@@ -132,6 +151,8 @@ static pgut_option options[] =
 	{ 's', 22, "inclusive",				&target_inclusive,	SOURCE_CMDLINE },
 	{ 'u', 23, "timeline",				&target_tli,		SOURCE_CMDLINE },
 	{ 'f', 'T', "tablespace-mapping",	opt_tablespace_map,	SOURCE_CMDLINE },
+	/* show options */
+	{ 'b', 180, "stats",				&show_stats,		SOURCE_CMDLINE },
 	/* delete options */
 	{ 'b', 130, "wal",					&delete_wal,		SOURCE_CMDLINE },
 	{ 'b', 131, "expired",				&delete_expired,	SOURCE_CMDLINE },
@@ -145,6 +166,7 @@ static pgut_option options[] =
 	{ 'f', 136, "compress-algorithm",	opt_compress_alg,	SOURCE_CMDLINE },
 	{ 'u', 137, "compress-level",		&compress_level,	SOURCE_CMDLINE },
 	{ 'b', 138, "compress",				&compress_shortcut,	SOURCE_CMDLINE },
+	{ 'b', 139, "compress-dict",		&compress_dict,		SOURCE_CMDLINE },
 	/* logging options */
 	{ 'f', 140, "log-level-console",	opt_log_level_console,	SOURCE_CMDLINE },
 	{ 'f', 141, "log-level-file",		opt_log_level_file,	SOURCE_CMDLINE },
@@ -153,6 +175,10 @@ static pgut_option options[] =
 	{ 's', 144, "log-directory",		&log_directory,		SOURCE_CMDLINE },
 	{ 'u', 145, "log-rotation-size",	&log_rotation_size,	SOURCE_CMDLINE,	SOURCE_DEFAULT,	OPTION_UNIT_KB },
 	{ 'u', 146, "log-rotation-age",		&log_rotation_age,	SOURCE_CMDLINE,	SOURCE_DEFAULT,	OPTION_UNIT_MIN },
+	/* throttle options */
+	{ 'u', 170, "read-rate-limit",		&read_rate_limit,	SOURCE_CMDLINE,	SOURCE_DEFAULT,	OPTION_UNIT_KB },
+	{ 'u', 171, "read-iops-limit",		&read_iops_limit,	SOURCE_CMDLINE },
+	{ 'u', 172, "throttle-latency",		&throttle_latency,	SOURCE_CMDLINE,	SOURCE_DEFAULT,	OPTION_UNIT_MS },
 	/* connection options */
 	{ 's', 'd', "pgdatabase",			&pgut_dbname,		SOURCE_CMDLINE },
 	{ 's', 'h', "pghost",				&host,				SOURCE_CMDLINE },
@@ -215,6 +241,8 @@ main(int argc, char *argv[])
 			backup_subcmd = SET_CONFIG;
 		else if (strcmp(argv[1], "show-config") == 0)
 			backup_subcmd = SHOW_CONFIG;
+		else if (strcmp(argv[1], "merge") == 0)
+			backup_subcmd = MERGE;
 		else if (strcmp(argv[1], "--help") == 0
 				|| strcmp(argv[1], "help") == 0
 				|| strcmp(argv[1], "-?") == 0)
@@ -362,6 +390,7 @@ main(int argc, char *argv[])
 		if (backup_subcmd != RESTORE
 			&& backup_subcmd != VALIDATE
 			&& backup_subcmd != DELETE
+			&& backup_subcmd != MERGE
 			&& backup_subcmd != SHOW)
 			elog(ERROR, "Cannot use -i (--backup-id) option together with the '%s' command",
 						argv[1]);
@@ -396,6 +425,16 @@ main(int argc, char *argv[])
 	if (num_threads < 1)
 		num_threads = 1;
 
+	/*
+	 * Files are read and written by -j threads unless --io-threads is set.
+	 * Without --cpu-threads the same threads verify and compress pages.
+	 */
+	if (io_threads < 1)
+		io_threads = num_threads;
+
+	if (io_depth < 1)
+		io_depth = 1;
+
 	compress_init();
 
 	/* do actual operation */
@@ -452,6 +491,10 @@ main(int argc, char *argv[])
 				return do_retention_purge();
 			else
 				return do_delete(current.backup_id);
+		case MERGE:
+			if (!backup_id_string_param)
+				elog(ERROR, "You must specify parameter (-i, --backup-id) for 'merge' command");
+			return do_merge(current.backup_id);
 		case SHOW_CONFIG:
 			return do_configure(true);
 		case SET_CONFIG:
@@ -496,6 +539,10 @@ parse_compress_alg(const char *arg)
 		return ZLIB_COMPRESS;
 	else if (pg_strncasecmp("pglz", arg, len) == 0)
 		return PGLZ_COMPRESS;
+	else if (pg_strncasecmp("zstd", arg, len) == 0)
+		return ZSTD_COMPRESS;
+	else if (pg_strncasecmp("lz4", arg, len) == 0)
+		return LZ4_COMPRESS;
 	else if (pg_strncasecmp("none", arg, len) == 0)
 		return NONE_COMPRESS;
 	else
@@ -516,6 +563,10 @@ deparse_compress_alg(int alg)
 			return "zlib";
 		case PGLZ_COMPRESS:
 			return "pglz";
+		case ZSTD_COMPRESS:
+			return "zstd";
+		case LZ4_COMPRESS:
+			return "lz4";
 	}
 
 	return NULL;
@@ -550,14 +601,33 @@ void compress_init(void)
 	if (compress_level == 0)
 		compress_alg = NOT_DEFINED_COMPRESS;
 
-	if (backup_subcmd == BACKUP || backup_subcmd == ARCHIVE_PUSH)
+	if (backup_subcmd == BACKUP || backup_subcmd == ARCHIVE_PUSH ||
+		backup_subcmd == MERGE)
 	{
 #ifndef HAVE_LIBZ
 		if (compress_alg == ZLIB_COMPRESS)
 			elog(ERROR, "This build does not support zlib compression");
 		else
 #endif
-		if (compress_alg == PGLZ_COMPRESS && num_threads > 1)
+#ifndef HAVE_LIBZSTD
+		if (compress_alg == ZSTD_COMPRESS)
+			elog(ERROR, "This build does not support zstd compression");
+		else
+#endif
+#ifndef HAVE_LIBLZ4
+		if (compress_alg == LZ4_COMPRESS)
+			elog(ERROR, "This build does not support lz4 compression");
+		else
+#endif
+		if (compress_alg == PGLZ_COMPRESS &&
+			(num_threads > 1 || io_threads > 1 || cpu_threads > 0))
 			elog(ERROR, "Multithread backup does not support pglz compression");
+
+		if (compress_dict && compress_alg != ZSTD_COMPRESS)
+			elog(ERROR, "--compress-dict option requires zstd compress algorithm");
+
+		/* Pages in the page store are shared by backups, unlike dictionary */
+		if (compress_dict && dedup)
+			elog(ERROR, "--compress-dict option cannot be used with --dedup");
 	}
 }
@@ -17,6 +17,7 @@
 
 #ifndef WIN32
 #include <sys/mman.h>
+#include <sys/uio.h>
 #endif
 
 #include "access/timeline.h"
@@ -27,10 +28,17 @@
 #include "storage/bufpage.h"
 #include "storage/checksum.h"
 #include "utils/pg_crc.h"
+#include "portability/instr_time.h"
 #include "common/relpath.h"
 
 #include "utils/parray.h"
 #include "utils/pgut.h"
+#include "utils/scheduler.h"
+#include "utils/aio.h"
+#include "utils/throttle.h"
+#include "utils/sha256.h"
+#include "utils/fsync_queue.h"
+#include "utils/work_pool.h"
 
 #include "datapagemap.h"
 
@@ -54,11 +62,14 @@
 #define PG_GLOBAL_DIR			"global"
 #define BACKUP_CONTROL_FILE		"backup.control"
 #define BACKUP_CATALOG_CONF_FILE	"pg_probackup.conf"
+#define DEDUP_DIR				"pages"
 #define BACKUP_CATALOG_PID		"pg_probackup.pid"
 #define DATABASE_FILE_LIST		"backup_content.control"
+#define BACKUP_STATS_FILE		"backup_stats.control"
 #define PG_BACKUP_LABEL_FILE	"backup_label"
 #define PG_BLACK_LIST			"black_list"
 #define PG_TABLESPACE_MAP_FILE "tablespace_map"
+#define COMPRESS_DICT_FILE		"compress.dict"
 
 /* Direcotry/File permission */
 #define DIR_PERMISSION		(0700)
@@ -75,6 +86,8 @@ typedef enum CompressAlg
 	NONE_COMPRESS,
 	PGLZ_COMPRESS,
 	ZLIB_COMPRESS,
+	ZSTD_COMPRESS,
+	LZ4_COMPRESS,
 } CompressAlg;
 
 /* Information about single file (or dir) in backup */
@@ -83,6 +96,7 @@ typedef struct pgFile
 	char	*name;			/* file or directory name */
 	mode_t	mode;			/* protection (file type and permission) */
 	size_t	size;			/* size of the file */
+	time_t	mtime;			/* modification time of the file */
 	size_t	read_size;		/* size of the portion read (if only some pages are
 							   backed up, it's different from size) */
 	size_t	write_size;		/* size of the backed-up file. BYTES_INVALID means
@@ -100,7 +114,6 @@ typedef struct pgFile
 	bool	is_cfs;			/* Flag to distinguish files compressed by CFS*/
 	bool	is_database;
 	CompressAlg compress_alg; /* compression algorithm applied to the file */
-	volatile uint32 lock;	/* lock for synchronization of parallel threads  */
 	datapagemap_t pagemap;	/* bitmap of pages updated since previous backup */
 } pgFile;
 
@@ -119,7 +132,8 @@ typedef enum BackupStatus
 	BACKUP_STATUS_DELETED,		/* data files have been deleted */
 	BACKUP_STATUS_DONE,			/* completed but not validated yet */
 	BACKUP_STATUS_ORPHAN,		/* backup validity is unknown but at least one parent backup is corrupted */
-	BACKUP_STATUS_CORRUPT		/* files are corrupted, not available */
+	BACKUP_STATUS_CORRUPT,		/* files are corrupted, not available */
+	BACKUP_STATUS_MERGING		/* backup is being merged into a full backup */
 } BackupStatus;
 
 typedef enum BackupMode
@@ -127,6 +141,7 @@ typedef enum BackupMode
 	BACKUP_MODE_INVALID = 0,
 	BACKUP_MODE_DIFF_PAGE,		/* incremental page backup */
 	BACKUP_MODE_DIFF_PTRACK,	/* incremental page backup with ptrack system*/
+	BACKUP_MODE_DIFF_DELTA,		/* incremental page backup with lsn comparison */
 	BACKUP_MODE_FULL			/* full backup */
 } BackupMode;
 
@@ -143,7 +158,8 @@ typedef enum ProbackupSubcmd
 	SHOW,
 	DELETE,
 	SET_CONFIG,
-	SHOW_CONFIG
+	SHOW_CONFIG,
+	MERGE
 } ProbackupSubcmd;
 
 
@@ -210,6 +226,8 @@ typedef struct pgBackup
 	int64			data_bytes;
 	/* Size of WAL files in archive needed to restore this backup */
 	int64			wal_bytes;
+	/* Time spent to make files of the backup durable, in milliseconds */
+	uint32			fsync_time;
 
 	/* Fields needed for compatibility check */
 	uint32			block_size;
@@ -220,6 +238,8 @@ typedef struct pgBackup
 
 	bool			stream; 		/* Was this backup taken in stream mode?
 									 * i.e. does it include all needed WAL files? */
+	bool			dedup;			/* Are pages of this backup stored in the
+									 * page store? */
 	time_t			parent_backup; 	/* Identifier of the previous backup.
 									 * Which is basic backup for this
 									 * incremental backup. */
@@ -242,6 +262,142 @@ typedef union DataPage
        char                    data[BLCKSZ];
 } DataPage;
 
+/*
+ * When copying datafiles to backup we validate and compress them block
+ * by block. Thus special header is required for each data block.
+ */
+typedef struct BackupPageHeader
+{
+	BlockNumber	block;			/* block number */
+	int32		compressed_size;
+} BackupPageHeader;
+
+/* Special values for compressed_size field */
+#define PageIsTruncated -2
+#define PageIsZeroed	-3		/* all-zero page, stored without payload */
+#define PageIsDeduplicated -4	/* page is in the page store, payload is its
+								 * SHA-256 hash */
+
+/* Size of payload following the header of backup record */
+#define BackupRecordPayloadSize(compressed_size) \
+	((compressed_size) > 0 ? MAXALIGN(compressed_size) : \
+	 (compressed_size) == PageIsDeduplicated ? SHA256_DIGEST_LEN : 0)
+
+/* Maximum number of contiguous blocks read from a datafile at once */
+#define BACKUP_READ_BLOCKS	((1024 * 1024) / BLCKSZ)
+
+/* Runs of pages of a file in flight through cpu_pool per I/O thread */
+#define CPU_PIPELINE_DEPTH	4
+
+/*
+ * Datafiles larger than this number of blocks are split into parts, which
+ * are backed up and restored by different threads. See pgFilePart.
+ */
+#define FILE_PART_BLOCKS	((128 * 1024 * 1024) / BLCKSZ)
+
+/*
+ * A range of blocks of a file, which is the unit of work of backup and
+ * restore threads. Most files make a single part covering the whole file.
+ * Parts of a split file share its pgFileSplit, and the thread which
+ * finishes the last part of the file completes it.
+ */
+typedef struct pgFileSplit pgFileSplit;
+
+typedef struct pgFilePart
+{
+	pgFile	   *file;
+	BlockNumber	start;			/* first block of the part */
+	BlockNumber	end;			/* block following the last one */
+	int			partno;
+	pgFileSplit *split;			/* NULL if the file is not split */
+} pgFilePart;
+
+/*
+ * Versions of a file backed up by a chain of backups from a full backup to
+ * an incremental one, oldest first: backups which have the file backed up.
+ * A non-data file has the newest version only.
+ */
+typedef struct pgFileChain
+{
+	pgFile	   *file;			/* the file in the newest backup */
+	int			nversions;
+	pgFile	  **versions;
+	char	  **roots;			/* database directories of versions */
+	pgBackup  **backups;		/* backups of versions */
+} pgFileChain;
+
+/*
+ * Chain of backups from a full backup to an incremental one with their file
+ * lists, restored or merged at once, see backup_chain_read().
+ */
+typedef struct BackupChain
+{
+	int			nbackups;
+	pgBackup  **backups;		/* oldest first */
+	char	  **roots;			/* database directories of backups */
+	parray	  **lists;			/* file lists of backups, sorted by path */
+	parray	   *files;			/* pgFileChain of every file of the newest
+								 * backup, in its order */
+} BackupChain;
+
+/*
+ * Index of a backed-up datafile, stored next to it in file with
+ * BACKUP_INDEX_SUFFIX. It maps block numbers to backup records, so that
+ * a single block can be read without scanning the file. Entries are
+ * ordered by offset of the record.
+ */
+#define BACKUP_INDEX_SUFFIX		".idx"
+#define BACKUP_INDEX_MAGIC		0x58494250	/* "PBIX" */
+#define BACKUP_INDEX_VERSION	1
+
+typedef struct BackupIndexHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nentries;
+	pg_crc32	crc;			/* CRC of entries */
+} BackupIndexHeader;
+
+typedef struct BackupIndexEntry
+{
+	uint64		offset;			/* offset of BackupPageHeader in the file */
+	BlockNumber	block;
+	int32		compressed_size;	/* as in BackupPageHeader */
+	pg_crc32	crc;			/* CRC of the header and payload */
+	uint32		reserved;
+} BackupIndexEntry;
+
+/* Size of the record described by the index entry */
+#define BackupIndexEntrySize(entry) \
+	(sizeof(BackupPageHeader) + BackupRecordPayloadSize((entry)->compressed_size))
+
+/* Size of zstd dictionary trained by --compress-dict and pages sampled */
+#define COMPRESS_DICT_SIZE		(112 * 1024)
+#define COMPRESS_DICT_SAMPLES	2048
+
+/*
+ * Counters of a backup thread, written to BACKUP_STATS_FILE. Pages are
+ * those of datafiles, times are spent on them as well, except copy_time.
+ */
+typedef struct BackupThreadStats
+{
+	uint64		files_copied;
+	uint64		files_skipped;	/* not changed since the previous backup */
+	uint64		bytes_read;
+	uint64		bytes_written;
+	uint64		data_bytes_read;	/* of datafiles, for compression ratio */
+	uint64		data_bytes_written;
+	uint64		pages_read;
+	uint64		pages_skipped;	/* not changed, in DELTA mode */
+	uint64		pages_zero;
+	uint64		pages_retried;	/* torn pages read again */
+	instr_time	read_time;
+	instr_time	compress_time;	/* verification, compression and hashing */
+	instr_time	write_time;
+	instr_time	fsync_time;
+	instr_time	copy_time;		/* copying files other than datafiles */
+} BackupThreadStats;
+
 typedef struct
 {
 	const char *from_root;
@@ -249,8 +405,28 @@ typedef struct
 	parray *backup_files_list;
 	parray *prev_backup_filelist;
 	XLogRecPtr prev_backup_start_lsn;
+	time_t	prev_backup_start_time;
+	scheduler *sched;			/* distributes files among threads */
+	int		thread_num;
 	PGconn *thread_backup_conn;
 	PGcancel *thread_cancel_conn;
+	bool	ptrack_stmt_prepared;	/* is statement to get blocks prepared */
+
+	/*
+	 * Buffers used to read, compress and write pages of datafiles, allocated
+	 * once per thread by init_backup_buffers().
+	 */
+	char	   *read_buf;		/* BACKUP_READ_BLOCKS pages */
+	char	   *compress_buf;	/* BACKUP_READ_BLOCKS compressed pages */
+	BackupPageHeader *page_headers;	/* BACKUP_READ_BLOCKS headers */
+	uint8	   *page_hashes;	/* BACKUP_READ_BLOCKS hashes, with --dedup */
+	struct iovec *iov;			/* header and payload for each block */
+	BackupIndexEntry *index;	/* index of the file being copied */
+	uint32		index_size;		/* allocated entries of index */
+	BlockNumber *retry;			/* blocks of the file to read again */
+	uint32		retry_size;		/* allocated entries of retry */
+
+	BackupThreadStats stats;
 } backup_files_args;
 
 /*
@@ -280,6 +456,12 @@ extern char		arclog_path[MAXPGPATH];
 
 /* common options */
 extern int		num_threads;
+extern int		io_depth;
+extern int		io_threads;
+extern int		cpu_threads;
+
+/* Number of reads and writes kept in flight by a thread, with io_uring */
+#define DEFAULT_IO_DEPTH	32
 extern bool		stream_wal;
 extern bool		progress;
 #if PG_VERSION_NUM >= 100000
@@ -297,6 +479,13 @@ extern const char *master_host;
 extern const char *master_port;
 extern const char *master_user;
 extern uint32	replica_timeout;
+extern bool		no_cache;
+extern bool		dedup;
+
+/* throttle options */
+extern uint32	read_rate_limit;
+extern uint32	read_iops_limit;
+extern uint32	throttle_latency;
 
 extern bool is_ptrack_support;
 extern bool is_checksum_enabled;
@@ -308,6 +497,9 @@ extern bool		delete_expired;
 extern bool		apply_to_all;
 extern bool		force_delete;
 
+/* show options */
+extern bool		show_stats;
+
 /* retention options */
 extern uint32	retention_redundancy;
 extern uint32	retention_window;
@@ -316,6 +508,7 @@ extern uint32	retention_window;
 extern CompressAlg compress_alg;
 extern int		compress_level;
 extern bool		compress_shortcut;
+extern bool		compress_dict;
 
 #define DEFAULT_COMPRESS_LEVEL 6
 
@@ -334,16 +527,23 @@ extern ProbackupSubcmd	backup_subcmd;
 extern const char *pgdata_exclude_dir[];
 
 /* in backup.c */
+extern throttle *backup_throttle;
 extern int do_backup(time_t start_time);
 extern BackupMode parse_backup_mode(const char *value);
 extern const char *deparse_backup_mode(BackupMode mode);
 extern void process_block_change(ForkNumber forknum, RelFileNode rnode,
 								 BlockNumber blkno);
 
-extern char *pg_ptrack_get_block(backup_files_args *arguments,
-								 Oid dbOid, Oid tblsOid, Oid relOid, 
-								 BlockNumber blknum,
-								 size_t *result_size);
+extern bool pg_ptrack_get_block(backup_files_args *arguments,
+								Oid dbOid, Oid tblsOid, Oid relOid,
+								BlockNumber blknum, char *page,
+								size_t *page_size);
+extern void pg_ptrack_get_blocks_begin(backup_files_args *arguments,
+									   pgFile *file, BlockNumber nblocks);
+extern bool pg_ptrack_get_blocks_next(backup_files_args *arguments,
+									  pgFile *file, BlockNumber blknum,
+									  char *page, size_t *page_size);
+extern void pg_ptrack_get_blocks_end(backup_files_args *arguments);
 /* in restore.c */
 extern int do_restore_or_validate(time_t target_backup_id,
 					  const char *target_time,
@@ -355,6 +555,10 @@ extern bool satisfy_timeline(const parray *timelines, const pgBackup *backup);
 extern bool satisfy_recovery_target(const pgBackup *backup,
 									const pgRecoveryTarget *rt);
 extern parray * readTimeLineHistory_probackup(TimeLineID targetTLI);
+extern int backup_chain_get_dict(pgBackup **backups, int nbackups,
+								 char *dict_path, size_t len);
+extern BackupChain *backup_chain_read(pgBackup **backups, int nbackups);
+extern void backup_chain_free(BackupChain *chain);
 extern pgRecoveryTarget *parseRecoveryTargetOptions(
 	const char *target_time,
 	const char *target_xid,
@@ -382,10 +586,26 @@ extern pgBackupConfig* readBackupCatalogConfigFile(void);
 /* in show.c */
 extern int do_show(time_t requested_backup_id);
 
+/* in merge.c */
+extern int do_merge(time_t backup_id);
+
 /* in delete.c */
 extern int do_delete(time_t backup_id);
 extern int do_retention_purge(void);
 extern int do_delete_instance(void);
+extern int pgBackupDeleteFiles(pgBackup *backup);
+
+/* in dedup.c */
+extern void dedup_page_path(char *path, size_t len, const uint8 *hash);
+extern void dedup_store_init(void);
+extern bool dedup_has_page(const uint8 *hash);
+extern void dedup_put_page(const uint8 *hash, const char *payload, int32 size,
+						   CompressAlg compress_alg);
+extern bool dedup_get_page(const uint8 *hash, char *payload, int32 *size,
+						   CompressAlg *compress_alg);
+extern void dedup_collect_garbage(void);
+extern void dedup_store_remove(void);
+extern bool dedup_validate_file(pgFile *file);
 
 /* in fetch.c */
 extern char *slurpFile(const char *datadir,
@@ -445,14 +665,49 @@ extern int pgFileComparePath(const void *f1, const void *f2);
 extern int pgFileComparePathDesc(const void *f1, const void *f2);
 extern int pgFileCompareLinked(const void *f1, const void *f2);
 extern int pgFileCompareSize(const void *f1, const void *f2);
+extern size_t pgFileWeightSize(const void *f);
+extern size_t pgFileWeightWriteSize(const void *f);
+
+/* in checksum.c */
+extern void (*pg_checksum_pages) (char *pages, int npages, BlockNumber blkno,
+								  uint16 *checksums);
 
 /* in data.c */
+extern fsync_queue *deferred_fsync;
+extern work_pool *cpu_pool;
+extern void compress_dict_build(parray *files, const char *dict_path);
+extern void compress_dict_load(const char *dict_path);
+extern void compress_dict_free(void);
+extern BackupIndexEntry *read_backup_index(pgFile *file, uint32 *nentries);
+extern bool read_backup_block(pgFile *file, BackupIndexEntry *index,
+							  uint32 nentries, BlockNumber blknum, char *page);
+extern bool check_backup_index(pgFile *file);
+extern bool read_dedup_page(const uint8 *hash, char *page);
+extern void init_backup_buffers(backup_files_args *arguments);
+extern void free_backup_buffers(backup_files_args *arguments);
 extern bool backup_data_file(backup_files_args* arguments,
 							 const char *from_root, const char *to_root,
 							 pgFile *file, XLogRecPtr prev_backup_start_lsn,
 							 BackupMode backup_mode);
+extern bool backup_data_file_part(backup_files_args* arguments,
+								  const char *from_root, const char *to_root,
+								  pgFilePart *part,
+								  XLogRecPtr prev_backup_start_lsn,
+								  BackupMode backup_mode);
 extern void restore_data_file(const char *from_root, const char *to_root,
 							  pgFile *file, pgBackup *backup);
+extern void restore_data_file_part(const char *from_root, const char *to_root,
+								   pgFilePart *part);
+extern bool restore_data_file_chain(int nversions, pgFile **versions,
+								   char **roots, const char *to_root,
+								   BlockNumber start, BlockNumber end);
+extern bool merge_data_file(int nversions, pgFile **versions,
+							pgFile *to_file);
+extern parray *backup_file_parts(parray *files, bool split);
+extern parray *restore_file_parts(parray *files, bool split);
+extern void free_file_parts(parray *parts);
+extern size_t pgFilePartWeightSize(const void *p);
+extern size_t pgFilePartWeightWriteSize(const void *p);
 extern bool copy_file(const char *from_root, const char *to_root,
 					  pgFile *file);
 extern void push_wal_file(const char *from_path, const char *to_path,
@@ -22,8 +22,24 @@ typedef struct
 {
 	parray *files;
 	pgBackup *backup;
+	scheduler *sched;
+	int		thread_num;
 } restore_files_args;
 
+/*
+ * Task of restore_chain(): blocks [start, end) of a file. Large datafiles
+ * are split into parts of FILE_PART_BLOCKS blocks restored by different
+ * threads, other files are restored by a single task.
+ */
+typedef struct RestoreChainTask
+{
+	pgFileChain *chain;
+	BlockNumber	start;
+	BlockNumber	end;
+	int			partno;
+	int			nparts;
+} RestoreChainTask;
+
 /* Tablespace mapping structures */
 
 typedef struct TablespaceListCell
@@ -52,6 +68,9 @@ typedef struct TablespaceCreatedList
 	TablespaceCreatedListCell *tail;
 } TablespaceCreatedList;
 
+static void restore_chain(pgBackup **backups, int nbackups,
+						  const char *dict_path);
+static void restore_chain_files(void *arg);
 static void restore_backup(pgBackup *backup);
 static void restore_directories(const char *pg_data_dir,
 								const char *backup_dir);
@@ -299,18 +318,44 @@ do_restore_or_validate(time_t target_backup_id,
 	/* We ensured that all backups are valid, now restore if required */
 	if (is_restore)
 	{
-		for (i = base_full_backup_index; i >= dest_backup_index; i--)
-		{
-			pgBackup   *backup = (pgBackup *) parray_get(backups, i);
-			restore_backup(backup);
-		}
+		int			nbackups = base_full_backup_index - dest_backup_index + 1;
+		pgBackup   *chain[nbackups];
+		char		dict_path[MAXPGPATH];
 
 		/*
-		 * Delete files which are not in dest backup file list. Files which were
-		 * deleted between previous and current backup are not in the list.
+		 * Files restored from all backups of the chain are synced at once,
+		 * a file written by several backups is synced once.
 		 */
-		if (dest_backup->backup_mode != BACKUP_MODE_FULL)
-			remove_deleted_files(dest_backup);
+		deferred_fsync = fsync_queue_new(pgdata, pgdata, false);
+
+		/* Backups of the chain, oldest first */
+		for (i = 0; i < nbackups; i++)
+			chain[i] = (pgBackup *) parray_get(backups,
+											   base_full_backup_index - i);
+
+		if (backup_chain_get_dict(chain, nbackups, dict_path,
+								  lengthof(dict_path)) <= 1)
+			restore_chain(chain, nbackups, dict_path);
+		else
+		{
+			/*
+			 * Backups compressed with different dictionaries are restored
+			 * one after another, each with its own dictionary.
+			 */
+			for (i = base_full_backup_index; i >= dest_backup_index; i--)
+			{
+				pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+				restore_backup(backup);
+			}
+
+			/*
+			 * Delete files which are not in dest backup file list. Files which
+			 * were deleted between previous and current backup are not in the
+			 * list.
+			 */
+			if (dest_backup->backup_mode != BACKUP_MODE_FULL)
+				remove_deleted_files(dest_backup);
+		}
 
 		/* Create recovery.conf with given recovery target parameters */
 		if (!dest_backup->stream
@@ -319,6 +364,10 @@ do_restore_or_validate(time_t target_backup_id,
 			create_recovery_conf(target_backup_id, target_time, target_xid,
 								target_inclusive, target_tli);
 		}
+
+		fsync_queue_flush(deferred_fsync, io_threads);
+		fsync_queue_free(deferred_fsync);
+		deferred_fsync = NULL;
 	}
 
 	/* cleanup */
@@ -330,6 +379,311 @@ do_restore_or_validate(time_t target_backup_id,
 	return 0;
 }
 
+/*
+ * Weight of the task of restore_chain(): size of the restored file or its
+ * part, or size of the newest version if the size of the file is unknown.
+ */
+static size_t
+chain_task_weight(const void *t)
+{
+	const RestoreChainTask *task = (const RestoreChainTask *) t;
+	const pgFileChain *chain = task->chain;
+
+	if (chain->file->size == 0)
+		return pgFileWeightWriteSize(chain->versions[chain->nversions - 1]);
+	return pgFileWeightSize(chain->file) / task->nparts;
+}
+
+/*
+ * Find the compression dictionary of backups of the chain. Pages are
+ * decompressed with a single dictionary at a time, so the chain can be
+ * restored or merged at once only if at most one of its backups has one.
+ * Returns the number of backups having a dictionary, dict_path is set to
+ * the path of the dictionary if there is one.
+ */
+int
+backup_chain_get_dict(pgBackup **backups, int nbackups, char *dict_path,
+					  size_t len)
+{
+	int			ndicts = 0;
+	int			i;
+
+	dict_path[0] = '\0';
+	for (i = 0; i < nbackups; i++)
+	{
+		char		path[MAXPGPATH];
+
+		pgBackupGetPath(backups[i], path, lengthof(path), COMPRESS_DICT_FILE);
+		if (fileExists(path))
+		{
+			strlcpy(dict_path, path, len);
+			ndicts++;
+		}
+	}
+
+	return ndicts;
+}
+
+/*
+ * Read file lists of a chain of backups from a full backup to an
+ * incremental one, oldest first, and find versions of every file of the
+ * newest backup: the newest version of a non-data file, and all versions
+ * of a datafile, which are merged by restore_data_file_chain() or
+ * merge_data_file(). Versions are backups which have the file backed up.
+ */
+BackupChain *
+backup_chain_read(pgBackup **backups, int nbackups)
+{
+	BackupChain *chain = pgut_new(BackupChain);
+	parray	   *dest_files;
+	char		path[MAXPGPATH];
+	int			i;
+	size_t		j;
+
+	chain->nbackups = nbackups;
+	chain->backups = pgut_newarray(pgBackup *, nbackups);
+	chain->roots = pgut_newarray(char *, nbackups);
+	chain->lists = pgut_newarray(parray *, nbackups);
+	chain->files = parray_new();
+
+	for (i = 0; i < nbackups; i++)
+	{
+		pgBackup   *backup = backups[i];
+		char		database_path[MAXPGPATH];
+
+		/* confirm block size compatibility */
+		if (backup->block_size != BLCKSZ)
+			elog(ERROR,
+				"BLCKSZ(%d) is not compatible(%d expected)",
+				backup->block_size, BLCKSZ);
+		if (backup->wal_block_size != XLOG_BLCKSZ)
+			elog(ERROR,
+				"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
+				backup->wal_block_size, XLOG_BLCKSZ);
+
+		pgBackupGetPath(backup, database_path, lengthof(database_path),
+						DATABASE_DIR);
+		pgBackupGetPath(backup, path, lengthof(path), DATABASE_FILE_LIST);
+
+		chain->backups[i] = backup;
+		chain->roots[i] = pgut_strdup(database_path);
+		chain->lists[i] = dir_read_file_list(database_path, path);
+		/* Paths share the root, so they are sorted as relative ones */
+		parray_qsort(chain->lists[i], pgFileComparePath);
+	}
+
+	dest_files = chain->lists[nbackups - 1];
+	for (j = 0; j < parray_num(dest_files); j++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(dest_files, j);
+		const char *rel_path = GetRelativePath(file->path,
+											   chain->roots[nbackups - 1]);
+		pgFileChain *file_chain = pgut_new(pgFileChain);
+		int			k;
+
+		file_chain->file = file;
+		file_chain->nversions = 0;
+		file_chain->versions = pgut_newarray(pgFile *, nbackups);
+		file_chain->roots = pgut_newarray(char *, nbackups);
+		file_chain->backups = pgut_newarray(pgBackup *, nbackups);
+		parray_append(chain->files, file_chain);
+
+		if (S_ISDIR(file->mode))
+			continue;
+
+		/* Only the newest version of a non-data file is needed */
+		for (i = nbackups - 1; i >= 0; i--)
+		{
+			pgFile	   *version = file;
+			pgFile		key;
+			pgFile	  **found;
+
+			if (i < nbackups - 1)
+			{
+				join_path_components(path, chain->roots[i], rel_path);
+				key.path = path;
+				found = (pgFile **) parray_bsearch(chain->lists[i], &key,
+												   pgFileComparePath);
+				/*
+				 * The file did not exist when this backup was taken, so
+				 * older versions belong to a dropped relation which had
+				 * the same path.
+				 */
+				if (found == NULL)
+					break;
+				version = *found;
+			}
+
+			/* not backed up */
+			if (version->write_size == BYTES_INVALID)
+				continue;
+
+			file_chain->versions[file_chain->nversions] = version;
+			file_chain->roots[file_chain->nversions] = chain->roots[i];
+			file_chain->backups[file_chain->nversions] = backups[i];
+			file_chain->nversions++;
+
+			if (!file->is_datafile || file->is_cfs)
+				break;
+		}
+
+		/* Versions were collected newest first */
+		for (k = 0; k < file_chain->nversions / 2; k++)
+		{
+			int			l = file_chain->nversions - 1 - k;
+			pgFile	   *version = file_chain->versions[k];
+			char	   *root = file_chain->roots[k];
+			pgBackup   *backup = file_chain->backups[k];
+
+			file_chain->versions[k] = file_chain->versions[l];
+			file_chain->roots[k] = file_chain->roots[l];
+			file_chain->backups[k] = file_chain->backups[l];
+			file_chain->versions[l] = version;
+			file_chain->roots[l] = root;
+			file_chain->backups[l] = backup;
+		}
+	}
+
+	return chain;
+}
+
+void
+backup_chain_free(BackupChain *chain)
+{
+	size_t		j;
+	int			i;
+
+	for (j = 0; j < parray_num(chain->files); j++)
+	{
+		pgFileChain *file_chain = (pgFileChain *) parray_get(chain->files, j);
+
+		free(file_chain->versions);
+		free(file_chain->roots);
+		free(file_chain->backups);
+		free(file_chain);
+	}
+	parray_free(chain->files);
+
+	for (i = 0; i < chain->nbackups; i++)
+	{
+		parray_walk(chain->lists[i], pgFileFree);
+		parray_free(chain->lists[i]);
+		free(chain->roots[i]);
+	}
+	free(chain->lists);
+	free(chain->roots);
+	free(chain->backups);
+	free(chain);
+}
+
+/*
+ * Restore a chain of backups from a full backup to the dest one, oldest
+ * first, at once instead of restoring them one after another. Every file
+ * of the dest backup is restored from the newest backup which has it
+ * backed up: a non-data file is copied once, a datafile is merged from all
+ * its versions by restore_data_file_chain(), so that every block is written
+ * once. Files missing in the file list of the dest backup are never
+ * restored, so nothing is deleted afterwards.
+ */
+static void
+restore_chain(pgBackup **backups, int nbackups, const char *dict_path)
+{
+	pgBackup   *dest_backup = backups[nbackups - 1];
+	BackupChain *chain;
+	char		path[MAXPGPATH];
+	parray	   *tasks = parray_new();
+	scheduler  *restore_sched;
+	restore_files_args *restore_threads_args[io_threads];
+	int			i;
+	size_t		j;
+
+	for (i = 0; i < nbackups; i++)
+		if (backups[i]->status != BACKUP_STATUS_OK)
+			elog(ERROR, "Backup %s cannot be restored because it is not valid",
+				 base36enc(backups[i]->start_time));
+
+	chain = backup_chain_read(backups, nbackups);
+	if (dict_path[0] != '\0')
+		compress_dict_load(dict_path);
+
+	elog(LOG, "restoring database from chain of %d backups ending with %s",
+		 nbackups, base36enc(dest_backup->start_time));
+
+	pgBackupGetPath(dest_backup, path, lengthof(path), NULL);
+	restore_directories(pgdata, path);
+
+	for (j = 0; j < parray_num(chain->files); j++)
+	{
+		pgFileChain *file_chain = (pgFileChain *) parray_get(chain->files, j);
+		pgFile	   *file = file_chain->file;
+		int			nparts = 1;
+		int			k;
+
+		/*
+		 * Directories were created before, tablespace_map is not restored,
+		 * and there is nothing to restore a file never backed up from.
+		 */
+		if (S_ISDIR(file->mode) || file_chain->nversions == 0 ||
+			path_is_prefix_of_path(PG_TABLESPACE_MAP_FILE,
+								   GetRelativePath(file->path,
+												   chain->roots[nbackups - 1])))
+			continue;
+
+		if (io_threads > 1 && file->is_datafile && !file->is_cfs)
+			nparts = Max(1, (file->size / BLCKSZ + FILE_PART_BLOCKS - 1) /
+						 FILE_PART_BLOCKS);
+
+		for (k = 0; k < nparts; k++)
+		{
+			RestoreChainTask *task = pgut_new(RestoreChainTask);
+
+			task->chain = file_chain;
+			task->start = k * FILE_PART_BLOCKS;
+			/* The last part takes blocks the file has grown by */
+			task->end = (k == nparts - 1) ?
+				InvalidBlockNumber : (k + 1) * FILE_PART_BLOCKS;
+			task->partno = k;
+			task->nparts = nparts;
+			parray_append(tasks, task);
+		}
+	}
+
+	restore_sched = scheduler_new(tasks, chain_task_weight, io_threads);
+	for (i = 0; i < io_threads; i++)
+	{
+		restore_files_args *arg = pg_malloc(sizeof(restore_files_args));
+		arg->files = NULL;
+		arg->backup = dest_backup;
+		arg->sched = restore_sched;
+		arg->thread_num = i;
+
+		restore_threads_args[i] = arg;
+	}
+
+	elog(LOG, "Start %d threads for num:%li", io_threads, parray_num(tasks));
+	/* Files without index are restored by restore_data_file() with the pool */
+	cpu_pool = work_pool_start("decompress", cpu_threads,
+							   io_threads * CPU_PIPELINE_DEPTH);
+	scheduler_run(restore_sched, "restore", restore_chain_files,
+				  (void **) restore_threads_args);
+	work_pool_stop(cpu_pool);
+	cpu_pool = NULL;
+
+	for (i = 0; i < io_threads; i++)
+		pg_free(restore_threads_args[i]);
+	scheduler_free(restore_sched);
+	compress_dict_free();
+
+	/* cleanup */
+	parray_walk(tasks, free);
+	parray_free(tasks);
+	backup_chain_free(chain);
+
+	if (LOG_LEVEL_CONSOLE <= LOG || LOG_LEVEL_FILE <= LOG)
+		elog(LOG, "restore %s backup completed",
+			 base36enc(dest_backup->start_time));
+}
+
 /*
  * Restore one backup.
  */
@@ -340,10 +694,12 @@ restore_backup(pgBackup *backup)
 	char		this_backup_path[MAXPGPATH];
 	char		database_path[MAXPGPATH];
 	char		list_path[MAXPGPATH];
+	char		dict_path[MAXPGPATH];
 	parray	   *files;
+	parray	   *parts;
 	int			i;
-	pthread_t	restore_threads[num_threads];
-	restore_files_args *restore_threads_args[num_threads];
+	scheduler  *restore_sched;
+	restore_files_args *restore_threads_args[io_threads];
 
 	if (backup->status != BACKUP_STATUS_OK)
 		elog(ERROR, "Backup %s cannot be restored because it is not valid",
@@ -387,32 +743,42 @@ restore_backup(pgBackup *backup)
 			pgFileFree(parray_remove(files, i));
 	}
 
-	/* setup threads */
-	for (i = 0; i < parray_num(files); i++)
-	{
-		pgFile *file = (pgFile *) parray_get(files, i);
-		__sync_lock_release(&file->lock);
-	}
+	/* Pages of the backup may be compressed with a dictionary */
+	pgBackupGetPath(backup, dict_path, lengthof(dict_path), COMPRESS_DICT_FILE);
+	compress_dict_load(dict_path);
 
-	/* Restore files into target directory */
-	for (i = 0; i < num_threads; i++)
+	/*
+	 * Restore files into target directory, largest first. Large datafiles
+	 * are split into parts restored by different threads.
+	 */
+	parts = restore_file_parts(files, io_threads > 1);
+	restore_sched = scheduler_new(parts, pgFilePartWeightWriteSize,
+								  io_threads);
+	for (i = 0; i < io_threads; i++)
 	{
 		restore_files_args *arg = pg_malloc(sizeof(restore_files_args));
 		arg->files = files;
 		arg->backup = backup;
-
-		elog(LOG, "Start thread for num:%li", parray_num(files));
+		arg->sched = restore_sched;
+		arg->thread_num = i;
 
 		restore_threads_args[i] = arg;
-		pthread_create(&restore_threads[i], NULL, (void *(*)(void *)) restore_files, arg);
 	}
 
-	/* Wait theads */
-	for (i = 0; i < num_threads; i++)
-	{
-		pthread_join(restore_threads[i], NULL);
+	elog(LOG, "Start %d threads for num:%li", io_threads, parray_num(parts));
+	/* Pages of records read by restoring threads are restored by cpu_pool */
+	cpu_pool = work_pool_start("decompress", cpu_threads,
+							   io_threads * CPU_PIPELINE_DEPTH);
+	scheduler_run(restore_sched, "restore", restore_files,
+				  (void **) restore_threads_args);
+	work_pool_stop(cpu_pool);
+	cpu_pool = NULL;
+
+	for (i = 0; i < io_threads; i++)
 		pg_free(restore_threads_args[i]);
-	}
+	scheduler_free(restore_sched);
+	free_file_parts(parts);
+	compress_dict_free();
 
 	/* cleanup */
 	parray_walk(files, pgFileFree);
@@ -422,6 +788,64 @@ restore_backup(pgBackup *backup)
 		elog(LOG, "restore %s backup completed", base36enc(backup->start_time));
 }
 
+/*
+ * Restore tasks of restore_chain() scheduled to the thread.
+ */
+static void
+restore_chain_files(void *arg)
+{
+	restore_files_args *arguments = (restore_files_args *) arg;
+	RestoreChainTask *task;
+	size_t		task_no;
+
+	while ((task = (RestoreChainTask *) scheduler_next(arguments->sched,
+													   arguments->thread_num,
+													   &task_no)) != NULL)
+	{
+		pgFileChain *chain = task->chain;
+		int			newest = chain->nversions - 1;
+		pgFile	   *file = chain->versions[newest];
+		char	   *from_root = chain->roots[newest];
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR, "interrupted during restore database");
+
+		if (progress)
+			elog(LOG, "Progress: (%lu/%lu). Process file %s ",
+				 (unsigned long) task_no,
+				 (unsigned long) scheduler_num_tasks(arguments->sched),
+				 GetRelativePath(file->path, from_root));
+
+		elog(VERBOSE, "Restoring file %s from %d backups, is_datafile %i, is_cfs %i",
+			 file->path, chain->nversions, chain->file->is_datafile?1:0,
+			 chain->file->is_cfs?1:0);
+
+		if (!chain->file->is_datafile || chain->file->is_cfs)
+			copy_file(from_root, pgdata, file);
+		else if (!restore_data_file_chain(chain->nversions, chain->versions,
+										  chain->roots, pgdata,
+										  task->start, task->end))
+		{
+			int			v;
+
+			/*
+			 * Versions backed up without index are applied one after another
+			 * to the whole file, by the first part.
+			 */
+			if (task->partno != 0)
+				continue;
+			for (v = 0; v < chain->nversions; v++)
+				restore_data_file(chain->roots[v], pgdata, chain->versions[v],
+								  chain->backups[v]);
+		}
+
+		if (task->nparts == 1)
+			elog(LOG, "Restored file %s : %lu bytes",
+				 file->path, (unsigned long) file->write_size);
+	}
+}
+
 /*
  * Delete files which are not in backup's file list from target pgdata.
  * It is necessary to restore incremental backup correctly.
@@ -687,17 +1111,17 @@ check_tablespace_mapping(pgBackup *backup)
 static void
 restore_files(void *arg)
 {
-	int			i;
 	restore_files_args *arguments = (restore_files_args *)arg;
+	pgFilePart *part;
+	size_t		task_no;
 
-	for (i = 0; i < parray_num(arguments->files); i++)
+	while ((part = (pgFilePart *) scheduler_next(arguments->sched,
+												 arguments->thread_num,
+												 &task_no)) != NULL)
 	{
+		pgFile	   *file = part->file;
 		char		from_root[MAXPGPATH];
 		char	   *rel_path;
-		pgFile	   *file = (pgFile *) parray_get(arguments->files, i);
-
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
 
 		pgBackupGetPath(arguments->backup, from_root,
 						lengthof(from_root), DATABASE_DIR);
@@ -709,8 +1133,10 @@ restore_files(void *arg)
 		rel_path = GetRelativePath(file->path,from_root);
 
 		if (progress)
-			elog(LOG, "Progress: (%d/%lu). Process file %s ",
-				 i + 1, (unsigned long) parray_num(arguments->files), rel_path);
+			elog(LOG, "Progress: (%lu/%lu). Process file %s ",
+				 (unsigned long) task_no,
+				 (unsigned long) scheduler_num_tasks(arguments->sched),
+				 rel_path);
 
 
 		/* Directories was created before */
@@ -741,7 +1167,13 @@ restore_files(void *arg)
 		 * copy the file from backup.
 		 */
 		elog(VERBOSE, "Restoring file %s, is_datafile %i, is_cfs %i", file->path, file->is_datafile?1:0, file->is_cfs?1:0);
-		if (file->is_datafile && !file->is_cfs)
+		if (part->split != NULL)
+		{
+			/* Other parts of the file may be restored by other threads */
+			restore_data_file_part(from_root, pgdata, part);
+			continue;
+		}
+		else if (file->is_datafile && !file->is_cfs)
 			restore_data_file(from_root, pgdata, file, arguments->backup);
 		else
 			copy_file(from_root, pgdata, file);
@@ -17,6 +17,7 @@
 
 static void show_backup_list(FILE *out, parray *backup_list);
 static void show_backup_detail(FILE *out, pgBackup *backup);
+static void show_backup_stats(FILE *out, pgBackup *backup);
 static int do_show_instance(time_t requested_backup_id);
 
 int
@@ -27,6 +28,9 @@ do_show(time_t requested_backup_id)
 		&& requested_backup_id != INVALID_BACKUP_ID)
 		elog(ERROR, "You must specify --instance to use --backup_id option");
 
+	if (show_stats && requested_backup_id == INVALID_BACKUP_ID)
+		elog(ERROR, "You must specify --backup_id to use --stats option");
+
 	if (instance_name == NULL)
 	{
 		/* Show list of instances */
@@ -93,7 +97,10 @@ do_show_instance(time_t requested_backup_id)
 			return 0;
 		}
 
-		show_backup_detail(stdout, backup);
+		if (show_stats)
+			show_backup_stats(stdout, backup);
+		else
+			show_backup_detail(stdout, backup);
 
 		/* cleanup */
 		pgBackupFree(backup);
@@ -279,3 +286,36 @@ show_backup_detail(FILE *out, pgBackup *backup)
 {
 	pgBackupWriteControl(out, backup);
 }
+
+/*
+ * Print BACKUP_STATS_FILE of the backup. Backups taken by older versions
+ * and unfinished ones have no stats.
+ */
+static void
+show_backup_stats(FILE *out, pgBackup *backup)
+{
+	char		path[MAXPGPATH];
+	char		buf[1024];
+	FILE	   *fp;
+	size_t		len;
+
+	pgBackupGetPath(backup, path, lengthof(path), BACKUP_STATS_FILE);
+	fp = fopen(path, "rt");
+	if (fp == NULL)
+	{
+		if (errno != ENOENT)
+			elog(ERROR, "cannot open stats file \"%s\": %s", path,
+				 strerror(errno));
+
+		elog(INFO, "Backup %s has no stats", base36enc(backup->start_time));
+		return;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, len, out);
+
+	if (ferror(fp))
+		elog(ERROR, "cannot read stats file \"%s\": %s", path,
+			 strerror(errno));
+	fclose(fp);
+}
@@ -250,9 +250,10 @@ status2str(BackupStatus status)
 		"DELETED",
 		"DONE",
 		"ORPHAN",
-		"CORRUPT"
+		"CORRUPT",
+		"MERGING"
 	};
-	if (status < BACKUP_STATUS_INVALID || BACKUP_STATUS_CORRUPT < status)
+	if (status < BACKUP_STATUS_INVALID || BACKUP_STATUS_MERGING < status)
 		return "UNKNOWN";
 
 	return statusName[status];
@@ -314,6 +315,8 @@ pgBackup_init(pgBackup *backup)
 	backup->block_size = BLCKSZ;
 	backup->wal_block_size = XLOG_BLCKSZ;
 	backup->stream = false;
+	backup->dedup = false;
+	backup->fsync_time = 0;
 	backup->parent_backup = 0;
 	backup->server_version[0] = '\0';
 }
@@ -0,0 +1,276 @@
+/*-------------------------------------------------------------------------
+ *
+ * aio.c: asynchronous file I/O.
+ *
+ * With io_uring every thread can keep many reads and writes in flight,
+ * which is required to saturate fast storage without running hundreds of
+ * threads. The kernel may lack io_uring support or forbid it, so it is
+ * probed at runtime and synchronous pread()/pwrite() are used when it is
+ * not available. Readiness notification (epoll and alike) is of no use for
+ * regular files, which are always reported ready.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "src/pg_probackup.h"
+
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "aio.h"
+
+/* members of struct aio_context are hidden from client. */
+struct aio_context
+{
+	int			depth;			/* maximum number of requests in flight */
+	int			inflight;		/* number of requests in flight */
+#ifdef HAVE_LIBURING
+	bool		use_uring;
+	struct io_uring ring;
+#endif
+};
+
+/*
+ * Perform the request synchronously, starting from byte done of it.
+ * Reads stop at the end of file.
+ */
+static void
+aio_perform(aio_request *req, size_t done)
+{
+	while (done < req->len)
+	{
+		ssize_t		rc;
+
+		if (req->write)
+			rc = pwrite(req->fd, req->buf + done, req->len - done,
+						req->offset + done);
+		else
+			rc = pread(req->fd, req->buf + done, req->len - done,
+					   req->offset + done);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			req->result = -errno;
+			req->done = true;
+			return;
+		}
+		/* EOF */
+		if (rc == 0)
+			break;
+		done += rc;
+	}
+
+	req->result = done;
+	req->done = true;
+}
+
+/*
+ * Create context keeping up to depth requests in flight.
+ */
+aio_context *
+aio_init(int depth)
+{
+	aio_context *ctx = pgut_new(aio_context);
+
+	ctx->depth = 1;
+	ctx->inflight = 0;
+
+#ifdef HAVE_LIBURING
+	ctx->use_uring = false;
+
+	if (depth > 1)
+	{
+		struct io_uring_probe *probe;
+		int			rc;
+
+		rc = io_uring_queue_init(depth, &ctx->ring, 0);
+		if (rc < 0)
+		{
+			elog(VERBOSE, "io_uring is not available: %s", strerror(-rc));
+			return ctx;
+		}
+
+		probe = io_uring_get_probe_ring(&ctx->ring);
+		if (probe == NULL ||
+			!io_uring_opcode_supported(probe, IORING_OP_READ) ||
+			!io_uring_opcode_supported(probe, IORING_OP_WRITE))
+		{
+			elog(VERBOSE, "io_uring does not support file reads and writes");
+			if (probe)
+				io_uring_free_probe(probe);
+			io_uring_queue_exit(&ctx->ring);
+			return ctx;
+		}
+		io_uring_free_probe(probe);
+
+		ctx->use_uring = true;
+		ctx->depth = depth;
+	}
+#endif
+
+	return ctx;
+}
+
+void
+aio_free(aio_context *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	aio_wait_all(ctx);
+#ifdef HAVE_LIBURING
+	if (ctx->use_uring)
+		io_uring_queue_exit(&ctx->ring);
+#endif
+	free(ctx);
+}
+
+/* Are requests performed asynchronously? */
+bool
+aio_is_async(aio_context *ctx)
+{
+	return ctx->depth > 1;
+}
+
+/* Maximum number of requests in flight */
+int
+aio_depth(aio_context *ctx)
+{
+	return ctx->depth;
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Wait for completion of any request in flight.
+ */
+static void
+aio_reap(aio_context *ctx)
+{
+	struct io_uring_cqe *cqe;
+	aio_request *req;
+	int			rc;
+
+	Assert(ctx->inflight > 0);
+
+	do
+		rc = io_uring_wait_cqe(&ctx->ring, &cqe);
+	while (rc == -EINTR);
+
+	if (rc < 0)
+		elog(ERROR, "cannot wait for I/O completion: %s", strerror(-rc));
+
+	req = (aio_request *) io_uring_cqe_get_data(cqe);
+	rc = cqe->res;
+	io_uring_cqe_seen(&ctx->ring, cqe);
+	ctx->inflight--;
+
+	/* Complete short or interrupted transfer synchronously */
+	if (rc == -EINTR || rc == -EAGAIN)
+		aio_perform(req, 0);
+	else if (rc > 0 && rc < req->len)
+		aio_perform(req, rc);
+	else
+	{
+		req->result = rc;
+		req->done = true;
+	}
+}
+#endif
+
+static void
+aio_submit(aio_context *ctx, aio_request *req, int fd, void *buf, size_t len,
+		   off_t offset, bool write)
+{
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+	req->write = write;
+	req->done = false;
+	req->result = 0;
+
+#ifdef HAVE_LIBURING
+	if (ctx->use_uring)
+	{
+		struct io_uring_sqe *sqe;
+		int			rc;
+
+		while (ctx->inflight >= ctx->depth)
+			aio_reap(ctx);
+
+		sqe = io_uring_get_sqe(&ctx->ring);
+		if (sqe == NULL)
+			elog(ERROR, "io_uring submission queue is full");
+
+		if (write)
+			io_uring_prep_write(sqe, fd, buf, len, offset);
+		else
+			io_uring_prep_read(sqe, fd, buf, len, offset);
+		io_uring_sqe_set_data(sqe, req);
+
+		do
+			rc = io_uring_submit(&ctx->ring);
+		while (rc == -EINTR);
+		if (rc < 0)
+			elog(ERROR, "cannot submit I/O request: %s", strerror(-rc));
+
+		ctx->inflight++;
+		return;
+	}
+#endif
+
+	aio_perform(req, 0);
+}
+
+/*
+ * Start reading len bytes at offset of fd into buf. The result is less than
+ * len at the end of file.
+ */
+void
+aio_read(aio_context *ctx, aio_request *req, int fd, void *buf, size_t len,
+		 off_t offset)
+{
+	aio_submit(ctx, req, fd, buf, len, offset, false);
+}
+
+/*
+ * Start writing len bytes of buf at offset of fd.
+ */
+void
+aio_write(aio_context *ctx, aio_request *req, int fd, void *buf, size_t len,
+		  off_t offset)
+{
+	aio_submit(ctx, req, fd, buf, len, offset, true);
+}
+
+/*
+ * Wait for completion of the request.
+ */
+void
+aio_wait(aio_context *ctx, aio_request *req)
+{
+#ifdef HAVE_LIBURING
+	while (!req->done)
+		aio_reap(ctx);
+#endif
+	Assert(req->done);
+}
+
+/*
+ * Wait for completion of all requests in flight.
+ */
+void
+aio_wait_all(aio_context *ctx)
+{
+#ifdef HAVE_LIBURING
+	while (ctx->inflight > 0)
+		aio_reap(ctx);
+#endif
+}
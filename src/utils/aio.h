@@ -0,0 +1,48 @@
+/*-------------------------------------------------------------------------
+ *
+ * aio.h: asynchronous file I/O.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+
+/*
+ * "aio_context" keeps up to a fixed number of reads and writes in flight.
+ * It uses io_uring if pg_probackup is built with liburing and the kernel
+ * supports it. Otherwise requests are performed synchronously at submission,
+ * so callers need no separate code path.
+ *
+ * Requests are owned by the caller and must stay valid until completed.
+ * Requests complete in any order, aio_wait() waits for the given one.
+ */
+typedef struct aio_context aio_context;
+
+typedef struct aio_request
+{
+	int			fd;
+	char	   *buf;
+	size_t		len;
+	off_t		offset;
+	bool		write;
+	bool		done;
+	ssize_t		result;			/* bytes transferred or -errno */
+} aio_request;
+
+extern aio_context *aio_init(int depth);
+extern void aio_free(aio_context *ctx);
+extern bool aio_is_async(aio_context *ctx);
+extern int	aio_depth(aio_context *ctx);
+extern void aio_read(aio_context *ctx, aio_request *req, int fd,
+					 void *buf, size_t len, off_t offset);
+extern void aio_write(aio_context *ctx, aio_request *req, int fd,
+					  void *buf, size_t len, off_t offset);
+extern void aio_wait(aio_context *ctx, aio_request *req);
+extern void aio_wait_all(aio_context *ctx);
+
+#endif /* AIO_H */
@@ -0,0 +1,363 @@
+/*-------------------------------------------------------------------------
+ *
+ * fsync_queue.c: deferred fsync of written files.
+ *
+ * Files of a backup or restore are synced by a pass at the end, which is
+ * distributed among threads: fsync() of a file waits mostly for the
+ * device, so many of them in parallel take about as long as the slowest
+ * one. Directories holding the files are synced by the same pass, up to
+ * the root directory of the queue.
+ *
+ * If the files have a file system of their own, a single syncfs()
+ * replaces fsync() of every file on it.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "src/pg_probackup.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "fsync_queue.h"
+
+typedef struct fsync_entry
+{
+	char	   *path;
+	size_t		size;			/* size of the file, 0 for directory */
+	bool		is_dir;
+} fsync_entry;
+
+/* members of struct fsync_queue are hidden from client. */
+struct fsync_queue
+{
+	pthread_mutex_t mutex;
+	parray	   *entries;		/* fsync_entry */
+	char		root[MAXPGPATH];
+	char		own_fs[MAXPGPATH];	/* empty if none */
+	bool		drop_cache;		/* drop synced files from page cache */
+};
+
+typedef struct fsync_worker_args
+{
+	scheduler  *sched;
+	int			thread_num;
+	bool		skip_dev;		/* skip files on device dev */
+	dev_t		dev;
+	bool		drop_cache;
+} fsync_worker_args;
+
+/*
+ * Create queue of files written under root. If own_fs is not NULL and
+ * a file system is mounted there, it is synced at once. If drop_cache is
+ * true, files are dropped from the page cache once they are synced.
+ */
+fsync_queue *
+fsync_queue_new(const char *root, const char *own_fs, bool drop_cache)
+{
+	fsync_queue *queue = pgut_new(fsync_queue);
+
+	pthread_mutex_init(&queue->mutex, NULL);
+	queue->entries = parray_new();
+	strncpy(queue->root, root, MAXPGPATH);
+	queue->root[MAXPGPATH - 1] = '\0';
+	canonicalize_path(queue->root);
+	strncpy(queue->own_fs, own_fs ? own_fs : "", MAXPGPATH);
+	queue->own_fs[MAXPGPATH - 1] = '\0';
+	queue->drop_cache = drop_cache;
+
+	return queue;
+}
+
+static void
+fsync_entry_free(void *entry)
+{
+	free(((fsync_entry *) entry)->path);
+	free(entry);
+}
+
+void
+fsync_queue_free(fsync_queue *queue)
+{
+	if (queue == NULL)
+		return;
+
+	parray_walk(queue->entries, fsync_entry_free);
+	parray_free(queue->entries);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue);
+}
+
+/*
+ * Ask the kernel to start writeback of dirty pages of the file without
+ * waiting for it.
+ */
+void
+fsync_start_writeback(int fd)
+{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+	(void) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+/*
+ * Add the file open as fd to the queue. The file may be closed and even
+ * written again before the queue is flushed.
+ */
+void
+fsync_queue_add(fsync_queue *queue, int fd, const char *path)
+{
+	fsync_entry *entry = pgut_new(fsync_entry);
+	struct stat	st;
+
+	fsync_start_writeback(fd);
+
+	entry->path = pgut_strdup(path);
+	entry->size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+	entry->is_dir = false;
+
+	pthread_mutex_lock(&queue->mutex);
+	parray_append(queue->entries, entry);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static int
+fsync_entry_cmp(const void *a, const void *b)
+{
+	return strcmp((*(fsync_entry * const *) a)->path,
+				  (*(fsync_entry * const *) b)->path);
+}
+
+static size_t
+fsync_entry_weight(const void *entry)
+{
+	/* Count every entry as a block at least, for directories */
+	return ((const fsync_entry *) entry)->size + BLCKSZ;
+}
+
+/* Sort entries by path and remove duplicates */
+static void
+fsync_entries_unique(parray *entries)
+{
+	size_t		i;
+	size_t		n = 0;
+
+	parray_qsort(entries, fsync_entry_cmp);
+
+	for (i = 0; i < parray_num(entries); i++)
+	{
+		fsync_entry *entry = (fsync_entry *) parray_get(entries, i);
+
+		if (n > 0)
+		{
+			fsync_entry *prev = (fsync_entry *) parray_get(entries, n - 1);
+
+			if (strcmp(prev->path, entry->path) == 0)
+			{
+				prev->size = Max(prev->size, entry->size);
+				fsync_entry_free(entry);
+				continue;
+			}
+		}
+		parray_set(entries, n++, entry);
+	}
+
+	while (parray_num(entries) > n)
+		parray_remove(entries, parray_num(entries) - 1);
+}
+
+/*
+ * Add directories holding the queued files to entries: the parent of each
+ * file and its ancestors up to the root.
+ */
+static void
+fsync_queue_add_dirs(fsync_queue *queue)
+{
+	parray	   *dirs = parray_new();
+	size_t		root_len = strlen(queue->root);
+	size_t		i;
+
+	for (i = 0; i < parray_num(queue->entries); i++)
+	{
+		fsync_entry *file = (fsync_entry *) parray_get(queue->entries, i);
+		char		dir[MAXPGPATH];
+
+		strncpy(dir, file->path, MAXPGPATH);
+		dir[MAXPGPATH - 1] = '\0';
+
+		for (;;)
+		{
+			fsync_entry *entry;
+
+			get_parent_directory(dir);
+			if (dir[0] == '\0')
+				break;
+
+			entry = pgut_new(fsync_entry);
+			entry->path = pgut_strdup(dir);
+			entry->size = 0;
+			entry->is_dir = true;
+			parray_append(dirs, entry);
+
+			/* Stop at the root or outside of it */
+			if (strlen(dir) <= root_len ||
+				strncmp(dir, queue->root, root_len) != 0)
+				break;
+		}
+	}
+
+	/* Directories are shared by many files */
+	fsync_entries_unique(dirs);
+	parray_concat(queue->entries, dirs);
+	parray_free(dirs);
+}
+
+/* Is path a mount point? */
+static bool
+is_mount_point(const char *path, dev_t *dev)
+{
+	char		parent[MAXPGPATH];
+	struct stat	st;
+	struct stat	parent_st;
+
+	snprintf(parent, lengthof(parent), "%s/..", path);
+	if (stat(path, &st) != 0 || stat(parent, &parent_st) != 0)
+		return false;
+
+	*dev = st.st_dev;
+	return st.st_dev != parent_st.st_dev || st.st_ino == parent_st.st_ino;
+}
+
+static void
+fsync_worker(void *arg)
+{
+	fsync_worker_args *args = (fsync_worker_args *) arg;
+	fsync_entry *entry;
+	size_t		task_no;
+
+	while ((entry = (fsync_entry *) scheduler_next(args->sched,
+												   args->thread_num,
+												   &task_no)) != NULL)
+	{
+		struct stat	st;
+		int			fd;
+
+		if (interrupted)
+			elog(ERROR, "interrupted during fsync");
+
+		fd = open(entry->path, O_RDONLY | PG_BINARY, 0);
+		if (fd < 0)
+		{
+			/* The file was removed after it was written */
+			if (errno == ENOENT)
+				continue;
+			elog(ERROR, "cannot open \"%s\": %s", entry->path, strerror(errno));
+		}
+
+		if (args->skip_dev && fstat(fd, &st) == 0 && st.st_dev == args->dev)
+		{
+			close(fd);
+			continue;
+		}
+
+		/* Some platforms do not allow to fsync directories */
+		if (fsync(fd) != 0 &&
+			!(entry->is_dir && (errno == EBADF || errno == EINVAL)))
+			elog(ERROR, "cannot fsync \"%s\": %s", entry->path, strerror(errno));
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+		/* Pages are clean now, so they can be dropped */
+		if (args->drop_cache && !entry->is_dir)
+			(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		close(fd);
+	}
+}
+
+static double
+current_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Sync queued files and their directories by nthreads threads and empty
+ * the queue. Returns the time it took, in seconds.
+ */
+double
+fsync_queue_flush(fsync_queue *queue, int nthreads)
+{
+	double		start_time = current_time();
+	double		elapsed;
+	scheduler  *sched;
+	fsync_worker_args *args;
+	void	  **args_ptrs;
+	bool		use_syncfs = false;
+	dev_t		dev = 0;
+	size_t		nfiles;
+	int			i;
+
+	fsync_entries_unique(queue->entries);
+	nfiles = parray_num(queue->entries);
+	fsync_queue_add_dirs(queue);
+
+	/* Pages can be dropped from cache file by file only */
+#ifdef __linux__
+	if (!queue->drop_cache && queue->own_fs[0] != '\0')
+		use_syncfs = is_mount_point(queue->own_fs, &dev);
+#endif
+
+	sched = scheduler_new(queue->entries, fsync_entry_weight, nthreads);
+	args = pgut_malloc(sizeof(fsync_worker_args) * nthreads);
+	args_ptrs = pgut_malloc(sizeof(void *) * nthreads);
+	for (i = 0; i < nthreads; i++)
+	{
+		args[i].sched = sched;
+		args[i].thread_num = i;
+		args[i].skip_dev = use_syncfs;
+		args[i].dev = dev;
+		args[i].drop_cache = queue->drop_cache;
+		args_ptrs[i] = &args[i];
+	}
+
+	scheduler_run(sched, "fsync", fsync_worker, args_ptrs);
+
+	scheduler_free(sched);
+	free(args);
+	free(args_ptrs);
+
+#ifdef __linux__
+	if (use_syncfs)
+	{
+		int			fd = open(queue->own_fs, O_RDONLY | PG_BINARY, 0);
+
+		if (fd < 0)
+			elog(ERROR, "cannot open directory \"%s\": %s",
+				 queue->own_fs, strerror(errno));
+		if (syncfs(fd) != 0)
+			elog(ERROR, "cannot sync file system of \"%s\": %s",
+				 queue->own_fs, strerror(errno));
+		close(fd);
+	}
+#endif
+
+	elapsed = current_time() - start_time;
+	elog(LOG, "synced %lu files and %lu directories%s in %.3f s",
+		 (unsigned long) nfiles,
+		 (unsigned long) (parray_num(queue->entries) - nfiles),
+		 use_syncfs ? " with syncfs()" : "", elapsed);
+
+	parray_walk(queue->entries, fsync_entry_free);
+	parray_free(queue->entries);
+	queue->entries = parray_new();
+
+	return elapsed;
+}
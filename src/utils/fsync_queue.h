@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+ *
+ * fsync_queue.h: deferred fsync of written files.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef FSYNC_QUEUE_H
+#define FSYNC_QUEUE_H
+
+#include <sys/types.h>
+
+/*
+ * "fsync_queue" collects files written by many threads, so that they are
+ * made durable at once by fsync_queue_flush() instead of one by one, right
+ * after each file is written. Writeback of a file is started when it is
+ * added, so little is left to write at the flush.
+ */
+typedef struct fsync_queue fsync_queue;
+
+extern fsync_queue *fsync_queue_new(const char *root, const char *own_fs,
+									 bool drop_cache);
+extern void fsync_queue_free(fsync_queue *queue);
+extern void fsync_queue_add(fsync_queue *queue, int fd, const char *path);
+extern double fsync_queue_flush(fsync_queue *queue, int nthreads);
+extern void fsync_start_writeback(int fd);
+
+#endif /* FSYNC_QUEUE_H */
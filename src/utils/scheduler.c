@@ -0,0 +1,284 @@
+/*-------------------------------------------------------------------------
+ *
+ * scheduler.c: distribution of tasks among worker threads.
+ *
+ * Tasks are sorted by weight in descending order and dealt round-robin to
+ * per-worker queues, so every worker starts with the largest tasks and the
+ * small ones are left for the end. A worker takes tasks from the head of
+ * its own queue. When the queue is exhausted it steals the largest task of
+ * the worker which has the most work left, so no worker stays idle while
+ * there is anything to do.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "src/pg_probackup.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "scheduler.h"
+
+typedef struct task_queue
+{
+	pthread_mutex_t	mutex;
+	void	  **tasks;			/* tasks of the worker, largest first */
+	size_t		head;			/* next task to take */
+	size_t		tail;			/* end of tasks */
+	size_t		weight;			/* total weight of tasks left */
+	double		finish_time;	/* when the worker found no tasks left */
+} task_queue;
+
+/* members of struct scheduler are hidden from client. */
+struct scheduler
+{
+	int			nworkers;
+	task_queue *queues;
+	void	  **tasks;			/* storage of queues' tasks */
+	size_t	   *weights;		/* weights of tasks in the same order */
+	size_t		ntasks;
+	size_t		ntaken;			/* number of tasks handed out */
+};
+
+typedef struct weighted_task
+{
+	void	   *task;
+	size_t		weight;
+} weighted_task;
+
+/* Compare weighted tasks, heavier first */
+static int
+weighted_task_cmp(const void *a, const void *b)
+{
+	size_t		wa = ((const weighted_task *) a)->weight;
+	size_t		wb = ((const weighted_task *) b)->weight;
+
+	if (wa > wb)
+		return -1;
+	else if (wa < wb)
+		return 1;
+	return 0;
+}
+
+static double
+current_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Create scheduler for the tasks to be processed by nworkers threads.
+ * The tasks array is not modified.
+ */
+scheduler *
+scheduler_new(parray *tasks, scheduler_weight_fn weight, int nworkers)
+{
+	scheduler  *sched = pgut_new(scheduler);
+	size_t		ntasks = parray_num(tasks);
+	weighted_task *sorted;
+	size_t		i;
+	int			w;
+
+	Assert(nworkers > 0);
+
+	sched->nworkers = nworkers;
+	sched->ntasks = ntasks;
+	sched->ntaken = 0;
+	sched->queues = pgut_malloc(sizeof(task_queue) * nworkers);
+	sched->tasks = pgut_malloc(sizeof(void *) * (ntasks + 1));
+	sched->weights = pgut_malloc(sizeof(size_t) * (ntasks + 1));
+
+	/* Sort tasks largest first */
+	sorted = pgut_malloc(sizeof(weighted_task) * (ntasks + 1));
+	for (i = 0; i < ntasks; i++)
+	{
+		sorted[i].task = parray_get(tasks, i);
+		sorted[i].weight = weight(sorted[i].task);
+	}
+	qsort(sorted, ntasks, sizeof(weighted_task), weighted_task_cmp);
+
+	/*
+	 * Deal tasks round-robin. Queue of the worker w occupies a contiguous
+	 * part of sched->tasks and gets tasks w, w + nworkers, w + 2 * nworkers
+	 * and so on.
+	 */
+	i = 0;
+	for (w = 0; w < nworkers; w++)
+	{
+		task_queue *queue = &sched->queues[w];
+		size_t		j;
+
+		pthread_mutex_init(&queue->mutex, NULL);
+		queue->tasks = sched->tasks + i;
+		queue->head = 0;
+		queue->tail = 0;
+		queue->weight = 0;
+		queue->finish_time = 0;
+
+		for (j = w; j < ntasks; j += nworkers)
+		{
+			sched->tasks[i] = sorted[j].task;
+			sched->weights[i] = sorted[j].weight;
+			queue->weight += sched->weights[i];
+			queue->tail++;
+			i++;
+		}
+	}
+
+	free(sorted);
+
+	return sched;
+}
+
+void
+scheduler_free(scheduler *sched)
+{
+	int			w;
+
+	for (w = 0; w < sched->nworkers; w++)
+		pthread_mutex_destroy(&sched->queues[w].mutex);
+
+	free(sched->queues);
+	free(sched->tasks);
+	free(sched->weights);
+	free(sched);
+}
+
+/*
+ * Take the task from the head of the queue. The queue must be locked.
+ */
+static void *
+queue_take(scheduler *sched, task_queue *queue)
+{
+	size_t		pos;
+
+	if (queue->head == queue->tail)
+		return NULL;
+
+	pos = queue->tasks - sched->tasks + queue->head;
+	queue->head++;
+	queue->weight -= sched->weights[pos];
+
+	return sched->tasks[pos];
+}
+
+/*
+ * Get the next task for the worker. Returns NULL if there are no tasks left.
+ * If task_no is not NULL, it is set to the ordinal number of the task
+ * counting from 1, useful to report progress.
+ */
+void *
+scheduler_next(scheduler *sched, int worker, size_t *task_no)
+{
+	task_queue *own = &sched->queues[worker];
+	void	   *task;
+
+	Assert(worker >= 0 && worker < sched->nworkers);
+
+	pthread_mutex_lock(&own->mutex);
+	task = queue_take(sched, own);
+	pthread_mutex_unlock(&own->mutex);
+
+	/* Steal from the worker which has the most work left */
+	while (task == NULL)
+	{
+		task_queue *victim = NULL;
+		size_t		max_weight = 0;
+		bool		found = false;
+		int			w;
+
+		for (w = 0; w < sched->nworkers; w++)
+		{
+			task_queue *queue = &sched->queues[w];
+
+			/* Unlocked reads are fine here, the choice is rechecked below */
+			if (queue->head == queue->tail)
+				continue;
+			if (!found || queue->weight > max_weight)
+			{
+				victim = queue;
+				max_weight = queue->weight;
+				found = true;
+			}
+		}
+
+		/* Nothing left to do */
+		if (!found)
+			break;
+
+		pthread_mutex_lock(&victim->mutex);
+		task = queue_take(sched, victim);
+		pthread_mutex_unlock(&victim->mutex);
+	}
+
+	if (task == NULL)
+	{
+		if (own->finish_time == 0)
+			own->finish_time = current_time();
+		return NULL;
+	}
+
+	if (task_no)
+		*task_no = __sync_add_and_fetch(&sched->ntaken, 1);
+	else
+		__sync_add_and_fetch(&sched->ntaken, 1);
+
+	return task;
+}
+
+size_t
+scheduler_num_tasks(scheduler *sched)
+{
+	return sched->ntasks;
+}
+
+/*
+ * Run worker function in sched->nworkers threads, args[i] is the argument of
+ * the i-th thread, and wait for all of them. Idle time of every worker, from
+ * the moment it ran out of tasks until the last worker finished, is logged.
+ */
+void
+scheduler_run(scheduler *sched, const char *name,
+			  void (*worker) (void *), void **args)
+{
+	pthread_t  *threads;
+	double		start_time;
+	double		end_time;
+	int			w;
+
+	threads = pgut_malloc(sizeof(pthread_t) * sched->nworkers);
+
+	start_time = current_time();
+	for (w = 0; w < sched->nworkers; w++)
+	{
+		elog(VERBOSE, "Start thread num: %i", w);
+		pthread_create(&threads[w], NULL, (void *(*)(void *)) worker, args[w]);
+	}
+
+	for (w = 0; w < sched->nworkers; w++)
+		pthread_join(threads[w], NULL);
+	end_time = current_time();
+
+	elog(LOG, "%s: %lu tasks processed by %d threads in %.3f s",
+		 name, (unsigned long) sched->ntasks, sched->nworkers,
+		 end_time - start_time);
+
+	for (w = 0; w < sched->nworkers; w++)
+	{
+		double		finish_time = sched->queues[w].finish_time;
+
+		/* Worker could have returned without asking for more tasks */
+		if (finish_time == 0)
+			finish_time = end_time;
+
+		elog(LOG, "%s: thread %d was idle for %.3f s",
+			 name, w, end_time - finish_time);
+	}
+
+	free(threads);
+}
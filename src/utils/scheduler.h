@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * scheduler.h: distribution of tasks among worker threads.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "utils/parray.h"
+
+/*
+ * "scheduler" hands out tasks to a fixed number of worker threads, largest
+ * tasks first. Each worker has its own queue of tasks and steals tasks from
+ * other workers when its queue is exhausted.
+ */
+typedef struct scheduler scheduler;
+
+/* Returns weight of the task, i.e. amount of work it takes */
+typedef size_t (*scheduler_weight_fn) (const void *task);
+
+extern scheduler *scheduler_new(parray *tasks, scheduler_weight_fn weight,
+								int nworkers);
+extern void scheduler_free(scheduler *sched);
+extern void *scheduler_next(scheduler *sched, int worker, size_t *task_no);
+extern size_t scheduler_num_tasks(scheduler *sched);
+extern void scheduler_run(scheduler *sched, const char *name,
+						  void (*worker) (void *), void **args);
+
+#endif /* SCHEDULER_H */
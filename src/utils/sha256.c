@@ -0,0 +1,174 @@
+/*-------------------------------------------------------------------------
+ *
+ * sha256.c: SHA-256 message digest, as specified by FIPS 180-4.
+ *
+ * PostgreSQL provides SHA-2 to frontend programs since version 10 only,
+ * so pg_probackup has its own implementation.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres_fe.h"
+
+#include "sha256.h"
+
+#define ROTR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)		(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SIGMA0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define sigma0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define sigma1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static const uint32 K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Process a single 64-byte block */
+static void
+sha256_transform(uint32 *state, const uint8 *block)
+{
+	uint32		w[64];
+	uint32		a, b, c, d, e, f, g, h;
+	int			i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32) block[i * 4] << 24) |
+			((uint32) block[i * 4 + 1] << 16) |
+			((uint32) block[i * 4 + 2] << 8) |
+			(uint32) block[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = sigma1(w[i - 2]) + w[i - 7] + sigma0(w[i - 15]) + w[i - 16];
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (i = 0; i < 64; i++)
+	{
+		uint32		t1 = h + SIGMA1(e) + CH(e, f, g) + K[i] + w[i];
+		uint32		t2 = SIGMA0(a) + MAJ(a, b, c);
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void
+sha256_init(sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->bitcount = 0;
+}
+
+void
+sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8 *p = (const uint8 *) data;
+	size_t		used = (ctx->bitcount >> 3) % SHA256_BLOCK_LEN;
+
+	ctx->bitcount += (uint64) len << 3;
+
+	/* Fill the partial block left by the previous call */
+	if (used > 0)
+	{
+		size_t		n = Min(len, SHA256_BLOCK_LEN - used);
+
+		memcpy(ctx->buffer + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < SHA256_BLOCK_LEN)
+			return;
+		sha256_transform(ctx->state, ctx->buffer);
+	}
+
+	for (; len >= SHA256_BLOCK_LEN; p += SHA256_BLOCK_LEN, len -= SHA256_BLOCK_LEN)
+		sha256_transform(ctx->state, p);
+
+	if (len > 0)
+		memcpy(ctx->buffer, p, len);
+}
+
+void
+sha256_final(sha256_ctx *ctx, uint8 *digest)
+{
+	size_t		used = (ctx->bitcount >> 3) % SHA256_BLOCK_LEN;
+	uint64		bitcount = ctx->bitcount;
+	int			i;
+
+	/* Padding: a single 1 bit, zeroes and the message length in bits */
+	ctx->buffer[used++] = 0x80;
+	if (used > SHA256_BLOCK_LEN - 8)
+	{
+		memset(ctx->buffer + used, 0, SHA256_BLOCK_LEN - used);
+		sha256_transform(ctx->state, ctx->buffer);
+		used = 0;
+	}
+	memset(ctx->buffer + used, 0, SHA256_BLOCK_LEN - 8 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buffer[SHA256_BLOCK_LEN - 1 - i] = (uint8) (bitcount >> (i * 8));
+	sha256_transform(ctx->state, ctx->buffer);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i * 4] = (uint8) (ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (uint8) (ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (uint8) (ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (uint8) ctx->state[i];
+	}
+}
+
+/* Compute digest of data in one call */
+void
+sha256(const void *data, size_t len, uint8 *digest)
+{
+	sha256_ctx	ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+ *
+ * sha256.h: SHA-256 message digest.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+#define SHA256_BLOCK_LEN	64
+#define SHA256_DIGEST_LEN	32
+
+typedef struct sha256_ctx
+{
+	uint32		state[8];
+	uint64		bitcount;
+	uint8		buffer[SHA256_BLOCK_LEN];
+} sha256_ctx;
+
+extern void sha256_init(sha256_ctx *ctx);
+extern void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+extern void sha256_final(sha256_ctx *ctx, uint8 *digest);
+extern void sha256(const void *data, size_t len, uint8 *digest);
+
+#endif /* SHA256_H */
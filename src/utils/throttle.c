@@ -0,0 +1,140 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.c: I/O rate limiting shared by threads.
+ *
+ * Both limits are token buckets implemented by "theoretical arrival time":
+ * each bucket keeps the time when the budget consumed so far is paid off.
+ * A request moves it forward by its cost and sleeps until it is reached.
+ * Budget unused while idle accumulates for at most THROTTLE_BURST seconds,
+ * so a pause is followed by a short burst only.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "src/pg_probackup.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "throttle.h"
+
+/* Seconds of unused budget allowed to accumulate */
+#define THROTTLE_BURST		0.1
+
+/* Lowest factor limits may be scaled to */
+#define THROTTLE_MIN_FACTOR	0.01
+
+typedef struct token_bucket
+{
+	double		rate;			/* units per second, 0 for no limit */
+	double		paid_time;		/* when consumed budget is paid off */
+} token_bucket;
+
+/* members of struct throttle are hidden from client. */
+struct throttle
+{
+	pthread_mutex_t	mutex;
+	token_bucket bytes;
+	token_bucket ios;
+	double		factor;
+};
+
+static double
+monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+throttle *
+throttle_new(double bytes_per_sec, double ios_per_sec)
+{
+	throttle   *t = pgut_new(throttle);
+	double		now = monotonic_time();
+
+	pthread_mutex_init(&t->mutex, NULL);
+	t->bytes.rate = bytes_per_sec;
+	t->bytes.paid_time = now;
+	t->ios.rate = ios_per_sec;
+	t->ios.paid_time = now;
+	t->factor = 1.0;
+
+	return t;
+}
+
+void
+throttle_free(throttle *t)
+{
+	if (t == NULL)
+		return;
+
+	pthread_mutex_destroy(&t->mutex);
+	free(t);
+}
+
+/*
+ * Consume amount of the bucket's budget, return seconds to wait for it.
+ */
+static double
+token_bucket_consume(token_bucket *b, double amount, double factor,
+					 double now)
+{
+	if (b->rate <= 0 || amount <= 0)
+		return 0;
+
+	b->paid_time = Max(b->paid_time, now - THROTTLE_BURST);
+	b->paid_time += amount / (b->rate * factor);
+
+	return b->paid_time - now;
+}
+
+/*
+ * Account bytes read by nios operations, sleeping as long as the limits
+ * require. Does nothing if t is NULL.
+ */
+void
+throttle_acquire(throttle *t, size_t bytes, int nios)
+{
+	double		now;
+	double		wait;
+
+	if (t == NULL)
+		return;
+
+	now = monotonic_time();
+
+	pthread_mutex_lock(&t->mutex);
+	wait = Max(token_bucket_consume(&t->bytes, bytes, t->factor, now),
+			   token_bucket_consume(&t->ios, nios, t->factor, now));
+	pthread_mutex_unlock(&t->mutex);
+
+	if (wait > 0)
+		pg_usleep((long) (wait * 1000000));
+}
+
+double
+throttle_get_factor(throttle *t)
+{
+	double		factor;
+
+	pthread_mutex_lock(&t->mutex);
+	factor = t->factor;
+	pthread_mutex_unlock(&t->mutex);
+
+	return factor;
+}
+
+/*
+ * Scale the limits by factor, which is clamped to [THROTTLE_MIN_FACTOR, 1].
+ */
+void
+throttle_set_factor(throttle *t, double factor)
+{
+	pthread_mutex_lock(&t->mutex);
+	t->factor = Min(Max(factor, THROTTLE_MIN_FACTOR), 1.0);
+	pthread_mutex_unlock(&t->mutex);
+}
@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.h: I/O rate limiting shared by threads.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+/*
+ * "throttle" limits bytes and I/O operations per second of all threads
+ * using it. Either limit may be zero, which means no limit. The limits are
+ * scaled by a factor in (0, 1], which a caller may adjust while threads are
+ * running to follow the load of the server.
+ */
+typedef struct throttle throttle;
+
+extern throttle *throttle_new(double bytes_per_sec, double ios_per_sec);
+extern void throttle_free(throttle *t);
+extern void throttle_acquire(throttle *t, size_t bytes, int nios);
+extern double throttle_get_factor(throttle *t);
+extern void throttle_set_factor(throttle *t, double factor);
+
+#endif /* THROTTLE_H */
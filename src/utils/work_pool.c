@@ -0,0 +1,181 @@
+/*-------------------------------------------------------------------------
+ *
+ * work_pool.c: pool of threads doing CPU-bound work of I/O threads.
+ *
+ * Backup and restore threads read and write files, and hand verification,
+ * compression and decompression of pages over to the pool. So the number
+ * of threads waiting for I/O and the number of threads busy with CPU are
+ * chosen separately, by --io-threads and --cpu-threads.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "src/pg_probackup.h"
+
+#include <pthread.h>
+
+#include "work_pool.h"
+
+/* members of struct work_pool are hidden from client. */
+struct work_pool
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t	not_empty;	/* an item was queued, or the pool stops */
+	pthread_cond_t	not_full;	/* an item was taken from the queue */
+	pthread_cond_t	done;		/* an item was processed */
+	work_item **queue;			/* ring of queued items */
+	int			queue_size;
+	int			head;			/* next item to take */
+	int			nqueued;
+	bool		stopping;
+
+	const char *name;
+	int			nthreads;
+	pthread_t  *threads;
+	uint64		nitems;			/* items processed, for the log */
+};
+
+static void *
+work_pool_worker(void *arg)
+{
+	work_pool  *pool = (work_pool *) arg;
+
+	for (;;)
+	{
+		work_item  *item;
+
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->nqueued == 0 && !pool->stopping)
+			pthread_cond_wait(&pool->not_empty, &pool->mutex);
+		if (pool->nqueued == 0)
+		{
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		item = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_size;
+		pool->nqueued--;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->mutex);
+
+		item->fn(item->arg);
+
+		pthread_mutex_lock(&pool->mutex);
+		item->done = true;
+		pool->nitems++;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start nthreads threads taking items from the queue of queue_size items.
+ * Returns NULL if nthreads is 0: items are run by submitting threads then.
+ */
+work_pool *
+work_pool_start(const char *name, int nthreads, int queue_size)
+{
+	work_pool  *pool;
+	int			i;
+
+	if (nthreads <= 0)
+		return NULL;
+
+	pool = pgut_new(work_pool);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->queue_size = Max(queue_size, 1);
+	pool->queue = pgut_malloc(sizeof(work_item *) * pool->queue_size);
+	pool->head = 0;
+	pool->nqueued = 0;
+	pool->stopping = false;
+	pool->name = name;
+	pool->nthreads = nthreads;
+	pool->threads = pgut_malloc(sizeof(pthread_t) * nthreads);
+	pool->nitems = 0;
+
+	for (i = 0; i < nthreads; i++)
+	{
+		elog(VERBOSE, "Start %s thread num: %i", name, i);
+		if (pthread_create(&pool->threads[i], NULL, work_pool_worker, pool) != 0)
+			elog(ERROR, "cannot start %s thread: %s", name, strerror(errno));
+	}
+
+	return pool;
+}
+
+/*
+ * Queue the item, waiting for room in the queue if it is full.
+ */
+void
+work_pool_submit(work_pool *pool, work_item *item)
+{
+	item->done = false;
+
+	if (pool == NULL)
+	{
+		item->fn(item->arg);
+		item->done = true;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nqueued == pool->queue_size)
+		pthread_cond_wait(&pool->not_full, &pool->mutex);
+	pool->queue[(pool->head + pool->nqueued) % pool->queue_size] = item;
+	pool->nqueued++;
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Wait until the item submitted by this thread is processed.
+ */
+void
+work_pool_wait(work_pool *pool, work_item *item)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!item->done)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Process items left in the queue and stop threads of the pool.
+ */
+void
+work_pool_stop(work_pool *pool)
+{
+	int			i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	elog(LOG, "%s: %lu items processed by %d threads",
+		 pool->name, (unsigned long) pool->nitems, pool->nthreads);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_cond_destroy(&pool->not_full);
+	pthread_cond_destroy(&pool->done);
+	free(pool->queue);
+	free(pool->threads);
+	free(pool);
+}
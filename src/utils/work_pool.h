@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * work_pool.h: pool of threads doing CPU-bound work of I/O threads.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+/*
+ * "work_pool" runs items of work submitted by other threads, so that the
+ * submitting thread does I/O while its items are being processed. Items
+ * wait in a bounded queue: a thread submitting to the full queue waits
+ * for room in it. The submitting thread owns the item and waits for it
+ * with work_pool_wait() before reusing it.
+ *
+ * A NULL pool runs items right in work_pool_submit().
+ */
+typedef struct work_pool work_pool;
+
+typedef struct work_item
+{
+	void		(*fn) (void *arg);
+	void	   *arg;
+	bool		done;			/* fn has returned */
+} work_item;
+
+extern work_pool *work_pool_start(const char *name, int nthreads,
+								  int queue_size);
+extern void work_pool_submit(work_pool *pool, work_item *item);
+extern void work_pool_wait(work_pool *pool, work_item *item);
+extern void work_pool_stop(work_pool *pool);
+
+#endif /* WORK_POOL_H */
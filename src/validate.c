@@ -23,6 +23,9 @@ typedef struct
 {
 	parray *files;
 	bool corrupted;
+	bool dedup;			/* check pages referenced in the page store */
+	scheduler *sched;
+	int		thread_num;
 } validate_files_args;
 
 /*
@@ -35,7 +38,7 @@ pgBackupValidate(pgBackup *backup)
 	char		path[MAXPGPATH];
 	parray	   *files;
 	bool		corrupted = false;
-	pthread_t	validate_threads[num_threads];
+	scheduler  *validate_sched;
 	validate_files_args *validate_threads_args[num_threads];
 	int			i;
 
@@ -51,38 +54,37 @@ pgBackupValidate(pgBackup *backup)
 
 	if (backup->backup_mode != BACKUP_MODE_FULL &&
 		backup->backup_mode != BACKUP_MODE_DIFF_PAGE &&
-		backup->backup_mode != BACKUP_MODE_DIFF_PTRACK)
+		backup->backup_mode != BACKUP_MODE_DIFF_PTRACK &&
+		backup->backup_mode != BACKUP_MODE_DIFF_DELTA)
 		elog(INFO, "Invalid backup_mode of backup %s", base36enc(backup->start_time));
 
 	pgBackupGetPath(backup, base_path, lengthof(base_path), DATABASE_DIR);
 	pgBackupGetPath(backup, path, lengthof(path), DATABASE_FILE_LIST);
 	files = dir_read_file_list(base_path, path);
 
-	/* setup threads */
-	for (i = 0; i < parray_num(files); i++)
-	{
-		pgFile	   *file = (pgFile *) parray_get(files, i);
-		__sync_lock_release(&file->lock);
-	}
-
-	/* Validate files */
+	/* Validate files, largest first */
+	validate_sched = scheduler_new(files, pgFileWeightWriteSize, num_threads);
 	for (i = 0; i < num_threads; i++)
 	{
 		validate_files_args *arg = pg_malloc(sizeof(validate_files_args));
 		arg->files = files;
 		arg->corrupted = false;
+		arg->dedup = backup->dedup;
+		arg->sched = validate_sched;
+		arg->thread_num = i;
 		validate_threads_args[i] = arg;
-		pthread_create(&validate_threads[i], NULL, (void *(*)(void *)) pgBackupValidateFiles, arg);
 	}
 
-	/* Wait theads */
+	scheduler_run(validate_sched, "validate", pgBackupValidateFiles,
+				  (void **) validate_threads_args);
+
 	for (i = 0; i < num_threads; i++)
 	{
-		pthread_join(validate_threads[i], NULL);
 		if (validate_threads_args[i]->corrupted)
 			corrupted = true;
 		pg_free(validate_threads_args[i]);
 	}
+	scheduler_free(validate_sched);
 
 	/* cleanup */
 	parray_walk(files, pgFileFree);
@@ -107,18 +109,17 @@ pgBackupValidate(pgBackup *backup)
 static void
 pgBackupValidateFiles(void *arg)
 {
-	int		i;
 	validate_files_args *arguments = (validate_files_args *)arg;
 	pg_crc32	crc;
+	pgFile	   *file;
+	size_t		task_no;
 
-	for (i = 0; i < parray_num(arguments->files); i++)
+	while ((file = (pgFile *) scheduler_next(arguments->sched,
+											 arguments->thread_num,
+											 &task_no)) != NULL)
 	{
 		struct stat st;
 
-		pgFile *file = (pgFile *) parray_get(arguments->files, i);
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
-
 		if (interrupted)
 			elog(ERROR, "Interrupted during validate");
 
@@ -140,8 +141,9 @@ pgBackupValidateFiles(void *arg)
 			continue;
 
 		/* print progress */
-		elog(VERBOSE, "Validate files: (%d/%lu) %s",
-			 i + 1, (unsigned long) parray_num(arguments->files), file->path);
+		elog(VERBOSE, "Validate files: (%lu/%lu) %s",
+			 (unsigned long) task_no,
+			 (unsigned long) parray_num(arguments->files), file->path);
 
 		if (stat(file->path, &st) == -1)
 		{
@@ -168,6 +170,21 @@ pgBackupValidateFiles(void *arg)
 		{
 			elog(WARNING, "Invalid CRC of backup file \"%s\" : %X. Expected %X",
 					file->path, file->crc, crc);
+
+			/* Report corrupted blocks, if the file has an index */
+			if (file->is_datafile)
+				check_backup_index(file);
+
+			arguments->corrupted = true;
+			return;
+		}
+
+		/* Pages of deduplicated backup are checked in the page store */
+		if (arguments->dedup && file->is_datafile &&
+			!dedup_validate_file(file))
+		{
+			elog(WARNING, "Backup file \"%s\" refers to missing or corrupted pages",
+				 file->path);
 			arguments->corrupted = true;
 			return;
 		}
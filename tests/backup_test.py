@@ -1,6 +1,6 @@
 import unittest
 import os
-from time import sleep
+from time import sleep, time
 from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
 from .helpers.cfs_helpers import find_by_name
 
@@ -475,3 +475,300 @@ class BackupTest(ProbackupTest, unittest.TestCase):
                 "Following file copied twice by backup:\n {0}".format(
                     message)
                 )
+
+    # @unittest.skip("skip")
+    def test_backup_zeroed_pages(self):
+        """make node, append zeroed pages to relation, take full and
+        delta backups, check that zeroed pages are stored without payload
+        and restored correctly"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select 1 as id, md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,1000) i")
+        heap_path = node.safe_psql(
+            "postgres",
+            "select pg_relation_filepath('t_heap')").rstrip()
+        node.stop()
+
+        # Zeroed pages are valid, postgres leaves them after relation extension
+        with open(os.path.join(node.data_dir, heap_path), "ab") as f:
+            f.write(b"\0" * 8192 * 128)
+            f.flush()
+            f.close
+
+        node.start()
+        full_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=["-j", "4", "--stream"])
+
+        backup_heap_path = os.path.join(
+            backup_dir, 'backups', 'node', full_id, 'database', heap_path)
+        self.assertLess(
+            os.path.getsize(backup_heap_path),
+            os.path.getsize(os.path.join(node.data_dir, heap_path)) - 8192 * 128)
+
+        node.safe_psql(
+            "postgres",
+            "insert into t_heap select 2 as id, md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,1000) i")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["-j", "4", "--stream"])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_backup_io_depth(self):
+        """make node, take full and delta backups with deep and synchronous
+        I/O, restore them with both and check data correctness"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,10000) i")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=["-j", "2", "--stream", "--io-depth=64"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set id = id + 1 where id % 7 = 0")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["-j", "2", "--stream", "--io-depth=1"])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        for io_depth in ["1", "64"]:
+            node_restored.cleanup()
+            self.restore_node(
+                backup_dir, 'node', node_restored,
+                options=["-j", "2", "--io-depth={0}".format(io_depth)])
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_backup_no_cache(self):
+        """make node, take full and delta backups bypassing page cache,
+        restore them and check data correctness"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,10000) i")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=["-j", "2", "--stream", "--no-cache"])
+
+        node.safe_psql(
+            "postgres",
+            "delete from t_heap where id % 5 = 0")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["-j", "2", "--stream", "--no-cache"])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "2"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_backup_read_rate_limit(self):
+        """make node, take full backup with read rate limit,
+        check that it is not faster than the limit and restores correctly"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,100000) i")
+        heap_size = int(node.safe_psql(
+            "postgres",
+            "select pg_relation_size('t_heap')").rstrip())
+
+        start = time()
+        backup_id = self.backup_node(
+            backup_dir, 'node', node,
+            options=["-j", "4", "--stream", "--read-rate-limit=2MB",
+                     "--read-iops-limit=1000"])
+        elapsed = time() - start
+        self.assertGreater(elapsed, heap_size / (2 * 1024 * 1024) - 1)
+        self.assertEqual(
+            self.show_pb(backup_dir, 'node', backup_id)['status'], "OK")
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_backup_split_large_file(self):
+        """make node with a table larger than a part of datafile, take full
+        and delta backups and restore them by several threads, so that parts
+        of the table are copied by different threads, check data correctness"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        # About 270MB with fillfactor 10, three parts of 128MB
+        node.safe_psql(
+            "postgres",
+            "create table t_large (id int, text text) with (fillfactor=10); "
+            "insert into t_large select i, md5(i::text) "
+            "from generate_series(0,400000) i")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=["-j", "4", "--stream"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_large set id = id + 1 where id % 1000 = 0")
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["-j", "4", "--stream", "--compress"])
+
+        self.validate_pb(backup_dir, 'node', backup_id)
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_backup_cpu_threads(self):
+        """make node, take full and delta compressed backups with pages
+        compressed by separate threads, restore them with pages decompressed
+        by separate threads, check data correctness"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.pgbench_init(scale=5)
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=[
+                "-j", "2", "--io-threads", "2", "--cpu-threads", "2",
+                "--stream", "--compress"])
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=[
+                "-j", "2", "--io-threads", "2", "--cpu-threads", "2",
+                "--stream", "--compress"])
+
+        self.validate_pb(backup_dir, 'node', backup_id)
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=["--io-threads", "2", "--cpu-threads", "2"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -292,6 +292,91 @@ class CompressionTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_compression_stream_zstd_dict(self):
+        """make node, make full and delta stream backups compressed by zstd
+        with trained dictionary, check data correctness in restored instance"""
+        self.maxDiff = None
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2', 'checkpoint_timeout': '30s'}
+            )
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        # FULL BACKUP
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, md5(repeat(i::text,10))::tsvector as tsvector from generate_series(0,10000) i")
+        full_backup_id = self.backup_node(backup_dir, 'node', node, backup_type='full',
+            options=['--stream', '--compress-algorithm=zstd', '--compress-dict', '-j', '4'])
+        self.assertTrue(os.path.isfile(os.path.join(
+            backup_dir, 'backups', 'node', full_backup_id, 'compress.dict')))
+
+        # DELTA BACKUP
+        node.safe_psql(
+            "postgres",
+            "insert into t_heap select i as id, md5(i::text) as text, md5(repeat(i::text,10))::tsvector as tsvector from generate_series(10000,20000) i")
+        delta_result = node.execute("postgres", "SELECT * FROM t_heap")
+        delta_backup_id = self.backup_node(backup_dir, 'node', node, backup_type='delta',
+            options=['--stream', '--compress-algorithm=zstd', '--compress-dict', '-j', '4'])
+
+        # Drop Node
+        node.cleanup()
+
+        # Check delta backup, which also restores full backup with its own dictionary
+        self.assertIn("INFO: Restore of backup {0} completed.".format(delta_backup_id),
+            self.restore_node(backup_dir, 'node', node, backup_id=delta_backup_id, options=["-j", "4"]),
+            '\n Unexpected Error Message: {0}\n CMD: {1}'.format(repr(self.output), self.cmd))
+        node.start()
+        delta_result_new = node.execute("postgres", "SELECT * FROM t_heap")
+        self.assertEqual(delta_result, delta_result_new)
+        node.cleanup()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_compression_stream_lz4(self):
+        """make node, make full stream backup compressed by lz4, check data correctness in restored instance"""
+        self.maxDiff = None
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2', 'checkpoint_timeout': '30s'}
+            )
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, md5(repeat(i::text,10))::tsvector as tsvector from generate_series(0,10000) i")
+        full_result = node.execute("postgres", "SELECT * FROM t_heap")
+        full_backup_id = self.backup_node(backup_dir, 'node', node, backup_type='full',
+            options=['--stream', '--compress-algorithm=lz4', '-j', '4'])
+
+        node.cleanup()
+
+        self.assertIn("INFO: Restore of backup {0} completed.".format(full_backup_id),
+            self.restore_node(backup_dir, 'node', node, backup_id=full_backup_id, options=["-j", "4"]),
+            '\n Unexpected Error Message: {0}\n CMD: {1}'.format(repr(self.output), self.cmd))
+        node.start()
+        full_result_new = node.execute("postgres", "SELECT * FROM t_heap")
+        self.assertEqual(full_result, full_result_new)
+        node.cleanup()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     def test_compression_wrong_algorithm(self):
         """make archive node, make full and page backups, check data correctness in restored instance"""
         self.maxDiff = None
@@ -230,3 +230,61 @@ class DeleteTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_delete_dedup_backups(self):
+        """take two deduplicated full backups, check that pages are shared,
+        delete the first one and restore the second one"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        pages_dir = os.path.join(backup_dir, 'backups', 'node', 'pages')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,100000) i")
+
+        def count_pages():
+            return sum(len(files) for _, _, files in os.walk(pages_dir))
+
+        id_1 = self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '--dedup'])
+        pages_1 = count_pages()
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'x' where id < 1000")
+        node.safe_psql("postgres", "checkpoint")
+
+        id_2 = self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '--dedup'])
+        pages_2 = count_pages()
+
+        # The second backup adds changed pages only
+        self.assertLess(pages_2 - pages_1, pages_1 / 2)
+
+        self.validate_pb(backup_dir, 'node')
+
+        # Pages used by the deleted backup only are removed
+        self.delete_pb(backup_dir, 'node', id_1)
+        self.assertLess(count_pages(), pages_2)
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, backup_id=id_2)
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
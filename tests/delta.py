@@ -0,0 +1,168 @@
+import os
+import unittest
+from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
+
+
+module_name = 'delta'
+
+
+class DeltaTest(ProbackupTest, unittest.TestCase):
+
+    # @unittest.skip("skip")
+    def test_delta_stream(self):
+        """make node without archiving, take full and delta stream backups,
+        restore them and check data correctness"""
+        self.maxDiff = None
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={
+                'wal_level': 'replica',
+                'max_wal_senders': '2',
+                'checkpoint_timeout': '30s'}
+            )
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        # FULL BACKUP
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, "
+            "md5(i::text)::tsvector as tsvector "
+            "from generate_series(0,100000) i")
+
+        full_result = node.execute("postgres", "SELECT * FROM t_heap")
+        full_backup_id = self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='full', options=['--stream'])
+
+        # DELTA BACKUP
+        node.safe_psql(
+            "postgres",
+            "insert into t_heap select i as id, md5(i::text) as text, "
+            "md5(i::text)::tsvector as tsvector "
+            "from generate_series(100000,100100) i")
+        delta_result = node.execute("postgres", "SELECT * FROM t_heap")
+        delta_backup_id = self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='delta', options=['--stream'])
+
+        show_backup = self.show_pb(backup_dir, 'node')[1]
+        self.assertEqual(show_backup['Mode'], "DELTA")
+        self.assertEqual(show_backup['Status'], "OK")
+
+        # Only changed pages should be copied
+        full_size = self.show_pb(
+            backup_dir, 'node', full_backup_id)['data-bytes']
+        delta_size = self.show_pb(
+            backup_dir, 'node', delta_backup_id)['data-bytes']
+        self.assertLess(int(delta_size), int(full_size))
+
+        # Drop Node
+        node.cleanup()
+
+        # Check full backup
+        self.assertIn(
+            "INFO: Restore of backup {0} completed.".format(full_backup_id),
+            self.restore_node(
+                backup_dir, 'node', node,
+                backup_id=full_backup_id, options=["-j", "4"]),
+            '\n Unexpected Error Message: {0}\n'
+            ' CMD: {1}'.format(repr(self.output), self.cmd))
+        node.start()
+        full_result_new = node.execute("postgres", "SELECT * FROM t_heap")
+        self.assertEqual(full_result, full_result_new)
+        node.cleanup()
+
+        # Check delta backup
+        self.assertIn(
+            "INFO: Restore of backup {0} completed.".format(delta_backup_id),
+            self.restore_node(
+                backup_dir, 'node', node,
+                backup_id=delta_backup_id, options=["-j", "4"]),
+            '\n Unexpected Error Message: {0}\n'
+            ' CMD: {1}'.format(repr(self.output), self.cmd))
+        node.start()
+        delta_result_new = node.execute("postgres", "SELECT * FROM t_heap")
+        self.assertEqual(delta_result, delta_result_new)
+        node.cleanup()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_delta_vacuum_truncate(self):
+        """make node, create table, take full backup,
+           delete last pages, vacuum relation,
+           take delta backup, restore it and check data correctness"""
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={
+                'wal_level': 'replica',
+                'max_wal_senders': '2',
+                'checkpoint_timeout': '300s'
+            }
+        )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname),
+        )
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node_restored.cleanup()
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create sequence t_seq; "
+            "create table t_heap as select i as id, "
+            "md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,1024) i;"
+        )
+        node.safe_psql(
+            "postgres",
+            "vacuum t_heap"
+        )
+
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        node.safe_psql(
+            "postgres",
+            "delete from t_heap where ctid >= '(11,0)'"
+        )
+        node.safe_psql(
+            "postgres",
+            "vacuum t_heap"
+        )
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta',
+            options=['--stream']
+        )
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"]
+        )
+
+        # Physical comparison
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node_restored.append_conf(
+            "postgresql.auto.conf", "port = {0}".format(node_restored.port))
+        node_restored.start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -696,6 +696,16 @@ class ProbackupTest(object):
 
         return self.run_pb(cmd_list + options)
 
+    def merge_backup(self, backup_dir, instance, backup_id, options=[]):
+        cmd_list = [
+            "merge",
+            "-B", backup_dir,
+            "--instance={0}".format(instance),
+            "-i", backup_id
+        ]
+
+        return self.run_pb(cmd_list + options)
+
     def delete_expired(self, backup_dir, instance, options=[]):
         cmd_list = [
             "delete", "--expired", "--wal",
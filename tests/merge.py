@@ -0,0 +1,174 @@
+import os
+import unittest
+from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
+
+
+module_name = 'merge'
+
+
+class MergeTest(ProbackupTest, unittest.TestCase):
+
+    # @unittest.skip("skip")
+    def test_merge_delta_chain(self):
+        """make full backup and a chain of delta backups, merge the last
+        delta backup into a full one and check that it replaces the chain,
+        keeps its child valid and restores the same data as the node"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,10000) i")
+        self.backup_node(
+            backup_dir, 'node', node, options=["--stream"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed' where id % 10 = 0")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream", "--compress"])
+
+        node.safe_psql(
+            "postgres",
+            "delete from t_heap where id > 5000")
+        node.safe_psql("postgres", "vacuum t_heap")
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream"])
+        pgdata = self.pgdata_content(node.data_dir)
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed again' where id % 7 = 0")
+        child_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream"])
+        pgdata_child = self.pgdata_content(node.data_dir)
+
+        self.merge_backup(
+            backup_dir, 'node', backup_id,
+            options=["-j", "4", "--compress-algorithm=zlib"])
+
+        show_backups = self.show_pb(backup_dir, 'node')
+        self.assertEqual(len(show_backups), 2)
+        self.assertEqual(show_backups[0]['ID'], backup_id)
+        self.assertEqual(show_backups[0]['Mode'], "FULL")
+        self.assertEqual(show_backups[0]['Status'], "OK")
+        self.assertEqual(show_backups[1]['ID'], child_id)
+        self.assertEqual(
+            self.show_pb(
+                backup_dir, 'node',
+                backup_id=child_id)["parent-backup-id"], backup_id)
+
+        self.validate_pb(backup_dir, 'node')
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            backup_id=backup_id, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node_restored.cleanup()
+        self.restore_node(
+            backup_dir, 'node', node_restored, backup_id=child_id)
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata_child, pgdata_restored)
+
+        # Full backup cannot be merged
+        try:
+            self.merge_backup(backup_dir, 'node', backup_id)
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because backup is full.\n "
+                "Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                "is a full backup", e.message,
+                '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                    repr(e.message), self.cmd))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_merge_without_block_index(self):
+        """merge of a chain having a datafile backed up without block index
+        must fail before the chain is changed, leaving it restorable"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,10000) i")
+        full_id = self.backup_node(
+            backup_dir, 'node', node, options=["--stream"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed' where id % 10 = 0")
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream"])
+        pgdata = self.pgdata_content(node.data_dir)
+
+        # Backups taken before block indexes have no index files
+        relation_path = node.safe_psql(
+            "postgres",
+            "select pg_relation_filepath('t_heap')").rstrip()
+        os.remove(os.path.join(
+            backup_dir, 'backups', 'node', full_id,
+            'database', relation_path + '.idx'))
+
+        try:
+            self.merge_backup(backup_dir, 'node', backup_id)
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because datafile has no block index.\n "
+                "Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                "was backed up without block index", e.message,
+                '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                    repr(e.message), self.cmd))
+
+        show_backups = self.show_pb(backup_dir, 'node')
+        self.assertEqual(len(show_backups), 2)
+        self.assertEqual(show_backups[0]['Mode'], "FULL")
+        self.assertEqual(show_backups[0]['Status'], "OK")
+        self.assertEqual(show_backups[1]['Mode'], "DELTA")
+        self.assertEqual(show_backups[1]['Status'], "OK")
+
+        self.restore_node(
+            backup_dir, 'node', node_restored, backup_id=backup_id)
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
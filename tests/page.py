@@ -295,3 +295,60 @@ class PageBackupTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_page_skip_unchanged_files(self):
+        """make node, take full and page backups, check that non-data files
+        which were not modified are not copied to page backup, change one
+        of them, take page backup, restore it and check data correctness"""
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={
+                'wal_level': 'replica',
+                'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,100) i")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='full', options=['--stream'])
+
+        # Modification time must be older than the start of the parent
+        time.sleep(1)
+        page_id = self.backup_node(
+            backup_dir, 'node', node, backup_type='page', options=['--stream'])
+
+        self.assertFalse(os.path.exists(os.path.join(
+            backup_dir, 'backups', 'node', page_id,
+            'database', 'PG_VERSION')))
+
+        with open(os.path.join(node.data_dir, 'PG_VERSION'), 'a') as f:
+            f.write('\n')
+        page_id = self.backup_node(
+            backup_dir, 'node', node, backup_type='page', options=['--stream'])
+
+        self.assertTrue(os.path.exists(os.path.join(
+            backup_dir, 'backups', 'node', page_id,
+            'database', 'PG_VERSION')))
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -857,3 +857,80 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_merged_chain(self):
+        """make full backup and a chain of delta and page backups changing,
+        truncating and dropping tables, restore the chain at once and check
+        that restored data and files are the same as in the node"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        node_restored = self.make_simple_node(
+            base_dir="{0}/{1}/node_restored".format(module_name, fname))
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,10000) i; "
+            "create table t_drop as select i as id "
+            "from generate_series(0,10000) i")
+        self.backup_node(
+            backup_dir, 'node', node, options=["--stream"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed' where id % 10 = 0")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream"])
+
+        node.safe_psql(
+            "postgres",
+            "delete from t_heap where id > 5000; "
+            "drop table t_drop")
+        node.safe_psql("postgres", "vacuum t_heap")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream", "--compress"])
+
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed again' where id % 7 = 0")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="delta",
+            options=["--stream"])
+
+        # Truncated pages must not come back from older versions
+        node.safe_psql(
+            "postgres",
+            "delete from t_heap where id > 1000")
+        node.safe_psql("postgres", "vacuum t_heap")
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="page")
+
+        node.safe_psql(
+            "postgres",
+            "insert into t_heap select i as id, 'new' as text "
+            "from generate_series(10001,12000) i")
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type="page")
+
+        pgdata = self.pgdata_content(node.data_dir)
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            backup_id=backup_id, options=["-j", "4"])
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -81,3 +81,46 @@ class OptionTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_show_stats(self):
+        """Show stats of backup phases and threads"""
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir="{0}/{1}/node".format(module_name, fname),
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica'}
+            )
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.start()
+
+        node.pgbench_init(scale=2)
+
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, options=["-j", "2"])
+
+        stats = self.show_pb(
+            backup_dir, 'node', backup_id, options=["--stats"])
+
+        for phase in [
+                'start-backup', 'list-files', 'pagemap', 'copy', 'fsync',
+                'stop-backup', 'wal-wait', 'write-filelist', 'total']:
+            self.assertIn('{0}-time'.format(phase), stats)
+
+        # Counters of all threads add up
+        self.assertGreater(int(stats['pages-read']), 0)
+        self.assertEqual(
+            int(stats['pages-read']),
+            int(stats['thread-0-pages-read']) +
+            int(stats['thread-1-pages-read']))
+        self.assertEqual(
+            int(stats['bytes-written']),
+            int(stats['thread-0-bytes-written']) +
+            int(stats['thread-1-bytes-written']))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -1347,3 +1347,53 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         # self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_validate_corrupted_block_via_index(self):
+        """make node, take FULL backup, corrupt second block of data file
+        in backup, run validate, expect corrupted block to be reported
+        using backup index of the file"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(base_dir="{0}/{1}/node".format(module_name, fname),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_level': 'replica', 'max_wal_senders': '2'}
+            )
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text, md5(repeat(i::text,10))::tsvector as tsvector from generate_series(0,10000) i")
+        file_path = node.safe_psql(
+            "postgres",
+            "select pg_relation_filepath('t_heap')").rstrip()
+
+        backup_id = self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        file = os.path.join(backup_dir, 'backups/node', backup_id, 'database', file_path)
+        self.assertTrue(os.path.isfile(file + '.idx'))
+
+        # Uncompressed record of block 0 takes 8 bytes of header and a page
+        with open(file, "rb+", 0) as f:
+            f.seek(8 + 8192 + 8 + 100)
+            f.write(b"blah")
+            f.flush()
+            f.close
+
+        try:
+            self.validate_pb(backup_dir, 'node', backup_id=backup_id)
+            self.assertEqual(1, 0, "Expecting Error because of data files corruption.\n Output: {0} \n CMD: {1}".format(
+                repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                'WARNING: invalid CRC of block 1 of backup file "{0}"'.format(file),
+                e.message,
+                '\n Unexpected Error Message: {0}\n CMD: {1}'.format(repr(e.message), self.cmd))
+
+        self.assertEqual('CORRUPT', self.show_pb(backup_dir, 'node', backup_id)['status'], 'Backup STATUS should be "CORRUPT"')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)